@@ -0,0 +1,66 @@
+#ifndef ADPCM_H
+#define ADPCM_H
+
+#include <stdint.h>
+
+// IMA (DVI) and Microsoft ADPCM as stored in WAVE files, 4 bits a
+// sample, in blocks of block_align bytes.  Each block starts with a
+// header per channel that seeds the decoder, so blocks decode
+// independently; the last block of a file may be short.
+//
+// IMA: per channel a 16-bit first sample, the step index and a pad byte,
+// then for mono a stream of nibbles, low nibble first, and for stereo
+// alternating runs of 4 bytes (8 samples) of each channel.
+//
+// MS: per channel a predictor, then the deltas, the second and the first
+// sample, each field for every channel before the next, then nibbles
+// high first, alternating channels for stereo.  Only the seven standard
+// predictors are supported; rounding follows libavcodec.
+//
+// The decoder is a stream: it takes the data in pieces of any size, and
+// carries its state from one call to the next, across pieces and across
+// blocks.  It only takes whole units of input (a channel header, a byte,
+// or for stereo IMA a group of 8 bytes), so the caller keeps what is
+// left of a piece in front of the next one.  The data can come straight
+// off the card, or from a compressed copy kept in RAM.
+
+#define ADPCM_IMA_HEADER 4      // Header bytes per channel
+#define ADPCM_MS_HEADER 7
+#define ADPCM_MS_PREDICTORS 7
+// The most input the decoder can leave unused at the end of a piece
+#define ADPCM_MAX_UNIT (2 * ADPCM_MS_HEADER)
+
+extern const int16_t adpcm_ms_coef[ADPCM_MS_PREDICTORS][2];
+
+typedef struct {
+    int32_t s1, s2;         // The last two samples (IMA keeps just s1)
+    int32_t c1, c2;         // MS predictor coefficients, 8 fractional bits
+    int32_t step;           // MS delta, or IMA step index
+} adpcm_chan_t;
+
+typedef struct {
+    uint16_t format;        // WAV_FORMAT_IMA_ADPCM or WAV_FORMAT_MS_ADPCM
+    uint16_t channels;      // 1 or 2
+    uint16_t block_align;
+    uint16_t block_frames;
+    uint32_t left;          // Bytes of the block still to take, 0 before a header
+    uint32_t frames;        // Frames of the block still to produce
+    adpcm_chan_t ch[2];
+} adpcm_t;
+
+// Frames in a block of len bytes, 0 if it is too short for its headers
+unsigned adpcm_frames(uint16_t format, unsigned len, unsigned channels);
+
+// Get ready for the first block of a stream.  block_frames is at most
+// adpcm_frames() of block_align.
+void adpcm_start(adpcm_t *d, uint16_t format, unsigned channels,
+        unsigned block_align, unsigned block_frames);
+
+// Decode up to max interleaved frames into dst from the *len bytes at
+// *src, and move *src and *len past the input taken.  Stops when the
+// next unit does not fit dst or is not all there.  A block with a bad
+// header is skipped.  Returns the number of frames.
+unsigned adpcm_decode(adpcm_t *d, int16_t *dst, unsigned max,
+        const uint8_t **src, unsigned *len);
+
+#endif
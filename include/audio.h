@@ -8,12 +8,70 @@
 #include <stdio.h>
 #include <string.h>
 
-#define AUDIO_BUFFER_SIZE 80000
+// Up to AUDIO_VOICES files play at once, mixed into one output.  Each
+// voice streams through a ring of AUDIO_SEGMENTS segments.  The ring is
+// refilled by audio_service() once AUDIO_LOW_WATER or fewer segments are
+// left, up to AUDIO_HIGH_WATER full segments.
+#define AUDIO_VOICES 8
+#define AUDIO_SEGMENTS 8
+#define AUDIO_SEGMENT_SAMPLES 512
+#define AUDIO_LOW_WATER 4
+#define AUDIO_HIGH_WATER AUDIO_SEGMENTS
+// Samples per DMA block.  The CPU is interrupted once per block.
+#define AUDIO_BLOCK_SAMPLES 256
+// The output rate.  Files at other rates are resampled.
+#define AUDIO_RATE 44100
+// Fastest a voice can step through its source, in source frames per
+// output frame, whatever its rate and pitch
+#define AUDIO_MAX_STEP 4
+// Interpolation for resampled voices: 1 for 4-point cubic, 0 for linear,
+// which costs less and aliases more
+#define AUDIO_CUBIC 1
+
+// Histogram bins of interrupt service times: bin 0 counts interrupts
+// under 1 us, bin k those from 2^(k-1) to 2^k - 1 us, and the last one
+// everything longer.
+#define AUDIO_IRQ_BINS 16
+
+typedef struct {
+    uint32_t blocks;            // Blocks rendered
+    uint32_t underruns;         // Output frames a voice sat out for want of data
+    uint32_t late_refills;      // Refills that began with less than a block left
+    uint32_t low_water;         // Fewest samples left in a ring after a block
+    uint32_t irq_us[AUDIO_IRQ_BINS];
+    uint32_t irq_max_us;        // Longest interrupt
+    uint64_t busy_us;           // Time spent in the interrupt
+    uint64_t elapsed_us;        // Time since the counters were reset
+    uint32_t mix_cycles;        // Cost of the last block's mix, in CPU cycles
+    uint32_t mix_max_cycles;
+    uint64_t mix_total_cycles;  // over all blocks
+} audio_stats_t;
 
 void audio_init(void);
-bool audio_play(const char *filename, uint8_t volume, bool loop);
+// Start a file on a free voice and return the voice, or -1.
+int audio_play(const char *filename, uint8_t volume, bool loop);
+// Start the WAVE file of size bytes at wav, which stays where it is
+// until the voice stops, on a free voice and return the voice, or -1.
+// ADPCM is decoded from it as it plays.
+int audio_play_mem(const void *wav, uint32_t size, uint8_t volume, bool loop);
+// Stop every voice.
 void audio_stop(void);
-void audio_set_volume(uint8_t volume);
-int64_t audio_update(alarm_id_t id, void *user_data);
+void audio_stop_voice(int voice);
+// True until the last sample of the voice has been mixed.
+bool audio_playing(int voice);
+void audio_set_volume(int voice, uint8_t volume);
+// Play the voice at pitch times its recorded pitch, 16.16 fixed point
+// (0x10000 is as recorded), up to AUDIO_MAX_STEP source frames per
+// output frame.  Takes effect from the next block.
+void audio_set_pitch(int voice, uint32_t pitch);
+// Copy the counters, all taken at the same moment.  busy_us over
+// elapsed_us is the share of the CPU the output takes, and
+// mix_total_cycles over blocks the average cost of a block.
+void audio_get_stats(audio_stats_t *st);
+void audio_reset_stats(void);
+// Refill the rings from the card.  Call it often from the main loop while
+// anything is playing; it returns at once while every ring is above the
+// low watermark.
+void audio_service(void);
 
 #endif
@@ -0,0 +1,21 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include "ff.h"
+
+// Number of fragments of a file (1: contiguous, 0: empty).
+FRESULT defrag_count(const char *path, DWORD *nfrag);
+
+// Rewrite a fragmented file into one contiguous extent and verify the
+// copy before it replaces the original.  Does nothing for a file that
+// is already contiguous.  A run that was interrupted, for example by a
+// power cut, is completed or rolled back first.  Returns FR_DENIED when
+// the volume has no free run long enough.
+FRESULT defrag_file(const char *path);
+
+// Make every file in a list contiguous.  Meant to be called at boot for
+// assets that are streamed.  Returns the first error; missing files are
+// skipped.
+FRESULT defrag_assets(const char *const paths[], int count);
+
+#endif
@@ -7,7 +7,6 @@
 
 #include <stdbool.h>
 
-bool sd_init(void);
 void init_sdcard_io(void);
 void enable_sdcard(void);
 void disable_sdcard(void);
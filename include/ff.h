@@ -135,6 +135,7 @@ typedef struct {
 	BYTE	n_fats;			/* Number of FATs (1 or 2) */
 	BYTE	wflag;			/* win[] flag (b0:dirty) */
 	BYTE	fsi_flag;		/* FSINFO flags (b7:disabled, b0:dirty) */
+	BYTE	defer;			/* Deferred mount work (b7:fast mount, b6:written since mount, b0:load FSINFO, b1:check exFAT bitmap) */
 	WORD	id;				/* Volume mount ID */
 	WORD	n_rootdir;		/* Number of root directory entries (FAT12/16) */
 	WORD	csize;			/* Cluster size [sectors] */
@@ -192,6 +193,7 @@ typedef struct {
 	DWORD	c_scl;			/* Containing directory start cluster (valid when sclust != 0) */
 	DWORD	c_size;			/* b31-b8:Size of containing directory, b7-b0: Chain status (valid when c_scl != 0) */
 	DWORD	c_ofs;			/* Offset in the containing directory (valid when file object and sclust != 0) */
+	DWORD	r_end;			/* Cluster next to the run reserved past the end of file by f_expand (valid when not zero) */
 #endif
 #if FF_FS_LOCK
 	UINT	lockid;			/* File lock ID origin from 1 (index of file semaphore table Files[]) */
@@ -217,8 +219,30 @@ typedef struct {
 	DWORD*	cltbl;			/* Pointer to the cluster link map table (nulled on open, set by application) */
 #endif
 #if !FF_FS_TINY
+#if FF_BUF_POOL
+	BYTE*	buf;			/* File private data read/write window (taken from the buffer pool while open) */
+#else
 	BYTE	buf[FF_MAX_SS];	/* File private data read/write window */
 #endif
+#if FF_USE_FILEBUF
+	BYTE*	cbuf;			/* Pointer to the multi-sector read buffer (nulled on open, set by f_setbuf) */
+	UINT	cbsz;			/* Size of cbuf[] in unit of sector */
+	LBA_t	cbsect;			/* Sector number appearing in cbuf[0] */
+	UINT	cbcnt;			/* Number of valid sectors in cbuf[] (0:invalid) */
+#if FF_BUF_POOL
+	BYTE	cbpool;			/* cbuf[] holds a reference to the buffer pool */
+#endif
+#if FF_READAHEAD
+	BYTE	rawin;			/* Read-ahead window in unit of sector (0:disabled) */
+	BYTE	raseq;			/* Number of sector loads in sequence */
+	BYTE	raown;			/* cbuf[] was attached by the read-ahead */
+	DWORD	ranext;			/* Sector index in the file expected to be loaded next */
+#endif
+#endif
+#if FF_USE_BORROW
+	BYTE	lent;			/* Data in the sector buffer is lent out (f_borrow) */
+#endif
+#endif
 } FIL;
 
 
@@ -313,6 +337,7 @@ FRESULT f_closedir (DIR* dp);										/* Close an open directory */
 FRESULT f_readdir (DIR* dp, FILINFO* fno);							/* Read a directory item */
 FRESULT f_findfirst (DIR* dp, FILINFO* fno, const TCHAR* path, const TCHAR* pattern);	/* Find first file */
 FRESULT f_findnext (DIR* dp, FILINFO* fno);							/* Find next file */
+FRESULT f_readdirn (DIR* dp, FILINFO* fno, UINT nfno, UINT* nr, const TCHAR* ext);	/* Read a batch of directory items */
 FRESULT f_mkdir (const TCHAR* path);								/* Create a sub directory */
 FRESULT f_unlink (const TCHAR* path);								/* Delete an existing file or directory */
 FRESULT f_rename (const TCHAR* path_old, const TCHAR* path_new);	/* Rename/Move a file or directory */
@@ -327,6 +352,12 @@ FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
 FRESULT f_expand (FIL* fp, FSIZE_t fsz, BYTE opt);					/* Allocate a contiguous block to the file */
+FRESULT f_getfrag (FIL* fp, DWORD* nfrag, LBA_t* sect);			/* Count fragments of the file */
+FRESULT f_setbuf (FIL* fp, void* buff, UINT nsect);				/* Attach a multi-sector read buffer to the file */
+FRESULT f_readahead (FIL* fp, UINT nsect);							/* Set read-ahead window of the file */
+FRESULT f_borrow (FIL* fp, const BYTE** ptr, UINT btr, UINT* br);	/* Borrow file data in the sector buffer */
+FRESULT f_borrowsect (FIL* fp, void* buff, UINT nsect, const BYTE** ptr, UINT* br);	/* Read whole sectors into buff and borrow them */
+FRESULT f_release (FIL* fp);										/* Give back borrowed file data */
 FRESULT f_mount (FATFS* fs, const TCHAR* path, BYTE opt);			/* Mount/Unmount a logical drive */
 FRESULT f_mkfs (const TCHAR* path, const MKFS_PARM* opt, void* work, UINT len);	/* Create a FAT volume */
 FRESULT f_fdisk (BYTE pdrv, const LBA_t ptbl[], void* work);		/* Divide a physical drive into some partitions */
@@ -371,6 +402,13 @@ void* ff_memalloc (UINT msize);			/* Allocate memory block */
 void ff_memfree (void* mblock);			/* Free memory block */
 #endif
 
+#if FF_BUF_POOL && !FF_FS_TINY			/* Shared sector buffer pool */
+void* ff_bufalloc (UINT nsect);			/* Allocate sectors from the pool */
+void* ff_bufalloc_keep (UINT nsect, UINT keep);	/* Allocate sectors leaving some of the pool free */
+int ff_bufref (void* buf);				/* Add a reference to a pool buffer */
+void ff_buffree (void* buf);			/* Drop a reference to a pool buffer */
+#endif
+
 /* Sync functions */
 #if FF_FS_REENTRANT
 int ff_cre_syncobj (BYTE vol, FF_SYNC_t* sobj);	/* Create a sync object */
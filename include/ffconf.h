@@ -38,19 +38,31 @@
 /  f_findnext(). (0:Disable, 1:Enable 2:Enable with matching altname[] too) */
 
 
+#define FF_USE_READDIRN	1
+/* This option switches f_readdirn() function, which reads a batch of directory
+/  items in a call and can return only the files with a given extension.
+/  (0:Disable or 1:Enable) Also FF_FS_MINIMIZE needs to be 0 or 1 to enable this. */
+
+
+#ifdef FF_HOST
+#define FF_USE_MKFS		1
+#else
 #define FF_USE_MKFS		0
-/* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
+#endif
+/* This option switches f_mkfs() function. (0:Disable or 1:Enable)
+/  Only the host tests and the image builder (tools/mkimage.c), which are
+/  compiled with FF_HOST defined, format volumes. */
 
 
 #define FF_USE_FASTSEEK	0
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_EXPAND	0
+#define FF_USE_EXPAND	1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_CHMOD	0
+#define FF_USE_CHMOD	1
 /* This option switches attribute manipulation functions, f_chmod() and f_utime().
 /  (0:Disable or 1:Enable) Also FF_FS_READONLY needs to be 0 to enable this option. */
 
@@ -68,7 +80,7 @@
 / Locale and Namespace Configurations
 /---------------------------------------------------------------------------*/
 
-#define FF_CODE_PAGE	932
+#define FF_CODE_PAGE	437
 /* This option specifies the OEM code page to be used on the target system.
 /  Incorrect code page setting can cause a file open failure.
 /
@@ -97,7 +109,7 @@
 */
 
 
-#define FF_USE_LFN		0
+#define FF_USE_LFN		3
 #define FF_MAX_LFN		255
 /* The FF_USE_LFN switches the support for LFN (long file name).
 /
@@ -228,7 +240,47 @@
 /  buffer in the filesystem object (FATFS) is used for the file data transfer. */
 
 
-#define FF_FS_EXFAT		0
+#define FF_USE_FILEBUF	1
+/* This option switches f_setbuf() function. (0:Disable or 1:Enable)
+/  f_setbuf() attaches a multi-sector read buffer to a file object opened for
+/  read only. The buffer is filled with one multiple sector read and partial
+/  sector reads are served from it. This option has no effect at FF_FS_TINY = 1. */
+
+
+#define FF_BUF_POOL		16
+/* This option sets the number of sectors in the shared sector buffer pool.
+/  (0:Disable or >0:Enable) When enabled, the sector buffer of a file object is
+/  taken from the pool on f_open() and given back on f_close(), so closed file
+/  objects do not hold any buffer memory. f_setbuf() with a null buffer also
+/  takes its multi-sector read buffer from the pool. f_open() and f_setbuf()
+/  fail with FR_NOT_ENOUGH_CORE when the pool is exhausted.
+/  ff_bufalloc(), ff_bufalloc_keep(), ff_bufref() and ff_buffree() must be added
+/  to the project.
+/  This option has no effect at FF_FS_TINY = 1. */
+
+
+#define FF_READAHEAD	4
+/* This option sets the default read-ahead window in unit of sector. (0:Disable)
+/  When a file opened for read only is loaded sector by sector in sequence, a
+/  multi-sector read buffer of this size is taken from the buffer pool and
+/  filled ahead of the file pointer, continuing into the next cluster when it
+/  follows on the volume. The buffer goes back to the pool on random access.
+/  f_readahead() changes the window of a file object at run time. A buffer is
+/  only taken while it leaves a pool sector free for every file that can still
+/  be opened (unused FF_FS_LOCK entries), so reading ahead never makes f_open()
+/  fail with FR_NOT_ENOUGH_CORE; a smaller window is used when the pool is short.
+/  FF_USE_FILEBUF and FF_BUF_POOL need to be enabled to use this option. */
+
+
+#define FF_USE_BORROW	1
+/* This option switches f_borrow(), f_borrowsect() and f_release() function.
+/  (0:Disable or 1:Enable) They give out a pointer to file data in the sector
+/  buffer instead of copying it. While the data is lent out, the file object
+/  refuses every operation that can change the buffer with FR_LOCKED.
+/  This option has no effect at FF_FS_TINY = 1. */
+
+
+#define FF_FS_EXFAT		1
 /* This option switches support for exFAT filesystem. (0:Disable or 1:Enable)
 /  To enable exFAT, also LFN needs to be enabled. (FF_USE_LFN >= 1)
 /  Note that enabling exFAT discards ANSI C (C89) compatibility. */
@@ -260,7 +312,7 @@
 */
 
 
-#define FF_FS_LOCK		0
+#define FF_FS_LOCK		12
 /* The option FF_FS_LOCK switches file lock function to control duplicated file open
 /  and illegal operation to open objects. This option must be 0 when FF_FS_READONLY
 /  is 1.
@@ -272,10 +324,14 @@
 /      lock control is independent of re-entrancy. */
 
 
-/* #include <somertos.h>	// O/S definitions */
-#define FF_FS_REENTRANT	0
+#if defined FF_HOST && !defined FF_HOST_THREADS
+#define FF_FS_REENTRANT	0	/* The host tools are single threaded */
+#else
+#include "pico/mutex.h"	/* Both cores share the volume through a pico-sdk mutex (see ffsystem.c), host tests with threads through a pthread one */
+#define FF_FS_REENTRANT	1
+#endif
 #define FF_FS_TIMEOUT	1000
-#define FF_SYNC_t		HANDLE
+#define FF_SYNC_t		mutex_t*
 /* The option FF_FS_REENTRANT switches the re-entrancy (thread safe) of the FatFs
 /  module itself. Note that regardless of this option, file access to different
 /  volume is always re-entrant and volume control functions, f_mount(), f_mkfs()
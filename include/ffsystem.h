@@ -0,0 +1,51 @@
+/*-----------------------------------------------------------------------/
+/  OS dependent functions for FatFs - RP2350 (pico-sdk)                  /
+/-----------------------------------------------------------------------*/
+
+#ifndef FFSYSTEM_DEFINED
+#define FFSYSTEM_DEFINED
+
+#include "ff.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if FF_FS_REENTRANT
+
+/* Volume lock statistics (times in microseconds) */
+typedef struct {
+	DWORD		grants;		/* Number of times the volume lock was taken */
+	DWORD		contended;	/* Grants that had to wait for the other core */
+	DWORD		timeouts;	/* Requests given up after FF_FS_TIMEOUT ms */
+	DWORD		max_wait;	/* Longest wait for the lock */
+	DWORD		max_hold;	/* Longest time the lock was held */
+	uint64_t	total_wait;	/* Sum of all waits */
+	uint64_t	total_hold;	/* Sum of all hold times */
+} FF_LOCKSTAT;
+
+void ff_lockstat (BYTE vol, FF_LOCKSTAT* st, int reset);	/* Get (and clear) lock statistics of a volume */
+
+#endif
+
+#if FF_BUF_POOL && !FF_FS_TINY
+
+/* Sector buffer pool usage (in unit of sector) */
+typedef struct {
+	UINT	size;		/* Pool size (FF_BUF_POOL) */
+	UINT	used;		/* Sectors allocated now */
+	UINT	peak;		/* Highest number of sectors allocated at once */
+	DWORD	allocs;		/* Successful allocations */
+	DWORD	fails;		/* Allocations refused because the pool was exhausted */
+} FF_POOLSTAT;
+
+void ff_poolstat (FF_POOLSTAT* st);	/* Get usage of the buffer pool */
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FFSYSTEM_DEFINED */
@@ -0,0 +1,52 @@
+#ifndef KVSTORE_H
+#define KVSTORE_H
+
+#include "ff.h"
+#include <stdint.h>
+
+// Small key-value store for saves and settings.
+//
+// The store lives in a contiguous, preallocated file that is accessed
+// with raw sector reads and writes, so an update is a single sector write
+// and never touches the FAT or a directory entry.  Every value is also
+// held in RAM, so kv_get() does no I/O.  The store is not thread-safe;
+// use it from one core.
+
+#define KV_MAX_KEYS 32      // Number of keys the store can hold
+#define KV_KEY_MAX 23       // Longest key in bytes
+#define KV_VALUE_MAX 64     // Longest value in bytes
+#define KV_BANK_SECTORS 64  // Sectors per bank; the file holds two banks
+
+typedef struct {
+    uint32_t puts;
+    uint32_t deletes;
+    uint32_t sectors;       // Sectors written for puts and deletes
+    uint32_t copies;        // Sectors written by compaction
+    uint32_t compactions;
+    uint32_t max_put_us;    // Worst kv_put()/kv_delete() latency
+} kv_stats_t;
+
+// Open the store, creating the file when it does not exist, and load
+// every key into RAM.  Fails with FR_NO_FILESYSTEM when the file exists
+// but is not a store (wrong size or not contiguous).
+FRESULT kv_open(const char *path);
+
+// Copy the value of key into buf.  *len is set to the length of the
+// value, which may be larger than size.  FR_NO_FILE if there is no key.
+FRESULT kv_get(const char *key, void *buf, UINT size, UINT *len);
+
+// Set or replace the value of key.  FR_NOT_ENOUGH_CORE when all
+// KV_MAX_KEYS keys are in use, FR_INVALID_PARAMETER when the key or
+// value is too long.
+FRESULT kv_put(const char *key, const void *val, UINT len);
+
+// Remove key.  FR_NO_FILE if there is no key.
+FRESULT kv_delete(const char *key);
+
+// Advance background compaction by at most one sector write.  Call it
+// from the main loop; it returns at once when there is nothing to do.
+FRESULT kv_service(void);
+
+void kv_get_stats(kv_stats_t *st);
+
+#endif
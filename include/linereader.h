@@ -0,0 +1,23 @@
+#ifndef LINEREADER_H
+#define LINEREADER_H
+
+#include "ff.h"
+#include <stdbool.h>
+
+// Number of sectors buffered per reader.  A line longer than
+// (LINE_READER_SECTORS - 1) sectors may be returned in pieces.
+#define LINE_READER_SECTORS 2
+
+typedef struct {
+    FIL *fp;            // File being read
+    UINT pos;           // Offset of the next unread byte in buf
+    UINT len;           // Number of valid bytes in buf
+    bool eof;           // No more data left in the file
+    FRESULT err;        // First error returned by f_read
+    char buf[LINE_READER_SECTORS * FF_MAX_SS + 1];
+} line_reader_t;
+
+void line_reader_init(line_reader_t *lr, FIL *fp);
+char *line_reader_next(line_reader_t *lr, UINT *len);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef LOGSTREAM_H
+#define LOGSTREAM_H
+
+#include "ff.h"
+#include <stdint.h>
+
+// RAM ring size.  Records are collected here until whole sectors can be
+// written out.
+#define LOG_RING_SECTORS 8
+// Number of complete sectors that triggers a write to the card.
+#define LOG_BATCH_SECTORS 4
+
+typedef struct {
+    FIL fil;
+    FSIZE_t limit;      // End of the preallocated extent (0: not preallocated)
+    FSIZE_t spos;       // File offset of the first sector still held in ring
+    FSIZE_t wpos;       // File offset just past the last appended byte
+    uint32_t sectors;   // Sectors written to the card
+    uint32_t batches;   // Calls into f_write
+    uint32_t checkpoints;
+    uint32_t max_write_us;      // Worst log_write() latency
+    uint32_t max_checkpoint_us; // Worst log_checkpoint() latency
+    BYTE ring[LOG_RING_SECTORS * FF_MAX_SS];
+} log_stream_t;
+
+FRESULT log_open(log_stream_t *log, const char *path, FSIZE_t prealloc);
+FRESULT log_write(log_stream_t *log, const void *data, UINT len);
+FRESULT log_checkpoint(log_stream_t *log);
+FRESULT log_close(log_stream_t *log);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef MIXER_H
+#define MIXER_H
+
+#include <stdint.h>
+
+// Fixed-point block mixer.
+//
+// Voices are summed into a block of 32-bit accumulators, interleaved
+// left and right, each sample scaled by the voice's gain, from 0 to
+// MIXER_UNITY (1.0).  A mono voice goes to both sides.  Nothing
+// saturates until the whole block has been summed, so voices can
+// overshoot one another and cancel without clipping in between;
+// mixer_pwm_levels() then turns each frame into a PWM compare value.
+// There is room for 255 full-scale voices at unity gain before an
+// accumulator overflows.
+//
+// On a core with the DSP extension (__ARM_FEATURE_DSP, e.g. the M33 of
+// the RP2350) the kernels load two 16-bit samples per word: mixing
+// multiplies each halfword by the gain and adds it in one instruction
+// (SMLABB, SMLATB), resampling weighs a pair of neighbouring samples in
+// one dual multiply (SMUAD, SMLAD), and the quantizer clamps with USAT.
+// Elsewhere they fall back to plain C with the same results, bit for
+// bit.  The functions do not depend on the rest of the firmware, so both
+// versions can be built and checked on the host.
+
+#define MIXER_SHIFT 8
+#define MIXER_UNITY (1 << MIXER_SHIFT)
+
+// PWM resolution.  The counter wraps at MIXER_PWM_PERIOD, so the carrier
+// is clk_sys >> MIXER_PWM_BITS: 146 kHz at 10 bits and 150 MHz.  The mix
+// keeps 24 bits (16 plus MIXER_SHIFT of gain) until it is quantized to
+// this many, and the quantization error is shaped out of the low
+// frequencies.
+#ifndef MIXER_PWM_BITS
+#define MIXER_PWM_BITS 10
+#endif
+#define MIXER_PWM_PERIOD ((1 << MIXER_PWM_BITS) - 1)
+#if MIXER_PWM_BITS < 8 || MIXER_PWM_BITS > 16
+#error "MIXER_PWM_BITS must be 8 to 16"
+#endif
+
+// Error feedback state for mixer_pwm_levels(), per channel.  Start from
+// zeros.
+typedef struct {
+    int32_t e1[2];      // Quantization error of the last frame
+    int32_t e2[2];      // and of the one before
+    uint32_t quiet[2];  // Silent frames the last block ended in
+} mixer_shaper_t;
+
+// acc[2i] and acc[2i + 1] += src[i] * gain for n mono samples
+void mixer_add_mono(int32_t *acc, const int16_t *src, unsigned n, int32_t gain);
+
+// acc[i] += src[i] * gain for n interleaved stereo frames
+void mixer_add_stereo(int32_t *acc, const int16_t *src, unsigned n, int32_t gain);
+
+// Resampling.  src holds frames of ch channels, and output frame k is
+// taken at source frame pos + k * step, both 16.16 fixed point.  Linear
+// interpolation reads the frames on either side of that position; cubic
+// (Catmull-Rom) also one before and one after, so src[-ch] must be
+// readable.  The position's fraction is taken to 14 bits.  Adds n stereo
+// frames to acc, mono going to both sides.
+#define MIXER_STEP_ONE 0x10000u
+
+void mixer_resample_linear(int32_t *acc, const int16_t *src, unsigned ch, unsigned n,
+        uint32_t pos, uint32_t step, int32_t gain);
+void mixer_resample_cubic(int32_t *acc, const int16_t *src, unsigned ch, unsigned n,
+        uint32_t pos, uint32_t step, int32_t gain);
+
+// PWM compare values for n interleaved stereo frames of accumulators:
+// the left level in the high half (channel B, the left pin) and the right
+// level in the low half (channel A).  Each accumulator, a 16-bit sample
+// with MIXER_SHIFT fraction bits, is quantized to a level from 0 to
+// MIXER_PWM_PERIOD, saturating, with silence at (MIXER_PWM_PERIOD + 1) / 2.
+// The truncation error goes back in through a second-order filter,
+// 1 - 2z^-1 + z^-2, which moves its noise towards half the sample rate
+// and out of the band where most of the signal is.  When a block ends in
+// a run of digital silence, the error is dropped and the output rests at
+// the midpoint.
+void mixer_pwm_levels(uint32_t *dst, const int32_t *acc, unsigned n, mixer_shaper_t *ns);
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef PAK_H
+#define PAK_H
+
+#include <stdint.h>
+
+// Packed asset archive.
+//
+// A pack is one contiguous file built on the host by tools/pakpack.c.
+// Everything is little-endian and every asset starts on a sector
+// boundary:
+//
+//   sector 0   header (PAK_HDR_SIZE bytes), then the index, which may run
+//              on into the following sectors
+//   ...        asset data from sector index_sectors on
+//
+// The index holds one PAK_ENTRY_SIZE entry per asset, sorted by name
+// hash.  The packer refuses two names with the same hash, so the hash
+// finds at most one entry, and a second hash of the name in the entry
+// tells a name that is not in the pack from one that is.
+//
+// Define PAK_FORMAT_ONLY before including this file to get the format
+// without the FatFs reader (the host packer does this).
+
+#define PAK_MAGIC 0x314b4150u   // "PAK1"
+#define PAK_SECTOR 512
+#define PAK_HDR_SIZE 32
+#define PAK_ENTRY_SIZE 20
+#define PAK_MAX_ASSETS 64       // Index entries the reader keeps in RAM
+
+// Header offsets
+#define PAK_HDR_MAGIC 0
+#define PAK_HDR_COUNT 4         // u32 number of assets
+#define PAK_HDR_INDEX 8         // u32 sectors taken by header and index
+#define PAK_HDR_TOTAL 12        // u32 sectors in the whole pack
+#define PAK_HDR_CRC 16          // u32 CRC-32 of the index entries
+
+// Index entry offsets
+#define PAK_ENT_HASH 0          // u32 pak_hash() of the name
+#define PAK_ENT_START 4         // u32 first sector, from the start of the pack
+#define PAK_ENT_LENGTH 8        // u32 length in bytes
+#define PAK_ENT_FORMAT 12       // u16 one of PAK_FMT_*
+#define PAK_ENT_FLAGS 14        // u16 reserved, 0
+#define PAK_ENT_CHECK 16        // u32 pak_check() of the name
+
+#define PAK_FMT_RAW 0
+#define PAK_FMT_WAV 1
+
+// Hash of an asset name: FNV-1a over the name with ASCII letters folded
+// to lower case, so lookups are case-insensitive like FatFs.
+static inline uint32_t pak_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (; *name; name++) {
+        uint8_t c = *name;
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+static inline uint32_t pak_crc32_byte(uint32_t crc, uint8_t c)
+{
+    crc ^= c;
+    for (int k = 0; k < 8; k++)
+        crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+    return crc;
+}
+
+// CRC-32 (IEEE) of the index.  Bitwise; it only runs when a pack is
+// opened or built.
+static inline uint32_t pak_crc32(const uint8_t *p, uint32_t n)
+{
+    uint32_t crc = 0xffffffff;
+    while (n--)
+        crc = pak_crc32_byte(crc, *p++);
+    return ~crc;
+}
+
+// Second hash of an asset name, the CRC-32 of it folded the same way.
+// Two names that share pak_hash() are unlikely to share this as well.
+static inline uint32_t pak_check(const char *name)
+{
+    uint32_t crc = 0xffffffff;
+    for (; *name; name++) {
+        uint8_t c = *name;
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        crc = pak_crc32_byte(crc, c);
+    }
+    return ~crc;
+}
+
+#ifndef PAK_FORMAT_ONLY
+
+#include "ff.h"
+
+typedef struct {
+    uint32_t hash;
+    uint32_t check;             // pak_check() of the name
+    DWORD start;                // Sector offset in the pack
+    DWORD length;               // Bytes
+    uint16_t format;
+} pak_entry_t;
+
+typedef struct {
+    LBA_t lba;                  // First sector on the card
+    DWORD length;               // Bytes
+    uint16_t format;
+} pak_asset_t;
+
+typedef struct {
+    BYTE pdrv;
+    LBA_t base;                 // First sector of the pack on the card
+    DWORD sectors;              // Sectors in the pack
+    DWORD index_sectors;
+    UINT count;
+    pak_entry_t index[PAK_MAX_ASSETS];
+} pak_t;
+
+// Pure parsing, no I/O.  pak_parse_header() checks sector 0 of a pack
+// of nsect sectors and fills in pk->count, pk->sectors and
+// pk->index_sectors.  pak_parse_index() loads the entries from the
+// header and index bytes (at least pk->index_sectors sectors) and checks
+// the CRC, the sort order and that every asset lies inside the pack.
+// Both return FR_NO_FILESYSTEM for a malformed pack and FR_NOT_ENOUGH_CORE
+// when it has more than PAK_MAX_ASSETS assets.
+FRESULT pak_parse_header(pak_t *pk, const BYTE *sect, DWORD nsect);
+FRESULT pak_parse_index(pak_t *pk, const BYTE *data);
+
+// Find an asset by name.  FR_NO_FILE if it is not in the pack, also
+// when another name in the pack has the same hash.
+FRESULT pak_find(const pak_t *pk, const char *name, pak_asset_t *asset);
+
+// Open a pack file, check that it is contiguous and load its index.
+// The file is closed again; assets are read from the card directly.
+FRESULT pak_open(pak_t *pk, const char *path);
+
+// Read count sectors of an asset from sector sect on, with a single
+// multiple block read.  The last sector of an asset is padded with
+// zeros.  FR_INVALID_PARAMETER if the range runs past the asset.
+FRESULT pak_read(const pak_t *pk, const pak_asset_t *asset, DWORD sect,
+        BYTE *buf, UINT count);
+
+#endif
+
+#endif
@@ -2,7 +2,13 @@
 #define SDCARD_H
 
 #include "ff.h" // FatFs library header
+#include <stdbool.h>
+#include <stdint.h>
 
+extern FATFS fs_storage;
+extern uint32_t sd_mount_us;
+
+bool sd_init(void);
 void cd(int argc, char *argv[]);
 void input(int argc, char *argv[]);
 void ls(int argc, char *argv[]);
@@ -13,6 +19,8 @@ void rm(int argc, char *argv[]);
 void cat(int argc, char *argv[]);
 void append(int argc, char *argv[]);
 void date(int argc, char *argv[]);
+void fsstat(int argc, char *argv[]);
+void frag(int argc, char *argv[]);
 void restart(int argc, char *argv[]);
 
 #endif
\ No newline at end of file
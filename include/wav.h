@@ -0,0 +1,41 @@
+#ifndef WAV_H
+#define WAV_H
+
+#include "ff.h"
+#include <stdint.h>
+
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_MS_ADPCM 0x0002
+#define WAV_FORMAT_IMA_ADPCM 0x0011
+#define WAV_FORMAT_EXTENSIBLE 0xfffe
+
+typedef struct {
+    uint16_t format;        // Format tag (the sub-format of an extensible file)
+    uint16_t channels;
+    uint32_t rate;          // Frames per second
+    uint16_t bits;          // Bits per sample
+    uint16_t block_align;   // Bytes per frame, or per block for compressed formats
+    uint16_t block_frames;  // Frames per block: 1, or more for compressed formats
+    FSIZE_t data_ofs;       // File offset of the first byte of sample data
+    FSIZE_t data_len;       // Bytes of sample data
+} wav_info_t;
+
+// Parse the body of a fmt chunk of len bytes.  FR_NO_FILESYSTEM if it is
+// too short or inconsistent.  ADPCM (see adpcm.h) must be 4 bits, and MS
+// ADPCM must use the standard predictors.
+FRESULT wav_parse_fmt(const BYTE *p, UINT len, wav_info_t *info);
+
+// Walk the chunks of a RIFF (or RF64) WAVE file and fill in info from its
+// fmt and data chunks.  Other chunks are skipped.  The data length is
+// clipped to the end of the file, which also covers writers that leave
+// it at 0xffffffff, and to whole frames, though the last block of a
+// compressed format may be short.  Leaves the file at the first byte of
+// sample data.
+// FR_NO_FILESYSTEM if the file is not a WAVE file or lacks either chunk.
+FRESULT wav_open(FIL *fp, wav_info_t *info);
+
+// The same for a WAVE file of size bytes at p in memory.  data_ofs is
+// then the offset from p.
+FRESULT wav_open_mem(const BYTE *p, FSIZE_t size, wav_info_t *info);
+
+#endif
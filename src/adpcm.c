@@ -0,0 +1,249 @@
+#include "adpcm.h"
+#include "wav.h"
+
+static const int16_t ima_steps[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37,
+    41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173,
+    190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658,
+    724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894,
+    6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289,
+    16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t ima_index[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+static const int16_t ms_adapt[16] = {
+    230, 230, 230, 230, 307, 409, 512, 614,
+    768, 614, 512, 409, 307, 230, 230, 230
+};
+
+const int16_t adpcm_ms_coef[ADPCM_MS_PREDICTORS][2] = {
+    { 256, 0 }, { 512, -256 }, { 0, 0 }, { 192, 64 },
+    { 240, 0 }, { 460, -208 }, { 392, -232 }
+};
+
+static int16_t get_s16(const uint8_t *p)
+{
+    return (int16_t)(p[0] | p[1] << 8);
+}
+
+static int32_t clamp16(int32_t v)
+{
+    return v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+}
+
+static int16_t ima_nibble(adpcm_chan_t *c, unsigned n)
+{
+    int32_t step = ima_steps[c->step];
+    int32_t diff = step >> 3;
+    if (n & 4)
+        diff += step;
+    if (n & 2)
+        diff += step >> 1;
+    if (n & 1)
+        diff += step >> 2;
+    c->s1 = clamp16(n & 8 ? c->s1 - diff : c->s1 + diff);
+    int32_t index = c->step + ima_index[n & 7];
+    c->step = index < 0 ? 0 : index > 88 ? 88 : index;
+    return c->s1;
+}
+
+static int16_t ms_nibble(adpcm_chan_t *c, unsigned n)
+{
+    int32_t e = (int32_t)(n ^ 8) - 8;   // signed 4 bits
+    // Division, not a shift: the prediction rounds toward zero.
+    int32_t p = (c->s1 * c->c1 + c->s2 * c->c2) / 256 + e * c->step;
+    c->s2 = c->s1;
+    c->s1 = clamp16(p);
+    c->step = ms_adapt[n] * c->step >> 8;
+    if (c->step < 16)
+        c->step = 16;
+    else if (c->step > INT32_MAX / 768)
+        c->step = INT32_MAX / 768;      // a broken file, but no overflow
+    return c->s1;
+}
+
+unsigned adpcm_frames(uint16_t format, unsigned len, unsigned channels)
+{
+    if (format == WAV_FORMAT_IMA_ADPCM) {
+        if (len < ADPCM_IMA_HEADER * channels)
+            return 0;
+        len -= ADPCM_IMA_HEADER * channels;
+        // Stereo goes in groups of 8 frames, mono by the nibble.
+        return channels == 1 ? 1 + 2 * len : 1 + len / (4 * channels) * 8;
+    }
+    if (len < ADPCM_MS_HEADER * channels)
+        return 0;
+    return 2 + (len - ADPCM_MS_HEADER * channels) * 2 / channels;
+}
+
+void adpcm_start(adpcm_t *d, uint16_t format, unsigned channels,
+        unsigned block_align, unsigned block_frames)
+{
+    d->format = format;
+    d->channels = channels;
+    d->block_align = block_align;
+    d->block_frames = block_frames;
+    d->left = 0;
+    d->frames = 0;
+}
+
+// Take the headers at p and put out the frames they hold.  Returns the
+// number of frames, 0 for a bad header.
+static unsigned ima_header(adpcm_t *d, int16_t *dst, const uint8_t *p)
+{
+    for (unsigned c = 0; c < d->channels; c++) {
+        if (p[4 * c + 2] > 88)
+            return 0;
+    }
+    for (unsigned c = 0; c < d->channels; c++, p += ADPCM_IMA_HEADER) {
+        d->ch[c].s1 = get_s16(p);
+        d->ch[c].step = p[2];
+        dst[c] = d->ch[c].s1;
+    }
+    return 1;
+}
+
+static unsigned ms_header(adpcm_t *d, int16_t *dst, const uint8_t *p)
+{
+    unsigned n = d->channels;
+    for (unsigned c = 0; c < n; c++) {
+        if (p[c] >= ADPCM_MS_PREDICTORS)
+            return 0;
+    }
+    for (unsigned c = 0; c < n; c++) {
+        adpcm_chan_t *s = &d->ch[c];
+        s->c1 = adpcm_ms_coef[p[c]][0];
+        s->c2 = adpcm_ms_coef[p[c]][1];
+        s->step = get_s16(p + n + 2 * c);
+        s->s1 = get_s16(p + 3 * n + 2 * c);
+        s->s2 = get_s16(p + 5 * n + 2 * c);
+        dst[c] = s->s2;
+        dst[n + c] = s->s1;
+    }
+    return 2;
+}
+
+// One group of stereo IMA: 4 bytes of left, then 4 of right, 8 frames
+static void ima_group(adpcm_t *d, int16_t *dst, const uint8_t *p)
+{
+    for (unsigned c = 0; c < 2; c++) {
+        int16_t *o = dst + c;
+        for (unsigned k = 0; k < 4; k++, o += 4) {
+            uint8_t b = p[4 * c + k];
+            o[0] = ima_nibble(&d->ch[c], b & 15);
+            o[2] = ima_nibble(&d->ch[c], b >> 4);
+        }
+    }
+}
+
+unsigned adpcm_decode(adpcm_t *d, int16_t *dst, unsigned max,
+        const uint8_t **src, unsigned *len)
+{
+    const uint8_t *p = *src;
+    const uint8_t *end = p + *len;
+    int ima = d->format == WAV_FORMAT_IMA_ADPCM;
+    unsigned ch = d->channels;
+    unsigned done = 0;
+
+    for (;;) {
+        unsigned avail = end - p;
+        unsigned room = max - done;
+        int16_t *o = dst + done * ch;
+
+        if (d->left == 0) {
+            unsigned hdr = (ima ? ADPCM_IMA_HEADER : ADPCM_MS_HEADER) * ch;
+            if (avail < hdr || room < (ima ? 1u : 2u))
+                break;
+            unsigned n = ima ? ima_header(d, o, p) : ms_header(d, o, p);
+            p += hdr;
+            d->left = d->block_align - hdr;
+            d->frames = n ? d->block_frames - n : 0;
+            done += n;
+            if (d->left == 0)
+                d->frames = 0;
+            continue;
+        }
+
+        if (d->frames == 0) {
+            // The rest of the block is padding, or the block is bad.
+            unsigned skip = avail < d->left ? avail : d->left;
+            if (skip == 0)
+                break;
+            p += skip;
+            d->left -= skip;
+            continue;
+        }
+
+        if (ima && ch == 2) {
+            // Whole groups while they fit, then a group cut short by the
+            // end of the block.
+            if (avail < 8 || d->left < 8)
+                break;
+            unsigned n = d->frames < 8 ? d->frames : 8;
+            if (room < n)
+                break;
+            if (n == 8) {
+                unsigned groups = avail / 8;
+                if (groups > room / 8)
+                    groups = room / 8;
+                if (groups > d->frames / 8)
+                    groups = d->frames / 8;
+                for (unsigned g = 0; g < groups; g++, p += 8, o += 16)
+                    ima_group(d, o, p);
+                d->left -= 8 * groups;
+                d->frames -= 8 * groups;
+                done += 8 * groups;
+            } else {
+                int16_t tmp[16];
+                ima_group(d, tmp, p);
+                for (unsigned i = 0; i < 2 * n; i++)
+                    o[i] = tmp[i];
+                p += 8;
+                d->left -= 8;
+                d->frames = 0;
+                done += n;
+            }
+            continue;
+        }
+
+        // A byte is two frames of mono or one of stereo; the last byte of
+        // a mono block may hold just one.
+        unsigned per = ch == 1 ? 2 : 1;
+        unsigned bytes = avail < d->left ? avail : d->left;
+        unsigned frames = d->frames < room ? d->frames : room;
+        if (bytes > frames / per)
+            bytes = frames / per;
+        if (bytes == 0) {
+            if (ch == 1 && d->frames == 1 && room && avail) {
+                // The low (IMA) or high (MS) nibble of the last byte
+                *o = ima ? ima_nibble(&d->ch[0], *p & 15) : ms_nibble(&d->ch[0], *p >> 4);
+                p++;
+                d->left--;
+                d->frames = 0;
+                done++;
+                continue;
+            }
+            break;
+        }
+        if (ima) {
+            for (unsigned i = 0; i < bytes; i++, p++) {
+                *o++ = ima_nibble(&d->ch[0], *p & 15);
+                *o++ = ima_nibble(&d->ch[0], *p >> 4);
+            }
+        } else {
+            adpcm_chan_t *hi = &d->ch[0], *lo = &d->ch[ch - 1];
+            for (unsigned i = 0; i < bytes; i++, p++) {
+                *o++ = ms_nibble(hi, *p >> 4);
+                *o++ = ms_nibble(lo, *p & 15);
+            }
+        }
+        d->left -= bytes;
+        d->frames -= bytes * per;
+        done += bytes * per;
+    }
+    *src = p;
+    *len = end - p;
+    return done;
+}
@@ -1,81 +1,615 @@
 #include "audio.h"
+#include "sdcard.h"
+#include "wav.h"
+#include "adpcm.h"
+#include "mixer.h"
+#include "hardware/sync.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/clocks.h"
 
 static const uint PWM_AUDIO_RIGHT = 6;
 static const uint PWM_AUDIO_LEFT = 7;
-static const uint PERIOD = 255;
-static uint32_t sample_delay_us = 12;
-// sample_delay_us = (1000000 / sample_rate) - 30;
-// if (sample_delay_us < 5) sample_delay_us = 5;
-
-static FIL audio_file;
-static bool audio_active = false;
-static bool audio_loop = false;
-static uint32_t buffer_pos = 0;
-static uint32_t buffer_len = 0;
-static int16_t buffer[AUDIO_BUFFER_SIZE] = {0};
-static uint8_t volume = 128;
+static const uint PERIOD = MIXER_PWM_PERIOD;
+
+// Output
+//
+// Two DMA channels take turns writing blocks of compare values into the
+// CC register of the PWM slice, one value per tick of a DMA timer set to
+// the sample rate.  Each channel chains to the other when its block is
+// done, so the output never waits for the CPU.  The completion interrupt
+// renders the next block into the buffer that just finished, which leaves
+// it a whole block time to do so.  A CC value holds both channels, so
+// one store sets both sides: A (the right pin) in the low half and B
+// (the left pin) in the high half.
+
+// Voices
+//
+// Up to AUDIO_VOICES files play at once, each from its own ring.  The
+// DMA interrupt only takes samples out of the rings; it never calls into
+// FatFs.  audio_service() runs outside interrupt context and puts whole
+// segments in.  Once a ring is down to AUDIO_LOW_WATER full segments it
+// is topped up to AUDIO_HIGH_WATER, with one f_read() for each run of
+// free segments that does not wrap around, so the card sees a few long
+// reads instead of many short ones.
+//
+// ADPCM files are read into a buffer shared by all voices, a quarter of
+// the bytes the free segments hold, and decoded straight into the ring.
+// The decoder keeps its state in the voice between reads, so blocks of
+// any size stream without a copy of a whole block anywhere.
+//
+// A voice can also play a WAVE file held in memory, such as a short
+// effect loaded once or linked into flash.  It goes through the same
+// ring and decoder, read from memory instead of the card, so ADPCM stays
+// compressed where it is kept.
+//
+// seg_head and seg_tail count segments filled and played.  Each is
+// written by one side only, and a segment's samples are complete before
+// seg_head moves past it.  The interrupt mixes a voice only while
+// playing is set; it clears it after the last sample.  The rest of the
+// voice belongs to the main loop, which sets playing last when starting
+// a voice and clears it first when stopping one.  Both run on the same
+// core, so once playing is clear the interrupt is not inside the voice.
+//
+// The output runs all the time at AUDIO_RATE.  Each voice steps through
+// its source at its own rate times its pitch, a 16.16 step per output
+// frame, and is interpolated in between.  The interrupt copies the
+// frames a block needs out of the ring into a scratch buffer behind the
+// last three frames of the previous block, so the interpolation never
+// has to mind segment boundaries.  A voice at exactly the output rate
+// and pitch skips the interpolation.
+
+typedef struct {
+    FIL file;
+    const BYTE *mem;                    // The WAVE file in memory, or NULL
+    wav_info_t wav;
+    FSIZE_t data_left;                  // Bytes of the data chunk not read yet
+    int16_t ring[AUDIO_SEGMENTS][AUDIO_SEGMENT_SAMPLES];
+    uint16_t seg_len[AUDIO_SEGMENTS];   // Samples in each filled segment
+    volatile uint32_t seg_head;         // Written by audio_service()
+    volatile uint32_t seg_tail;         // Written by the DMA interrupt
+    uint32_t sample_pos;                // Next sample in segment seg_tail
+    volatile bool stream_end;           // The last segment is in the ring
+    volatile bool playing;              // Mixed by the DMA interrupt
+    bool refilling;                     // Filling up to the high watermark
+    bool open;                          // The file is open, or mem is set
+    bool loop;
+    volatile uint8_t volume;
+    volatile uint32_t step;             // Source frames per output frame, 16.16
+    uint32_t frac;                      // Position past hist[1], 16 bits
+    int16_t hist[3 * 2];                // The last three frames taken
+    uint8_t pad;                        // Silent frames taken after the end
+    adpcm_t adpcm;                      // Decoder state of an ADPCM file
+    uint8_t carry[ADPCM_MAX_UNIT];      // and the input it left last time
+    uint8_t carried;
+} voice_t;
+
+// Cycle counter for the cost of the mix: the DWT counter of the M33, or
+// elsewhere the microsecond timer scaled to clk_sys.
+#if defined(__ARM_ARCH_8M_MAIN__)
+#include "hardware/structs/m33.h"
+
+static void cycles_init(void) {
+    m33_hw->demcr |= M33_DEMCR_TRCENA_BITS;
+    m33_hw->dwt_ctrl |= M33_DWT_CTRL_CYCCNTENA_BITS;
+}
+
+static inline uint32_t cycles(void) {
+    return m33_hw->dwt_cyccnt;
+}
+#else
+static uint32_t cycles_per_us;
+
+static void cycles_init(void) {
+    cycles_per_us = clock_get_hz(clk_sys) / 1000000;
+}
+
+static inline uint32_t cycles(void) {
+    return time_us_32() * cycles_per_us;
+}
+#endif
+
+static voice_t voices[AUDIO_VOICES];
+// Telemetry.  The interrupt keeps all of it but late_refills up to date;
+// readers copy it with interrupts off.
+static audio_stats_t stats;
+static uint64_t stats_since;                // time_us_64() at the last reset
 static uint slice_num;
 
-static alarm_id_t audio_alarm_id = 0;
+#if 2 * (AUDIO_BLOCK_SAMPLES * AUDIO_MAX_STEP + 1) > AUDIO_SEGMENTS * AUDIO_SEGMENT_SAMPLES
+#error "The ring cannot hold a block at AUDIO_MAX_STEP"
+#endif
+// Every voice keeps its file open, which takes a lock slot and a sector
+// of the buffer pool, and no more: audio_play() turns its read-ahead
+// off.  Leave room for the files the rest of the firmware opens while
+// sound plays (the log, a pak, the shell), and for one of them reading
+// ahead.
+#define FILE_HEADROOM 4
+#if FF_FS_LOCK && FF_FS_LOCK < AUDIO_VOICES + FILE_HEADROOM
+#error "FF_FS_LOCK is too small for AUDIO_VOICES"
+#endif
+#if FF_BUF_POOL && FF_BUF_POOL < AUDIO_VOICES + FILE_HEADROOM + FF_READAHEAD
+#error "FF_BUF_POOL is too small for AUDIO_VOICES"
+#endif
+
+static int32_t mix[2 * AUDIO_BLOCK_SAMPLES];     // Left and right
+// Compressed data for the voice being refilled, after what was left of
+// its last read
+#define ADPCM_READ (4 * FF_MAX_SS)
+static BYTE adpcm_in[ADPCM_MAX_UNIT + ADPCM_READ];
+// History and source frames for one block of one voice at the top step
+static int16_t scratch[2 * (3 + AUDIO_BLOCK_SAMPLES * AUDIO_MAX_STEP + 1)];
+static mixer_shaper_t shaper;
+static uint32_t block[2][AUDIO_BLOCK_SAMPLES];  // CC values for the DMA
+static int dma_chan[2] = { -1, -1 };
+static int dma_timer = -1;
 
 
-static void audio_set_pwm(int level) {
-    pwm_set_chan_level(slice_num, PWM_CHAN_A, level);
-    pwm_set_chan_level(slice_num, PWM_CHAN_B, level);
+static void voice_reset(voice_t *v) {
+    v->seg_head = 0;
+    v->seg_tail = 0;
+    v->sample_pos = 0;
+    v->stream_end = false;
+    v->refilling = false;
+    v->frac = 0;
+    memset(v->hist, 0, sizeof v->hist);
+    v->pad = 0;
 }
 
-static void refill_buffer(void) {
-    if (!audio_active) return;
+// Source frames per output frame for a voice at rate played at pitch
+// times its own, both 16.16.
+static uint32_t voice_step(uint32_t rate, uint32_t pitch) {
+    uint64_t step = (uint64_t)rate * pitch / AUDIO_RATE;
+    if (step < 1)
+        step = 1;
+    if (step > AUDIO_MAX_STEP * MIXER_STEP_ONE)
+        step = AUDIO_MAX_STEP * MIXER_STEP_ONE;
+    return step;
+}
 
-    UINT br;
-    f_read(&audio_file, buffer, sizeof(buffer), &br);
-    buffer_len = br / 2;
-    buffer_pos = 0;
-
-    if (buffer_len == 0) {
-        if (audio_loop) {
-            f_lseek(&audio_file, 44);
-            // refill_buffer();
-        } else {
-            audio_active = false;
+// Put the decoder of an ADPCM voice at the start of the data.
+static void start_adpcm(voice_t *v) {
+    adpcm_start(&v->adpcm, v->wav.format, v->wav.channels,
+            v->wav.block_align, v->wav.block_frames);
+    v->carried = 0;
+}
+
+static void voice_stop(voice_t *v) {
+    v->playing = false;
+    if (v->open && !v->mem)
+        f_close(&v->file);
+    v->open = false;
+    v->mem = NULL;
+    voice_reset(v);
+}
+
+// Read up to want bytes of the data of v, from the card or from memory.
+static FRESULT voice_read(voice_t *v, void *dst, UINT want, UINT *br) {
+    if (!v->mem)
+        return f_read(&v->file, dst, want, br);
+    if (want > v->data_left)
+        want = v->data_left;
+    memcpy(dst, v->mem + v->wav.data_ofs + (v->wav.data_len - v->data_left), want);
+    *br = want;
+    return FR_OK;
+}
+
+// Where the next read of v starts within its sector.  Memory has none.
+static UINT voice_misalign(voice_t *v) {
+    return v->mem ? 0 : f_tell(&v->file) % FF_MAX_SS;
+}
+
+// Go back to the first sample of v.
+static FRESULT voice_rewind(voice_t *v) {
+    v->data_left = v->wav.data_len;
+    start_adpcm(v);
+    return v->mem ? FR_OK : f_lseek(&v->file, v->wav.data_ofs);
+}
+
+// Widen 8-bit unsigned samples to 16-bit signed.  src may lie in the
+// back half of dst's space: each sample is read before it is overwritten.
+static void widen_8bit(int16_t *dst, const uint8_t *src, UINT n) {
+    for (UINT i = 0; i < n; i++)
+        dst[i] = (int16_t)((src[i] - 128) * 256);
+}
+
+// Samples in the ring of v, from the next one to play
+static UINT ring_samples(voice_t *v, uint32_t tail, uint32_t head) {
+    UINT n = 0;
+    for (uint32_t t = tail; t != head; t++)
+        n += v->seg_len[t % AUDIO_SEGMENTS];
+    return n - v->sample_pos;
+}
+
+// Samples of v the next block takes out of the ring
+static UINT block_samples(voice_t *v) {
+    return ((AUDIO_BLOCK_SAMPLES * v->step >> 16) + 1) * v->wav.channels;
+}
+
+// Make the segment at seg_head, with samples in it, part of the ring.
+static void publish(voice_t *v, UINT samples) {
+    v->seg_len[v->seg_head % AUDIO_SEGMENTS] = samples;
+    __dmb();
+    v->seg_head = v->seg_head + 1;
+}
+
+// Read compressed data for up to segs segments of v and decode it into
+// the ring.  Input the decoder leaves (part of a header or a group) is
+// kept for the next read.  Each segment can fall short of full by less
+// than a stereo IMA group, 16 samples, so the read is cut to what
+// decodes into segments that are that much shorter.
+static FRESULT read_adpcm(voice_t *v, uint32_t segs) {
+    UINT ch = v->wav.channels;
+    UINT fill = 0;              // Samples in the segment at seg_head
+    uint32_t done = 0;          // Segments published
+    for (;;) {
+        int32_t room = ((int32_t)(segs - done) * (AUDIO_SEGMENT_SAMPLES - 16) - (int32_t)fill) / 2
+                - v->carried;
+        if (room <= 0)
+            break;
+        UINT want = room;
+        if (want > ADPCM_READ)
+            want = ADPCM_READ;
+        // End on a sector boundary if that leaves anything to read.
+        UINT over = (voice_misalign(v) + want) % FF_MAX_SS;
+        if (over < want)
+            want -= over;
+        if (want > v->data_left)
+            want = v->data_left;
+
+        UINT br;
+        memcpy(adpcm_in, v->carry, v->carried);
+        FRESULT fr = voice_read(v, adpcm_in + v->carried, want, &br);
+        if (fr)
+            return fr;
+        v->data_left = br < want ? 0 : v->data_left - br;
+
+        const BYTE *p = adpcm_in;
+        UINT len = v->carried + br;
+        while (len) {
+            uint32_t k = v->seg_head % AUDIO_SEGMENTS;
+            UINT before = len;
+            UINT frames = adpcm_decode(&v->adpcm, v->ring[k] + fill,
+                    (AUDIO_SEGMENT_SAMPLES - fill) / ch, &p, &len);
+            fill += frames * ch;
+            if (frames == 0 && len == before) {
+                // The next unit is not all there, or does not fit what
+                // is left of the segment: try it on an empty one.
+                if (fill == 0)
+                    break;
+                publish(v, fill);
+                fill = 0;
+                done++;
+            }
         }
+        memcpy(v->carry, p, len);
+        v->carried = len;
+
+        // A loop that ends part way into a segment goes round within it.
+        // Otherwise every pass of a sound shorter than a segment would
+        // take a segment of its own, and the ring could hold less than a
+        // block needs.
+        if (!v->loop || v->data_left > 0 || fill == 0)
+            break;
+        fr = voice_rewind(v);
+        if (fr)
+            return fr;
     }
+    if (fill)
+        publish(v, fill);
+    return FR_OK;
 }
 
-int64_t audio_update(alarm_id_t id, void *user_data) {
+// Read want bytes of PCM data of v, widened to 16 bits, to dst.  8-bit
+// data goes into the back half of the space and is widened in place.
+static FRESULT read_pcm(voice_t *v, int16_t *dst, UINT want, UINT *samples) {
+    UINT br;
+    UINT bps = v->wav.bits / 8;
+    BYTE *buf = (BYTE *)dst + (bps == 1 ? want : 0);
+    FRESULT fr = voice_read(v, buf, want, &br);
+    if (fr)
+        return fr;
+    v->data_left = br < want ? 0 : v->data_left - br;   // a short read is a cut file
+    *samples = br / bps;
+    if (bps == 1)
+        widen_8bit(dst, buf, *samples);
+    return FR_OK;
+}
+
+// Read into the ring of v until it holds AUDIO_HIGH_WATER segments or
+// the data ends.  Does nothing above the low watermark unless a top-up
+// is already under way.
+static FRESULT refill_ring(voice_t *v) {
+    uint32_t full = v->seg_head - v->seg_tail;
+    if (v->stream_end || (!v->refilling && full > AUDIO_LOW_WATER))
+        return FR_OK;
+    // A top-up this late may not beat the interrupt to the next block.
+    if (!v->refilling && ring_samples(v, v->seg_tail, v->seg_head) < block_samples(v))
+        stats.late_refills++;
+    v->refilling = true;
+
+    while (!v->stream_end && (full = v->seg_head - v->seg_tail) < AUDIO_HIGH_WATER) {
+        if (v->data_left == 0) {
+            // End of the data chunk: go back to its start when looping.
+            if (!v->loop || v->wav.data_len == 0) {
+                v->stream_end = true;
+                break;
+            }
+            FRESULT fr = voice_rewind(v);
+            if (fr)
+                return fr;
+        }
+
+        if (v->wav.format != WAV_FORMAT_PCM) {
+            FRESULT fr = read_adpcm(v, AUDIO_HIGH_WATER - full);
+            if (fr)
+                return fr;
+            continue;
+        }
 
-    
+        uint32_t first = v->seg_head % AUDIO_SEGMENTS;
+        uint32_t n = AUDIO_HIGH_WATER - full;
+        if (n > AUDIO_SEGMENTS - first)
+            n = AUDIO_SEGMENTS - first;
 
-    if (!audio_active) {
-        audio_set_pwm(PERIOD / 2);
-        return sample_delay_us;
+        // Keep the file position on a sector boundary.  After the header
+        // the first read stops at the next boundary (that segment is
+        // short), so the rest are whole-sector reads that FatFs passes
+        // straight to the card instead of through its sector buffer.
+        UINT bps = v->wav.bits / 8;
+        UINT want = n * AUDIO_SEGMENT_SAMPLES * bps;
+        UINT misalign = voice_misalign(v);
+        if (misalign && want > FF_MAX_SS - misalign)
+            want = FF_MAX_SS - misalign;
+        if (want > v->data_left)
+            want = v->data_left;
+        UINT samples;
+        FRESULT fr = read_pcm(v, v->ring[first], want, &samples);
+        if (fr)
+            return fr;
+        // A loop that ends part way into a segment goes round within it.
+        // Otherwise every pass of a sound shorter than a segment would
+        // take a segment of its own, and the ring could hold less than a
+        // block needs.
+        while (v->loop && v->data_left == 0 && samples % AUDIO_SEGMENT_SAMPLES) {
+            fr = voice_rewind(v);
+            if (fr)
+                return fr;
+            want = (AUDIO_SEGMENT_SAMPLES - samples % AUDIO_SEGMENT_SAMPLES) * bps;
+            if (want > v->data_left)
+                want = v->data_left;
+            UINT more;
+            fr = read_pcm(v, v->ring[first] + samples, want, &more);
+            if (fr)
+                return fr;
+            if (more == 0)
+                break;
+            samples += more;
+        }
+        // Publish the segments one by one.  The last one may be short
+        // at the end of the data.
+        while (samples) {
+            UINT len = samples < AUDIO_SEGMENT_SAMPLES ? samples : AUDIO_SEGMENT_SAMPLES;
+            publish(v, len);
+            samples -= len;
+        }
     }
+    v->refilling = false;
+    return FR_OK;
+}
+
+static void mix_frames(int32_t *acc, const int16_t *src, UINT n, UINT ch, int32_t gain) {
+    if (ch == 2)
+        mixer_add_stereo(acc, src, n, gain);
+    else
+        mixer_add_mono(acc, src, n, gain);
+}
 
-    if (buffer_pos >= buffer_len) {
-        // refill_buffer();
-        buffer_pos = 0; 
-        if (!audio_loop)
-        {
-            audio_stop(); 
-            return 0; 
+// Read the next n samples of the ring into dst, unless dst is NULL, and
+// take them out of the ring if take is set.
+static void ring_read(voice_t *v, int16_t *dst, UINT n, uint32_t *tail, bool take) {
+    uint32_t t = *tail;
+    uint32_t pos = v->sample_pos;
+    while (n) {
+        uint32_t seg = t % AUDIO_SEGMENTS;
+        UINT run = v->seg_len[seg] - pos;
+        if (run > n)
+            run = n;
+        if (dst) {
+            memcpy(dst, &v->ring[seg][pos], run * sizeof *dst);
+            dst += run;
         }
-        if (!audio_active) {
-            audio_set_pwm(PERIOD / 2);
-            return sample_delay_us;
+        pos += run;
+        n -= run;
+        if (pos >= v->seg_len[seg]) {
+            pos = 0;
+            t++;
+        }
+    }
+    if (take) {
+        v->sample_pos = pos;
+        *tail = t;
+    }
+}
+
+// Add the next n output frames of v to the stereo frames in acc.  Mono
+// goes to both sides.  When the ring is short of the frames the block
+// needs, the voice sits the block out and it counts as an underrun.
+// Returns false once the last frame of the stream has been mixed.
+static bool mix_voice(voice_t *v, int32_t *acc, UINT n) {
+    uint32_t tail = v->seg_tail;
+    uint32_t head = v->seg_head;
+    UINT ch = v->wav.channels;
+    int32_t gain = v->volume;
+    uint32_t step = v->step;
+    __dmb();
+
+    // Output frame k is at scratch frame 1 + (frac + k * step) / 2^16.
+    // The last one needs up to 2 frames past its position, and the next
+    // block starts with its history moved up by the frames taken.
+    uint32_t last = v->frac + (n - 1) * step;
+    uint32_t next = v->frac + n * step;
+    UINT take = next >> 16;
+    UINT need = (last >> 16) + 1;
+    if (need < take)
+        need = take;
+
+    UINT avail = ring_samples(v, tail, head) / ch;
+    if (avail < need && !v->stream_end) {
+        stats.underruns += n;
+        stats.low_water = 0;
+        return true;
+    }
+    UINT got = avail < need ? avail : need;
+    memcpy(scratch, v->hist, 3 * ch * sizeof scratch[0]);
+    ring_read(v, scratch + 3 * ch, got * ch, &tail, false);
+    // Past the end of the stream the source is silence.
+    memset(scratch + (3 + got) * ch, 0, (need - got) * ch * sizeof scratch[0]);
+
+    if (step == MIXER_STEP_ONE && v->frac == 0)
+        mix_frames(acc, scratch + ch, n, ch, gain);
+    else if (AUDIO_CUBIC)
+        mixer_resample_cubic(acc, scratch + ch, ch, n, v->frac, step, gain);
+    else
+        mixer_resample_linear(acc, scratch + ch, ch, n, v->frac, step, gain);
+
+    UINT taken = take < got ? take : got;
+    ring_read(v, NULL, taken * ch, &tail, true);
+    v->seg_tail = tail;
+    // How close the ring came to running dry while more can come
+    if (!v->stream_end && (avail - taken) * ch < stats.low_water)
+        stats.low_water = (avail - taken) * ch;
+    memcpy(v->hist, scratch + take * ch, 3 * ch * sizeof scratch[0]);
+    v->frac = next & 0xffff;
+    // Done once the history holds nothing but silence.
+    if (take > taken) {
+        UINT pad = v->pad + take - taken;
+        v->pad = pad > 3 ? 3 : pad;
+    }
+    return v->pad < 3;
+}
+
+// Fill dst with the CC values of the next n frames of the mix.  With
+// nothing playing the output rests at the midpoint.
+static void render_block(uint32_t *dst, UINT n) {
+    uint32_t start = cycles();
+    memset(mix, 0, 2 * n * sizeof mix[0]);
+    for (int k = 0; k < AUDIO_VOICES; k++) {
+        voice_t *v = &voices[k];
+        if (v->playing && !mix_voice(v, mix, n))
+            v->playing = false;     // its last sample is in this block
+    }
+    mixer_pwm_levels(dst, mix, n, &shaper);
+
+    uint32_t c = cycles() - start;
+    stats.blocks++;
+    stats.mix_cycles = c;
+    if (c > stats.mix_max_cycles)
+        stats.mix_max_cycles = c;
+    stats.mix_total_cycles += c;
+}
+
+static void note_irq(uint32_t us) {
+    int bin = us ? 32 - __builtin_clz(us) : 0;
+    if (bin >= AUDIO_IRQ_BINS)
+        bin = AUDIO_IRQ_BINS - 1;
+    stats.irq_us[bin]++;
+    if (us > stats.irq_max_us)
+        stats.irq_max_us = us;
+    stats.busy_us += us;
+}
+
+static void audio_dma_irq(void) {
+    uint32_t start = time_us_32();
+    for (int i = 0; i < 2; i++) {
+        if (!dma_channel_get_irq0_status(dma_chan[i]))
+            continue;
+        dma_channel_acknowledge_irq0(dma_chan[i]);
+        // The other channel is playing now; refill this one and rewind
+        // it for when the other one chains back.
+        render_block(block[i], AUDIO_BLOCK_SAMPLES);
+        dma_channel_set_read_addr(dma_chan[i], block[i], false);
+    }
+    note_irq(time_us_32() - start);
+}
+
+// |clk * x / y - rate| scaled by y, for comparing two fractions.
+static uint64_t rate_error(uint32_t clk, uint32_t rate, uint32_t x, uint32_t y) {
+    uint64_t a = (uint64_t)clk * x, b = (uint64_t)rate * y;
+    return a > b ? a - b : b - a;
+}
+
+// The DMA timer ticks at clk * X / Y with 16-bit X and Y.  Find the X/Y
+// closest to rate / clk: the last convergent of its continued fraction
+// that fits, or the largest semiconvergent after it if that is closer.
+static void rate_fraction(uint32_t clk, uint32_t rate, uint16_t *x, uint16_t *y) {
+    uint32_t p0 = 0, q0 = 1, p1 = 1, q1 = 0;
+    uint32_t a = rate, b = clk;
+    while (b) {
+        uint32_t t = a / b;
+        uint64_t p2 = (uint64_t)t * p1 + p0, q2 = (uint64_t)t * q1 + q0;
+        if (p2 > 0xffff || q2 > 0xffff) {
+            uint32_t m = p1 ? (0xffff - p0) / p1 : t;
+            uint32_t mq = q1 ? (0xffff - q0) / q1 : t;
+            if (mq < m)
+                m = mq;
+            uint32_t ps = p0 + m * p1, qs = q0 + m * q1;
+            if (m && rate_error(clk, rate, ps, qs) * q1 < rate_error(clk, rate, p1, q1) * qs) {
+                p1 = ps;
+                q1 = qs;
+            }
+            break;
         }
+        p0 = p1;
+        q0 = q1;
+        p1 = p2;
+        q1 = q2;
+        uint32_t r = a - t * b;
+        a = b;
+        b = r;
+    }
+    if (p1 == 0) {
+        // Below clk / 65535: as slow as the timer goes.
+        p1 = 1;
+        q1 = 0xffff;
     }
+    *x = p1;
+    *y = q1;
+}
+
+static void set_rate(uint32_t rate) {
+    uint16_t x, y;
+    rate_fraction(clock_get_hz(clk_sys), rate, &x, &y);
+    dma_timer_set_fraction(dma_timer, x, y);
+}
 
-    int16_t sample = buffer[buffer_pos++];
-    
-    int32_t scaled = (sample * (int32_t)volume) >> 8;
-    
-    scaled = (scaled >> 8) + (PERIOD / 2);
-    
-    if (scaled < 0) scaled = 0;
-    if (scaled > PERIOD) scaled = PERIOD;
+static void dma_init(void) {
+    dma_timer = dma_claim_unused_timer(true);
+    set_rate(AUDIO_RATE);
 
-    audio_set_pwm(scaled);
-    return sample_delay_us;
+    for (int i = 0; i < 2; i++)
+        dma_chan[i] = dma_claim_unused_channel(true);
+    for (int i = 0; i < 2; i++) {
+        dma_channel_config c = dma_channel_get_default_config(dma_chan[i]);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, true);
+        channel_config_set_write_increment(&c, false);
+        channel_config_set_dreq(&c, dma_get_timer_dreq(dma_timer));
+        channel_config_set_chain_to(&c, dma_chan[i ^ 1]);
+        dma_channel_configure(dma_chan[i], &c, &pwm_hw->slice[slice_num].cc,
+                block[i], AUDIO_BLOCK_SAMPLES, false);
+        dma_channel_set_irq0_enabled(dma_chan[i], true);
+    }
+    irq_set_exclusive_handler(DMA_IRQ_0, audio_dma_irq);
+    irq_set_enabled(DMA_IRQ_0, true);
+}
+
+static void dma_start(void) {
+    render_block(block[0], AUDIO_BLOCK_SAMPLES);
+    render_block(block[1], AUDIO_BLOCK_SAMPLES);
+    dma_channel_set_read_addr(dma_chan[0], block[0], false);
+    dma_channel_set_read_addr(dma_chan[1], block[1], false);
+    dma_channel_start(dma_chan[0]);
 }
 
 void audio_init(void) {
@@ -89,47 +623,150 @@ void audio_init(void) {
 
     slice_num = pwm_gpio_to_slice_num(PWM_AUDIO_RIGHT);
     pwm_set_wrap(slice_num, PERIOD);
-    pwm_set_chan_level(slice_num, PWM_CHAN_A, PERIOD / 2);
-    pwm_set_chan_level(slice_num, PWM_CHAN_B, PERIOD / 2);
+    pwm_set_chan_level(slice_num, PWM_CHAN_A, (PERIOD + 1) / 2);
+    pwm_set_chan_level(slice_num, PWM_CHAN_B, (PERIOD + 1) / 2);
     pwm_set_enabled(slice_num, true);
 
-    audio_active = false;
-    buffer_pos = 0;
-    buffer_len = 0;
+    dma_init();
+    cycles_init();
+    audio_reset_stats();
+    dma_start();
+}
+
+static bool playable(const wav_info_t *w) {
+    if (w->channels > 2)
+        return false;
+    if (w->format == WAV_FORMAT_PCM)
+        return w->bits == 8 || w->bits == 16;
+    return w->format == WAV_FORMAT_IMA_ADPCM || w->format == WAV_FORMAT_MS_ADPCM;
+}
+
+// A voice neither open nor still playing out, or NULL
+static voice_t *free_voice(void) {
+    for (int k = 0; k < AUDIO_VOICES; k++) {
+        if (!voices[k].open && !voices[k].playing)
+            return &voices[k];
+    }
+    return NULL;
 }
 
-bool audio_play(const char *filename, uint8_t vol, bool loop) {
-    if (audio_active) f_close(&audio_file);
+// Start v, with its source open and its format read, and return it, or
+// -1 if the source cannot be read.
+static int start_voice(voice_t *v, uint8_t volume, bool loop) {
+    v->open = true;
+    voice_reset(v);
+    v->volume = volume;
+    v->loop = loop;
+    v->step = voice_step(v->wav.rate, MIXER_STEP_ONE);
+
+    // Fill the whole ring before the first sample goes out.
+    v->refilling = true;
+    if (voice_rewind(v) != FR_OK || refill_ring(v) != FR_OK) {
+        voice_stop(v);
+        return -1;
+    }
+    __dmb();
+    v->playing = true;
+    return (int)(v - voices);
+}
+
+int audio_play(const char *filename, uint8_t volume, bool loop) {
+    voice_t *v = free_voice();
+    if (!v) {
+        printf("No free voice for %s\n", filename);
+        return -1;
+    }
 
-    if (f_open(&audio_file, filename, FA_READ) != FR_OK) {
+    if (f_open(&v->file, filename, FA_READ) != FR_OK) {
         printf("Failed to open file: %s\n", filename);
-        audio_active = false;
-        return false;
+        return -1;
     }
+#if FF_READAHEAD
+    // The ring is the voice's read-ahead.  Its reads that end part way
+    // into a sector (the first after the header, and small ADPCM reads)
+    // would otherwise start FatFs reading ahead too, with sectors from
+    // the pool that the other voices need to open their files.
+    f_readahead(&v->file, 0);
+#endif
 
-    f_lseek(&audio_file, 44);  // Skip WAV header
+    // Leaves the file at the first sample.
+    FRESULT fr = wav_open(&v->file, &v->wav);
+    if (fr == FR_OK && !playable(&v->wav))
+        fr = FR_DENIED;
+    if (fr) {
+        printf("Not a playable WAV file: %s\n", filename);
+        f_close(&v->file);
+        return -1;
+    }
+    return start_voice(v, volume, loop);
+}
 
-    buffer_pos = 0;
-    buffer_len = 0;
-    volume = vol;
-    audio_loop = loop;
-    
-    audio_active = true;
-    refill_buffer();
-    audio_alarm_id = add_alarm_in_us(sample_delay_us, audio_update, NULL, true);
-    return true;
+int audio_play_mem(const void *wav, uint32_t size, uint8_t volume, bool loop) {
+    voice_t *v = free_voice();
+    if (!v) {
+        printf("No free voice for a sound in memory\n");
+        return -1;
+    }
+    if (wav_open_mem(wav, size, &v->wav) != FR_OK || !playable(&v->wav)) {
+        printf("Not a playable WAV file in memory\n");
+        return -1;
+    }
+    v->mem = wav;
+    return start_voice(v, volume, loop);
 }
 
-void audio_stop(void) {
-    if (audio_alarm_id) {
-        cancel_alarm(audio_alarm_id);
-        audio_alarm_id = 0;
+void audio_service(void) {
+    for (int k = 0; k < AUDIO_VOICES; k++) {
+        voice_t *v = &voices[k];
+        if (!v->open)
+            continue;
+        if (!v->playing) {
+            // The last sample has gone out.
+            voice_stop(v);
+            continue;
+        }
+        if (refill_ring(v) != FR_OK) {
+            // Let the ring drain and stop at its end.
+            v->stream_end = true;
+        }
     }
-    if (audio_active) f_close(&audio_file);
-    audio_active = false;
-    audio_set_pwm(PERIOD / 2);
 }
 
-void audio_set_volume(uint8_t vol) {
-    volume = vol;
+void audio_stop(void) {
+    for (int k = 0; k < AUDIO_VOICES; k++)
+        voice_stop(&voices[k]);
+}
+
+void audio_stop_voice(int voice) {
+    if (voice >= 0 && voice < AUDIO_VOICES)
+        voice_stop(&voices[voice]);
+}
+
+bool audio_playing(int voice) {
+    return voice >= 0 && voice < AUDIO_VOICES && voices[voice].playing;
+}
+
+void audio_set_volume(int voice, uint8_t volume) {
+    if (voice >= 0 && voice < AUDIO_VOICES)
+        voices[voice].volume = volume;
+}
+
+void audio_set_pitch(int voice, uint32_t pitch) {
+    if (voice >= 0 && voice < AUDIO_VOICES && voices[voice].open)
+        voices[voice].step = voice_step(voices[voice].wav.rate, pitch);
+}
+
+void audio_get_stats(audio_stats_t *st) {
+    uint32_t irq = save_and_disable_interrupts();
+    *st = stats;
+    restore_interrupts(irq);
+    st->elapsed_us = time_us_64() - stats_since;
+}
+
+void audio_reset_stats(void) {
+    uint32_t irq = save_and_disable_interrupts();
+    memset(&stats, 0, sizeof stats);
+    stats.low_water = AUDIO_SEGMENTS * AUDIO_SEGMENT_SAMPLES;
+    stats_since = time_us_64();
+    restore_interrupts(irq);
 }
\ No newline at end of file
@@ -0,0 +1,230 @@
+#include "defrag.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Fragmented assets are copied into a fresh file ("name.~df") whose
+// clusters were reserved in one run by f_expand().  The copy is compared
+// with the original, then the original is renamed aside ("name.~do"),
+// the copy is renamed into its place and only then is the original
+// deleted.  At every point one of the names holds a complete copy, and
+// defrag_file() finishes or undoes an interrupted run before it looks at
+// the file again.
+
+// Sectors per copy buffer.  Two buffers are taken from the FatFs sector
+// pool for the duration of one file.
+#define COPY_SECTORS 2
+
+FRESULT defrag_count(const char *path, DWORD *nfrag)
+{
+    FIL fil;
+    FRESULT fr = f_open(&fil, path, FA_READ);
+    if (fr)
+        return fr;
+    fr = f_getfrag(&fil, nfrag, NULL);
+    FRESULT cr = f_close(&fil);
+    return fr ? fr : cr;
+}
+
+// Copy src into dst, which has been preallocated to the same size.
+static FRESULT copy_data(FIL *dst, FIL *src, BYTE *buf, UINT len)
+{
+    for (;;) {
+        UINT br, bw;
+        FRESULT fr = f_read(src, buf, len, &br);
+        if (fr || br == 0)
+            return fr;
+        fr = f_write(dst, buf, br, &bw);
+        if (fr)
+            return fr;
+        if (bw != br)
+            return FR_DENIED;
+    }
+}
+
+// Compare two open files from their current positions to the end.
+static FRESULT compare_data(FIL *a, FIL *b, BYTE *abuf, BYTE *bbuf, UINT len)
+{
+    if (f_size(a) != f_size(b))
+        return FR_INT_ERR;
+    for (;;) {
+        UINT ar, br;
+        FRESULT fr = f_read(a, abuf, len, &ar);
+        if (fr == FR_OK)
+            fr = f_read(b, bbuf, len, &br);
+        if (fr)
+            return fr;
+        if (ar != br || memcmp(abuf, bbuf, ar) != 0)
+            return FR_INT_ERR;
+        if (ar == 0)
+            return FR_OK;
+    }
+}
+
+// Write a contiguous copy of path to tmp and check it.
+static FRESULT make_copy(const char *path, const char *tmp, BYTE *buf, UINT len)
+{
+    FIL src, dst;
+    FRESULT fr = f_open(&src, path, FA_READ);
+    if (fr)
+        return fr;
+    fr = f_open(&dst, tmp, FA_WRITE|FA_CREATE_ALWAYS);
+    if (fr) {
+        f_close(&src);
+        return fr;
+    }
+    fr = f_expand(&dst, f_size(&src), 1);
+    if (fr == FR_OK)
+        fr = copy_data(&dst, &src, buf, len);
+    FRESULT cr = f_close(&dst);
+    if (fr == FR_OK)
+        fr = cr;
+
+    // Read the copy back from the card and make sure it is one extent.
+    if (fr == FR_OK)
+        fr = f_open(&dst, tmp, FA_READ);
+    if (fr == FR_OK) {
+        DWORD nfrag;
+        fr = f_getfrag(&dst, &nfrag, NULL);
+        if (fr == FR_OK && nfrag > 1)
+            fr = FR_INT_ERR;
+        if (fr == FR_OK)
+            fr = f_lseek(&src, 0);
+        if (fr == FR_OK)
+            fr = compare_data(&src, &dst, buf, buf + len, len);
+        f_close(&dst);
+    }
+    f_close(&src);
+    return fr;
+}
+
+static bool exists(const char *path)
+{
+    FILINFO fno;
+    return f_stat(path, &fno) == FR_OK;
+}
+
+// A rename cut short leaves two directory entries for one cluster chain.
+// Deleting either name would free the clusters of the other, so such a
+// pair is left alone for a disk check.
+static FRESULT check_separate(const char *a, const char *b)
+{
+    FIL fa, fb;
+    FRESULT fr = f_open(&fa, a, FA_READ);
+    if (fr)
+        return fr;
+    fr = f_open(&fb, b, FA_READ);
+    if (fr == FR_OK) {
+        if (fa.obj.sclust && fa.obj.sclust == fb.obj.sclust)
+            fr = FR_INT_ERR;
+        f_close(&fb);
+    }
+    f_close(&fa);
+    return fr;
+}
+
+// Give the copy now at path the timestamp and attributes of the
+// original at old, and delete the original.
+static FRESULT finish(const char *path, const char *old)
+{
+    FILINFO fno, cur;
+    FRESULT fr = f_stat(old, &fno);
+    if (fr == FR_OK)
+        fr = f_stat(path, &cur);
+    if (fr == FR_OK) {
+        // The copy is created writable, so a read-only copy got the bit
+        // from the original in an earlier call that was cut short after
+        // clearing it on the original.
+        fno.fattrib |= cur.fattrib & AM_RDO;
+        fr = f_utime(path, &fno);
+    }
+    if (fr == FR_OK)
+        fr = f_chmod(path, fno.fattrib, AM_RDO|AM_HID|AM_SYS|AM_ARC);
+    if (fr == FR_OK)
+        fr = f_chmod(old, 0, AM_RDO);
+    if (fr == FR_OK)
+        fr = f_unlink(old);
+    return fr;
+}
+
+// Clean up after a defrag_file() that did not complete.
+static FRESULT recover(const char *path, const char *tmp, const char *old)
+{
+    FRESULT fr;
+    if (!exists(old)) {
+        // The original was never moved: a copy left behind may be
+        // incomplete or unchecked.
+        if (exists(tmp) && exists(path))
+            return f_unlink(tmp);
+        return FR_OK;
+    }
+    if (exists(path)) {
+        // The copy was renamed into place (or the original is halfway
+        // through its rename).
+        fr = check_separate(path, old);
+        if (fr == FR_OK && exists(tmp))
+            fr = check_separate(path, tmp);
+        if (fr)
+            return fr;
+        return finish(path, old);
+    }
+    // Between the two renames.  A copy is only ever renamed once it
+    // has been checked, so either name can take the place of the file.
+    if (exists(tmp)) {
+        fr = f_rename(tmp, path);
+        return fr ? fr : finish(path, old);
+    }
+    return f_rename(old, path);
+}
+
+FRESULT defrag_file(const char *path)
+{
+    char tmp[FF_MAX_LFN + 1], old[FF_MAX_LFN + 1];
+    if (snprintf(tmp, sizeof tmp, "%s.~df", path) >= (int)sizeof tmp
+            || snprintf(old, sizeof old, "%s.~do", path) >= (int)sizeof old)
+        return FR_INVALID_NAME;
+    FRESULT fr = recover(path, tmp, old);
+    if (fr)
+        return fr;
+
+    DWORD nfrag;
+    fr = defrag_count(path, &nfrag);
+    if (fr || nfrag <= 1)
+        return fr;
+
+    UINT nsect = COPY_SECTORS;
+    BYTE *buf = ff_bufalloc(2 * nsect);
+    if (!buf) {
+        nsect = 1;
+        buf = ff_bufalloc(2 * nsect);
+    }
+    if (!buf)
+        return FR_NOT_ENOUGH_CORE;
+    fr = make_copy(path, tmp, buf, nsect * FF_MAX_SS);
+    ff_buffree(buf);
+    if (fr) {
+        f_unlink(tmp);
+        return fr;
+    }
+
+    // Swap the copy in, keeping the original until it is in place.
+    fr = f_rename(path, old);
+    if (fr == FR_OK)
+        fr = f_rename(tmp, path);
+    if (fr == FR_OK)
+        fr = finish(path, old);
+    return fr;
+}
+
+FRESULT defrag_assets(const char *const paths[], int count)
+{
+    FRESULT first = FR_OK;
+    for (int i = 0; i < count; i++) {
+        FRESULT fr = defrag_file(paths[i]);
+        if (fr == FR_NO_FILE)
+            continue;
+        if (fr && first == FR_OK)
+            first = fr;
+    }
+    return first;
+}
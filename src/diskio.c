@@ -5,6 +5,7 @@
 #include "diskio.h"		/* Declarations of disk functions */
 #include <stdio.h>
 #include "audio.h"
+#include "pico/mutex.h"
 
 spi_inst_t *sd = spi0; // the SPI interface to use for the SD card
 
@@ -13,8 +14,6 @@ const int SD_CS   = 37;
 const int SD_SCK  = 38;
 const int SD_MOSI = 35;
 
-static FATFS fs;
-
 void init_sdcard_io(void) {
     spi_init(spi0, 400 * 1000);
     gpio_set_function(SD_MISO, GPIO_FUNC_SPI);
@@ -42,13 +41,6 @@ void sdcard_io_high_speed(void) {
     spi_set_baudrate(spi0, 12 * 1000 * 1000);
 }
 
-bool sd_init(void) {
-    init_sdcard_io();
-    disable_sdcard();
-    FRESULT res = f_mount(&fs, "", 1);
-    return res == FR_OK;
-}
-
 // Make sure the receive FIFO of the SPI interface is clear.
 void spi_clear_rxfifo(spi_inst_t *s) {
     while (spi_is_readable(s)) {
@@ -113,8 +105,9 @@ int sdcard_r3(void)
     return value;
 }
 
-// Read a block of a specified length from the SD card.
-int sdcard_readblock(BYTE buffer[], int len)
+// Wait for a data token and read the data packet that follows it,
+// including its CRC.  Return the token (0xfe on success).
+static int sdcard_readdata(BYTE buffer[], int len)
 {
     int value = 0xff;
     int count=0;
@@ -128,16 +121,49 @@ int sdcard_readblock(BYTE buffer[], int len)
         buffer[i] = sdcard_write(0xff);
     uint8_t __attribute__((unused))crc1 = sdcard_write(0xff);
     uint8_t __attribute__((unused))crc2 = sdcard_write(0xff);
+    return 0xfe;
+}
+
+// Read a block of a specified length from the SD card.
+int sdcard_readblock(BYTE buffer[], int len)
+{
+    int value = sdcard_readdata(buffer, len);
+    if (value != 0xfe)
+        return value;
     uint8_t __attribute__((unused))check = sdcard_write(0xff); // Check that this is 0xff
     return 0xfe;
 }
 
+// End a multiple block read (CMD18) with CMD12.  The byte right after
+// the command is a stuff byte, and the card may hold the bus busy
+// (reading 0x00) for a while after its response.
+int sdcard_stop_transmission(void)
+{
+    sdcard_write(64 + 12);
+    sdcard_write(0);
+    sdcard_write(0);
+    sdcard_write(0);
+    sdcard_write(0);
+    sdcard_write(0x61);
+    sdcard_write(0xff); // stuff byte
+    int value = 0xff;
+    for(int count=0; count<100; count++) {
+        value = sdcard_write(0xff);
+        if (value != 0xff) break;
+    }
+    while(sdcard_write(0xff) != 0xff)
+        ;
+    return value;
+}
+
 // Write a block of a specified length to the SD card.
-int sdcard_writeblock(const BYTE buffer[], int len)
+// The token is 0xfe for a single block write (CMD24) or
+// 0xfc for each block of a multiple block write (CMD25).
+int sdcard_writeblock(uint8_t token, const BYTE buffer[], int len)
 {
     int value = 0xff;
     value = sdcard_write(0xff); // pause for one byte [expect 0xff]
-    value = sdcard_write(0xfe); // start data packet [expect 0xff]
+    value = sdcard_write(token); // start data packet [expect 0xff]
     for(int i=0; i<len; i++)
         value = sdcard_write(buffer[i]);
     value = sdcard_write(0x01); // write the crc [expect 0xff]
@@ -160,7 +186,12 @@ int sdcard_writeblock(const BYTE buffer[], int len)
 
 static DSTATUS sdcard_status = STA_NOINIT;
 
-DSTATUS disk_initialize (
+// The card is used by FatFs under its volume lock and by the key-value
+// store, which writes raw sectors without one.  Every transfer holds this
+// lock so that commands from the two cores never interleave on the bus.
+auto_init_recursive_mutex(sd_bus);
+
+static DSTATUS sd_initialize (
 	BYTE pdrv				/* Physical drive nmuber to identify the drive */
 )
 {
@@ -218,12 +249,12 @@ DSTATUS disk_initialize (
 /* Get Drive Status                                                      */
 /*-----------------------------------------------------------------------*/
 
-DSTATUS disk_status (
+static DSTATUS sd_status (
     BYTE pdrv       /* Physical drive nmuber to identify the drive */
 )
 {
     if (sdcard_status != 0) {
-        sdcard_status = disk_initialize(pdrv);
+        sdcard_status = sd_initialize(pdrv);
     }
     // Read the OCR to check if the card is still accessible.
     enable_sdcard();
@@ -234,7 +265,7 @@ DSTATUS disk_status (
     disable_sdcard();
 
     sdcard_status = STA_NOINIT;
-    return disk_initialize(pdrv);
+    return sd_initialize(pdrv);
 }
 
 
@@ -243,7 +274,7 @@ DSTATUS disk_status (
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_read (
+static DRESULT sd_read (
 	BYTE pdrv,		/* Physical drive nmuber to identify the drive */
 	BYTE *buffer,	/* Data buffer to store read data */
 	LBA_t sector,	/* Start sector in LBA */
@@ -253,22 +284,34 @@ DRESULT disk_read (
 	DRESULT __attribute__((unused)) res;
     int value;
     int status = RES_OK;
-    if (disk_status(pdrv) == STA_NOINIT)
+    // FatFs calls disk_status() for every operation, so only a card
+    // that was never brought up needs attention here.
+    if (sdcard_status != 0 && sd_status(pdrv) == STA_NOINIT)
         return RES_NOTRDY;
     enable_sdcard();
+    if (count == 1) {
+        value = sdcard_cmd(17, sector, 0x01);
+        if (value != 0 || sdcard_readblock(buffer, 512) != 0xfe)
+            status = RES_ERROR;
+        disable_sdcard();
+        return status;
+    }
+    // Fetch a run of sectors with one multiple block read so that the
+    // command overhead is paid once for the whole transfer.
+    value = sdcard_cmd(18, sector, 0x01);
+    if (value != 0) {
+        disable_sdcard();
+        return RES_ERROR;
+    }
     for(int c=0; c<count; c++) {
         BYTE *p = &buffer[512 * c];
-        value = sdcard_cmd(17, sector+c, 0x01);
-        if (value != 0) {
-            status = RES_ERROR;
-            break;
-        }
-        value = sdcard_readblock(p,512);
+        value = sdcard_readdata(p, 512);
         if (value != 0xfe) {
             status = RES_ERROR;
             break;
         }
     }
+    sdcard_stop_transmission();
     disable_sdcard();
     return status;
 }
@@ -281,7 +324,7 @@ DRESULT disk_read (
 
 #if FF_FS_READONLY == 0
 
-DRESULT disk_write (
+static DRESULT sd_write (
 	BYTE pdrv,			/* Physical drive nmuber to identify the drive */
 	const BYTE *buffer,	/* Data to be written */
 	LBA_t sector,		/* Start sector in LBA */
@@ -292,22 +335,36 @@ DRESULT disk_write (
     BYTE __attribute__((unused)) *p;
     int value;
     int status = RES_OK;
-    if (disk_status(pdrv) == STA_NOINIT)
+    if (sdcard_status != 0 && sd_status(pdrv) == STA_NOINIT)
         return RES_NOTRDY;
     enable_sdcard();
+    if (count == 1) {
+        value = sdcard_cmd(24, sector, 0x01);
+        if (value != 0 || sdcard_writeblock(0xfe, buffer, 512) != 0x05)
+            status = RES_ERROR;
+        disable_sdcard();
+        return status;
+    }
+    // Send a run of sectors as one multiple block write so the card
+    // can program them without a command round trip per sector.
+    value = sdcard_cmd(25, sector, 0x01);
+    if (value != 0) {
+        disable_sdcard();
+        return RES_ERROR;
+    }
     for(int c=0; c<count; c++) {
         const BYTE *p = &buffer[512 * c];
-        value = sdcard_cmd(24, sector+c, 0x01);
-        if (value != 0) {
-            status = RES_ERROR;
-            break;
-        }
-        value = sdcard_writeblock(p,512);
+        value = sdcard_writeblock(0xfc, p, 512);
         if (value != 0x05) {
             status = RES_ERROR;
             break;
         }
     }
+    sdcard_write(0xfd); // stop transmission token
+    sdcard_write(0xff); // skip one byte before the busy signal
+    do {
+        value = sdcard_write(0xff); // wait while the card is busy
+    } while(value != 0xff);
     disable_sdcard();
     return status;
 }
@@ -319,7 +376,7 @@ DRESULT disk_write (
 /* Miscellaneous Functions                                               */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_ioctl (
+static DRESULT sd_ioctl (
 	BYTE pdrv,		/* Physical drive nmuber (0..) */
 	BYTE cmd,		/* Control code */
 	void *buff		/* Buffer to send/receive control data */
@@ -329,7 +386,7 @@ DRESULT disk_ioctl (
 	BYTE __attribute__((unused)) n, csd[16];
 	int __attribute__((unused)) result;
 
-	if (disk_status(pdrv) & STA_NOINIT)
+	if (sd_status(pdrv) & STA_NOINIT)
 	    return RES_NOTRDY;
 
 	switch (cmd) {
@@ -354,4 +411,54 @@ DRESULT disk_ioctl (
 	    return RES_PARERR;
 	}
 	return res;
-}
\ No newline at end of file
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Locked Entry Points                                                   */
+/*-----------------------------------------------------------------------*/
+
+DSTATUS disk_initialize (BYTE pdrv)
+{
+    recursive_mutex_enter_blocking(&sd_bus);
+    DSTATUS stat = sd_initialize(pdrv);
+    recursive_mutex_exit(&sd_bus);
+    return stat;
+}
+
+DSTATUS disk_status (BYTE pdrv)
+{
+    recursive_mutex_enter_blocking(&sd_bus);
+    DSTATUS stat = sd_status(pdrv);
+    recursive_mutex_exit(&sd_bus);
+    return stat;
+}
+
+DRESULT disk_read (BYTE pdrv, BYTE *buffer, LBA_t sector, UINT count)
+{
+    recursive_mutex_enter_blocking(&sd_bus);
+    DRESULT res = sd_read(pdrv, buffer, sector, count);
+    recursive_mutex_exit(&sd_bus);
+    return res;
+}
+
+#if FF_FS_READONLY == 0
+
+DRESULT disk_write (BYTE pdrv, const BYTE *buffer, LBA_t sector, UINT count)
+{
+    recursive_mutex_enter_blocking(&sd_bus);
+    DRESULT res = sd_write(pdrv, buffer, sector, count);
+    recursive_mutex_exit(&sd_bus);
+    return res;
+}
+
+#endif
+
+DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void *buff)
+{
+    recursive_mutex_enter_blocking(&sd_bus);
+    DRESULT res = sd_ioctl(pdrv, cmd, buff);
+    recursive_mutex_exit(&sd_bus);
+    return res;
+}
@@ -21,6 +21,7 @@
 
 #include "ff.h"			/* Declarations of FatFs API */
 #include "diskio.h"		/* Declarations of device I/O functions */
+#include <string.h>		/* memcpy(), memset() and memcmp() of the toolchain */
 
 
 /*--------------------------------------------------------------------------
@@ -230,6 +231,38 @@
 #define ABORT(fs, res)		{ fp->err = (BYTE)(res); LEAVE_FF(fs, res); }
 
 
+/* Data of the current sector fp->sect (multi-sector read buffer or private sector buffer) */
+#if FF_USE_FILEBUF && !FF_FS_TINY
+#define FILBUF_HIT(fp, sc)	((fp)->cbuf && (LBA_t)((sc) - (fp)->cbsect) < (fp)->cbcnt)
+#define FILBUF(fp)	(FILBUF_HIT(fp, (fp)->sect) ? (fp)->cbuf + (UINT)((fp)->sect - (fp)->cbsect) * SS((fp)->obj.fs) : (fp)->buf)
+#else
+#define FILBUF(fp)	((fp)->buf)
+#endif
+
+/* Contiguous file without FAT chain (sectors are found by arithmetic) */
+#if FF_FS_EXFAT
+#define NOCHAIN(fs, fp)	((fs)->fs_type == FS_EXFAT && (fp)->obj.stat == 2)
+#else
+#define NOCHAIN(fs, fp)	0
+#endif
+
+/* File data is lent out by f_borrow (the file cannot be read, written or moved) */
+#if FF_USE_BORROW && !FF_FS_TINY
+#define LENT(fp)	((fp)->lent)
+#else
+#define LENT(fp)	0
+#endif
+
+/* Read-ahead starts after this number of sector loads in sequence */
+#if FF_READAHEAD && !FF_FS_TINY
+#if !FF_USE_FILEBUF || !FF_BUF_POOL
+#error FF_READAHEAD needs FF_USE_FILEBUF and FF_BUF_POOL
+#endif
+#define RA_TRIGGER	2
+#define RA_KEEP		2	/* Pool sectors read-ahead leaves free for files to be opened (without FF_FS_LOCK) */
+#endif
+
+
 /* Re-entrancy related */
 #if FF_FS_REENTRANT
 #if FF_USE_LFN == 1
@@ -607,17 +640,38 @@ static const BYTE DbcTbl[] = MKCVTBL(TBL_DC, FF_CODE_PAGE);
 /* Load/Store multi-byte word in the FAT structure                       */
 /*-----------------------------------------------------------------------*/
 
+/* On a little-endian core that can access unaligned words (Cortex-M33), a
+/  field is loaded or stored with a single LDR/STR. The packed structures
+/  tell the compiler that the address may be unaligned. */
+#if defined(__ARM_FEATURE_UNALIGNED) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LD_UNALIGNED	1
+typedef struct { WORD v; } __attribute__((packed, may_alias)) UA_WORD;
+typedef struct { DWORD v; } __attribute__((packed, may_alias)) UA_DWORD;
+#if FF_FS_EXFAT
+typedef struct { QWORD v; } __attribute__((packed, may_alias)) UA_QWORD;
+#endif
+#else
+#define LD_UNALIGNED	0
+#endif
+
 static WORD ld_word (const BYTE* ptr)	/*	 Load a 2-byte little-endian word */
 {
+#if LD_UNALIGNED
+	return ((const UA_WORD*)ptr)->v;
+#else
 	WORD rv;
 
 	rv = ptr[1];
 	rv = rv << 8 | ptr[0];
 	return rv;
+#endif
 }
 
 static DWORD ld_dword (const BYTE* ptr)	/* Load a 4-byte little-endian word */
 {
+#if LD_UNALIGNED
+	return ((const UA_DWORD*)ptr)->v;
+#else
 	DWORD rv;
 
 	rv = ptr[3];
@@ -625,11 +679,15 @@ static DWORD ld_dword (const BYTE* ptr)	/* Load a 4-byte little-endian word */
 	rv = rv << 8 | ptr[1];
 	rv = rv << 8 | ptr[0];
 	return rv;
+#endif
 }
 
 #if FF_FS_EXFAT
 static QWORD ld_qword (const BYTE* ptr)	/* Load an 8-byte little-endian word */
 {
+#if LD_UNALIGNED
+	return ((const UA_QWORD*)ptr)->v;
+#else
 	QWORD rv;
 
 	rv = ptr[7];
@@ -641,27 +699,39 @@ static QWORD ld_qword (const BYTE* ptr)	/* Load an 8-byte little-endian word */
 	rv = rv << 8 | ptr[1];
 	rv = rv << 8 | ptr[0];
 	return rv;
+#endif
 }
 #endif
 
 #if !FF_FS_READONLY
 static void st_word (BYTE* ptr, WORD val)	/* Store a 2-byte word in little-endian */
 {
+#if LD_UNALIGNED
+	((UA_WORD*)ptr)->v = val;
+#else
 	*ptr++ = (BYTE)val; val >>= 8;
 	*ptr++ = (BYTE)val;
+#endif
 }
 
 static void st_dword (BYTE* ptr, DWORD val)	/* Store a 4-byte word in little-endian */
 {
+#if LD_UNALIGNED
+	((UA_DWORD*)ptr)->v = val;
+#else
 	*ptr++ = (BYTE)val; val >>= 8;
 	*ptr++ = (BYTE)val; val >>= 8;
 	*ptr++ = (BYTE)val; val >>= 8;
 	*ptr++ = (BYTE)val;
+#endif
 }
 
 #if FF_FS_EXFAT
 static void st_qword (BYTE* ptr, QWORD val)	/* Store an 8-byte word in little-endian */
 {
+#if LD_UNALIGNED
+	((UA_QWORD*)ptr)->v = val;
+#else
 	*ptr++ = (BYTE)val; val >>= 8;
 	*ptr++ = (BYTE)val; val >>= 8;
 	*ptr++ = (BYTE)val; val >>= 8;
@@ -670,6 +740,7 @@ static void st_qword (BYTE* ptr, QWORD val)	/* Store an 8-byte word in little-en
 	*ptr++ = (BYTE)val; val >>= 8;
 	*ptr++ = (BYTE)val; val >>= 8;
 	*ptr++ = (BYTE)val;
+#endif
 }
 #endif
 #endif	/* !FF_FS_READONLY */
@@ -680,42 +751,29 @@ static void st_qword (BYTE* ptr, QWORD val)	/* Store an 8-byte word in little-en
 /* String functions                                                      */
 /*-----------------------------------------------------------------------*/
 
+/* The C library versions move aligned blocks a word (or several words) at
+/  a time, where the byte loops below moved one byte per iteration. This
+/  matters for the 512-byte sector copies and clears in f_read/f_write and
+/  for the directory entry compares. */
+
 /* Copy memory to memory */
 static void mem_cpy (void* dst, const void* src, UINT cnt)
 {
-	BYTE *d = (BYTE*)dst;
-	const BYTE *s = (const BYTE*)src;
-
-	if (cnt != 0) {
-		do {
-			*d++ = *s++;
-		} while (--cnt);
-	}
+	if (cnt != 0) memcpy(dst, src, cnt);
 }
 
 
 /* Fill memory block */
 static void mem_set (void* dst, int val, UINT cnt)
 {
-	BYTE *d = (BYTE*)dst;
-
-	do {
-		*d++ = (BYTE)val;
-	} while (--cnt);
+	memset(dst, val, cnt);
 }
 
 
 /* Compare memory block */
 static int mem_cmp (const void* dst, const void* src, UINT cnt)	/* ZR:same, NZ:different */
 {
-	const BYTE *d = (const BYTE *)dst, *s = (const BYTE *)src;
-	int r = 0;
-
-	do {
-		r = *d++ - *s++;
-	} while (--cnt && r == 0);
-
-	return r;
+	return memcmp(dst, src, cnt);
 }
 
 
@@ -1534,6 +1592,45 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 
 
 
+#if FF_FS_EXFAT && FF_USE_EXPAND && !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* exFAT: Give back the clusters reserved past the end of file           */
+/*-----------------------------------------------------------------------*/
+/* The run f_expand(opt=2) reserves is in use on the bitmap but not owned by
+/  the file on the volume, so it is held only while the file is open. */
+
+static FRESULT release_rsv (	/* FR_OK(0):succeeded, !=0:error */
+	FFOBJID* obj		/* Object with clusters reserved */
+)
+{
+	FRESULT res = FR_OK;
+	FATFS *fs = obj->fs;
+	DWORD ncl;
+
+
+	if (obj->r_end == 0) return FR_OK;
+	ncl = obj->objsize ? (DWORD)((obj->objsize - 1) / ((DWORD)fs->csize * SS(fs))) + 1 : 0;	/* Number of clusters in use */
+	ncl += obj->sclust;		/* First reserved cluster */
+	if (ncl < obj->r_end) {
+		res = change_bitmap(fs, ncl, obj->r_end - ncl, 0);	/* Mark the rest of the run 'free' on the bitmap */
+		if (res == FR_OK && fs->free_clst <= fs->n_fatent - 2) {	/* Update FSINFO */
+			fs->free_clst += obj->r_end - ncl;
+			fs->fsi_flag |= 1;
+		}
+	}
+	if (res == FR_OK) {
+		obj->r_end = 0;
+		if (obj->objsize == 0) {	/* Nothing was written into the run */
+			obj->sclust = 0; obj->stat = 0;
+		}
+	}
+	return res;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Stretch a chain or Create a new chain                  */
 /*-----------------------------------------------------------------------*/
@@ -1559,6 +1656,9 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 		if (cs < fs->n_fatent) return cs;	/* It is already followed by next cluster */
 		scl = clst;							/* Cluster to start to find */
 	}
+#if FF_FS_EXFAT && FF_USE_EXPAND && !FF_FS_READONLY
+	if (fs->fs_type == FS_EXFAT && clst != 0 && obj->stat == 2 && clst + 1 < obj->r_end) return clst + 1;	/* Next cluster of the run reserved by f_expand (already in use on the bitmap) */
+#endif
 	if (fs->free_clst == 0) return 0;		/* No free cluster */
 
 #if FF_FS_EXFAT
@@ -1666,6 +1766,117 @@ static DWORD clmt_clust (	/* <2:Error, >=2:Cluster number */
 
 
 
+#if FF_USE_FILEBUF && !FF_FS_TINY
+/*-----------------------------------------------------------------------*/
+/* File buffer - Fill multi-sector read buffer                           */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT fill_filebuf (	/* FR_OK(0):succeeded, !=0:error */
+	FIL* fp,		/* Pointer to the file object (fp->clust and fp->fptr point the sector) */
+	LBA_t sect		/* Sector to be loaded to the top of the buffer */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	UINT n, csect;
+	DWORD clst, nxt;
+	FSIZE_t left;
+
+
+	csect = (UINT)(fp->fptr / SS(fs) & (fs->csize - 1));	/* Sector offset in the cluster */
+	if (NOCHAIN(fs, fp)) {					/* Contiguous file: no cluster boundary */
+		n = fp->cbsz;
+	} else {
+		n = fs->csize - csect;				/* Sectors left in the cluster */
+		for (clst = fp->clust; n < fp->cbsz; clst = nxt, n += fs->csize) {	/* Continue into the following clusters while they are next on the volume */
+			nxt = get_fat(&fp->obj, clst);
+			if (nxt != clst + 1) break;
+		}
+	}
+	if (n > fp->cbsz) n = fp->cbsz;			/* Clip at buffer size */
+	left = (fp->obj.objsize + SS(fs) - 1) / SS(fs) - fp->fptr / SS(fs);	/* Sectors left in the file */
+	if (n > left) n = (UINT)left;
+	if (n == 0) n = 1;
+	fp->cbcnt = 0;
+	if (disk_read(fs->pdrv, fp->cbuf, sect, n) != RES_OK) return FR_DISK_ERR;
+	fp->cbsect = sect;
+	fp->cbcnt = n;
+	return FR_OK;
+}
+
+#endif	/* FF_USE_FILEBUF && !FF_FS_TINY */
+
+
+
+#if FF_READAHEAD && !FF_FS_TINY
+/*-----------------------------------------------------------------------*/
+/* Read-ahead - Give back the read-ahead buffer                          */
+/*-----------------------------------------------------------------------*/
+
+static void ra_detach (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	if (FILBUF_HIT(fp, fp->sect)) {	/* Move current sector into the private buffer */
+		mem_cpy(fp->buf, FILBUF(fp), SS(fp->obj.fs));
+	}
+	ff_buffree(fp->cbuf);
+	fp->cbuf = 0;
+	fp->cbpool = 0;
+	fp->raown = 0;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read-ahead - Track sequential access on a sector load                 */
+/*-----------------------------------------------------------------------*/
+
+static void ra_track (
+	FIL* fp		/* Pointer to the file object (fp->fptr points the sector to be loaded) */
+)
+{
+	DWORD idx = (DWORD)(fp->fptr / SS(fp->obj.fs));	/* Sector index in the file */
+	BYTE *buf = 0;
+	UINT n, keep;
+#if FF_FS_LOCK
+	UINT i;
+#endif
+
+
+	if (idx == fp->ranext) {		/* Next sector in sequence? */
+		if (fp->raseq < RA_TRIGGER) fp->raseq++;
+	} else {						/* Random access */
+		fp->raseq = 0;
+		if (fp->raown) ra_detach(fp);	/* Stop reading ahead */
+	}
+	fp->ranext = idx + 1;
+	if (!fp->cbuf && fp->raseq >= RA_TRIGGER && !(fp->flag & FA_WRITE)) {	/* Start reading ahead */
+#if FF_FS_LOCK
+		for (i = keep = 0; i < FF_FS_LOCK; i++) {	/* Leave a sector buffer for each file that can still be opened */
+			if (!Files[i].fs) keep++;
+		}
+#else
+		keep = RA_KEEP;
+#endif
+		for (n = fp->rawin; n >= 2; n /= 2) {	/* Take a smaller buffer if the pool is short */
+			buf = (BYTE*)ff_bufalloc_keep(n, keep);
+			if (buf) break;
+		}
+		if (buf) {
+			fp->cbuf = buf;
+			fp->cbsz = n;
+			fp->cbcnt = 0;
+			fp->cbpool = 1;
+			fp->raown = 1;
+		}
+	}
+}
+
+#endif	/* FF_READAHEAD && !FF_FS_TINY */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Fill a cluster with zeros                        */
 /*-----------------------------------------------------------------------*/
@@ -2245,6 +2456,7 @@ static void init_alloc_info (
 	obj->objsize = ld_qword(fs->dirbuf + XDIR_FileSize);	/* Size */
 	obj->stat = fs->dirbuf[XDIR_GenFlags] & 2;				/* Allocation status */
 	obj->n_frag = 0;										/* No last fragment info */
+	obj->r_end = 0;											/* No reserved clusters */
 }
 
 
@@ -2267,6 +2479,7 @@ static FRESULT load_obj_xdir (
 	dp->obj.stat = (BYTE)obj->c_size;
 	dp->obj.objsize = obj->c_size & 0xFFFFFF00;
 	dp->obj.n_frag = 0;
+	dp->obj.r_end = 0;
 	dp->blk_ofs = obj->c_ofs;
 
 	res = dir_sdi(dp, dp->blk_ofs);	/* Goto object's entry block */
@@ -3078,6 +3291,7 @@ static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 	}
 #if FF_FS_EXFAT
 	dp->obj.n_frag = 0;	/* Invalidate last fragment counter of the object */
+	dp->obj.r_end = 0;
 #if FF_FS_RPATH != 0
 	if (fs->fs_type == FS_EXFAT && dp->obj.sclust) {	/* exFAT: Retrieve the sub-directory's status */
 		DIR dj;
@@ -3377,6 +3591,53 @@ static UINT find_volume (	/* Returns BS status found in the hosting drive */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Do the mount work deferred by a fast mount                            */
+/*-----------------------------------------------------------------------*/
+/* Neither the FSInfo nor the exFAT bitmap check is needed to open and
+/  read a file, so a fast mount leaves them until the first write access
+/  or f_getfree(). A normal mount calls this at the end of mount_volume(). */
+
+static FRESULT load_deferred (	/* FR_OK(0): successful, !=0: an error occurred */
+	FATFS* fs		/* Filesystem object (the volume is analyzed) */
+)
+{
+#if FF_FS_EXFAT
+	DWORD bcl, cv;
+
+	if (fs->defer & 2) {	/* Check if bitmap is contiguous (implementation assumption) */
+		bcl = (DWORD)((fs->bitbase - fs->database) / fs->csize) + 2;	/* Bitmap cluster */
+		for (;;) {
+			if (move_window(fs, fs->fatbase + bcl / (SS(fs) / 4)) != FR_OK) return FR_DISK_ERR;
+			cv = ld_dword(fs->win + bcl % (SS(fs) / 4) * 4);
+			if (cv == 0xFFFFFFFF) break;				/* Last link? */
+			if (cv != ++bcl) return FR_NO_FILESYSTEM;	/* Fragmented? */
+		}
+	}
+#endif
+#if !FF_FS_READONLY && (FF_FS_NOFSINFO & 3) != 3
+	if ((fs->defer & 1) && move_window(fs, fs->volbase + 1) == FR_OK) {	/* Get FSInfo */
+		fs->fsi_flag = 0;
+		if (ld_word(fs->win + BS_55AA) == 0xAA55	/* Load FSInfo data if available */
+			&& ld_dword(fs->win + FSI_LeadSig) == 0x41615252
+			&& ld_dword(fs->win + FSI_StrucSig) == 0x61417272)
+		{
+#if (FF_FS_NOFSINFO & 1) == 0
+			fs->free_clst = ld_dword(fs->win + FSI_Free_Count);
+#endif
+#if (FF_FS_NOFSINFO & 2) == 0
+			fs->last_clst = ld_dword(fs->win + FSI_Nxt_Free);
+#endif
+		}
+	}
+#endif
+	fs->defer &= (BYTE)~3;	/* Nothing is left to do */
+	return FR_OK;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Determine logical drive number and mount the volume if needed         */
 /*-----------------------------------------------------------------------*/
@@ -3416,6 +3677,10 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 			if (!FF_FS_READONLY && mode && (stat & STA_PROTECT)) {	/* Check write protection if needed */
 				return FR_WRITE_PROTECTED;
 			}
+			if (mode) fs->defer |= 0x40;	/* The volume is written */
+			if (mode && (fs->defer & 3)) {	/* First write access after a fast mount? */
+				return load_deferred(fs);
+			}
 			return FR_OK;				/* The filesystem object is already valid */
 		}
 	}
@@ -3424,6 +3689,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 	/* Following code attempts to mount the volume. (find a FAT volume, analyze the BPB and initialize the filesystem object) */
 
 	fs->fs_type = 0;					/* Clear the filesystem object */
+	fs->defer &= 0x80;					/* Keep only the mount mode */
 	fs->pdrv = LD2PD(vol);				/* Volume hosting physical drive */
 	stat = disk_initialize(fs->pdrv);	/* Initialize the physical drive */
 	if (stat & STA_NOINIT) { 			/* Check if the initialization succeeded */
@@ -3432,6 +3698,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 	if (!FF_FS_READONLY && mode && (stat & STA_PROTECT)) { /* Check disk write protection if needed */
 		return FR_WRITE_PROTECTED;
 	}
+	if (mode) fs->defer |= 0x40;		/* The volume is written */
 #if FF_MAX_SS != FF_MIN_SS				/* Get sector size (multiple sector size cfg only) */
 	if (disk_ioctl(fs->pdrv, GET_SECTOR_SIZE, &SS(fs)) != RES_OK) return FR_DISK_ERR;
 	if (SS(fs) > FF_MAX_SS || SS(fs) < FF_MIN_SS || (SS(fs) & (SS(fs) - 1))) return FR_DISK_ERR;
@@ -3448,7 +3715,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 #if FF_FS_EXFAT
 	if (fmt == 1) {
 		QWORD maxlba;
-		DWORD so, cv, bcl, i;
+		DWORD so, bcl, i;
 
 		for (i = BPB_ZeroedEx; i < BPB_ZeroedEx + 53 && fs->win[i] == 0; i++) ;	/* Check zero filler */
 		if (i < BPB_ZeroedEx + 53) return FR_NO_FILESYSTEM;
@@ -3495,12 +3762,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 		bcl = ld_dword(fs->win + i + 20);					/* Bitmap cluster */
 		if (bcl < 2 || bcl >= fs->n_fatent) return FR_NO_FILESYSTEM;
 		fs->bitbase = fs->database + fs->csize * (bcl - 2);	/* Bitmap sector */
-		for (;;) {	/* Check if bitmap is contiguous */
-			if (move_window(fs, fs->fatbase + bcl / (SS(fs) / 4)) != FR_OK) return FR_DISK_ERR;
-			cv = ld_dword(fs->win + bcl % (SS(fs) / 4) * 4);
-			if (cv == 0xFFFFFFFF) break;				/* Last link? */
-			if (cv != ++bcl) return FR_NO_FILESYSTEM;	/* Fragmented? */
-		}
+		fs->defer |= 2;			/* Check if bitmap is contiguous (load_deferred) */
 
 #if !FF_FS_READONLY
 		fs->last_clst = fs->free_clst = 0xFFFFFFFF;		/* Initialize cluster allocation information */
@@ -3566,26 +3828,19 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 		fs->fsi_flag = 0x80;
 #if (FF_FS_NOFSINFO & 3) != 3
 		if (fmt == FS_FAT32				/* Allow to update FSInfo only if BPB_FSInfo32 == 1 */
-			&& ld_word(fs->win + BPB_FSInfo32) == 1
-			&& move_window(fs, bsect + 1) == FR_OK)
+			&& ld_word(fs->win + BPB_FSInfo32) == 1)
 		{
-			fs->fsi_flag = 0;
-			if (ld_word(fs->win + BS_55AA) == 0xAA55	/* Load FSInfo data if available */
-				&& ld_dword(fs->win + FSI_LeadSig) == 0x41615252
-				&& ld_dword(fs->win + FSI_StrucSig) == 0x61417272)
-			{
-#if (FF_FS_NOFSINFO & 1) == 0
-				fs->free_clst = ld_dword(fs->win + FSI_Free_Count);
-#endif
-#if (FF_FS_NOFSINFO & 2) == 0
-				fs->last_clst = ld_dword(fs->win + FSI_Nxt_Free);
-#endif
-			}
+			fs->defer |= 1;		/* Load FSInfo (load_deferred) */
 		}
 #endif	/* (FF_FS_NOFSINFO & 3) != 3 */
 #endif	/* !FF_FS_READONLY */
 	}
 
+	if (!(fs->defer & 0x80) || mode) {	/* Not a fast mount or write access is requested */
+		FRESULT res = load_deferred(fs);
+		if (res != FR_OK) return res;
+	}
+
 	fs->fs_type = (BYTE)fmt;/* FAT sub-type */
 	fs->id = ++Fsid;		/* Volume mount ID */
 #if FF_USE_LFN == 1
@@ -3657,7 +3912,7 @@ static FRESULT validate (	/* Returns FR_OK or FR_INVALID_OBJECT */
 FRESULT f_mount (
 	FATFS* fs,			/* Pointer to the filesystem object (NULL:unmount)*/
 	const TCHAR* path,	/* Logical drive number to be mounted/unmounted */
-	BYTE opt			/* Mode option 0:Do not mount (delayed mount), 1:Mount immediately */
+	BYTE opt			/* Mode option 0:Do not mount (delayed mount), 1:Mount immediately, 2:Fast mount */
 )
 {
 	FATFS *cfs;
@@ -3683,6 +3938,7 @@ FRESULT f_mount (
 
 	if (fs) {
 		fs->fs_type = 0;				/* Clear new fs object */
+		fs->defer = (opt == 2) ? 0x80 : 0;	/* Fast mount defers FSInfo and exFAT bitmap check to the first write access */
 #if FF_FS_REENTRANT						/* Create sync object for the new volume */
 		if (!ff_cre_syncobj((BYTE)vol, &fs->sobj)) return FR_INT_ERR;
 #endif
@@ -3720,6 +3976,9 @@ FRESULT f_open (
 
 
 	if (!fp) return FR_INVALID_OBJECT;
+#if FF_BUF_POOL && !FF_FS_TINY
+	fp->buf = 0;
+#endif
 
 	/* Get logical drive number */
 	mode &= FF_FS_READONLY ? FA_READ : FA_READ | FA_WRITE | FA_CREATE_ALWAYS | FA_CREATE_NEW | FA_OPEN_ALWAYS | FA_OPEN_APPEND;
@@ -3727,6 +3986,11 @@ FRESULT f_open (
 	if (res == FR_OK) {
 		dj.obj.fs = fs;
 		INIT_NAMBUF(fs);
+#if FF_BUF_POOL && !FF_FS_TINY
+		fp->buf = (BYTE*)ff_bufalloc(1);	/* Take a sector buffer from the pool */
+		if (!fp->buf) res = FR_NOT_ENOUGH_CORE;
+		if (res == FR_OK)
+#endif
 		res = follow_path(&dj, path);	/* Follow the file path */
 #if !FF_FS_READONLY	/* Read/Write configuration */
 		if (res == FR_OK) {
@@ -3840,6 +4104,9 @@ FRESULT f_open (
 			{
 				fp->obj.sclust = ld_clust(fs, dj.dir);					/* Get object allocation info */
 				fp->obj.objsize = ld_dword(dj.dir + DIR_FileSize);
+#if FF_FS_EXFAT
+				fp->obj.r_end = 0;
+#endif
 			}
 #if FF_USE_FASTSEEK
 			fp->cltbl = 0;			/* Disable fast seek mode */
@@ -3850,9 +4117,24 @@ FRESULT f_open (
 			fp->err = 0;			/* Clear error flag */
 			fp->sect = 0;			/* Invalidate current data sector */
 			fp->fptr = 0;			/* Set file pointer top of the file */
+#if FF_USE_FILEBUF && !FF_FS_TINY
+			fp->cbuf = 0;			/* Disable multi-sector read buffer */
+#if FF_BUF_POOL
+			fp->cbpool = 0;
+#endif
+#if FF_READAHEAD
+			fp->rawin = (FF_READAHEAD < FF_BUF_POOL) ? FF_READAHEAD : FF_BUF_POOL;	/* Default read-ahead window */
+			fp->raseq = 0;
+			fp->raown = 0;
+			fp->ranext = 0;
+#endif
+#endif
+#if FF_USE_BORROW && !FF_FS_TINY
+			fp->lent = 0;			/* Nothing is lent out */
+#endif
 #if !FF_FS_READONLY
 #if !FF_FS_TINY
-			mem_set(fp->buf, 0, sizeof fp->buf);	/* Clear sector buffer */
+			mem_set(fp->buf, 0, FF_MAX_SS);	/* Clear sector buffer */
 #endif
 			if ((mode & FA_SEEKEND) && fp->obj.objsize > 0) {	/* Seek to end of file if FA_OPEN_APPEND is specified */
 				fp->fptr = fp->obj.objsize;			/* Offset to seek */
@@ -3882,7 +4164,13 @@ FRESULT f_open (
 		FREE_NAMBUF();
 	}
 
-	if (res != FR_OK) fp->obj.fs = 0;	/* Invalidate file object on error */
+	if (res != FR_OK) {
+#if FF_BUF_POOL && !FF_FS_TINY
+		ff_buffree(fp->buf);	/* Give the sector buffer back */
+		fp->buf = 0;
+#endif
+		fp->obj.fs = 0;			/* Invalidate file object on error */
+	}
 
 	LEAVE_FF(fs, res);
 }
@@ -3914,6 +4202,7 @@ FRESULT f_read (
 	res = validate(&fp->obj, &fs);				/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);	/* Check validity */
 	if (!(fp->flag & FA_READ)) LEAVE_FF(fs, FR_DENIED); /* Check access mode */
+	if (LENT(fp)) LEAVE_FF(fs, FR_LOCKED);		/* Check borrowed data */
 	remain = fp->obj.objsize - fp->fptr;
 	if (btr > remain) btr = (UINT)remain;		/* Truncate btr by remaining bytes */
 
@@ -3930,7 +4219,9 @@ FRESULT f_read (
 						clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
 					} else
 #endif
-					{
+					if (NOCHAIN(fs, fp)) {
+						clst = fp->obj.sclust + (DWORD)(fp->fptr / SS(fs) / fs->csize);	/* Contiguous file: no FAT access */
+					} else {
 						clst = get_fat(&fp->obj, fp->clust);	/* Follow cluster chain on the FAT */
 					}
 				}
@@ -3942,8 +4233,13 @@ FRESULT f_read (
 			if (sect == 0) ABORT(fs, FR_INT_ERR);
 			sect += csect;
 			cc = btr / SS(fs);					/* When remaining bytes >= sector size, */
+#if FF_USE_FILEBUF && !FF_FS_TINY
+			if (fp->cbuf && cc < fp->cbsz) cc = 0;	/* Reads shorter than the multi-sector read buffer go through it */
+#endif
 			if (cc > 0) {						/* Read maximum contiguous sectors directly */
-				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
+				if (NOCHAIN(fs, fp)) {			/* Contiguous file can be read across clusters */
+					fp->clust = fp->obj.sclust + (DWORD)((fp->fptr / SS(fs) + cc - 1) / fs->csize);	/* Cluster of the last sector */
+				} else if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
 					cc = fs->csize - csect;
 				}
 				if (disk_read(fs->pdrv, rbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
@@ -3957,6 +4253,9 @@ FRESULT f_read (
 					mem_cpy(rbuff + ((fp->sect - sect) * SS(fs)), fp->buf, SS(fs));
 				}
 #endif
+#endif
+#if FF_READAHEAD && !FF_FS_TINY
+				fp->ranext = (DWORD)(fp->fptr / SS(fs)) + cc;	/* Sequence continues after the direct read */
 #endif
 				rcnt = SS(fs) * cc;				/* Number of bytes transferred */
 				continue;
@@ -3968,6 +4267,14 @@ FRESULT f_read (
 					if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
 					fp->flag &= (BYTE)~FA_DIRTY;
 				}
+#endif
+#if FF_USE_FILEBUF
+#if FF_READAHEAD
+				ra_track(fp);					/* Start or stop reading ahead */
+#endif
+				if (fp->cbuf) {					/* Multi-sector read buffer attached? */
+					if (!FILBUF_HIT(fp, sect) && fill_filebuf(fp, sect) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Fill it from this sector */
+				} else
 #endif
 				if (disk_read(fs->pdrv, fp->buf, sect, 1) != RES_OK)	ABORT(fs, FR_DISK_ERR);	/* Fill sector cache */
 			}
@@ -3980,7 +4287,7 @@ FRESULT f_read (
 		if (move_window(fs, fp->sect) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Move sector window */
 		mem_cpy(rbuff, fs->win + fp->fptr % SS(fs), rcnt);	/* Extract partial sector */
 #else
-		mem_cpy(rbuff, fp->buf + fp->fptr % SS(fs), rcnt);	/* Extract partial sector */
+		mem_cpy(rbuff, FILBUF(fp) + fp->fptr % SS(fs), rcnt);	/* Extract partial sector */
 #endif
 	}
 
@@ -4014,6 +4321,7 @@ FRESULT f_write (
 	res = validate(&fp->obj, &fs);			/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);	/* Check validity */
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
+	if (LENT(fp)) LEAVE_FF(fs, FR_LOCKED);		/* Check borrowed data */
 
 	/* Check fptr wrap-around (file size cannot reach 4 GiB at FAT volume) */
 	if ((!FF_FS_EXFAT || fs->fs_type != FS_EXFAT) && (DWORD)(fp->fptr + btw) < (DWORD)fp->fptr) {
@@ -4153,7 +4461,7 @@ FRESULT f_sync (
 					if (res == FR_OK) {
 						fs->dirbuf[XDIR_Attr] |= AM_ARC;				/* Set archive attribute to indicate that the file has been changed */
 						fs->dirbuf[XDIR_GenFlags] = fp->obj.stat | 1;	/* Update file allocation information */
-						st_dword(fs->dirbuf + XDIR_FstClus, fp->obj.sclust);		/* Update start cluster */
+						st_dword(fs->dirbuf + XDIR_FstClus, fp->obj.objsize ? fp->obj.sclust : 0);	/* Update start cluster (a reserved run is not recorded) */
 						st_qword(fs->dirbuf + XDIR_FileSize, fp->obj.objsize);		/* Update file size */
 						st_qword(fs->dirbuf + XDIR_ValidFileSize, fp->obj.objsize);	/* (FatFs does not support Valid File Size feature) */
 						st_dword(fs->dirbuf + XDIR_ModTime, tm);		/* Update modified time */
@@ -4205,6 +4513,20 @@ FRESULT f_close (
 	FRESULT res;
 	FATFS *fs;
 
+	if (LENT(fp)) return FR_LOCKED;		/* Borrowed data has not been released */
+#if FF_FS_EXFAT && FF_USE_EXPAND && !FF_FS_READONLY
+	if (fp->obj.r_end != 0) {			/* Give back the clusters reserved past the end of file */
+		res = validate(&fp->obj, &fs);
+		if (res == FR_OK) {
+			res = release_rsv(&fp->obj);
+			fp->flag |= FA_MODIFIED;
+#if FF_FS_REENTRANT
+			unlock_fs(fs, res);
+#endif
+		}
+		if (res != FR_OK) return res;
+	}
+#endif
 #if !FF_FS_READONLY
 	res = f_sync(fp);					/* Flush cached data */
 	if (res == FR_OK)
@@ -4218,6 +4540,16 @@ FRESULT f_close (
 #else
 			fp->obj.fs = 0;	/* Invalidate file object */
 #endif
+#if FF_BUF_POOL && !FF_FS_TINY
+			if (!fp->obj.fs) {			/* Give the buffers back to the pool */
+#if FF_USE_FILEBUF
+				if (fp->cbpool) ff_buffree(fp->cbuf);
+				fp->cbuf = 0;
+#endif
+				ff_buffree(fp->buf);
+				fp->buf = 0;
+			}
+#endif
 #if FF_FS_REENTRANT
 			unlock_fs(fs, FR_OK);		/* Unlock volume */
 #endif
@@ -4430,6 +4762,7 @@ FRESULT f_lseek (
 
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
 	if (res == FR_OK) res = (FRESULT)fp->err;
+	if (res == FR_OK && LENT(fp)) res = FR_LOCKED;	/* Check borrowed data */
 #if FF_FS_EXFAT && !FF_FS_READONLY
 	if (res == FR_OK && fs->fs_type == FS_EXFAT) {
 		res = fill_last_frag(&fp->obj, fp->clust, 0xFFFFFFFF);	/* Fill last fragment on the FAT if needed */
@@ -4519,6 +4852,14 @@ FRESULT f_lseek (
 				fp->clust = clst;
 			}
 			if (clst != 0) {
+#if FF_FS_EXFAT
+				if (NOCHAIN(fs, fp) && fp->fptr + ofs <= fp->obj.objsize) {	/* Contiguous file: skip the cluster following loop */
+					fp->fptr += (ofs - 1) / bcs * bcs;
+					clst += (DWORD)((ofs - 1) / bcs);
+					ofs = (ofs - 1) % bcs + 1;
+					fp->clust = clst;
+				}
+#endif
 				while (ofs > bcs) {						/* Cluster following loop */
 					ofs -= bcs; fp->fptr += bcs;
 #if !FF_FS_READONLY
@@ -4559,6 +4900,11 @@ FRESULT f_lseek (
 				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
 				fp->flag &= (BYTE)~FA_DIRTY;
 			}
+#endif
+#if FF_USE_FILEBUF
+			if (fp->cbuf) {						/* Multi-sector read buffer attached? */
+				if (!FILBUF_HIT(fp, nsect) && fill_filebuf(fp, nsect) != FR_OK) ABORT(fs, FR_DISK_ERR);
+			} else
 #endif
 			if (disk_read(fs->pdrv, fp->buf, nsect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);	/* Fill sector cache */
 #endif
@@ -4755,6 +5101,75 @@ FRESULT f_findfirst (
 
 
 
+#if FF_USE_READDIRN
+/*-----------------------------------------------------------------------*/
+/* Read a Batch of Directory Items                                       */
+/*-----------------------------------------------------------------------*/
+/* The object is validated, the volume is locked and the LFN working buffer
+/  is allocated once for the whole batch, and the entries are decoded while
+/  their directory sector stays in the window. */
+
+static int ext_match (	/* 0:not matched, 1:matched */
+	const TCHAR* nam,	/* File name */
+	const TCHAR* ext	/* Extension without or with the leading dot */
+)
+{
+	const TCHAR *pp = 0;
+	TCHAR c1, c2;
+
+
+	if (*ext == '.') ext++;
+	for ( ; *nam; nam++) {	/* Find the last dot in the name */
+		if (*nam == '.') pp = nam + 1;
+	}
+	if (!pp) return *ext == 0;	/* No extension */
+	do {	/* Compare the extension, ASCII case insensitive */
+		c1 = *pp++; c2 = *ext++;
+		if (IsLower(c1)) c1 -= 0x20;
+		if (IsLower(c2)) c2 -= 0x20;
+		if (c1 != c2) return 0;
+	} while (c1);
+	return 1;
+}
+
+
+FRESULT f_readdirn (
+	DIR* dp,			/* Pointer to the open directory object */
+	FILINFO* fno,		/* Pointer to the array of file information to return */
+	UINT nfno,			/* Number of items in the array */
+	UINT* nr,			/* Pointer to number of items read (0:end of directory) */
+	const TCHAR* ext	/* Extension of files to return ("wav" or ".wav"), null:all items */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DEF_NAMBUF
+
+
+	*nr = 0;
+	res = validate(&dp->obj, &fs);	/* Check validity of the directory object */
+	if (res == FR_OK) {
+		INIT_NAMBUF(fs);
+		while (*nr < nfno) {
+			res = DIR_READ_FILE(dp);		/* Read an item */
+			if (res != FR_OK) break;
+			get_fileinfo(dp, fno);			/* Get the object information */
+			if (!ext || (!(fno->fattrib & AM_DIR) && ext_match(fno->fname, ext))) {	/* Keep it if it passes the filter */
+				fno++; (*nr)++;
+			}
+			res = dir_next(dp, 0);			/* Increment index for next */
+			if (res != FR_OK) break;
+		}
+		if (res == FR_NO_FILE) res = FR_OK;	/* Ignore end of directory */
+		FREE_NAMBUF();
+	}
+	LEAVE_FF(fs, res);
+}
+
+#endif	/* FF_USE_READDIRN */
+
+
+
 #if FF_FS_MINIMIZE == 0
 /*-----------------------------------------------------------------------*/
 /* Get File Status                                                       */
@@ -4811,6 +5226,7 @@ FRESULT f_getfree (
 
 	/* Get logical drive */
 	res = mount_volume(&path, &fs, 0);
+	if (res == FR_OK && (fs->defer & 3)) res = load_deferred(fs);	/* Get FSInfo deferred by a fast mount */
 	if (res == FR_OK) {
 		*fatfs = fs;				/* Return ptr to the fs object */
 		/* If free_clst is valid, return it without full FAT scan */
@@ -4830,6 +5246,7 @@ FRESULT f_getfree (
 			} else {
 #if FF_FS_EXFAT
 				if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan allocation bitmap */
+					static const BYTE Zbits[] = {4, 3, 3, 2, 3, 2, 2, 1, 3, 2, 2, 1, 2, 1, 1, 0};	/* Number of zero bits in a nibble */
 					BYTE bm;
 					UINT b;
 
@@ -4841,9 +5258,15 @@ FRESULT f_getfree (
 							res = move_window(fs, sect++);
 							if (res != FR_OK) break;
 						}
-						for (b = 8, bm = fs->win[i]; b && clst; b--, clst--) {
-							if (!(bm & 1)) nfree++;
-							bm >>= 1;
+						bm = fs->win[i];
+						if (clst >= 8) {		/* Whole byte: count zero bits of both nibbles */
+							nfree += Zbits[bm & 15] + Zbits[bm >> 4];
+							clst -= 8;
+						} else {
+							for (b = clst; b; b--, clst--) {
+								if (!(bm & 1)) nfree++;
+								bm >>= 1;
+							}
 						}
 						i = (i + 1) % SS(fs);
 					} while (clst);
@@ -4872,6 +5295,9 @@ FRESULT f_getfree (
 			*nclst = nfree;			/* Return the free clusters */
 			fs->free_clst = nfree;	/* Now free_clst is valid */
 			fs->fsi_flag |= 1;		/* FAT32: FSInfo is to be updated */
+			if (res == FR_OK && fs->fsi_flag == 1 && (fs->defer & 0x40)) {
+				res = sync_fs(fs);	/* Save the count, so that the next mount trusts it instead of scanning again (only on a volume being written) */
+			}
 		}
 	}
 
@@ -4897,8 +5323,16 @@ FRESULT f_truncate (
 	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
+	if (LENT(fp)) LEAVE_FF(fs, FR_LOCKED);	/* Check borrowed data */
+#if FF_FS_EXFAT && FF_USE_EXPAND
+	if (fp->obj.r_end != 0) {	/* Give back the clusters reserved past the end of file */
+		res = release_rsv(&fp->obj);
+		if (res != FR_OK) ABORT(fs, res);
+		fp->flag |= FA_MODIFIED;
+	}
+#endif
 
-	if (fp->fptr < fp->obj.objsize) {	/* Process when fptr is not on the eof */
+	if (fp->fptr < fp->obj.objsize || (fp->obj.sclust != 0 && (fp->fptr == 0 || get_fat(&fp->obj, fp->clust) < fs->n_fatent))) {	/* Process when fptr is not on the eof or clusters are reserved beyond the eof */
 		if (fp->fptr == 0) {	/* When set file size to zero, remove entire cluster chain */
 			res = remove_chain(&fp->obj, fp->obj.sclust, 0);
 			fp->obj.sclust = 0;
@@ -5535,7 +5969,7 @@ FRESULT f_setlabel (
 FRESULT f_expand (
 	FIL* fp,		/* Pointer to the file object */
 	FSIZE_t fsz,	/* File size to be expanded to */
-	BYTE opt		/* Operation mode 0:Find and prepare or 1:Find and allocate */
+	BYTE opt		/* Operation mode 0:Find and prepare, 1:Find and allocate or 2:Find and reserve (file size is kept 0) */
 )
 {
 	FRESULT res;
@@ -5600,8 +6034,11 @@ FRESULT f_expand (
 		fs->last_clst = lclst;		/* Set suggested start cluster to start next */
 		if (opt) {	/* Is it allocated now? */
 			fp->obj.sclust = scl;		/* Update object allocation information */
-			fp->obj.objsize = fsz;
+			fp->obj.objsize = (opt == 2) ? 0 : fsz;	/* Reserved block is filled by following f_write */
 			if (FF_FS_EXFAT) fp->obj.stat = 2;	/* Set status 'contiguous chain' */
+#if FF_FS_EXFAT
+			if (fs->fs_type == FS_EXFAT && opt == 2) fp->obj.r_end = scl + tcl;	/* Held on the bitmap until f_truncate or f_close */
+#endif
 			fp->flag |= FA_MODIFIED;
 			if (fs->free_clst <= fs->n_fatent - 2) {	/* Update FSINFO */
 				fs->free_clst -= tcl;
@@ -5617,6 +6054,343 @@ FRESULT f_expand (
 
 
 
+#if FF_USE_EXPAND
+/*-----------------------------------------------------------------------*/
+/* Count Fragments of the File                                           */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_getfrag (
+	FIL* fp,		/* Pointer to the file object */
+	DWORD* nfrag,	/* Pointer to return number of fragments (0:no cluster allocated) */
+	LBA_t* sect		/* Pointer to return the first sector of the file (null:not needed) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst, nxt, n = 0;
+
+
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res == FR_OK) res = (FRESULT)fp->err;
+	if (res == FR_OK) {
+		clst = fp->obj.sclust;
+		if (sect) *sect = clst ? clst2sect(fs, clst) : 0;
+		if (clst != 0) n = 1;
+		if (NOCHAIN(fs, fp)) clst = 0;	/* Contiguous file is always one fragment */
+		while (clst != 0) {				/* Follow the cluster chain */
+			nxt = get_fat(&fp->obj, clst);
+			if (nxt == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+			if (nxt < 2) { res = FR_INT_ERR; break; }
+			if (nxt >= fs->n_fatent) break;	/* End of the chain */
+			if (nxt != clst + 1) n++;	/* Discontinuity */
+			clst = nxt;
+		}
+		*nfrag = n;
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+#endif /* FF_USE_EXPAND */
+
+
+
+#if FF_USE_FILEBUF && !FF_FS_TINY
+/*-----------------------------------------------------------------------*/
+/* Attach a Multi-sector Read Buffer to the File                         */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_setbuf (
+	FIL* fp,		/* Pointer to the file object */
+	void* buff,		/* Pointer to the buffer (null:take it from the pool or detach the buffer) */
+	UINT nsect		/* Size of the buffer in unit of sector (0:detach the buffer) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+#if FF_BUF_POOL
+	BYTE pool = 0;
+#endif
+
+
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res == FR_OK) res = (FRESULT)fp->err;
+	if (res == FR_OK && (fp->flag & FA_WRITE)) res = FR_DENIED;	/* Only read-only files can be buffered */
+	if (res == FR_OK && LENT(fp)) res = FR_LOCKED;	/* Check borrowed data */
+	if (res == FR_OK) {
+#if FF_BUF_POOL
+		if (nsect > 0) {				/* Reference the new buffer first (it can be the current one) */
+			if (!buff) {
+				buff = ff_bufalloc(nsect);	/* Take a buffer from the pool */
+				if (!buff) LEAVE_FF(fs, FR_NOT_ENOUGH_CORE);
+				pool = 1;
+			} else {
+				pool = (BYTE)ff_bufref(buff);	/* Keep a pool buffer given by the caller alive */
+			}
+		}
+#endif
+		if (FILBUF_HIT(fp, fp->sect)) {	/* Move current sector into the private buffer */
+			mem_cpy(fp->buf, FILBUF(fp), SS(fs));
+		}
+#if FF_BUF_POOL
+		if (fp->cbpool) ff_buffree(fp->cbuf);	/* Drop the reference to the old buffer */
+		fp->cbpool = pool;
+#endif
+#if FF_READAHEAD
+		fp->raown = 0;					/* The buffer is owned by the application */
+#endif
+		if (!buff || nsect == 0) {		/* Detach the buffer */
+			buff = 0; nsect = 0;
+		}
+		fp->cbuf = (BYTE*)buff;
+		fp->cbsz = nsect;
+		fp->cbcnt = 0;					/* Invalidate buffered sectors */
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+#if FF_READAHEAD
+/*-----------------------------------------------------------------------*/
+/* Set Read-ahead Window                                                 */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_readahead (
+	FIL* fp,		/* Pointer to the file object */
+	UINT nsect		/* Read-ahead window in unit of sector (0 or 1:disable) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res == FR_OK) res = (FRESULT)fp->err;
+	if (res == FR_OK && LENT(fp)) res = FR_LOCKED;	/* Check borrowed data */
+	if (res == FR_OK) {
+		if (nsect > FF_BUF_POOL) nsect = FF_BUF_POOL;
+		fp->rawin = (BYTE)nsect;
+		if (fp->raown && fp->cbsz != nsect) ra_detach(fp);	/* Give back the buffer of the old window */
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+#endif	/* FF_READAHEAD */
+
+#endif /* FF_USE_FILEBUF && !FF_FS_TINY */
+
+
+
+#if FF_USE_BORROW && !FF_FS_TINY
+/*-----------------------------------------------------------------------*/
+/* Borrow File Data in the Sector Buffer                                 */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_borrow (
+	FIL* fp, 		/* Pointer to the file object */
+	const BYTE** ptr,	/* Pointer to the variable to return pointer to the data */
+	UINT btr,		/* Number of bytes to borrow */
+	UINT* br		/* Pointer to number of bytes lent (0:end of file) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst;
+	LBA_t sect;
+	FSIZE_t remain;
+	UINT ofs, csect, n;
+
+
+	*ptr = 0; *br = 0;
+	res = validate(&fp->obj, &fs);				/* Check validity of the file object */
+	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);	/* Check validity */
+	if (!(fp->flag & FA_READ)) LEAVE_FF(fs, FR_DENIED); /* Check access mode */
+	if (LENT(fp)) LEAVE_FF(fs, FR_LOCKED);		/* Previous data has not been released */
+	remain = fp->obj.objsize - fp->fptr;
+	if (btr > remain) btr = (UINT)remain;		/* Truncate btr by remaining bytes */
+	if (btr == 0) LEAVE_FF(fs, FR_OK);
+
+	if (fp->fptr % SS(fs) == 0) {				/* On the sector boundary? */
+		csect = (UINT)(fp->fptr / SS(fs) & (fs->csize - 1));	/* Sector offset in the cluster */
+		if (csect == 0) {						/* On the cluster boundary? */
+			if (fp->fptr == 0) {				/* On the top of the file? */
+				clst = fp->obj.sclust;			/* Follow cluster chain from the origin */
+			} else {							/* Middle or end of the file */
+#if FF_USE_FASTSEEK
+				if (fp->cltbl) {
+					clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
+				} else
+#endif
+				if (NOCHAIN(fs, fp)) {
+					clst = fp->obj.sclust + (DWORD)(fp->fptr / SS(fs) / fs->csize);	/* Contiguous file: no FAT access */
+				} else {
+					clst = get_fat(&fp->obj, fp->clust);	/* Follow cluster chain on the FAT */
+				}
+			}
+			if (clst < 2) ABORT(fs, FR_INT_ERR);
+			if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
+			fp->clust = clst;					/* Update current cluster */
+		}
+		sect = clst2sect(fs, fp->clust);		/* Get current sector */
+		if (sect == 0) ABORT(fs, FR_INT_ERR);
+		sect += csect;
+		if (fp->sect != sect) {					/* Load data sector if not in cache */
+#if !FF_FS_READONLY
+			if (fp->flag & FA_DIRTY) {			/* Write-back dirty sector cache */
+				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+				fp->flag &= (BYTE)~FA_DIRTY;
+			}
+#endif
+#if FF_USE_FILEBUF
+			if (fp->cbuf) {						/* Multi-sector read buffer attached? */
+				if (!FILBUF_HIT(fp, sect) && fill_filebuf(fp, sect) != FR_OK) ABORT(fs, FR_DISK_ERR);
+			} else
+#endif
+			if (disk_read(fs->pdrv, fp->buf, sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);	/* Fill sector cache */
+		}
+		fp->sect = sect;
+	}
+
+	ofs = (UINT)(fp->fptr % SS(fs));
+	n = SS(fs) - ofs;							/* Bytes left in the current sector */
+#if FF_USE_FILEBUF
+	if (FILBUF_HIT(fp, fp->sect)) {				/* Following sectors in the read buffer can be lent too */
+		n += (UINT)(fp->cbsect + fp->cbcnt - 1 - fp->sect) * SS(fs);
+	}
+#endif
+	if (n > btr) n = btr;
+	*ptr = FILBUF(fp) + ofs;
+	fp->sect += (ofs + n - 1) / SS(fs);			/* Sector containing the last lent byte */
+	fp->fptr += n;
+	if (NOCHAIN(fs, fp)) {						/* The read buffer can span clusters of a contiguous file */
+		fp->clust = fp->obj.sclust + (DWORD)((fp->fptr - 1) / SS(fs) / fs->csize);
+	} else {									/* or clusters of a chain that are next to each other on the volume (fill_filebuf) */
+		fp->clust += (DWORD)((fp->fptr - 1) / SS(fs) / fs->csize - (fp->fptr - n) / SS(fs) / fs->csize);
+	}
+	*br = n;
+	fp->lent = 1;
+
+	LEAVE_FF(fs, FR_OK);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read Whole Sectors into the Caller's Buffer and Borrow Them           */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_borrowsect (
+	FIL* fp, 		/* Pointer to the file object (file pointer must be on a sector boundary) */
+	void* buff,		/* Pointer to the sector aligned buffer to read data (e.g. DMA target) */
+	UINT nsect,		/* Size of the buffer in unit of sector */
+	const BYTE** ptr,	/* Pointer to the variable to return pointer to the data */
+	UINT* br		/* Pointer to number of bytes lent (0:end of file) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst;
+	LBA_t sect;
+	FSIZE_t remain;
+	UINT csect, cc, n;
+
+
+	*ptr = 0; *br = 0;
+	res = validate(&fp->obj, &fs);				/* Check validity of the file object */
+	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);	/* Check validity */
+	if (!(fp->flag & FA_READ)) LEAVE_FF(fs, FR_DENIED); /* Check access mode */
+	if (LENT(fp)) LEAVE_FF(fs, FR_LOCKED);		/* Previous data has not been released */
+	remain = fp->obj.objsize - fp->fptr;
+	if (remain == 0) LEAVE_FF(fs, FR_OK);		/* End of the file (also after a partial last sector) */
+	if (fp->fptr % SS(fs) || nsect == 0) LEAVE_FF(fs, FR_INVALID_PARAMETER);
+
+	csect = (UINT)(fp->fptr / SS(fs) & (fs->csize - 1));	/* Sector offset in the cluster */
+	if (csect == 0) {							/* On the cluster boundary? */
+		if (fp->fptr == 0) {					/* On the top of the file? */
+			clst = fp->obj.sclust;				/* Follow cluster chain from the origin */
+		} else {								/* Middle or end of the file */
+#if FF_USE_FASTSEEK
+			if (fp->cltbl) {
+				clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
+			} else
+#endif
+			if (NOCHAIN(fs, fp)) {
+				clst = fp->obj.sclust + (DWORD)(fp->fptr / SS(fs) / fs->csize);	/* Contiguous file: no FAT access */
+			} else {
+				clst = get_fat(&fp->obj, fp->clust);	/* Follow cluster chain on the FAT */
+			}
+		}
+		if (clst < 2) ABORT(fs, FR_INT_ERR);
+		if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
+		fp->clust = clst;						/* Update current cluster */
+	}
+	sect = clst2sect(fs, fp->clust);			/* Get current sector */
+	if (sect == 0) ABORT(fs, FR_INT_ERR);
+	sect += csect;
+	cc = NOCHAIN(fs, fp) ? nsect : fs->csize - csect;	/* Clip at cluster boundary unless the file is contiguous */
+	if (cc > nsect) cc = nsect;					/* Clip at buffer size */
+	if ((FSIZE_t)cc * SS(fs) > remain) cc = (UINT)((remain + SS(fs) - 1) / SS(fs));	/* Clip at end of the file */
+	if (NOCHAIN(fs, fp)) {
+		fp->clust = fp->obj.sclust + (DWORD)((fp->fptr / SS(fs) + cc - 1) / fs->csize);	/* Cluster of the last sector */
+	}
+	if (disk_read(fs->pdrv, (BYTE*)buff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
+#if !FF_FS_READONLY
+	if ((fp->flag & FA_DIRTY) && fp->sect - sect < cc) {	/* Replace one of the read sectors with cached data if it contains a dirty sector */
+		mem_cpy((BYTE*)buff + ((fp->sect - sect) * SS(fs)), fp->buf, SS(fs));
+	}
+#endif
+	n = cc * SS(fs);
+	if (n > remain) {							/* Last sector of the file is partial */
+		n = (UINT)remain;
+		if (fp->sect != sect + cc - 1) {		/* Make it the current sector for later read/write */
+#if !FF_FS_READONLY
+			if (fp->flag & FA_DIRTY) {			/* Write-back dirty sector cache */
+				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+				fp->flag &= (BYTE)~FA_DIRTY;
+			}
+#endif
+			fp->sect = sect + cc - 1;
+			mem_cpy(fp->buf, (BYTE*)buff + (cc - 1) * SS(fs), SS(fs));
+		}
+	}
+	*ptr = (const BYTE*)buff;
+	fp->fptr += n;
+	*br = n;
+	fp->lent = 1;
+
+	LEAVE_FF(fs, FR_OK);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Give Back Borrowed File Data                                          */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_release (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res == FR_OK && !fp->lent) res = FR_INVALID_PARAMETER;	/* Nothing is lent out */
+	if (res == FR_OK) fp->lent = 0;
+
+	LEAVE_FF(fs, res);
+}
+
+#endif /* FF_USE_BORROW && !FF_FS_TINY */
+
+
+
 #if FF_USE_FORWARD
 /*-----------------------------------------------------------------------*/
 /* Forward Data to the Stream Directly                                   */
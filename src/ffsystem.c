@@ -0,0 +1,303 @@
+/*------------------------------------------------------------------------*/
+/* OS Dependent Functions for FatFs - RP2350 (pico-sdk)                   */
+/*------------------------------------------------------------------------*/
+
+#include "ff.h"
+#include "ffsystem.h"
+#ifndef FF_HOST
+#include "pico/stdlib.h"
+#include "pico/mutex.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+
+#if FF_USE_LFN == 3	/* Dynamic memory allocation */
+/*------------------------------------------------------------------------*/
+/* Allocate/Free a Memory Block                                           */
+/*------------------------------------------------------------------------*/
+/* The LFN working buffer (about 1.1 KB with exFAT) is only needed while
+/  an API call is in progress, so it lives on the heap rather than on the
+/  small core stacks. pico-sdk guards malloc() with a mutex when
+/  pico_multicore is linked (PICO_USE_MALLOC_MUTEX). */
+
+void* ff_memalloc (	/* Returns pointer to the allocated memory block (null if not enough core) */
+	UINT msize		/* Number of bytes to allocate */
+)
+{
+	return malloc((size_t)msize);	/* Allocate a new memory block */
+}
+
+
+void ff_memfree (
+	void* mblock	/* Pointer to the memory block to free (no effect if null) */
+)
+{
+	free(mblock);	/* Free the memory block */
+}
+
+#endif
+
+
+
+#if FF_FS_REENTRANT
+/*------------------------------------------------------------------------*/
+/* Volume Locking                                                         */
+/*------------------------------------------------------------------------*/
+/* Each volume is guarded by a pico-sdk mutex, so core0 and core1 can both
+/  use the file system. The mutex is owned by the core that takes it, and
+/  a core waiting for it sleeps in WFE instead of spinning on the bus.
+/  FF_FS_TIMEOUT is in milliseconds. */
+
+static mutex_t Mutex[FF_VOLUMES];		/* Volume locks */
+static FF_LOCKSTAT Stat[FF_VOLUMES];	/* Lock statistics (updated while the lock is held) */
+static uint32_t Since[FF_VOLUMES];		/* Time the current owner took the lock */
+static volatile DWORD Timeouts[FF_VOLUMES];	/* Counted without the lock */
+
+
+
+/* Create a sync object (called by f_mount) */
+
+int ff_cre_syncobj (	/* 1:Function succeeded, 0:Could not create the sync object */
+	BYTE vol,			/* Corresponding volume (logical drive number) */
+	FF_SYNC_t* sobj		/* Pointer to return the created sync object */
+)
+{
+	if (!mutex_is_initialized(&Mutex[vol])) mutex_init(&Mutex[vol]);
+	*sobj = &Mutex[vol];
+	return 1;
+}
+
+
+
+/* Delete a sync object (called by f_mount at unmount) */
+
+int ff_del_syncobj (	/* 1:Function succeeded, 0:Could not delete due to an error */
+	FF_SYNC_t sobj		/* Sync object tied to the logical drive to be deleted */
+)
+{
+	(void)sobj;			/* The mutex is static and is reused by the next mount */
+	return 1;
+}
+
+
+
+/* Request grant to access the volume */
+
+int ff_req_grant (	/* 1:Got a grant to access the volume, 0:Could not get a grant */
+	FF_SYNC_t sobj	/* Sync object to wait */
+)
+{
+	UINT vol = (UINT)(sobj - Mutex);
+	FF_LOCKSTAT *st = &Stat[vol];
+	uint32_t t0 = 0, wait = 0;
+	int waited = 0;
+
+
+	if (!mutex_try_enter(sobj, NULL)) {		/* The other core has the volume */
+		t0 = time_us_32();
+		if (!mutex_enter_timeout_ms(sobj, FF_FS_TIMEOUT)) {
+			Timeouts[vol]++;
+			return 0;
+		}
+		waited = 1;
+	}
+	Since[vol] = time_us_32();
+	if (waited) {
+		wait = Since[vol] - t0;
+		st->contended++;
+		st->total_wait += wait;
+		if (wait > st->max_wait) st->max_wait = wait;
+	}
+	st->grants++;
+	return 1;
+}
+
+
+
+/* Release grant to access the volume */
+
+void ff_rel_grant (
+	FF_SYNC_t sobj	/* Sync object to be signaled */
+)
+{
+	UINT vol = (UINT)(sobj - Mutex);
+	FF_LOCKSTAT *st = &Stat[vol];
+	uint32_t hold = time_us_32() - Since[vol];
+
+
+	st->total_hold += hold;
+	if (hold > st->max_hold) st->max_hold = hold;
+	mutex_exit(sobj);
+}
+
+
+
+/* Get lock statistics of a volume */
+
+void ff_lockstat (
+	BYTE vol,			/* Logical drive number */
+	FF_LOCKSTAT* st,	/* Pointer to return the statistics */
+	int reset			/* Clear the statistics after reading them */
+)
+{
+	int locked = mutex_is_initialized(&Mutex[vol]) && mutex_enter_timeout_ms(&Mutex[vol], FF_FS_TIMEOUT);
+
+
+	*st = Stat[vol];
+	st->timeouts = Timeouts[vol];
+	if (reset) {
+		memset(&Stat[vol], 0, sizeof Stat[vol]);
+		Timeouts[vol] = 0;
+	}
+	if (locked) mutex_exit(&Mutex[vol]);
+}
+
+#endif	/* FF_FS_REENTRANT */
+
+
+
+#if FF_BUF_POOL && !FF_FS_TINY
+/*------------------------------------------------------------------------*/
+/* Shared Sector Buffer Pool                                              */
+/*------------------------------------------------------------------------*/
+/* A fixed budget of FF_BUF_POOL sectors is shared by all file objects.
+/  A buffer is a run of contiguous sectors allocated first-fit. It carries
+/  a reference count and goes back to the pool when the count drops to 0. */
+
+static BYTE Pool[FF_BUF_POOL][FF_MAX_SS] __attribute__((aligned(4)));
+static BYTE Run[FF_BUF_POOL];		/* Number of sectors in the run starting here (0:not a run head) */
+static BYTE Refs[FF_BUF_POOL];		/* Reference count of the run starting here */
+static BYTE Used[FF_BUF_POOL];		/* Sector is allocated */
+static FF_POOLSTAT PoolStat = { FF_BUF_POOL, 0, 0, 0, 0 };
+#if defined FF_HOST && !defined FF_HOST_THREADS	/* Single threaded */
+#define POOL_LOCK()
+#define POOL_UNLOCK()
+#else
+auto_init_mutex(PoolMutex);
+#define POOL_LOCK()		mutex_enter_blocking(&PoolMutex)
+#define POOL_UNLOCK()	mutex_exit(&PoolMutex)
+#endif
+
+
+
+/* Get the run head index of a pool buffer (-1:not a pool buffer) */
+
+static int pool_index (
+	void* buf
+)
+{
+	BYTE *p = (BYTE*)buf;
+	int i;
+
+
+	if (p < Pool[0] || p >= Pool[FF_BUF_POOL]) return -1;
+	i = (int)((p - Pool[0]) / FF_MAX_SS);
+	if ((p - Pool[0]) % FF_MAX_SS || Run[i] == 0) return -1;
+	return i;
+}
+
+
+
+/* Allocate a buffer of nsect sectors with one reference, only if keep
+/  sectors of the pool stay free besides. Refusing for the sake of keep
+/  is not counted as a failure. */
+
+void* ff_bufalloc_keep (	/* Returns pointer to the buffer, null:pool is exhausted or short of keep */
+	UINT nsect,		/* Number of sectors */
+	UINT keep		/* Number of sectors to be left free */
+)
+{
+	UINT i, n = 0;
+	void *buf = 0;
+
+
+	if (nsect == 0 || nsect > FF_BUF_POOL || nsect > 255) return 0;
+	POOL_LOCK();
+	if (keep == 0 || PoolStat.used + nsect + keep <= FF_BUF_POOL) {
+		for (i = 0; i < FF_BUF_POOL; i++) {
+			n = Used[i] ? 0 : n + 1;
+			if (n == nsect) break;
+		}
+		if (i < FF_BUF_POOL) {
+			i = i + 1 - nsect;
+			memset(&Used[i], 1, nsect);
+			Run[i] = (BYTE)nsect;
+			Refs[i] = 1;
+			PoolStat.used += nsect;
+			if (PoolStat.used > PoolStat.peak) PoolStat.peak = PoolStat.used;
+			PoolStat.allocs++;
+			buf = Pool[i];
+		} else {
+			PoolStat.fails++;
+		}
+	}
+	POOL_UNLOCK();
+	return buf;
+}
+
+
+
+/* Allocate a buffer of nsect sectors with one reference */
+
+void* ff_bufalloc (	/* Returns pointer to the buffer, null:pool is exhausted */
+	UINT nsect		/* Number of sectors */
+)
+{
+	return ff_bufalloc_keep(nsect, 0);
+}
+
+
+
+/* Add a reference to a pool buffer */
+
+int ff_bufref (	/* 1:Referenced, 0:Not a pool buffer */
+	void* buf	/* Pointer to the buffer */
+)
+{
+	int i;
+
+
+	POOL_LOCK();
+	i = pool_index(buf);
+	if (i >= 0) Refs[i]++;
+	POOL_UNLOCK();
+	return i >= 0;
+}
+
+
+
+/* Drop a reference to a pool buffer and free it at the last one */
+
+void ff_buffree (
+	void* buf		/* Pointer to the buffer (null and other memory are ignored) */
+)
+{
+	int i;
+
+
+	if (!buf) return;
+	POOL_LOCK();
+	i = pool_index(buf);
+	if (i >= 0 && --Refs[i] == 0) {
+		memset(&Used[i], 0, Run[i]);
+		PoolStat.used -= Run[i];
+		Run[i] = 0;
+	}
+	POOL_UNLOCK();
+}
+
+
+
+/* Get usage of the pool */
+
+void ff_poolstat (
+	FF_POOLSTAT* st		/* Pointer to return the statistics */
+)
+{
+	POOL_LOCK();
+	*st = PoolStat;
+	POOL_UNLOCK();
+}
+
+#endif	/* FF_BUF_POOL && !FF_FS_TINY */
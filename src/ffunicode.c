@@ -0,0 +1,120 @@
+/*------------------------------------------------------------------------*/
+/* Unicode Handling Functions for FatFs - CP437 only                      */
+/*------------------------------------------------------------------------*/
+/* The full ffunicode.c carries the tables of every code page and a
+/  compressed up-case table of the whole BMP. This board only uses CP437
+/  names, so a single 128-entry table and up-case conversion of the
+/  Latin, Greek and Cyrillic blocks cover everything it can produce. */
+
+#include "ff.h"
+
+#if FF_USE_LFN
+
+#if FF_CODE_PAGE != 437
+#error This ffunicode.c supports only FF_CODE_PAGE 437
+#endif
+
+static const WCHAR uc437[] = {	/*  CP437(U.S.) to Unicode conversion table */
+	0x00C7, 0x00FC, 0x00E9, 0x00E2, 0x00E4, 0x00E0, 0x00E5, 0x00E7, 0x00EA, 0x00EB, 0x00E8, 0x00EF, 0x00EE, 0x00EC, 0x00C4, 0x00C5,
+	0x00C9, 0x00E6, 0x00C6, 0x00F4, 0x00F6, 0x00F2, 0x00FB, 0x00F9, 0x00FF, 0x00D6, 0x00DC, 0x00A2, 0x00A3, 0x00A5, 0x20A7, 0x0192,
+	0x00E1, 0x00ED, 0x00F3, 0x00FA, 0x00F1, 0x00D1, 0x00AA, 0x00BA, 0x00BF, 0x2310, 0x00AC, 0x00BD, 0x00BC, 0x00A1, 0x00AB, 0x00BB,
+	0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556, 0x2555, 0x2563, 0x2551, 0x2557, 0x255D, 0x255C, 0x255B, 0x2510,
+	0x2514, 0x2534, 0x252C, 0x251C, 0x2500, 0x253C, 0x255E, 0x255F, 0x255A, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256C, 0x2567,
+	0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256B, 0x256A, 0x2518, 0x250C, 0x2588, 0x2584, 0x258C, 0x2590, 0x2580,
+	0x03B1, 0x00DF, 0x0393, 0x03C0, 0x03A3, 0x03C3, 0x00B5, 0x03C4, 0x03A6, 0x0398, 0x03A9, 0x03B4, 0x221E, 0x03C6, 0x03B5, 0x2229,
+	0x2261, 0x00B1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00F7, 0x2248, 0x00B0, 0x2219, 0x00B7, 0x221A, 0x207F, 0x00B2, 0x25A0, 0x00A0
+};
+
+
+
+/*------------------------------------------------------------------------*/
+/* OEM <==> Unicode conversions for static code page configuration        */
+/*------------------------------------------------------------------------*/
+
+WCHAR ff_uni2oem (	/* Returns OEM code character, zero on error */
+	DWORD	uni,	/* UTF-16 encoded character to be converted */
+	WORD	cp		/* Code page for the conversion */
+)
+{
+	WCHAR c = 0;
+	UINT i;
+
+
+	if (uni < 0x80) {	/* ASCII? */
+		c = (WCHAR)uni;
+
+	} else {			/* Non-ASCII */
+		if (uni < 0x10000 && cp == FF_CODE_PAGE) {	/* Is it in BMP and valid code page? */
+			for (i = 0; i < 0x80 && uni != uc437[i]; i++) ;
+			if (i < 0x80) c = (WCHAR)(i + 0x80);
+		}
+	}
+
+	return c;
+}
+
+
+WCHAR ff_oem2uni (	/* Returns Unicode character in UTF-16, zero on error */
+	WCHAR	oem,	/* OEM code to be converted */
+	WORD	cp		/* Code page for the conversion */
+)
+{
+	WCHAR c = 0;
+
+
+	if (oem < 0x80) {	/* ASCII? */
+		c = oem;
+
+	} else {			/* Extended char */
+		if (cp == FF_CODE_PAGE) {	/* Is it a valid code page? */
+			if (oem < 0x100) c = uc437[oem - 0x80];
+		}
+	}
+
+	return c;
+}
+
+
+
+/*------------------------------------------------------------------------*/
+/* Unicode up-case conversion                                             */
+/*------------------------------------------------------------------------*/
+/* Covers ASCII, Latin-1, Latin Extended-A, Greek, Cyrillic and the
+/  full-width Latin letters. Other characters are returned as is. */
+
+DWORD ff_wtoupper (	/* Returns up-converted code point */
+	DWORD uni		/* Unicode code point to be up-converted */
+)
+{
+	if (uni < 0x80) {						/* ASCII */
+		if (uni >= 'a' && uni <= 'z') uni -= 0x20;
+	} else if (uni < 0x100) {				/* Latin-1 Supplement */
+		if (uni >= 0xE0 && uni <= 0xFE && uni != 0xF7) uni -= 0x20;
+		else if (uni == 0xFF) uni = 0x178;
+		else if (uni == 0xB5) uni = 0x39C;
+	} else if (uni < 0x180) {				/* Latin Extended-A: pairs of upper/lower case */
+		if ((uni >= 0x100 && uni <= 0x12F) || (uni >= 0x132 && uni <= 0x137) || (uni >= 0x14A && uni <= 0x177)) {
+			uni &= ~(DWORD)1;
+		} else if ((uni >= 0x139 && uni <= 0x148) || (uni >= 0x179 && uni <= 0x17E)) {
+			if (!(uni & 1)) uni -= 1;
+		} else if (uni == 0x131) {
+			uni = 'I';
+		} else if (uni == 0x17F) {
+			uni = 'S';
+		}
+	} else if (uni >= 0x3B1 && uni <= 0x3CB && uni != 0x3C2) {	/* Greek */
+		uni -= 0x20;
+	} else if (uni == 0x3C2) {
+		uni = 0x3A3;
+	} else if (uni >= 0x430 && uni <= 0x44F) {	/* Cyrillic */
+		uni -= 0x20;
+	} else if (uni >= 0x450 && uni <= 0x45F) {
+		uni -= 0x50;
+	} else if (uni >= 0xFF41 && uni <= 0xFF5A) {	/* Full-width Latin */
+		uni -= 0x20;
+	}
+
+	return uni;
+}
+
+#endif /* #if FF_USE_LFN */
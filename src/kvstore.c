@@ -0,0 +1,552 @@
+#include "kvstore.h"
+#include "diskio.h"
+#include "pico/stdlib.h"
+#include <string.h>
+
+// Layout
+//
+// The file is split into two banks of KV_BANK_SECTORS.  Every record
+// takes a whole sector:
+//
+//     0  magic "KVS1"
+//     4  generation of the bank
+//     8  position of the record in the bank
+//    10  type (put, delete, commit)
+//    11  key length
+//    12  value length
+//    14  reserved
+//    16  key, then value
+//   508  CRC-32 of bytes 0..507
+//
+// Updates are appended to the active bank.  Once it is three quarters
+// full, compaction copies every key into the other bank under a new
+// generation, one sector per kv_service() call, and finishes with a
+// commit record.  Until the commit is on the card the old bank stays the
+// valid one, so a power cut loses at most the update being written.  A
+// bank is read up to the first sector whose CRC, generation or position
+// does not match.
+
+#define KV_MAGIC 0x3153564bu // "KVS1"
+#define REC_PUT 1
+#define REC_DEL 2
+#define REC_COMMIT 3
+#define HDR_SIZE 16
+#define CRC_OFS (FF_MAX_SS - 4)
+#define HASH_SLOTS (2 * KV_MAX_KEYS)
+// Sectors read with one command while loading a bank.
+#define READ_SECTORS 4
+
+#if HDR_SIZE + KV_KEY_MAX + KV_VALUE_MAX > CRC_OFS
+#error A record does not fit in a sector
+#endif
+// Compaction writes each key once, again for each update made while it
+// runs (at most a quarter of a bank), and the commit record.
+#if KV_MAX_KEYS + KV_BANK_SECTORS / 4 + 1 > KV_BANK_SECTORS
+#error KV_BANK_SECTORS is too small for KV_MAX_KEYS
+#endif
+
+enum { FREE, LIVE, GONE }; // GONE: deleted, but a copy is in the new bank
+
+typedef struct {
+    uint32_t hash;
+    uint8_t state;
+    uint8_t copied;     // Current value is in the bank being compacted into
+    uint8_t in_new;     // Some value is in the bank being compacted into
+    uint8_t klen;
+    uint16_t vlen;
+    char key[KV_KEY_MAX + 1];
+    uint8_t value[KV_VALUE_MAX];
+} kv_entry_t;
+
+static struct {
+    BYTE pdrv;
+    LBA_t base;         // First sector of the file (0: store not open)
+    int bank;           // Active bank
+    uint32_t gen;       // Generation of the active bank
+    uint32_t max_gen;   // Highest generation found on the card
+    UINT pos;           // Next free sector in the active bank
+    int compacting;
+    uint32_t new_gen;
+    UINT new_pos;       // Next free sector in the bank being compacted into
+    UINT cursor;        // Next entry to copy
+    kv_entry_t entries[KV_MAX_KEYS];
+    uint8_t slots[HASH_SLOTS]; // Entry index + 1 (0: empty)
+    kv_stats_t stats;
+} kv;
+
+static BYTE sect[FF_MAX_SS] __attribute__((aligned(4)));
+
+static uint32_t crc32(const BYTE *p, UINT n)
+{
+    static const uint32_t tab[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+    uint32_t crc = 0xffffffff;
+    while (n--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ tab[crc & 15];
+        crc = (crc >> 4) ^ tab[crc & 15];
+    }
+    return ~crc;
+}
+
+static uint32_t hash_key(const char *key, UINT klen)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    while (klen--)
+        h = (h ^ (uint8_t)*key++) * 16777619u;
+    return h;
+}
+
+static void put16(BYTE *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(BYTE *p, uint32_t v) { put16(p, v); put16(p + 2, v >> 16); }
+static uint16_t get16(const BYTE *p) { return p[0] | p[1] << 8; }
+static uint32_t get32(const BYTE *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+
+static LBA_t bank_sector(int bank, UINT pos)
+{
+    return kv.base + (LBA_t)bank * KV_BANK_SECTORS + pos;
+}
+
+// Find an entry (live or deleted) by key.  Returns its index or -1.
+static int lookup(const char *key, UINT klen, uint32_t hash)
+{
+    for (UINT i = hash % HASH_SLOTS, n = 0; n < HASH_SLOTS; i = (i + 1) % HASH_SLOTS, n++) {
+        if (kv.slots[i] == 0)
+            return -1;
+        kv_entry_t *e = &kv.entries[kv.slots[i] - 1];
+        if (e->hash == hash && e->klen == klen && memcmp(e->key, key, klen) == 0)
+            return kv.slots[i] - 1;
+    }
+    return -1;
+}
+
+// Rebuild the hash slots from the entries.  With a few dozen keys this
+// is cheaper than keeping deleted markers in the probe chains.
+static void rebuild_slots(void)
+{
+    memset(kv.slots, 0, sizeof kv.slots);
+    for (int k = 0; k < KV_MAX_KEYS; k++) {
+        if (kv.entries[k].state == FREE)
+            continue;
+        UINT i = kv.entries[k].hash % HASH_SLOTS;
+        while (kv.slots[i])
+            i = (i + 1) % HASH_SLOTS;
+        kv.slots[i] = k + 1;
+    }
+}
+
+static int alloc_entry(const char *key, UINT klen, uint32_t hash)
+{
+    for (int k = 0; k < KV_MAX_KEYS; k++) {
+        kv_entry_t *e = &kv.entries[k];
+        if (e->state != FREE)
+            continue;
+        e->hash = hash;
+        e->klen = klen;
+        memcpy(e->key, key, klen);
+        e->key[klen] = '\0';
+        e->vlen = 0;
+        e->state = LIVE;
+        e->copied = 0;
+        e->in_new = 0;
+        UINT i = hash % HASH_SLOTS;
+        while (kv.slots[i])
+            i = (i + 1) % HASH_SLOTS;
+        kv.slots[i] = k + 1;
+        return k;
+    }
+    return -1;
+}
+
+static int have_free_entry(void)
+{
+    for (int k = 0; k < KV_MAX_KEYS; k++) {
+        if (kv.entries[k].state == FREE)
+            return 1;
+    }
+    return 0;
+}
+
+static void free_entry(kv_entry_t *e)
+{
+    e->state = FREE;
+    rebuild_slots();
+}
+
+// Build a record in sect[].
+static void encode(int type, uint32_t gen, UINT pos, const char *key, UINT klen,
+        const void *val, UINT vlen)
+{
+    memset(sect, 0, sizeof sect);
+    put32(sect, KV_MAGIC);
+    put32(sect + 4, gen);
+    put16(sect + 8, pos);
+    sect[10] = type;
+    sect[11] = klen;
+    put16(sect + 12, vlen);
+    memcpy(sect + HDR_SIZE, key, klen);
+    memcpy(sect + HDR_SIZE + klen, val, vlen);
+    put32(sect + CRC_OFS, crc32(sect, CRC_OFS));
+}
+
+// Check a record read from position pos.  gen == 0 accepts any
+// generation.  Returns the record type, or 0 if it is not valid.
+static int decode(const BYTE *p, uint32_t gen, UINT pos)
+{
+    if (get32(p) != KV_MAGIC || get32(p + CRC_OFS) != crc32(p, CRC_OFS))
+        return 0;
+    if ((gen && get32(p + 4) != gen) || get16(p + 8) != pos)
+        return 0;
+    if (p[11] > KV_KEY_MAX || get16(p + 12) > KV_VALUE_MAX)
+        return 0;
+    if (p[10] < REC_PUT || p[10] > REC_COMMIT)
+        return 0;
+    return p[10];
+}
+
+static FRESULT write_sect(int bank, UINT pos)
+{
+    if (disk_write(kv.pdrv, sect, bank_sector(bank, pos), 1) != RES_OK)
+        return FR_DISK_ERR;
+    return FR_OK;
+}
+
+// Apply a valid record to the RAM copy.
+static FRESULT apply(const BYTE *p)
+{
+    const char *key = (const char *)p + HDR_SIZE;
+    UINT klen = p[11];
+    uint32_t hash = hash_key(key, klen);
+    int k = lookup(key, klen, hash);
+    if (p[10] == REC_DEL) {
+        if (k >= 0)
+            free_entry(&kv.entries[k]);
+        return FR_OK;
+    }
+    if (k < 0)
+        k = alloc_entry(key, klen, hash);
+    if (k < 0)
+        return FR_INT_ERR; // more keys on the card than KV_MAX_KEYS
+    kv_entry_t *e = &kv.entries[k];
+    e->vlen = get16(p + 12);
+    memcpy(e->value, p + HDR_SIZE + klen, e->vlen);
+    return FR_OK;
+}
+
+// Load a bank into RAM.  *npos is set to the number of valid records
+// and *committed to whether the bank holds a commit record.
+static FRESULT replay(int bank, uint32_t gen, UINT *npos, int *committed)
+{
+    BYTE *buf = sect;
+    UINT chunk = 1;
+#if FF_BUF_POOL && !FF_FS_TINY
+    BYTE *pool = ff_bufalloc(READ_SECTORS);
+    if (pool) {
+        buf = pool;
+        chunk = READ_SECTORS;
+    }
+#endif
+    FRESULT fr = FR_OK;
+    UINT pos;
+    memset(kv.entries, 0, sizeof kv.entries);
+    memset(kv.slots, 0, sizeof kv.slots);
+    *committed = 0;
+    for (pos = 0; pos < KV_BANK_SECTORS; pos++) {
+        UINT k = pos % chunk;
+        if (k == 0) {
+            UINT cnt = KV_BANK_SECTORS - pos < chunk ? KV_BANK_SECTORS - pos : chunk;
+            if (disk_read(kv.pdrv, buf, bank_sector(bank, pos), cnt) != RES_OK) {
+                fr = FR_DISK_ERR;
+                break;
+            }
+        }
+        const BYTE *p = buf + k * FF_MAX_SS;
+        int type = decode(p, gen, pos);
+        if (type == 0)
+            break;
+        if (type == REC_COMMIT)
+            *committed = 1;
+        else if ((fr = apply(p)) != FR_OK)
+            break;
+    }
+#if FF_BUF_POOL && !FF_FS_TINY
+    ff_buffree(pool);
+#endif
+    *npos = pos;
+    return fr;
+}
+
+// Start an empty store: clear both banks and commit an empty bank 0.
+static FRESULT format(void)
+{
+    memset(sect, 0, sizeof sect);
+    for (UINT pos = 0; pos < KV_BANK_SECTORS; pos++) {
+        for (int bank = 0; bank < 2; bank++) {
+            FRESULT fr = write_sect(bank, pos);
+            if (fr)
+                return fr;
+        }
+    }
+    memset(kv.entries, 0, sizeof kv.entries);
+    memset(kv.slots, 0, sizeof kv.slots);
+    encode(REC_COMMIT, 1, 0, "", 0, "", 0);
+    FRESULT fr = write_sect(0, 0);
+    if (fr)
+        return fr;
+    kv.bank = 0;
+    kv.gen = kv.max_gen = 1;
+    kv.pos = 1;
+    return FR_OK;
+}
+
+// Load the newest committed bank.  A bank without a commit record was
+// being compacted into when power was lost.
+static FRESULT load(void)
+{
+    uint32_t gen[2];
+    for (int bank = 0; bank < 2; bank++) {
+        if (disk_read(kv.pdrv, sect, bank_sector(bank, 0), 1) != RES_OK)
+            return FR_DISK_ERR;
+        gen[bank] = decode(sect, 0, 0) ? get32(sect + 4) : 0;
+    }
+    kv.max_gen = gen[0] > gen[1] ? gen[0] : gen[1];
+    int first = gen[1] > gen[0];
+    for (int i = 0; i < 2; i++) {
+        int bank = i ? !first : first;
+        UINT npos;
+        int committed;
+        if (gen[bank] == 0)
+            continue;
+        FRESULT fr = replay(bank, gen[bank], &npos, &committed);
+        if (fr)
+            return fr;
+        if (committed) {
+            kv.bank = bank;
+            kv.gen = gen[bank];
+            kv.pos = npos;
+            return FR_OK;
+        }
+    }
+    return format();
+}
+
+FRESULT kv_open(const char *path)
+{
+    FIL fil;
+    DWORD nfrag;
+    LBA_t base = 0;
+    const FSIZE_t size = 2 * KV_BANK_SECTORS * FF_MAX_SS;
+    int fresh = 0;
+
+    memset(&kv, 0, sizeof kv);
+    FRESULT fr = f_open(&fil, path, FA_READ);
+    if (fr == FR_NO_FILE) {
+        fr = f_open(&fil, path, FA_READ|FA_WRITE|FA_CREATE_NEW);
+        if (fr)
+            return fr;
+        fresh = 1;
+        fr = f_expand(&fil, size, 1);
+    } else if (fr) {
+        return fr;
+    }
+    if (fr == FR_OK && f_size(&fil) != size)
+        fr = FR_NO_FILESYSTEM;
+    if (fr == FR_OK)
+        fr = f_getfrag(&fil, &nfrag, &base);
+    if (fr == FR_OK && nfrag != 1)
+        fr = FR_NO_FILESYSTEM;
+    BYTE pdrv = fil.obj.fs->pdrv;
+    FRESULT cr = f_close(&fil);
+    if (fr == FR_OK)
+        fr = cr;
+    if (fr) {
+        if (fresh)
+            f_unlink(path);
+        return fr;
+    }
+    // Keep rm and the defragmenter from moving the sectors under us.
+    if (fresh)
+        f_chmod(path, AM_RDO|AM_SYS, AM_RDO|AM_SYS);
+
+    kv.pdrv = pdrv;
+    kv.base = base;
+    fr = fresh ? format() : load();
+    if (fr)
+        kv.base = 0;
+    return fr;
+}
+
+FRESULT kv_get(const char *key, void *buf, UINT size, UINT *len)
+{
+    UINT klen = strlen(key);
+    int k = lookup(key, klen, hash_key(key, klen));
+    if (k < 0 || kv.entries[k].state != LIVE)
+        return FR_NO_FILE;
+    kv_entry_t *e = &kv.entries[k];
+    memcpy(buf, e->value, e->vlen < size ? e->vlen : size);
+    *len = e->vlen;
+    return FR_OK;
+}
+
+// Write one sector of compaction, starting it if needed.
+static FRESULT compact_step(void)
+{
+    int dst = !kv.bank;
+    if (!kv.compacting) {
+        kv.compacting = 1;
+        kv.new_gen = kv.max_gen + 1;
+        kv.new_pos = 0;
+        kv.cursor = 0;
+        for (int k = 0; k < KV_MAX_KEYS; k++)
+            kv.entries[k].copied = kv.entries[k].in_new = 0;
+        kv.stats.compactions++;
+    }
+    if (kv.new_pos >= KV_BANK_SECTORS)
+        return FR_INT_ERR;
+
+    // Copy the next entry that is not in the new bank yet.
+    for (int n = 0; n < KV_MAX_KEYS; n++) {
+        kv_entry_t *e = &kv.entries[kv.cursor];
+        kv.cursor = (kv.cursor + 1) % KV_MAX_KEYS;
+        if (e->state == FREE || e->copied)
+            continue;
+        encode(e->state == LIVE ? REC_PUT : REC_DEL, kv.new_gen, kv.new_pos,
+                e->key, e->klen, e->value, e->state == LIVE ? e->vlen : 0);
+        FRESULT fr = write_sect(dst, kv.new_pos);
+        if (fr)
+            return fr;
+        kv.new_pos++;
+        kv.stats.copies++;
+        e->copied = e->in_new = 1;
+        if (e->state == GONE)
+            free_entry(e);
+        return FR_OK;
+    }
+
+    // Everything is copied: commit and switch banks.
+    encode(REC_COMMIT, kv.new_gen, kv.new_pos, "", 0, "", 0);
+    FRESULT fr = write_sect(dst, kv.new_pos);
+    if (fr)
+        return fr;
+    kv.stats.copies++;
+    kv.bank = dst;
+    kv.gen = kv.max_gen = kv.new_gen;
+    kv.pos = kv.new_pos + 1;
+    kv.compacting = 0;
+    return FR_OK;
+}
+
+static FRESULT finish_compaction(void)
+{
+    FRESULT fr;
+    do {
+        fr = compact_step();
+    } while (fr == FR_OK && kv.compacting);
+    return fr;
+}
+
+// Append the record in sect[] to the active bank.
+static FRESULT append(int type, const char *key, UINT klen, const void *val, UINT vlen)
+{
+    if (kv.pos >= KV_BANK_SECTORS) {
+        FRESULT fr = finish_compaction();
+        if (fr)
+            return fr;
+    }
+    encode(type, kv.gen, kv.pos, key, klen, val, vlen);
+    FRESULT fr = write_sect(kv.bank, kv.pos);
+    if (fr)
+        return fr;
+    kv.pos++;
+    kv.stats.sectors++;
+    return FR_OK;
+}
+
+static void note_latency(uint32_t t0)
+{
+    uint32_t dt = time_us_32() - t0;
+    if (dt > kv.stats.max_put_us)
+        kv.stats.max_put_us = dt;
+}
+
+FRESULT kv_put(const char *key, const void *val, UINT len)
+{
+    UINT klen = strlen(key);
+    if (klen == 0 || klen > KV_KEY_MAX || len > KV_VALUE_MAX)
+        return FR_INVALID_PARAMETER;
+    if (!kv.base)
+        return FR_NOT_READY;
+    uint32_t t0 = time_us_32();
+    uint32_t hash = hash_key(key, klen);
+    int k = lookup(key, klen, hash);
+    if (k >= 0 && kv.entries[k].state == LIVE && kv.entries[k].vlen == len
+            && memcmp(kv.entries[k].value, val, len) == 0)
+        return FR_OK; // unchanged, save the write
+    if (k < 0 && !have_free_entry()) {
+        // Deleted keys still hold entries until compaction ends.
+        if (kv.compacting) {
+            FRESULT fr = finish_compaction();
+            if (fr)
+                return fr;
+        }
+        if (!have_free_entry())
+            return FR_NOT_ENOUGH_CORE;
+    }
+    FRESULT fr = append(REC_PUT, key, klen, val, len);
+    if (fr)
+        return fr;
+    // append() may have finished a compaction, which frees deleted keys.
+    k = lookup(key, klen, hash);
+    if (k < 0)
+        k = alloc_entry(key, klen, hash);
+    kv_entry_t *e = &kv.entries[k];
+    e->state = LIVE;
+    e->vlen = len;
+    memcpy(e->value, val, len);
+    e->copied = 0;
+    kv.stats.puts++;
+    note_latency(t0);
+    return FR_OK;
+}
+
+FRESULT kv_delete(const char *key)
+{
+    UINT klen = strlen(key);
+    if (!kv.base)
+        return FR_NOT_READY;
+    int k = lookup(key, klen, hash_key(key, klen));
+    if (k < 0 || kv.entries[k].state != LIVE)
+        return FR_NO_FILE;
+    uint32_t t0 = time_us_32();
+    FRESULT fr = append(REC_DEL, key, klen, "", 0);
+    if (fr)
+        return fr;
+    kv_entry_t *e = &kv.entries[k];
+    if (kv.compacting && e->in_new) {
+        e->state = GONE; // the new bank still needs the delete
+        e->copied = 0;
+    } else {
+        free_entry(e);
+    }
+    kv.stats.deletes++;
+    note_latency(t0);
+    return FR_OK;
+}
+
+FRESULT kv_service(void)
+{
+    if (!kv.base)
+        return FR_OK;
+    if (kv.compacting || kv.pos >= KV_BANK_SECTORS - KV_BANK_SECTORS / 4)
+        return compact_step();
+    return FR_OK;
+}
+
+void kv_get_stats(kv_stats_t *st)
+{
+    *st = kv.stats;
+}
@@ -0,0 +1,76 @@
+#include "linereader.h"
+#include <string.h>
+
+// Text files are read a whole sector at a time and lines are handed out
+// as pointers into the reader's own buffer.  This replaces f_gets(),
+// which goes through f_read() once for every byte of the file.
+
+void line_reader_init(line_reader_t *lr, FIL *fp)
+{
+    lr->fp = fp;
+    lr->pos = 0;
+    lr->len = 0;
+    lr->eof = false;
+    lr->err = FR_OK;
+}
+
+// Move the unread tail to the front of the buffer and top it up with
+// as many whole sectors as will fit.  Reads stay sector aligned in the
+// file, so f_read() transfers them straight from the card into buf.
+static void fill(line_reader_t *lr)
+{
+    UINT rem = lr->len - lr->pos;
+    if (rem && lr->pos)
+        memmove(lr->buf, &lr->buf[lr->pos], rem);
+    lr->pos = 0;
+    lr->len = rem;
+
+    UINT room = (sizeof lr->buf - 1 - rem) / FF_MAX_SS * FF_MAX_SS;
+    if (room == 0)
+        return;
+    UINT br;
+    FRESULT fr = f_read(lr->fp, &lr->buf[rem], room, &br);
+    if (fr != FR_OK) {
+        lr->err = fr;
+        br = 0;
+    }
+    lr->len += br;
+    if (br < room)
+        lr->eof = true;
+}
+
+// Return the next line with its line ending removed and a terminating
+// NUL written in its place.  The pointer stays valid until the next call.
+// Returns NULL at end of file or on a read error (see lr->err).
+char *line_reader_next(line_reader_t *lr, UINT *len)
+{
+    char *nl = NULL;
+    for (;;) {
+        UINT avail = lr->len - lr->pos;
+        if (avail)
+            nl = memchr(&lr->buf[lr->pos], '\n', avail);
+        if (nl || lr->eof)
+            break;
+        if (lr->pos == 0 && sizeof lr->buf - 1 - lr->len < FF_MAX_SS)
+            break; // Line does not fit in the buffer: return what we have
+        fill(lr);
+    }
+
+    char *line = &lr->buf[lr->pos];
+    UINT n;
+    if (nl) {
+        n = nl - line;
+        lr->pos += n + 1;
+    } else {
+        n = lr->len - lr->pos;
+        if (n == 0)
+            return NULL;
+        lr->pos = lr->len;
+    }
+    if (n && line[n - 1] == '\r')
+        n--;
+    line[n] = '\0';
+    if (len)
+        *len = n;
+    return line;
+}
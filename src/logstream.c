@@ -0,0 +1,169 @@
+#include "logstream.h"
+#include "pico/stdlib.h"
+#include <stddef.h>
+#include <string.h>
+
+// Append-only writer for logs and telemetry.
+//
+// Records are copied into a RAM ring and only whole sectors are handed
+// to f_write(), several at a time, so FatFs sends them to the card as one
+// multiple block write.  When the log is preallocated, the extent is
+// reserved with f_expand() up front: the FAT is never touched while
+// logging, and the directory entry is only rewritten by log_checkpoint().
+
+#define RING_SIZE (LOG_RING_SECTORS * FF_MAX_SS)
+
+// Write n complete sectors from the front of the ring.
+static FRESULT flush_sectors(log_stream_t *log, UINT n)
+{
+    FRESULT fr;
+    while (n) {
+        UINT ri = (UINT)(log->spos % RING_SIZE);
+        UINT cnt = n * FF_MAX_SS;
+        if (cnt > RING_SIZE - ri)
+            cnt = RING_SIZE - ri;
+        if (f_tell(&log->fil) != log->spos) {
+            fr = f_lseek(&log->fil, log->spos);
+            if (fr)
+                return fr;
+        }
+        UINT bw;
+        fr = f_write(&log->fil, &log->ring[ri], cnt, &bw);
+        if (fr == FR_OK && bw != cnt)
+            fr = FR_DENIED; // volume is full
+        if (fr)
+            return fr;
+        log->spos += cnt;
+        log->sectors += cnt / FF_MAX_SS;
+        log->batches++;
+        n -= cnt / FF_MAX_SS;
+    }
+    return FR_OK;
+}
+
+// Open a log.  With prealloc != 0 the file is recreated and a contiguous
+// extent of that many bytes is reserved for it; if the volume has no
+// free run that long the log still works, it just grows cluster by
+// cluster, as it also does once it outgrows the extent.  With
+// prealloc == 0 the file is opened for appending.
+FRESULT log_open(log_stream_t *log, const char *path, FSIZE_t prealloc)
+{
+    FRESULT fr;
+    memset(log, 0, offsetof(log_stream_t, ring));
+    if (prealloc) {
+        fr = f_open(&log->fil, path, FA_WRITE|FA_CREATE_ALWAYS);
+        if (fr)
+            return fr;
+        fr = f_expand(&log->fil, prealloc, 2);
+        if (fr == FR_OK) {
+            log->limit = prealloc;
+            // Put the allocation on the card now rather than in the
+            // middle of the first writes.
+            fr = f_sync(&log->fil);
+        } else if (fr == FR_DENIED) {
+            fr = FR_OK;
+        }
+        if (fr)
+            f_close(&log->fil);
+        return fr;
+    }
+
+    fr = f_open(&log->fil, path, FA_READ|FA_WRITE|FA_OPEN_APPEND);
+    if (fr)
+        return fr;
+    log->wpos = f_size(&log->fil);
+    log->spos = log->wpos - log->wpos % FF_MAX_SS;
+    if (log->wpos != log->spos) {
+        // Keep the partial last sector in the ring so that it is
+        // rewritten as a whole once it fills up.
+        UINT br;
+        fr = f_lseek(&log->fil, log->spos);
+        if (fr == FR_OK)
+            fr = f_read(&log->fil, &log->ring[log->spos % RING_SIZE],
+                        (UINT)(log->wpos - log->spos), &br);
+        if (fr) {
+            f_close(&log->fil);
+            return fr;
+        }
+    }
+    return FR_OK;
+}
+
+FRESULT log_write(log_stream_t *log, const void *data, UINT len)
+{
+    uint32_t start = time_us_32();
+    const BYTE *p = data;
+    FRESULT fr = FR_OK;
+
+    while (len) {
+        UINT used = (UINT)(log->wpos - log->spos);
+        if (used == RING_SIZE) {
+            fr = flush_sectors(log, LOG_RING_SECTORS);
+            if (fr)
+                return fr;
+            continue;
+        }
+        UINT ri = (UINT)(log->wpos % RING_SIZE);
+        UINT cnt = RING_SIZE - used;
+        if (cnt > RING_SIZE - ri)
+            cnt = RING_SIZE - ri;
+        if (cnt > len)
+            cnt = len;
+        memcpy(&log->ring[ri], p, cnt);
+        p += cnt;
+        len -= cnt;
+        log->wpos += cnt;
+    }
+    UINT full = (UINT)(log->wpos - log->spos) / FF_MAX_SS;
+    if (full >= LOG_BATCH_SECTORS)
+        fr = flush_sectors(log, full);
+
+    uint32_t elapsed = time_us_32() - start;
+    if (elapsed > log->max_write_us)
+        log->max_write_us = elapsed;
+    return fr;
+}
+
+// Put everything appended so far on the card and update the file size
+// in the directory entry.
+FRESULT log_checkpoint(log_stream_t *log)
+{
+    uint32_t start = time_us_32();
+    FRESULT fr = flush_sectors(log, (UINT)(log->wpos - log->spos) / FF_MAX_SS);
+    if (fr)
+        return fr;
+    UINT tail = (UINT)(log->wpos - log->spos);
+    if (tail) {
+        // The partial sector stays in the ring and is written again
+        // when it is complete.
+        UINT bw;
+        if (f_tell(&log->fil) != log->spos)
+            fr = f_lseek(&log->fil, log->spos);
+        if (fr == FR_OK)
+            fr = f_write(&log->fil, &log->ring[log->spos % RING_SIZE], tail, &bw);
+        if (fr == FR_OK && bw != tail)
+            fr = FR_DENIED;
+        if (fr)
+            return fr;
+    }
+    fr = f_sync(&log->fil);
+    log->checkpoints++;
+
+    uint32_t elapsed = time_us_32() - start;
+    if (elapsed > log->max_checkpoint_us)
+        log->max_checkpoint_us = elapsed;
+    return fr;
+}
+
+// Checkpoint, give back the unused part of the reserved extent and close.
+FRESULT log_close(log_stream_t *log)
+{
+    FRESULT fr = log_checkpoint(log);
+    if (fr == FR_OK && log->limit) {
+        fr = f_lseek(&log->fil, log->wpos);
+        if (fr == FR_OK)
+            fr = f_truncate(&log->fil);
+    }
+    FRESULT cr = f_close(&log->fil);
+    return fr ? fr : cr;
+}
@@ -2,6 +2,7 @@
 #include "pico/stdlib.h"
 #include "gyro.h"
 #include "audio.h"
+#include "defrag.h"
 
 void test_gyro(void);
 void test_audio(void);
@@ -20,11 +21,15 @@ void test_audio(void)
 
     audio_init();
 
+    // Streamed assets must be contiguous for multi-block reads.
+    static const char *const assets[] = { "car.wav" };
+    defrag_assets(assets, sizeof assets / sizeof assets[0]);
+
     audio_play("car.wav", 128, false);
 
     for (;;)
     {
-        tight_loop_contents();
+        audio_service();
     }
 }
 
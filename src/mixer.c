@@ -0,0 +1,303 @@
+#include "mixer.h"
+#include <string.h>
+
+#if defined(__ARM_FEATURE_DSP)
+#include <arm_acle.h>
+
+// Two samples from any halfword boundary.  The M33 allows unaligned word
+// loads, and memcpy keeps the compiler from assuming alignment.
+static inline int32_t load2(const int16_t *p)
+{
+    int32_t w;
+    memcpy(&w, p, sizeof w);
+    return w;
+}
+
+void mixer_add_mono(int32_t *acc, const int16_t *src, unsigned n, int32_t gain)
+{
+    unsigned i = 0;
+    for (; i + 2 <= n; i += 2, acc += 4) {
+        int32_t w = load2(src + i);
+        acc[0] = __smlabb(w, gain, acc[0]);
+        acc[1] = __smlabb(w, gain, acc[1]);
+        acc[2] = __smlatb(w, gain, acc[2]);
+        acc[3] = __smlatb(w, gain, acc[3]);
+    }
+    if (i < n) {
+        acc[0] += src[i] * gain;
+        acc[1] += src[i] * gain;
+    }
+}
+
+void mixer_add_stereo(int32_t *acc, const int16_t *src, unsigned n, int32_t gain)
+{
+    // One load for both channels of a frame
+    for (unsigned i = 0; i < n; i++, acc += 2) {
+        int32_t w = load2(src + 2 * i);
+        acc[0] = __smlabb(w, gain, acc[0]);
+        acc[1] = __smlatb(w, gain, acc[1]);
+    }
+}
+
+#else
+
+// Two frames per pass: the loads, multiplies and stores of one sample
+// overlap those of the next, and the loop overhead is paid half as
+// often.
+
+void mixer_add_mono(int32_t *acc, const int16_t *src, unsigned n, int32_t gain)
+{
+    unsigned i = 0;
+    for (; i + 2 <= n; i += 2, acc += 4) {
+        int32_t a = src[i] * gain, b = src[i + 1] * gain;
+        acc[0] += a;
+        acc[1] += a;
+        acc[2] += b;
+        acc[3] += b;
+    }
+    if (i < n) {
+        acc[0] += src[i] * gain;
+        acc[1] += src[i] * gain;
+    }
+}
+
+void mixer_add_stereo(int32_t *acc, const int16_t *src, unsigned n, int32_t gain)
+{
+    unsigned i = 0;
+    for (; i + 2 <= n; i += 2, acc += 4, src += 4) {
+        acc[0] += src[0] * gain;
+        acc[1] += src[1] * gain;
+        acc[2] += src[2] * gain;
+        acc[3] += src[3] * gain;
+    }
+    if (i < n) {
+        acc[0] += src[0] * gain;
+        acc[1] += src[1] * gain;
+    }
+}
+
+#endif
+
+// Resampling weighs the source frames around each position: the two on
+// either side for linear interpolation, the four around it for cubic.
+// The weights have W_BITS fraction bits, so a pair of them fits in a
+// word and two neighbouring samples are weighed with one dual multiply
+// (SMUAD, then SMLAD for the next pair) on the DSP extension.  They add
+// up to exactly W_ONE, so a constant comes through unchanged.
+#define W_BITS 14
+#define W_ONE (1 << W_BITS)
+
+// The weight of the frame after pos, from its 16-bit fraction
+static inline int32_t lerp_weight(uint32_t pos)
+{
+    return (pos & 0xffff) >> (16 - W_BITS);
+}
+
+// Catmull-Rom weights of the frames before, at, after and two after the
+// position.  The one at the position takes up the rounding of the rest.
+static inline void cubic_weights(uint32_t pos, int32_t *w)
+{
+    int32_t t = lerp_weight(pos);
+    int32_t t2 = (t * t) >> W_BITS;
+    int32_t t3 = (t2 * t) >> W_BITS;
+    w[0] = (2 * t2 - t3 - t) >> 1;
+    w[2] = (4 * t2 - 3 * t3 + t) >> 1;
+    w[3] = (t3 - t2) >> 1;
+    w[1] = W_ONE - w[0] - w[2] - w[3];
+}
+
+#if defined(__ARM_FEATURE_DSP)
+
+// Halfword pairs: lo and hi from the bottoms of two words, or the bottom
+// and top halves of two words (PKHBT, PKHTB).
+static inline int32_t pair(int32_t lo, int32_t hi)
+{
+    return (int32_t)(((uint32_t)lo & 0xffff) | (uint32_t)hi << 16);
+}
+
+static inline int32_t pair_hi(int32_t lo, int32_t hi)
+{
+    return (int32_t)((uint32_t)lo >> 16 | ((uint32_t)hi & 0xffff0000));
+}
+
+void mixer_resample_linear(int32_t *acc, const int16_t *src, unsigned ch, unsigned n,
+        uint32_t pos, uint32_t step, int32_t gain)
+{
+    if (ch == 2) {
+        // The frame at and the frame after the position are two words,
+        // which repack into a left pair and a right pair.
+        for (unsigned i = 0; i < n; i++, acc += 2, pos += step) {
+            const int16_t *s = src + 2 * (pos >> 16);
+            int32_t w = lerp_weight(pos), ws = pair(W_ONE - w, w);
+            int32_t a = load2(s), b = load2(s + 2);
+            acc[0] += (__smuad(pair(a, b), ws) >> W_BITS) * gain;
+            acc[1] += (__smuad(pair_hi(a, b), ws) >> W_BITS) * gain;
+        }
+    } else {
+        for (unsigned i = 0; i < n; i++, acc += 2, pos += step) {
+            int32_t w = lerp_weight(pos);
+            int32_t y = (__smuad(load2(src + (pos >> 16)), pair(W_ONE - w, w)) >> W_BITS) * gain;
+            acc[0] += y;
+            acc[1] += y;
+        }
+    }
+}
+
+void mixer_resample_cubic(int32_t *acc, const int16_t *src, unsigned ch, unsigned n,
+        uint32_t pos, uint32_t step, int32_t gain)
+{
+    int32_t w[4];
+    if (ch == 2) {
+        for (unsigned i = 0; i < n; i++, acc += 2, pos += step) {
+            const int16_t *s = src + 2 * (pos >> 16);
+            cubic_weights(pos, w);
+            int32_t w01 = pair(w[0], w[1]), w23 = pair(w[2], w[3]);
+            int32_t a = load2(s - 2), b = load2(s), c = load2(s + 2), d = load2(s + 4);
+            int32_t l = __smlad(pair(c, d), w23, __smuad(pair(a, b), w01));
+            int32_t r = __smlad(pair_hi(c, d), w23, __smuad(pair_hi(a, b), w01));
+            acc[0] += (l >> W_BITS) * gain;
+            acc[1] += (r >> W_BITS) * gain;
+        }
+    } else {
+        for (unsigned i = 0; i < n; i++, acc += 2, pos += step) {
+            const int16_t *s = src + (pos >> 16);
+            cubic_weights(pos, w);
+            int32_t y = __smlad(load2(s + 1), pair(w[2], w[3]),
+                    __smuad(load2(s - 1), pair(w[0], w[1])));
+            y = (y >> W_BITS) * gain;
+            acc[0] += y;
+            acc[1] += y;
+        }
+    }
+}
+
+#else
+
+// The sample between s[0] and s[ch], w of the way along
+static inline int32_t lerp(const int16_t *s, unsigned ch, int32_t w)
+{
+    return (s[0] * (W_ONE - w) + s[ch] * w) >> W_BITS;
+}
+
+// The same through s[-ch] .. s[2ch] with the weights of cubic_weights()
+static inline int32_t cubic(const int16_t *s, unsigned ch, const int32_t *w)
+{
+    return (s[-(int)ch] * w[0] + s[0] * w[1] + s[ch] * w[2] + s[2 * ch] * w[3]) >> W_BITS;
+}
+
+void mixer_resample_linear(int32_t *acc, const int16_t *src, unsigned ch, unsigned n,
+        uint32_t pos, uint32_t step, int32_t gain)
+{
+    if (ch == 2) {
+        for (unsigned i = 0; i < n; i++, acc += 2, pos += step) {
+            const int16_t *s = src + 2 * (pos >> 16);
+            int32_t w = lerp_weight(pos);
+            acc[0] += lerp(s, 2, w) * gain;
+            acc[1] += lerp(s + 1, 2, w) * gain;
+        }
+    } else {
+        for (unsigned i = 0; i < n; i++, acc += 2, pos += step) {
+            int32_t y = lerp(src + (pos >> 16), 1, lerp_weight(pos)) * gain;
+            acc[0] += y;
+            acc[1] += y;
+        }
+    }
+}
+
+void mixer_resample_cubic(int32_t *acc, const int16_t *src, unsigned ch, unsigned n,
+        uint32_t pos, uint32_t step, int32_t gain)
+{
+    int32_t w[4];
+    if (ch == 2) {
+        for (unsigned i = 0; i < n; i++, acc += 2, pos += step) {
+            const int16_t *s = src + 2 * (pos >> 16);
+            cubic_weights(pos, w);
+            acc[0] += cubic(s, 2, w) * gain;
+            acc[1] += cubic(s + 1, 2, w) * gain;
+        }
+    } else {
+        for (unsigned i = 0; i < n; i++, acc += 2, pos += step) {
+            cubic_weights(pos, w);
+            int32_t y = cubic(src + (pos >> 16), 1, w) * gain;
+            acc[0] += y;
+            acc[1] += y;
+        }
+    }
+}
+
+#endif
+
+// Bits below the PWM level in an accumulator
+#define LEVEL_SHIFT (16 + MIXER_SHIFT - MIXER_PWM_BITS)
+#define HALF (1 << (15 + MIXER_SHIFT))
+
+// Silent frames in a row after which the error is dropped
+#define SILENT_RUN 64
+
+// The loop itself: a few instructions per sample and no branch, as the
+// saturate and level passes it replaced were.
+static inline uint32_t shape(int32_t acc, int32_t *e1, int32_t *e2)
+{
+    int32_t v = acc + HALF + 2 * *e1 - *e2;
+    // Feed back only the truncation, never what clipping takes off, so
+    // the error stays within one level and the loop cannot run away.
+    *e2 = *e1;
+    *e1 = v & ((1 << LEVEL_SHIFT) - 1);
+#if defined(__ARM_FEATURE_DSP)
+    return __usat(v >> LEVEL_SHIFT, MIXER_PWM_BITS);
+#else
+    int32_t level = v >> LEVEL_SHIFT;
+    if (level < 0)
+        level = 0;
+    if (level > MIXER_PWM_PERIOD)
+        level = MIXER_PWM_PERIOD;
+    return level;
+#endif
+}
+
+// On digital silence the loop would keep cycling through the error left
+// by the last sound, a faint tone that never ends.  When the block ends
+// in silence that has lasted SILENT_RUN frames, the error is dropped
+// from the frame after the SILENT_RUN-th on, and those frames rest at
+// the midpoint, as the loop gives them with no error.  A single 0 is
+// only a sound crossing zero, and dropping the error there would let it
+// into the band; a gap shorter than the rest of the block is left to the
+// loop too.  Only the silent end of the block is looked at again, so a
+// block of sound pays one compare per channel.
+static void settle(uint32_t *dst, const int32_t *acc, unsigned n, mixer_shaper_t *ns,
+        unsigned c)
+{
+    unsigned k = n;
+    while (k > 0 && acc[2 * (k - 1) + c] == 0)
+        k--;
+    uint32_t run = k == 0 ? ns->quiet[c] + n : n - k;
+    if (run <= SILENT_RUN) {
+        ns->quiet[c] = run;
+        return;
+    }
+    unsigned shift = c ? 0 : 16;
+    unsigned from = run - SILENT_RUN >= n ? 0 : n - (run - SILENT_RUN);
+    for (unsigned i = from; i < n; i++)
+        dst[i] = (dst[i] & ~(0xffffu << shift)) | (MIXER_PWM_PERIOD + 1) / 2 << shift;
+    ns->e1[c] = 0;
+    ns->e2[c] = 0;
+    ns->quiet[c] = SILENT_RUN;
+}
+
+void mixer_pwm_levels(uint32_t *dst, const int32_t *acc, unsigned n, mixer_shaper_t *ns)
+{
+    int32_t l1 = ns->e1[0], l2 = ns->e2[0];
+    int32_t r1 = ns->e1[1], r2 = ns->e2[1];
+    const int32_t *a = acc;
+    for (unsigned i = 0; i < n; i++, a += 2) {
+        uint32_t left = shape(a[0], &l1, &l2);
+        uint32_t right = shape(a[1], &r1, &r2);
+        dst[i] = left << 16 | right;
+    }
+    ns->e1[0] = l1;
+    ns->e2[0] = l2;
+    ns->e1[1] = r1;
+    ns->e2[1] = r2;
+    settle(dst, acc, n, ns, 0);
+    settle(dst, acc, n, ns, 1);
+}
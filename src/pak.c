@@ -0,0 +1,144 @@
+#include "pak.h"
+#include "diskio.h"
+
+// The index is loaded once by pak_open().  After that a lookup is a
+// binary search in RAM and a read is one multiple block read straight
+// from the card, with no directory search and no FAT access.
+
+static uint32_t get_u32(const BYTE *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t get_u16(const BYTE *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static DWORD span_sectors(DWORD length)
+{
+    return (length + PAK_SECTOR - 1) / PAK_SECTOR;
+}
+
+FRESULT pak_parse_header(pak_t *pk, const BYTE *sect, DWORD nsect)
+{
+    if (get_u32(sect + PAK_HDR_MAGIC) != PAK_MAGIC)
+        return FR_NO_FILESYSTEM;
+    DWORD count = get_u32(sect + PAK_HDR_COUNT);
+    DWORD index_sectors = get_u32(sect + PAK_HDR_INDEX);
+    DWORD total = get_u32(sect + PAK_HDR_TOTAL);
+    if (total != nsect || index_sectors == 0 || index_sectors > total)
+        return FR_NO_FILESYSTEM;
+    if (count > (index_sectors * PAK_SECTOR - PAK_HDR_SIZE) / PAK_ENTRY_SIZE)
+        return FR_NO_FILESYSTEM;
+    if (count > PAK_MAX_ASSETS)
+        return FR_NOT_ENOUGH_CORE;
+    pk->count = count;
+    pk->sectors = total;
+    pk->index_sectors = index_sectors;
+    return FR_OK;
+}
+
+FRESULT pak_parse_index(pak_t *pk, const BYTE *data)
+{
+    const BYTE *p = data + PAK_HDR_SIZE;
+    if (pak_crc32(p, pk->count * PAK_ENTRY_SIZE) != get_u32(data + PAK_HDR_CRC))
+        return FR_NO_FILESYSTEM;
+    for (UINT i = 0; i < pk->count; i++, p += PAK_ENTRY_SIZE) {
+        pak_entry_t *e = &pk->index[i];
+        e->hash = get_u32(p + PAK_ENT_HASH);
+        e->start = get_u32(p + PAK_ENT_START);
+        e->length = get_u32(p + PAK_ENT_LENGTH);
+        e->format = get_u16(p + PAK_ENT_FORMAT);
+        e->check = get_u32(p + PAK_ENT_CHECK);
+        if (i > 0 && e->hash <= pk->index[i - 1].hash)
+            return FR_NO_FILESYSTEM;
+        if (e->start < pk->index_sectors || e->start > pk->sectors
+                || span_sectors(e->length) > pk->sectors - e->start)
+            return FR_NO_FILESYSTEM;
+    }
+    return FR_OK;
+}
+
+FRESULT pak_find(const pak_t *pk, const char *name, pak_asset_t *asset)
+{
+    uint32_t hash = pak_hash(name);
+    UINT lo = 0, hi = pk->count;
+    while (lo < hi) {
+        UINT mid = (lo + hi) / 2;
+        const pak_entry_t *e = &pk->index[mid];
+        if (e->hash == hash) {
+            if (e->check != pak_check(name))
+                return FR_NO_FILE;
+            asset->lba = pk->base + e->start;
+            asset->length = e->length;
+            asset->format = e->format;
+            return FR_OK;
+        }
+        if (e->hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return FR_NO_FILE;
+}
+
+FRESULT pak_open(pak_t *pk, const char *path)
+{
+    FIL fil;
+    DWORD nfrag;
+    LBA_t base = 0;
+
+    pk->count = 0;
+    FRESULT fr = f_open(&fil, path, FA_READ);
+    if (fr)
+        return fr;
+    FSIZE_t size = f_size(&fil);
+    fr = f_getfrag(&fil, &nfrag, &base);
+    if (fr == FR_OK && (nfrag != 1 || size % PAK_SECTOR))
+        fr = FR_NO_FILESYSTEM;
+    BYTE pdrv = fil.obj.fs->pdrv;
+    FRESULT cr = f_close(&fil);
+    if (fr == FR_OK)
+        fr = cr;
+    if (fr)
+        return fr;
+
+    // Only the sectors that hold entries are read; the packer may leave
+    // the rest of the index area as padding.
+    UINT nsect = (PAK_HDR_SIZE + PAK_MAX_ASSETS * PAK_ENTRY_SIZE + PAK_SECTOR - 1) / PAK_SECTOR;
+    BYTE *buf = ff_bufalloc(nsect);
+    if (!buf)
+        return FR_NOT_ENOUGH_CORE;
+    fr = FR_OK;
+    if (disk_read(pdrv, buf, base, 1) != RES_OK)
+        fr = FR_DISK_ERR;
+    if (fr == FR_OK)
+        fr = pak_parse_header(pk, buf, size / PAK_SECTOR);
+    if (fr == FR_OK) {
+        UINT need = (PAK_HDR_SIZE + pk->count * PAK_ENTRY_SIZE + PAK_SECTOR - 1) / PAK_SECTOR;
+        if (need > 1 && disk_read(pdrv, buf + PAK_SECTOR, base + 1, need - 1) != RES_OK)
+            fr = FR_DISK_ERR;
+    }
+    if (fr == FR_OK)
+        fr = pak_parse_index(pk, buf);
+    ff_buffree(buf);
+    if (fr) {
+        pk->count = 0;
+        return fr;
+    }
+    pk->pdrv = pdrv;
+    pk->base = base;
+    return FR_OK;
+}
+
+FRESULT pak_read(const pak_t *pk, const pak_asset_t *asset, DWORD sect,
+        BYTE *buf, UINT count)
+{
+    DWORD span = span_sectors(asset->length);
+    if (count == 0 || sect >= span || count > span - sect)
+        return FR_INVALID_PARAMETER;
+    if (disk_read(pk->pdrv, buf, asset->lba + sect, count) != RES_OK)
+        return FR_DISK_ERR;
+    return FR_OK;
+}
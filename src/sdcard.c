@@ -4,9 +4,18 @@
 #include <stdio.h>
 #include <string.h>
 #include "sdcard.h"
+#include "linereader.h"
+#include "logstream.h"
+#include "ffsystem.h"
+#include "defrag.h"
 #include "hardware/watchdog.h"  
 
-FATFS fs_storage; // Global file system object
+FATFS fs_storage; // The only file system object; mounted by sd_init() or mount
+uint32_t sd_mount_us; // Time the last mount took, card initialization included
+
+// Space reserved up front for a file created with the input command.
+#define INPUT_PREALLOC (32 * 1024)
+
 const char *month_name[] = {
     [1] = "Jan",
     [2] = "Feb",
@@ -187,21 +196,12 @@ void date(int argc, char *argv[])
             year, month_name[month], ft.day, ft.hour, ft.minute, ft.bisecond*2);
 }
 
-void append(int argc, char *argv[])
+// Read lines from stdin and add them to an open log until a line with a
+// single '.' is entered.
+static void read_lines(log_stream_t *log, const char *name)
 {
-    if (argc != 2) {
-        printf("Specify only one file name to append to.");
-        return;
-    }
-    FIL fil;        /* File object */
     char line[100]; /* Line buffer */
     FRESULT fr;     /* FatFs return code */
-    fr = f_open(&fil, argv[1], FA_WRITE|FA_OPEN_EXISTING|FA_OPEN_APPEND);
-    if (fr) {
-        print_error(fr, argv[1]);
-        return;
-    }
-    printf("To end append, enter a line with a single '.'\n");
     for(;;) {
         fgets(line, sizeof(line)-1, stdin);
         if (line[0] == '.' && (line[1] == '\n' || (line[1] == '\r' && line[2] == '\n')))
@@ -209,12 +209,33 @@ void append(int argc, char *argv[])
         int len = strlen(line);
         if (line[len-1] == '\004')
             len -= 1;
-        UINT wlen;
-        fr = f_write(&fil, (BYTE*)line, len, &wlen);
+        fr = log_write(log, line, len);
         if (fr)
-            print_error(fr, argv[1]);
+            print_error(fr, name);
+    }
+    fr = log_close(log);
+    if (fr)
+        print_error(fr, name);
+}
+
+// append and input never run at the same time, so they share one writer.
+static log_stream_t shell_log;
+
+void append(int argc, char *argv[])
+{
+    if (argc != 2) {
+        printf("Specify only one file name to append to.");
+        return;
     }
-    f_close(&fil);
+    log_stream_t *log = &shell_log;
+    FRESULT fr;     /* FatFs return code */
+    fr = log_open(log, argv[1], 0);
+    if (fr) {
+        print_error(fr, argv[1]);
+        return;
+    }
+    printf("To end append, enter a line with a single '.'\n");
+    read_lines(log, argv[1]);
 }
 
 void input(int argc, char *argv[])
@@ -223,35 +244,72 @@ void input(int argc, char *argv[])
         printf("Specify only one file name to create.");
         return;
     }
-    FIL fil;        /* File object */
-    char line[100]; /* Line buffer */
+    log_stream_t *log = &shell_log;
+    FILINFO fno;
     FRESULT fr;     /* FatFs return code */
-    fr = f_open(&fil, argv[1], FA_WRITE|FA_CREATE_NEW);
+    if (f_stat(argv[1], &fno) == FR_OK) {
+        print_error(FR_EXIST, argv[1]);
+        return;
+    }
+    fr = log_open(log, argv[1], INPUT_PREALLOC);
     if (fr) {
         print_error(fr, argv[1]);
         return;
     }
     printf("To end input, enter a line with a single '.'\n");
-    for(;;) {
-        fgets(line, sizeof(line)-1, stdin);
-        if (line[0] == '.' && (line[1] == '\n' || (line[1] == '\r' && line[2] == '\n')))
-            break;
-        int len = strlen(line);
-        if (line[len-1] == '\004')
-            len -= 1;
-        UINT wlen;
-        fr = f_write(&fil, (BYTE*)line, len, &wlen);
-        if (fr)
-            print_error(fr, argv[1]);
+    read_lines(log, argv[1]);
+}
+
+// Directory items fetched per f_readdirn() call.
+#define LS_BATCH 8
+
+static void print_fileinfo(const FILINFO *fno, const char *path, int info)
+{
+    if (info) {
+        printf("%04d-%s-%02d %02d:%02d:%02d %6llu %c%c%c%c%c ",
+                (fno->fdate >> 9) + 1980,
+                month_name[fno->fdate >> 5 & 15],
+                fno->fdate & 31,
+                fno->ftime >> 11,
+                fno->ftime >> 5 & 63,
+                (fno->ftime & 31) * 2,
+                (unsigned long long)fno->fsize,
+                (fno->fattrib & AM_DIR) ? 'D' : '-',
+                (fno->fattrib & AM_RDO) ? 'R' : '-',
+                (fno->fattrib & AM_HID) ? 'H' : '-',
+                (fno->fattrib & AM_SYS) ? 'S' : '-',
+                (fno->fattrib & AM_ARC) ? 'A' : '-');
+    }
+    size_t len = strlen(path);
+    if (len > 0 && path[len - 1] != '/')
+        printf("%s/%s\n", path, fno->fname);
+    else
+        printf("%s%s\n", path, fno->fname); // none or the root's own slash
+}
+
+// Split "dir/*.ext" into the directory and the extension.  Returns NULL
+// and copies the whole path when the last component is not "*.ext".
+static const char *split_ext(const char *path, char *dir, size_t size)
+{
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    if (name[0] != '*' || name[1] != '.') {
+        snprintf(dir, size, "%s", path);
+        return NULL;
     }
-    f_close(&fil);
+    int len = name - path;
+    if (len > 1)
+        len -= 1; // drop the slash, but keep "/" for the root
+    snprintf(dir, size, "%.*s", len, path);
+    return name + 2;
 }
 
 void ls(int argc, char *argv[])
 {
     FRESULT res;
     DIR dir;
-    static FILINFO fno;
+    static FILINFO fno[LS_BATCH];
+    static char dirpath[FF_MAX_LFN + 1];
     const char *path = "";
     int info = 0;
     int i=1;
@@ -269,33 +327,19 @@ void ls(int argc, char *argv[])
             path = argv[i];
         }
 
-        res = f_opendir(&dir, path);                       /* Open the directory */
+        // "ls dir/*.wav" lists only the .wav files in dir.
+        const char *ext = split_ext(path, dirpath, sizeof dirpath);
+        res = f_opendir(&dir, dirpath);                    /* Open the directory */
         if (res != FR_OK) {
             print_error(res, argv[1]);
             return;
         }
         for (;;) {
-            res = f_readdir(&dir, &fno);                   /* Read a directory item */
-            if (res != FR_OK || fno.fname[0] == 0) break;  /* Break on error or end of dir */
-            if (info) {
-                printf("%04d-%s-%02d %02d:%02d:%02d %6ld %c%c%c%c%c ",
-                        (fno.fdate >> 9) + 1980,
-                        month_name[fno.fdate >> 5 & 15],
-                        fno.fdate & 31,
-                        fno.ftime >> 11,
-                        fno.ftime >> 5 & 63,
-                        (fno.ftime & 31) * 2,
-                        fno.fsize,
-                        (fno.fattrib & AM_DIR) ? 'D' : '-',
-                        (fno.fattrib & AM_RDO) ? 'R' : '-',
-                        (fno.fattrib & AM_HID) ? 'H' : '-',
-                        (fno.fattrib & AM_SYS) ? 'S' : '-',
-                        (fno.fattrib & AM_ARC) ? 'A' : '-');
-            }
-            if (path[0] != '\0')
-                printf("%s/%s\n", path, fno.fname);
-            else
-                printf("%s\n", fno.fname);
+            UINT n;
+            res = f_readdirn(&dir, fno, LS_BATCH, &n, ext); /* Read a batch of items */
+            if (res != FR_OK || n == 0) break;             /* Break on error or end of dir */
+            for (UINT k = 0; k < n; k++)
+                print_fileinfo(&fno[k], dirpath, info);
         }
         f_closedir(&dir);
         i += 1;
@@ -313,6 +357,28 @@ void mkdir(int argc, char *argv[])
     }
 }
 
+// Mount the card without reading FSInfo or checking the exFAT bitmap.
+// FatFs does that on the first write or free space query, so the first
+// file can be opened and read sooner.
+static FRESULT fast_mount(void)
+{
+    uint32_t t0 = time_us_32();
+    FRESULT fr = f_mount(&fs_storage, "", 2);
+    sd_mount_us = time_us_32() - t0;
+    return fr;
+}
+
+// Bring up the SD card interface and mount the card, unless the mount
+// command already did.
+bool sd_init(void)
+{
+    init_sdcard_io();
+    disable_sdcard();
+    if (fs_storage.fs_type != 0)
+        return true;
+    return fast_mount() == FR_OK;
+}
+
 void mount(int argc, char *argv[])
 {
     FATFS *fs = &fs_storage;
@@ -320,7 +386,7 @@ void mount(int argc, char *argv[])
         print_error(FR_DISK_ERR, "Already mounted.");
         return;
     }
-    int res = f_mount(fs, "", 1);
+    int res = fast_mount();
     if (res != FR_OK)
         print_error(res, "Error occurred while mounting");
 }
@@ -347,9 +413,10 @@ void rm(int argc, char *argv[])
 
 void cat(int argc, char *argv[])
 {
+    static line_reader_t lr; /* Sector buffered line reader */
     for(int i=1; i<argc; i++) {
         FIL fil;        /* File object */
-        char line[100]; /* Line buffer */
+        char *line;     /* Current line inside lr's buffer */
         FRESULT fr;     /* FatFs return code */
 
         /* Open a text file */
@@ -360,13 +427,43 @@ void cat(int argc, char *argv[])
         }
 
         /* Read every line and display it */
-        while(f_gets(line, sizeof line, &fil))
-            printf(line);
+        line_reader_init(&lr, &fil);
+        while((line = line_reader_next(&lr, NULL)) != NULL)
+            printf("%s\n", line);
+        if (lr.err)
+            print_error(lr.err, argv[i]);
         /* Close the file */
         f_close(&fil);
     }
 }
 
+// Report the number of fragments of each file.  With -f, fragmented
+// files are rewritten into one contiguous extent.
+void frag(int argc, char *argv[])
+{
+    int fix = 0;
+    for(int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-f") == 0) {
+            fix = 1;
+            continue;
+        }
+        DWORD nfrag;
+        FRESULT fr = defrag_count(argv[i], &nfrag);
+        if (fr) {
+            print_error(fr, argv[i]);
+            continue;
+        }
+        printf("%s: %lu fragment%s\n", argv[i], (unsigned long)nfrag, nfrag == 1 ? "" : "s");
+        if (fix && nfrag > 1) {
+            fr = defrag_file(argv[i]);
+            if (fr)
+                print_error(fr, argv[i]);
+            else
+                printf("%s: now contiguous\n", argv[i]);
+        }
+    }
+}
+
 void cd(int argc, char *argv[])
 {
     if (argc > 2) {
@@ -385,6 +482,34 @@ void cd(int argc, char *argv[])
         print_error(res, argv[1]);
 }
 
+// Report file system memory use and how the two cores have been sharing
+// the volume.  With -r the lock counters are cleared after they are
+// printed.
+void fsstat(int argc, char *argv[])
+{
+    printf("mount %lu us\n", (unsigned long)sd_mount_us);
+
+    FF_POOLSTAT ps;
+    ff_poolstat(&ps);
+    printf("FATFS %u bytes, FIL %u bytes, DIR %u bytes, log writer %u bytes\n",
+            (unsigned)sizeof(FATFS), (unsigned)sizeof(FIL),
+            (unsigned)sizeof(DIR), (unsigned)sizeof shell_log);
+    printf("buffer pool %u sectors: %u in use, peak %u, %lu allocs, %lu refused\n",
+            ps.size, ps.used, ps.peak,
+            (unsigned long)ps.allocs, (unsigned long)ps.fails);
+
+    FF_LOCKSTAT st;
+    int reset = argc > 1 && strcmp(argv[1], "-r") == 0;
+    ff_lockstat(0, &st, reset);
+    printf("lock grants %lu, contended %lu, timeouts %lu\n",
+            (unsigned long)st.grants, (unsigned long)st.contended,
+            (unsigned long)st.timeouts);
+    printf("lock wait max %lu us, total %llu us\n",
+            (unsigned long)st.max_wait, (unsigned long long)st.total_wait);
+    printf("lock hold max %lu us, total %llu us\n",
+            (unsigned long)st.max_hold, (unsigned long long)st.total_hold);
+}
+
 void restart(int argc, char *argv[])
 {
     printf("Restarting microcontroller...\n\n\n");
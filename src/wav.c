@@ -0,0 +1,162 @@
+#include "wav.h"
+#include "adpcm.h"
+#include <string.h>
+
+// A WAVE file is a RIFF header ("RIFF", size, "WAVE") followed by chunks
+// of an id, a 32-bit little-endian size and the body, padded to an even
+// length.  Only "fmt " and "data" matter here; LIST, fact, JUNK, bext and
+// the rest are skipped by their size.
+
+#define FMT_MIN 16          // WAVEFORMAT with wBitsPerSample
+#define FMT_EXT 40          // WAVEFORMATEXTENSIBLE
+#define FMT_ADPCM 20        // cbSize and wSamplesPerBlock
+#define FMT_MS_ADPCM (22 + 4 * ADPCM_MS_PREDICTORS)  // and the predictors
+#define FMT_MAX (FMT_EXT > FMT_MS_ADPCM ? FMT_EXT : FMT_MS_ADPCM)
+
+static uint16_t get_u16(const BYTE *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get_u32(const BYTE *p)
+{
+    return get_u16(p) | (uint32_t)get_u16(p + 2) << 16;
+}
+
+// The frames per block come after cbSize.  Some writers leave it 0, so
+// it is worked out from the block size then.
+static FRESULT parse_adpcm(const BYTE *p, UINT len, wav_info_t *info)
+{
+    unsigned most = adpcm_frames(info->format, info->block_align, info->channels);
+    if (info->bits != 4 || info->channels > 2 || most == 0)
+        return FR_NO_FILESYSTEM;
+    unsigned frames = len >= FMT_ADPCM ? get_u16(p + 18) : 0;
+    if (frames == 0 || frames > most)
+        frames = most;
+    info->block_frames = frames;
+    if (info->format == WAV_FORMAT_IMA_ADPCM)
+        return FR_OK;
+
+    // MS ADPCM lists its predictors, which must start with the standard
+    // seven.
+    if (len < FMT_MS_ADPCM || get_u16(p + 20) < ADPCM_MS_PREDICTORS)
+        return FR_NO_FILESYSTEM;
+    for (int i = 0; i < ADPCM_MS_PREDICTORS; i++) {
+        if ((int16_t)get_u16(p + 22 + 4 * i) != adpcm_ms_coef[i][0]
+                || (int16_t)get_u16(p + 24 + 4 * i) != adpcm_ms_coef[i][1])
+            return FR_NO_FILESYSTEM;
+    }
+    return FR_OK;
+}
+
+FRESULT wav_parse_fmt(const BYTE *p, UINT len, wav_info_t *info)
+{
+    if (len < FMT_MIN)
+        return FR_NO_FILESYSTEM;
+    info->format = get_u16(p);
+    info->channels = get_u16(p + 2);
+    info->rate = get_u32(p + 4);
+    info->block_align = get_u16(p + 12);
+    info->bits = get_u16(p + 14);
+    // The sub-format GUID starts with the real format tag.
+    if (info->format == WAV_FORMAT_EXTENSIBLE) {
+        if (len < FMT_EXT)
+            return FR_NO_FILESYSTEM;
+        info->format = get_u16(p + 24);
+    }
+    if (info->channels == 0 || info->rate == 0 || info->block_align == 0)
+        return FR_NO_FILESYSTEM;
+    info->block_frames = 1;
+    if (info->format == WAV_FORMAT_PCM) {
+        if (info->bits == 0 || info->bits > 32 || info->bits % 8
+                || info->block_align != info->channels * (info->bits / 8))
+            return FR_NO_FILESYSTEM;
+    } else if (info->format == WAV_FORMAT_IMA_ADPCM
+            || info->format == WAV_FORMAT_MS_ADPCM) {
+        return parse_adpcm(p, len, info);
+    }
+    return FR_OK;
+}
+
+// Where the chunks are read from: a file, or a WAVE file in memory
+typedef struct {
+    FIL *fp;
+    const BYTE *mem;
+    FSIZE_t size;
+} source_t;
+
+static FRESULT source_read(const source_t *s, FSIZE_t pos, BYTE *dst, UINT n, UINT *br)
+{
+    if (s->fp) {
+        FRESULT fr = f_lseek(s->fp, pos);
+        return fr ? fr : f_read(s->fp, dst, n, br);
+    }
+    *br = pos >= s->size ? 0 : s->size - pos < n ? (UINT)(s->size - pos) : n;
+    memcpy(dst, s->mem + pos, *br);
+    return FR_OK;
+}
+
+static FRESULT walk(const source_t *s, wav_info_t *info)
+{
+    BYTE hdr[FMT_MAX];
+    UINT br;
+    int have_fmt = 0, have_data = 0;
+
+    FRESULT fr = source_read(s, 0, hdr, 12, &br);
+    if (fr)
+        return fr;
+    if (br < 12 || (memcmp(hdr, "RIFF", 4) && memcmp(hdr, "RF64", 4))
+            || memcmp(hdr + 8, "WAVE", 4))
+        return FR_NO_FILESYSTEM;
+
+    // The RIFF size is often wrong in files that were cut or streamed, so
+    // the walk goes by the file size instead.
+    FSIZE_t size = s->size;
+    FSIZE_t pos = 12;
+    while (!(have_fmt && have_data) && pos + 8 <= size) {
+        fr = source_read(s, pos, hdr, 8, &br);
+        if (fr)
+            return fr;
+        if (br < 8)
+            break;
+        uint32_t len = get_u32(hdr + 4);
+        FSIZE_t body = pos + 8;
+
+        if (memcmp(hdr, "fmt ", 4) == 0) {
+            UINT n = len < sizeof hdr ? len : sizeof hdr;
+            fr = source_read(s, body, hdr, n, &br);
+            if (fr)
+                return fr;
+            fr = wav_parse_fmt(hdr, br, info);
+            if (fr)
+                return fr;
+            have_fmt = 1;
+        } else if (memcmp(hdr, "data", 4) == 0) {
+            info->data_ofs = body;
+            info->data_len = size - body < len ? size - body : len;
+            have_data = 1;
+            // A data chunk with an unknown size runs to the end.
+            if (len == 0xffffffff)
+                break;
+        }
+        pos = body + len + (len & 1);
+    }
+    if (!have_fmt || !have_data)
+        return FR_NO_FILESYSTEM;
+    if (info->block_frames == 1)
+        info->data_len -= info->data_len % info->block_align;  // no partial frame
+    return FR_OK;
+}
+
+FRESULT wav_open(FIL *fp, wav_info_t *info)
+{
+    source_t s = { fp, NULL, f_size(fp) };
+    FRESULT fr = walk(&s, info);
+    return fr ? fr : f_lseek(fp, info->data_ofs);
+}
+
+FRESULT wav_open_mem(const BYTE *p, FSIZE_t size, wav_info_t *info)
+{
+    source_t s = { NULL, p, size };
+    return walk(&s, info);
+}
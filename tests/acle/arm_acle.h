@@ -0,0 +1,52 @@
+#ifndef ARM_ACLE_H
+#define ARM_ACLE_H
+
+// Host models of the ACLE intrinsics mixer.c uses on the DSP extension,
+// as the Armv8-M Architecture Reference Manual defines the instructions:
+// signed halfwords, products added modulo 2^32.  test_dsp builds mixer.c
+// against these and checks it against the plain C version.
+
+#include <stdint.h>
+
+static inline int32_t acle_lo(int32_t x)
+{
+    return (int16_t)(x & 0xffff);
+}
+
+static inline int32_t acle_hi(int32_t x)
+{
+    return (int16_t)((uint32_t)x >> 16);
+}
+
+// a.lo * b.lo + c
+static inline int32_t __smlabb(int32_t a, int32_t b, int32_t c)
+{
+    return (int32_t)((uint32_t)(acle_lo(a) * acle_lo(b)) + (uint32_t)c);
+}
+
+// a.hi * b.lo + c
+static inline int32_t __smlatb(int32_t a, int32_t b, int32_t c)
+{
+    return (int32_t)((uint32_t)(acle_hi(a) * acle_lo(b)) + (uint32_t)c);
+}
+
+// a.lo * b.lo + a.hi * b.hi
+static inline int32_t __smuad(int32_t a, int32_t b)
+{
+    return (int32_t)((uint32_t)(acle_lo(a) * acle_lo(b)) + (uint32_t)(acle_hi(a) * acle_hi(b)));
+}
+
+// a.lo * b.lo + a.hi * b.hi + c
+static inline int32_t __smlad(int32_t a, int32_t b, int32_t c)
+{
+    return (int32_t)((uint32_t)__smuad(a, b) + (uint32_t)c);
+}
+
+// x clamped to 0 .. 2^n - 1
+static inline uint32_t __usat(int32_t x, unsigned n)
+{
+    int64_t max = ((int64_t)1 << n) - 1;
+    return x < 0 ? 0 : x > max ? (uint32_t)max : (uint32_t)x;
+}
+
+#endif
@@ -0,0 +1,294 @@
+#include "audio_sim.h"
+#include "audio.h"
+#include "sdcard.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/pwm.h"
+#include <string.h>
+
+#define CHANNELS 12
+
+uint32_t *sim_out;
+uint32_t sim_nout;
+uint32_t sim_irqs;
+uint32_t sim_clk_hz = 150000000;
+uint16_t sim_timer_x;
+uint16_t sim_timer_y;
+
+FATFS fs_storage;
+
+static uint32_t cap;
+static pwm_hw_t pwm_regs;
+pwm_hw_t *pwm_hw = &pwm_regs;
+
+static struct {
+    volatile uint32_t *write;
+    const volatile uint32_t *read;
+    uint32_t count;         // Transfers per trigger
+    uint32_t left;          // Transfers still to do
+    uint chain_to;
+    bool irq;               // Raised when a block is done
+} chan[CHANNELS];
+static int nchan;
+static int active = -1;     // Channel moving data, -1 when none
+static irq_handler_t handler;
+static double next_tick;    // Simulated time of the next timer tick
+
+bool sd_init(void)
+{
+    return f_mount(&fs_storage, "", 1) == FR_OK;
+}
+
+void gpio_set_function(uint gpio, int fn)
+{
+}
+
+uint pwm_gpio_to_slice_num(uint gpio)
+{
+    return (gpio >> 1) & 7;
+}
+
+void pwm_set_wrap(uint slice_num, uint16_t wrap)
+{
+    pwm_hw->slice[slice_num].top = wrap;
+}
+
+void pwm_set_chan_level(uint slice_num, uint chan, uint16_t level)
+{
+    volatile uint32_t *cc = &pwm_hw->slice[slice_num].cc;
+    if (chan == PWM_CHAN_B)
+        *cc = (*cc & 0xffff) | (uint32_t)level << 16;
+    else
+        *cc = (*cc & 0xffff0000) | level;
+}
+
+void pwm_set_enabled(uint slice_num, bool enabled)
+{
+}
+
+uint32_t clock_get_hz(enum clock_index clk_index)
+{
+    return sim_clk_hz;
+}
+
+int dma_claim_unused_channel(bool required)
+{
+    CHECK(nchan < CHANNELS);
+    return nchan++;
+}
+
+int dma_claim_unused_timer(bool required)
+{
+    return 0;
+}
+
+void dma_timer_set_fraction(uint timer, uint16_t numerator, uint16_t denominator)
+{
+    sim_timer_x = numerator;
+    sim_timer_y = denominator;
+}
+
+uint dma_get_timer_dreq(uint timer)
+{
+    return 59 + timer;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel)
+{
+    dma_channel_config c = { channel };   // chained to itself: no chain
+    return c;
+}
+
+void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size)
+{
+    CHECK(size == DMA_SIZE_32);
+}
+
+void channel_config_set_read_increment(dma_channel_config *c, bool incr)
+{
+    CHECK(incr);
+}
+
+void channel_config_set_write_increment(dma_channel_config *c, bool incr)
+{
+    CHECK(!incr);
+}
+
+void channel_config_set_dreq(dma_channel_config *c, uint dreq)
+{
+}
+
+void channel_config_set_chain_to(dma_channel_config *c, uint chain_to)
+{
+    c->ctrl = chain_to;
+}
+
+static void trigger(uint c)
+{
+    CHECK(active < 0);
+    chan[c].left = chan[c].count;
+    active = c;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config,
+        volatile void *write_addr, const volatile void *read_addr,
+        uint transfer_count, bool trigger_now)
+{
+    chan[channel].write = write_addr;
+    chan[channel].read = read_addr;
+    chan[channel].count = transfer_count;
+    chan[channel].chain_to = config->ctrl;
+    if (trigger_now)
+        trigger(channel);
+}
+
+void dma_channel_set_read_addr(uint channel, const volatile void *read_addr, bool trigger_now)
+{
+    chan[channel].read = read_addr;
+    if (trigger_now)
+        trigger(channel);
+}
+
+void dma_channel_set_irq0_enabled(uint channel, bool enabled)
+{
+}
+
+bool dma_channel_get_irq0_status(uint channel)
+{
+    return chan[channel].irq;
+}
+
+void dma_channel_acknowledge_irq0(uint channel)
+{
+    chan[channel].irq = false;
+}
+
+void dma_channel_start(uint channel)
+{
+    next_tick = (double)sim_us;
+    trigger(channel);
+}
+
+void irq_set_exclusive_handler(uint num, irq_handler_t h)
+{
+    handler = h;
+}
+
+void irq_set_enabled(uint num, bool enabled)
+{
+}
+
+// Move the data due by now.  A finished channel triggers the one it
+// chains to and raises its interrupt, which runs at once.
+static void run_dma(void)
+{
+    double period = 1e6 * sim_timer_y / ((double)sim_clk_hz * sim_timer_x);
+    while (active >= 0 && next_tick <= (double)sim_us) {
+        int c = active;
+        uint32_t v = *chan[c].read++;
+        *chan[c].write = v;
+        if (sim_out && sim_nout < cap)
+            sim_out[sim_nout++] = v;
+        next_tick += period;
+        if (--chan[c].left == 0) {
+            active = -1;
+            chan[c].irq = true;
+            if (chan[c].chain_to != (uint)c)
+                trigger(chan[c].chain_to);
+            sim_irqs++;
+            handler();
+        }
+    }
+}
+
+void sim_init(uint32_t n)
+{
+    free(sim_out);
+    sim_out = malloc(n * sizeof *sim_out);
+    CHECK(sim_out);
+    cap = n;
+    sim_nout = 0;
+    disk_hook = run_dma;
+}
+
+void sim_run(uint32_t us)
+{
+    sim_us += us;
+    run_dma();
+}
+
+void sim_frames(uint32_t n)
+{
+    uint32_t end = sim_nout + n;
+    while (sim_nout < end)
+        sim_run(10);
+}
+
+void sim_block_start(void)
+{
+    sim_frames(2 * AUDIO_BLOCK_SAMPLES);
+    for (uint32_t irqs = sim_irqs; sim_irqs == irqs;)
+        sim_frames(1);
+}
+
+static void put32(BYTE *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void chunk(FIL *fp, const char *id, const void *body, UINT len)
+{
+    BYTE hdr[8];
+    UINT bw;
+    memcpy(hdr, id, 4);
+    put32(hdr + 4, len);
+    CHECK(f_write(fp, hdr, 8, &bw) == FR_OK && bw == 8);
+    CHECK(f_write(fp, body, len, &bw) == FR_OK && bw == len);
+    if (len & 1)
+        CHECK(f_write(fp, "", 1, &bw) == FR_OK && bw == 1);
+}
+
+void sim_wav(const char *path, const void *fmt, UINT fmt_len, const void *data, UINT len,
+        UINT list)
+{
+    FIL fil;
+    BYTE riff[12];
+    UINT bw;
+
+    CHECK(f_open(&fil, path, FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(&fil, riff, 12, &bw) == FR_OK);
+    if (list) {
+        BYTE *info = calloc(list, 1);
+        CHECK(info);
+        chunk(&fil, "LIST", info, list);
+        free(info);
+    }
+    chunk(&fil, "fmt ", fmt, fmt_len);
+    chunk(&fil, "data", data, len);
+    memcpy(riff, "RIFF", 4);
+    put32(riff + 4, (uint32_t)f_size(&fil) - 8);
+    memcpy(riff + 8, "WAVE", 4);
+    CHECK(f_lseek(&fil, 0) == FR_OK);
+    CHECK(f_write(&fil, riff, 12, &bw) == FR_OK);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+UINT sim_pcm_fmt(BYTE *fmt, unsigned channels, uint32_t rate, unsigned bits)
+{
+    unsigned align = channels * bits / 8;
+    fmt[0] = 1;
+    fmt[1] = 0;
+    fmt[2] = channels;
+    fmt[3] = 0;
+    put32(fmt + 4, rate);
+    put32(fmt + 8, rate * align);
+    fmt[12] = align;
+    fmt[13] = 0;
+    fmt[14] = bits;
+    fmt[15] = 0;
+    return 16;
+}
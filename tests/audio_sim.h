@@ -0,0 +1,44 @@
+#ifndef AUDIO_SIM_H
+#define AUDIO_SIM_H
+
+// Support for the audio host tests: the PWM slice, DMA channels, DMA
+// timer and interrupt that audio.c drives, run on the simulated clock of
+// host.c.  The DMA moves one word per timer tick and the interrupt is
+// taken as soon as a channel finishes, also in the middle of a card read,
+// as on the target.  Every value the DMA writes to a CC register is kept
+// in sim_out.
+
+#include "host.h"
+#include "ff.h"
+
+extern FATFS fs_storage;        // The volume sd_init() mounts
+extern uint32_t *sim_out;       // CC values written, in order
+extern uint32_t sim_nout;       // and their number, up to the cap of sim_init()
+extern uint32_t sim_irqs;       // Interrupts taken
+extern uint32_t sim_clk_hz;     // clk_sys
+extern uint16_t sim_timer_x;    // DMA timer fraction set by audio.c
+extern uint16_t sim_timer_y;
+
+// Keep up to cap CC values, and run the DMA whenever the card is read.
+void sim_init(uint32_t cap);
+
+// The main loop is busy for us microseconds.
+void sim_run(uint32_t us);
+
+// Run until the DMA has written n more values.
+void sim_frames(uint32_t n);
+
+// Let the blocks already queued go out, then run until the interrupt has
+// just taken the next one, so that output frames count from a block
+// boundary.
+void sim_block_start(void);
+
+// Write a WAVE file with the given fmt chunk body and sample data.  A
+// LIST chunk of list bytes goes before fmt when list is not 0.
+void sim_wav(const char *path, const void *fmt, UINT fmt_len, const void *data, UINT len,
+        UINT list);
+
+// Fill in a PCM fmt chunk body and return its length.
+UINT sim_pcm_fmt(BYTE *fmt, unsigned channels, uint32_t rate, unsigned bits);
+
+#endif
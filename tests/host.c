@@ -0,0 +1,134 @@
+#include "host.h"
+#include "diskio.h"
+#include "pico/stdlib.h"
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+disk_stats_t disk_stats;
+uint64_t sim_us;
+void (*disk_hook)(void);
+int32_t disk_write_limit = -1;
+int32_t disk_torn_bytes;
+BYTE *disk_image;
+LBA_t disk_sectors;
+
+// The SPI pins of the card: nothing to set up.
+void init_sdcard_io(void)
+{
+}
+
+void disable_sdcard(void)
+{
+}
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+    if (!disk_image)
+        return STA_NOINIT;
+    sim_us += INIT_US;
+    return 0;
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+    return disk_image ? 0 : STA_NOINIT;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buffer, LBA_t sector, UINT count)
+{
+    if (sector + count > disk_sectors)
+        return RES_PARERR;
+    memcpy(buffer, disk_image + (size_t)sector * FF_MAX_SS, (size_t)count * FF_MAX_SS);
+    disk_stats.reads++;
+    disk_stats.read_sectors += count;
+    sim_us += CMD_US + (uint64_t)count * SECTOR_US;
+    if (disk_hook)
+        disk_hook();
+    return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buffer, LBA_t sector, UINT count)
+{
+    if (sector + count > disk_sectors)
+        return RES_PARERR;
+    if (disk_write_limit == 0) {
+        if (disk_torn_bytes > 0)
+            memcpy(disk_image + (size_t)sector * FF_MAX_SS, buffer, disk_torn_bytes);
+        disk_torn_bytes = 0;
+        return RES_ERROR;
+    }
+    if (disk_write_limit > 0)
+        disk_write_limit--;
+    memcpy(disk_image + (size_t)sector * FF_MAX_SS, buffer, (size_t)count * FF_MAX_SS);
+    disk_stats.writes++;
+    disk_stats.write_sectors += count;
+    sim_us += CMD_US + (uint64_t)count * (SECTOR_US + PROGRAM_US);
+    return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+    switch (cmd) {
+    case CTRL_SYNC:
+        return RES_OK;
+    case GET_SECTOR_COUNT:
+        *(LBA_t *)buff = disk_sectors;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *(DWORD *)buff = 1;
+        return RES_OK;
+    }
+    return RES_PARERR;
+}
+
+// sdcard.c has its own clock, set by the date command.
+__attribute__((weak)) DWORD get_fattime(void)
+{
+    return (DWORD)(2026 - 1980) << 25 | 1 << 21 | 1 << 16;
+}
+
+uint32_t time_us_32(void)
+{
+    return (uint32_t)sim_us;
+}
+
+uint64_t time_us_64(void)
+{
+    return sim_us;
+}
+
+void sleep_ms(uint32_t ms)
+{
+    sim_us += (uint64_t)ms * 1000;
+}
+
+FRESULT host_format(FATFS *fs, LBA_t sectors, BYTE fmt, DWORD au)
+{
+    static BYTE work[FF_MAX_SS * 8];
+    MKFS_PARM opt = { fmt, 1, 0, 0, au };
+
+    f_mount(NULL, "", 0);
+    // Shared, so that a forked child can stand for a run that loses
+    // power: the parent then sees the card as the child left it.
+    if (disk_image)
+        munmap(disk_image, (size_t)disk_sectors * FF_MAX_SS);
+    disk_image = mmap(NULL, (size_t)sectors * FF_MAX_SS, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (disk_image == MAP_FAILED) {
+        disk_image = NULL;
+        return FR_NOT_ENOUGH_CORE;
+    }
+    disk_sectors = sectors;
+    FRESULT fr = f_mkfs("", &opt, work, sizeof work);
+    if (fr == FR_OK)
+        fr = f_mount(fs, "", 1);
+    return fr;
+}
+
+double wall_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
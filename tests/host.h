@@ -0,0 +1,60 @@
+#ifndef HOST_H
+#define HOST_H
+
+// Support for the host tests: a RAM disk behind diskio.h that charges
+// what an SD card over SPI would cost to a simulated clock, and a check
+// macro.
+
+#include "ff.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    uint32_t reads;         // disk_read() calls
+    uint32_t writes;        // disk_write() calls
+    uint32_t read_sectors;
+    uint32_t write_sectors;
+} disk_stats_t;
+
+// Card timing: one command with its access time, then 512 bytes at a
+// 12 MHz SPI clock, plus the programming time of a written sector, and
+// the initialization of the card.
+#define CMD_US 300
+#define SECTOR_US 341
+#define PROGRAM_US 1000
+// Bringing the card up at every mount: CMD0 and CMD8, then ACMD41 polled
+// until the card leaves its idle state, which takes most of it.
+#define INIT_US 100000
+
+extern disk_stats_t disk_stats;
+// Simulated time in microseconds; time_us_32() and time_us_64() read it.
+extern uint64_t sim_us;
+// Called after every card read, with sim_us already advanced.
+extern void (*disk_hook)(void);
+// Writes the card still takes; once it reaches 0 every disk_write()
+// fails, as if power was cut.  Negative: no limit.
+extern int32_t disk_write_limit;
+// Bytes of its first sector the write that fails at the limit still
+// leaves on the card, as when power goes while the card programs it.
+extern int32_t disk_torn_bytes;
+// Card contents, for tests that save and restore them.  The mapping is
+// shared with forked children.
+extern BYTE *disk_image;
+extern LBA_t disk_sectors;
+
+// Create a zeroed card of the given size, format it (FM_FAT, FM_FAT32
+// or FM_EXFAT, au bytes per cluster, 0 for the default) and mount it.
+FRESULT host_format(FATFS *fs, LBA_t sectors, BYTE fmt, DWORD au);
+
+// Wall clock time in seconds, for the benchmark printouts.
+double wall_seconds(void);
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+#endif
@@ -0,0 +1,11 @@
+// Host stand-in for hardware/clocks.h
+#ifndef HARDWARE_CLOCKS_H
+#define HARDWARE_CLOCKS_H
+
+#include "pico/stdlib.h"
+
+enum clock_index { clk_gpout0 = 0, clk_ref = 4, clk_sys = 5, clk_peri = 6 };
+
+uint32_t clock_get_hz(enum clock_index clk_index);
+
+#endif
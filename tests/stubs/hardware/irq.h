@@ -0,0 +1,14 @@
+// Host stand-in for hardware/irq.h
+#ifndef HARDWARE_IRQ_H
+#define HARDWARE_IRQ_H
+
+#include "pico/stdlib.h"
+
+typedef void (*irq_handler_t)(void);
+
+enum { DMA_IRQ_0 = 10, DMA_IRQ_1 = 11 };
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler);
+void irq_set_enabled(uint num, bool enabled);
+
+#endif
@@ -0,0 +1,25 @@
+// Host stand-in for hardware/pwm.h: the slice registers are plain memory,
+// so a write to CC by the simulated DMA can be seen.
+#ifndef HARDWARE_PWM_H
+#define HARDWARE_PWM_H
+
+#include "pico/stdlib.h"
+
+enum pwm_chan { PWM_CHAN_A = 0, PWM_CHAN_B = 1 };
+
+typedef struct {
+    volatile uint32_t csr, div, ctr, cc, top;
+} pwm_slice_hw_t;
+
+typedef struct {
+    pwm_slice_hw_t slice[12];
+} pwm_hw_t;
+
+extern pwm_hw_t *pwm_hw;
+
+uint pwm_gpio_to_slice_num(uint gpio);
+void pwm_set_wrap(uint slice_num, uint16_t wrap);
+void pwm_set_chan_level(uint slice_num, uint chan, uint16_t level);
+void pwm_set_enabled(uint slice_num, bool enabled);
+
+#endif
@@ -0,0 +1,14 @@
+// Host stand-in for hardware/watchdog.h.  Nothing in a test may reboot.
+#ifndef HARDWARE_WATCHDOG_H
+#define HARDWARE_WATCHDOG_H
+
+#include "pico/stdlib.h"
+#include <stdlib.h>
+
+static inline void watchdog_reboot(uint32_t pc, uint32_t sp, uint32_t delay_ms)
+{
+    (void)pc, (void)sp, (void)delay_ms;
+    abort();
+}
+
+#endif
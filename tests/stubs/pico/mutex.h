@@ -0,0 +1,57 @@
+// Host stand-in for pico/mutex.h on a pthread mutex, so that FatFs can be
+// built thread-safe and its volume lock driven from two host threads.
+#ifndef PICO_MUTEX_H
+#define PICO_MUTEX_H
+
+#include "pico/stdlib.h"
+#include <pthread.h>
+#include <time.h>
+
+typedef struct {
+    pthread_mutex_t m;
+    bool initialized;
+} mutex_t;
+
+#define auto_init_mutex(name) static mutex_t name = { PTHREAD_MUTEX_INITIALIZER, true }
+
+static inline void mutex_init(mutex_t *mtx)
+{
+    pthread_mutex_init(&mtx->m, NULL);
+    mtx->initialized = true;
+}
+
+static inline bool mutex_is_initialized(mutex_t *mtx)
+{
+    return mtx->initialized;
+}
+
+static inline bool mutex_try_enter(mutex_t *mtx, uint32_t *owner_out)
+{
+    (void)owner_out;
+    return pthread_mutex_trylock(&mtx->m) == 0;
+}
+
+static inline bool mutex_enter_timeout_ms(mutex_t *mtx, uint32_t timeout_ms)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_sec += timeout_ms / 1000;
+    t.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (t.tv_nsec >= 1000000000) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000;
+    }
+    return pthread_mutex_timedlock(&mtx->m, &t) == 0;
+}
+
+static inline void mutex_enter_blocking(mutex_t *mtx)
+{
+    pthread_mutex_lock(&mtx->m);
+}
+
+static inline void mutex_exit(mutex_t *mtx)
+{
+    pthread_mutex_unlock(&mtx->m);
+}
+
+#endif
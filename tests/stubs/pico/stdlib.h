@@ -0,0 +1,23 @@
+// Host stand-in for the parts of the pico-sdk the tested sources use.
+// The timer reads and sleep_ms() advances the simulated clock in host.c.
+#ifndef PICO_STDLIB_H
+#define PICO_STDLIB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned int uint;
+
+uint32_t time_us_32(void);
+uint64_t time_us_64(void);
+void sleep_ms(uint32_t ms);
+
+#define GPIO_FUNC_PWM 4
+void gpio_set_function(uint gpio, int fn);
+
+#define __not_in_flash_func(f) f
+#define __time_critical_func(f) f
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+
+#endif
@@ -0,0 +1,520 @@
+// ADPCM: adpcm_decode() fed in pieces of random size, with random room
+// for its output, against a decoder written separately here a block at
+// a time from the IMA and Microsoft descriptions, for both formats in
+// mono and stereo, with a bad block and a short last block.  Then a
+// voice per format and layout, all AUDIO_VOICES of them ADPCM, play at
+// once through the simulated DMA, from the card and then from memory,
+// and come out as the reference mix, with files still opening for the
+// rest of the firmware, and a looped file of a single short block keeps
+// up at twice and four times the pitch.  Last, the decode throughput.
+//
+// Built with 16-bit PWM levels.  The decoded samples are full 16-bit
+// values, so the reference mix goes through the same quantizer.
+
+#include "audio_sim.h"
+#include "audio.h"
+#include "adpcm.h"
+#include "mixer.h"
+#include "wav.h"
+#include <string.h>
+
+#define MID 0x8000u
+#define BLOCK AUDIO_BLOCK_SAMPLES
+#define MAX_DATA 200000
+
+static FATFS *fs = &fs_storage;
+
+static const int ima_step[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767,
+};
+static const int ima_adjust[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+static const int ms_adapt[16] = {
+    230, 230, 230, 230, 307, 409, 512, 614, 768, 614, 512, 409, 307, 230, 230, 230,
+};
+static const int ms_coef1[7] = { 256, 512, 0, 192, 240, 460, 392 };
+static const int ms_coef2[7] = { 0, -256, 0, 64, 0, -208, -232 };
+
+static int sat16(int v)
+{
+    return v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+}
+
+static int s16(const uint8_t *p)
+{
+    return (int16_t)(p[0] | p[1] << 8);
+}
+
+typedef struct {
+    uint16_t format;
+    unsigned ch, align, frames;     // frames per block
+} layout_t;
+
+// IMA: the step adds up from its bits, as in the reference code.
+static int ima_sample(int *pred, int *index, int nibble)
+{
+    int step = ima_step[*index];
+    int diff = step >> 3;
+    if (nibble & 1)
+        diff += step >> 2;
+    if (nibble & 2)
+        diff += step >> 1;
+    if (nibble & 4)
+        diff += step;
+    *pred = sat16(nibble & 8 ? *pred - diff : *pred + diff);
+    *index += ima_adjust[nibble];
+    *index = *index < 0 ? 0 : *index > 88 ? 88 : *index;
+    return *pred;
+}
+
+static int ms_sample(int *s1, int *s2, int *delta, int c1, int c2, int nibble)
+{
+    int signed_nibble = nibble >= 8 ? nibble - 16 : nibble;
+    int pred = sat16((*s1 * c1 + *s2 * c2) / 256 + signed_nibble * *delta);
+    *s2 = *s1;
+    *s1 = pred;
+    *delta = (int)((int64_t)ms_adapt[nibble] * *delta / 256);
+    if (*delta < 16)
+        *delta = 16;
+    if (*delta > INT32_MAX / 768)
+        *delta = INT32_MAX / 768;
+    return pred;
+}
+
+// Decode one block of len bytes into out, interleaved.  Returns the
+// frames, 0 for a block with a bad header.
+static unsigned ref_block(const layout_t *l, const uint8_t *b, unsigned len, int16_t *out)
+{
+    unsigned ch = l->ch, n = 0;
+    if (l->format == WAV_FORMAT_IMA_ADPCM) {
+        int pred[2], index[2];
+        if (len < 4 * ch)
+            return 0;
+        for (unsigned c = 0; c < ch; c++) {
+            pred[c] = s16(b + 4 * c);
+            index[c] = b[4 * c + 2];
+            if (index[c] > 88)
+                return 0;
+            out[c] = pred[c];
+        }
+        n = 1;
+        const uint8_t *p = b + 4 * ch, *end = b + len;
+        if (ch == 1) {
+            for (; p < end && n < l->frames; p++) {
+                out[n++] = ima_sample(&pred[0], &index[0], *p & 15);
+                if (n < l->frames)
+                    out[n++] = ima_sample(&pred[0], &index[0], *p >> 4);
+            }
+        } else {
+            // 4 bytes of left, 4 of right: 8 frames
+            for (; end - p >= 8 && n < l->frames; p += 8) {
+                unsigned take = l->frames - n < 8 ? l->frames - n : 8;
+                for (unsigned c = 0; c < 2; c++) {
+                    for (unsigned i = 0; i < 8; i++) {
+                        unsigned nib = p[4 * c + i / 2] >> (i % 2 * 4) & 15;
+                        int v = ima_sample(&pred[c], &index[c], nib);
+                        if (i < take)
+                            out[2 * (n + i) + c] = v;
+                    }
+                }
+                n += take;
+            }
+        }
+        return n;
+    }
+
+    int s1[2], s2[2], delta[2], c1[2], c2[2];
+    if (len < 7 * ch)
+        return 0;
+    for (unsigned c = 0; c < ch; c++) {
+        if (b[c] > 6)
+            return 0;
+        c1[c] = ms_coef1[b[c]];
+        c2[c] = ms_coef2[b[c]];
+        delta[c] = s16(b + ch + 2 * c);
+        s1[c] = s16(b + 3 * ch + 2 * c);
+        s2[c] = s16(b + 5 * ch + 2 * c);
+        out[c] = s2[c];
+        out[ch + c] = s1[c];
+    }
+    n = 2 * ch;     // samples
+    for (const uint8_t *p = b + 7 * ch; p < b + len && n < l->frames * ch; p++) {
+        int hi = *p >> 4, lo = *p & 15;
+        unsigned c = n % ch;
+        out[n++] = ms_sample(&s1[c], &s2[c], &delta[c], c1[c], c2[c], hi);
+        c = n % ch;
+        if (n < l->frames * ch)
+            out[n++] = ms_sample(&s1[c], &s2[c], &delta[c], c1[c], c2[c], lo);
+    }
+    return n / ch;
+}
+
+// The whole stream, block by block
+static unsigned ref_decode(const layout_t *l, const uint8_t *data, unsigned len, int16_t *out)
+{
+    unsigned n = 0;
+    for (unsigned ofs = 0; ofs < len; ofs += l->align) {
+        unsigned blen = len - ofs < l->align ? len - ofs : l->align;
+        n += ref_block(l, data + ofs, blen, out + n * l->ch);
+    }
+    return n;
+}
+
+// Random data in blocks with valid headers that start from a random
+// sample, step and predictor, block bad turned into a bad one
+static void make_data(const layout_t *l, uint8_t *data, unsigned len, int bad)
+{
+    for (unsigned i = 0; i < len; i++)
+        data[i] = (uint8_t)rand();
+    for (unsigned ofs = 0, k = 0; ofs < len; ofs += l->align, k++) {
+        uint8_t *b = data + ofs;
+        unsigned ch = l->ch;
+        if (len - ofs < (l->format == WAV_FORMAT_IMA_ADPCM ? 4u : 7u) * ch)
+            break;
+        for (unsigned c = 0; c < ch; c++) {
+            if (l->format == WAV_FORMAT_IMA_ADPCM) {
+                b[4 * c + 2] = (uint8_t)(rand() % 89);
+                b[4 * c + 3] = 0;
+                if ((int)k == bad)
+                    b[4 * c + 2] = 89 + c;
+            } else {
+                int delta = 16 + rand() % 2000;
+                b[c] = (uint8_t)(rand() % 7);
+                if ((int)k == bad)
+                    b[c] = 7;
+                b[ch + 2 * c] = (uint8_t)delta;
+                b[ch + 2 * c + 1] = (uint8_t)(delta >> 8);
+            }
+        }
+    }
+}
+
+static const layout_t layouts[] = {
+    { WAV_FORMAT_IMA_ADPCM, 1, 256, 505 },
+    { WAV_FORMAT_IMA_ADPCM, 2, 512, 505 },
+    { WAV_FORMAT_IMA_ADPCM, 1, 1024, 2041 },
+    { WAV_FORMAT_IMA_ADPCM, 2, 2048, 2041 },
+    { WAV_FORMAT_IMA_ADPCM, 2, 36, 20 },        // a group short of full
+    { WAV_FORMAT_MS_ADPCM, 1, 256, 500 },
+    { WAV_FORMAT_MS_ADPCM, 2, 512, 500 },
+    { WAV_FORMAT_MS_ADPCM, 2, 1024, 1012 },
+    { WAV_FORMAT_MS_ADPCM, 1, 2048, 4084 },
+    { WAV_FORMAT_MS_ADPCM, 1, 256, 400 },       // fewer frames than fit
+};
+
+static uint8_t data[MAX_DATA];
+static int16_t ref[2 * 2 * MAX_DATA], out[2 * 2 * MAX_DATA];
+
+// Decode the way audio.c does: pieces of input, what the decoder leaves
+// carried in front of the next piece, and limited room for the output.
+static unsigned stream_decode(const layout_t *l, const uint8_t *src, unsigned len, int16_t *dst)
+{
+    adpcm_t d;
+    uint8_t buf[ADPCM_MAX_UNIT + 600];
+    unsigned carried = 0, n = 0;
+
+    adpcm_start(&d, l->format, l->ch, l->align, l->frames);
+    do {
+        unsigned take = rand() % 600;
+        if (take > len)
+            take = len;
+        memcpy(buf + carried, src, take);
+        src += take;
+        len -= take;
+        const uint8_t *p = buf;
+        unsigned left = carried + take;
+        for (unsigned room = 1 + rand() % 700;;) {
+            unsigned before = left;
+            unsigned got = adpcm_decode(&d, dst + n * l->ch, room, &p, &left);
+            n += got;
+            if (got || left != before) {
+                room = 1 + rand() % 700;
+            } else if (room < 4096) {
+                room = 4096;    // Too little room for the next unit
+            } else {
+                break;
+            }
+        }
+        CHECK(left <= ADPCM_MAX_UNIT);
+        memmove(buf, p, left);
+        carried = left;
+    } while (len);
+    return n;
+}
+
+static void test_decode(void)
+{
+    unsigned long frames = 0;
+    for (unsigned k = 0; k < count_of(layouts); k++) {
+        const layout_t *l = &layouts[k];
+        CHECK(l->frames <= adpcm_frames(l->format, l->align, l->ch));
+        for (int round = 0; round < 20; round++) {
+            unsigned blocks = 1 + rand() % (MAX_DATA / l->align - 1);
+            unsigned len = blocks * l->align + (round % 2 ? rand() % l->align : 0);
+            make_data(l, data, len, round % 3 == 0 ? (int)(rand() % blocks) : -1);
+            unsigned nref = ref_decode(l, data, len, ref);
+            unsigned n = stream_decode(l, data, len, out);
+            CHECK(n == nref);
+            CHECK(memcmp(out, ref, n * l->ch * sizeof *out) == 0);
+            frames += n;
+        }
+    }
+    printf("%lu frames of IMA and MS ADPCM match the reference decoder\n", frames);
+}
+
+// The fmt chunk of an ADPCM layout at rate
+static UINT adpcm_fmt(BYTE *f, const layout_t *l, uint32_t rate)
+{
+    UINT n = l->format == WAV_FORMAT_IMA_ADPCM ? 20 : 50;
+    uint32_t bytes = (uint32_t)((uint64_t)rate * l->align / l->frames);
+    memset(f, 0, n);
+    f[0] = (BYTE)l->format;
+    f[2] = (BYTE)l->ch;
+    memcpy(f + 4, &rate, 4);
+    memcpy(f + 8, &bytes, 4);
+    f[12] = (BYTE)l->align;
+    f[13] = (BYTE)(l->align >> 8);
+    f[14] = 4;
+    f[16] = (BYTE)(n - 18);
+    f[18] = (BYTE)l->frames;
+    f[19] = (BYTE)(l->frames >> 8);
+    if (l->format == WAV_FORMAT_MS_ADPCM) {
+        f[20] = ADPCM_MS_PREDICTORS;
+        for (int i = 0; i < ADPCM_MS_PREDICTORS; i++) {
+            int16_t c[2] = { adpcm_ms_coef[i][0], adpcm_ms_coef[i][1] };
+            memcpy(f + 22 + 4 * i, c, 4);
+        }
+    }
+    return n;
+}
+
+typedef struct {
+    int16_t *pcm;
+    unsigned frames, ch;
+    uint8_t volume;
+    uint32_t first;
+    UINT size;              // Bytes of the file
+} voice_ref_t;
+
+static voice_ref_t vref[AUDIO_VOICES];
+
+// Play the files test_play() made on every voice at once, from the card
+// or from copies in memory, and check the mix.
+static void play_all(bool mem)
+{
+    static BYTE images[AUDIO_VOICES][32768];
+    char name[16];
+    audio_stats_t st;
+    int v[AUDIO_VOICES];
+
+    if (mem) {
+        for (int k = 0; k < AUDIO_VOICES; k++) {
+            FIL fil;
+            UINT br;
+            snprintf(name, sizeof name, "adpcm%d.wav", k);
+            CHECK(f_open(&fil, name, FA_READ) == FR_OK);
+            CHECK(f_read(&fil, images[k], sizeof images[k], &br) == FR_OK);
+            CHECK(br == f_size(&fil) && br < sizeof images[k]);
+            CHECK(f_close(&fil) == FR_OK);
+            vref[k].size = br;
+        }
+    }
+
+    // Count output frames from a block boundary.
+    sim_block_start();
+    audio_reset_stats();
+    sim_nout = 0;
+    uint32_t last = 0;
+    for (int k = 0; k < AUDIO_VOICES; k++) {
+        snprintf(name, sizeof name, "adpcm%d.wav", k);
+        if (mem)
+            v[k] = audio_play_mem(images[k], vref[k].size, vref[k].volume, false);
+        else
+            v[k] = audio_play(name, vref[k].volume, false);
+        CHECK(v[k] >= 0);
+        vref[k].first = (sim_nout / BLOCK + 2) * BLOCK + 2;
+        if (vref[k].first + vref[k].frames > last)
+            last = vref[k].first + vref[k].frames;
+    }
+    // Every voice is open, and the rest of the firmware can still open a
+    // file and read it in small pieces, which starts read-ahead.
+    FIL fil;
+    UINT br;
+    CHECK(f_open(&fil, "adpcm0.wav", FA_READ) == FR_OK);
+    for (int i = 0; i < 100; i++)
+        CHECK(f_read(&fil, data, 100, &br) == FR_OK && br == 100);
+    CHECK(f_close(&fil) == FR_OK);
+
+    bool playing = true;
+    while (playing) {
+        audio_service();
+        sim_run(1000);
+        playing = false;
+        for (int k = 0; k < AUDIO_VOICES; k++)
+            playing |= audio_playing(v[k]);
+    }
+    sim_frames(2 * BLOCK);
+    audio_service();
+    audio_get_stats(&st);
+    CHECK(st.underruns == 0);
+    CHECK(sim_nout > last);
+
+    static int32_t acc[2 * BLOCK];
+    static uint32_t levels[BLOCK];
+    mixer_shaper_t ns = { { 0 }, { 0 }, { 0 } };
+    for (uint32_t b = 0; b < sim_nout; b += BLOCK) {
+        memset(acc, 0, sizeof acc);
+        for (int k = 0; k < AUDIO_VOICES; k++) {
+            voice_ref_t *r = &vref[k];
+            for (uint32_t i = 0; i < BLOCK; i++) {
+                uint32_t t = b + i;
+                if (t < r->first || t >= r->first + r->frames)
+                    continue;
+                const int16_t *s = r->pcm + (t - r->first) * r->ch;
+                acc[2 * i] += s[0] * r->volume;
+                acc[2 * i + 1] += s[r->ch - 1] * r->volume;
+            }
+        }
+        mixer_pwm_levels(levels, acc, BLOCK, &ns);
+        for (uint32_t i = 0; i < BLOCK && b + i < sim_nout; i++)
+            CHECK(sim_out[b + i] == levels[i]);
+    }
+    printf("%d ADPCM voices at once from %s, %u frames match the reference mix\n",
+           AUDIO_VOICES, mem ? "memory" : "the card", last);
+}
+
+static void test_play(void)
+{
+    static const unsigned use[AUDIO_VOICES] = { 0, 1, 5, 6, 2, 7, 3, 8 };
+    BYTE f[64];
+    char name[16];
+
+    for (int k = 0; k < AUDIO_VOICES; k++) {
+        const layout_t *l = &layouts[use[k]];
+        unsigned len = (15000 + rand() % 15000) / l->align * l->align;
+        make_data(l, data, len, -1);
+        voice_ref_t *r = &vref[k];
+        r->ch = l->ch;
+        r->pcm = malloc(len * 4 * sizeof *r->pcm);
+        CHECK(r->pcm);
+        r->frames = ref_decode(l, data, len, r->pcm);
+        r->volume = (uint8_t)(20 + 10 * k);
+        snprintf(name, sizeof name, "adpcm%d.wav", k);
+        sim_wav(name, f, adpcm_fmt(f, l, AUDIO_RATE), data, len, 0);
+    }
+    play_all(false);
+    play_all(true);
+}
+
+// A looped file of one short block, bent up in pitch so that each block
+// mixed takes the loop round several times, plays without an underrun
+// and comes out as the kernel gives it over the frames repeated, from
+// the card and from memory.
+static void test_short_loop(void)
+{
+    static const layout_t l = { WAV_FORMAT_IMA_ADPCM, 1, 36, 65 };
+    static const uint32_t pitches[] = { 2 * MIXER_STEP_ONE, 4 * MIXER_STEP_ONE };
+    enum { BLOCKS = 40, REPEATS = BLOCKS * BLOCK * AUDIO_MAX_STEP / 65 + 2 };
+    static int16_t pcm[65], z[3 + REPEATS * 65];
+    static int32_t acc[2 * BLOCK];
+    static uint32_t levels[BLOCK];
+    BYTE f[64], image[128];
+    audio_stats_t st;
+    FIL fil;
+    UINT size;
+
+    make_data(&l, data, l.align, -1);
+    CHECK(ref_decode(&l, data, l.align, pcm) == 65);
+    for (unsigned i = 0; i < REPEATS * 65; i++)
+        z[3 + i] = pcm[i % 65];
+    sim_wav("loop.wav", f, adpcm_fmt(f, &l, AUDIO_RATE), data, l.align, 0);
+    CHECK(f_open(&fil, "loop.wav", FA_READ) == FR_OK);
+    CHECK(f_read(&fil, image, sizeof image, &size) == FR_OK && size < sizeof image);
+    CHECK(f_close(&fil) == FR_OK);
+
+    for (unsigned k = 0; k < 2 * count_of(pitches); k++) {
+        uint32_t pitch = pitches[k % count_of(pitches)];
+        bool mem = k >= count_of(pitches);
+        sim_block_start();
+        audio_reset_stats();
+        sim_nout = 0;
+        uint32_t reads = disk_stats.reads;
+        int v = mem ? audio_play_mem(image, size, 255, true) : audio_play("loop.wav", 255, true);
+        CHECK(v >= 0);
+        audio_set_pitch(v, pitch);
+        uint32_t first = (sim_nout / BLOCK + 2) * BLOCK;
+        while (sim_nout < first + BLOCKS * BLOCK) {
+            audio_service();
+            sim_run(1000);
+        }
+        audio_stop_voice(v);
+        audio_get_stats(&st);
+        CHECK(st.underruns == 0);
+        CHECK(!mem || disk_stats.reads == reads);
+
+        mixer_shaper_t ns = { { 0 }, { 0 }, { 0 } };
+        uint64_t pos = 0;
+        for (uint32_t b = first; b < first + BLOCKS * BLOCK; b += BLOCK) {
+            memset(acc, 0, sizeof acc);
+            const int16_t *s = z + 1 + (pos >> 16);
+            if (AUDIO_CUBIC)
+                mixer_resample_cubic(acc, s, 1, BLOCK, pos & 0xffff, pitch, 255);
+            else
+                mixer_resample_linear(acc, s, 1, BLOCK, pos & 0xffff, pitch, 255);
+            pos += (uint64_t)BLOCK * pitch;
+            mixer_pwm_levels(levels, acc, BLOCK, &ns);
+            for (uint32_t i = 0; i < BLOCK; i++)
+                CHECK(sim_out[b + i] == levels[i]);
+        }
+        printf("65-frame ADPCM loop from %s at %ux pitch: %u frames match the kernel\n",
+               mem ? "memory" : "the card", pitch / MIXER_STEP_ONE, BLOCKS * BLOCK);
+    }
+}
+
+// Frames decoded per second on this machine, in segment-sized pieces as
+// audio.c asks for them
+static void bench(void)
+{
+    static const unsigned which[] = { 0, 1, 5, 6 };
+    static int16_t seg[AUDIO_SEGMENT_SAMPLES];
+
+    for (unsigned k = 0; k < count_of(which); k++) {
+        const layout_t *l = &layouts[which[k]];
+        unsigned len = MAX_DATA / l->align * l->align;
+        make_data(l, data, len, -1);
+        unsigned long frames = 0;
+        double t = wall_seconds();
+        for (int pass = 0; pass < 20; pass++) {
+            adpcm_t d;
+            const uint8_t *p = data;
+            unsigned left = len, got;
+            adpcm_start(&d, l->format, l->ch, l->align, l->frames);
+            while ((got = adpcm_decode(&d, seg, AUDIO_SEGMENT_SAMPLES / l->ch, &p, &left)))
+                frames += got;
+        }
+        t = wall_seconds() - t;
+        printf("%s %s: %.1f M frames/s, %.0fx real time at %u Hz\n",
+               l->format == WAV_FORMAT_IMA_ADPCM ? "IMA" : "MS ", l->ch == 2 ? "stereo" : "mono  ",
+               frames / t / 1e6, frames / t / AUDIO_RATE, AUDIO_RATE);
+        CHECK(seg[0] != 0x7fff || seg[1] != 0x7fff);
+    }
+}
+
+int main(void)
+{
+    CHECK(host_format(fs, 131072, FM_FAT, 4096) == FR_OK);
+    srand(49);
+    test_decode();
+    sim_init(3 * AUDIO_RATE);
+    audio_init();
+    test_play();
+    test_short_loop();
+    audio_stop();
+    bench();
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Borrowed reads: the data lent by f_borrow() and f_borrowsect(), the
+// calls refused while data is lent, and dirty sectors of a file open for
+// writing.
+
+#include "host.h"
+#include <string.h>
+
+#define FILE_SIZE 100003
+
+static FATFS fs;
+static FIL fil;
+static BYTE data[FILE_SIZE];
+static BYTE out[FILE_SIZE];
+static BYTE cbuf[8 * FF_MAX_SS];
+static BYTE dma[4 * FF_MAX_SS] __attribute__((aligned(4)));
+
+static void test_borrow(UINT nsect)
+{
+    const BYTE *p;
+    UINT br, bw;
+    FSIZE_t off = 0;
+
+    CHECK(f_open(&fil, "DATA.BIN", FA_READ) == FR_OK);
+    if (nsect)
+        CHECK(f_setbuf(&fil, cbuf, nsect) == FR_OK);
+    for (int calls = 0; ; calls++) {
+        CHECK(f_borrow(&fil, &p, 3000, &br) == FR_OK);
+        if (br == 0)
+            break;
+        CHECK(br <= (nsect ? nsect : 1) * FF_MAX_SS);
+        memcpy(&out[off], p, br);
+        off += br;
+        if (calls == 3) {
+            CHECK(f_read(&fil, out, 1, &bw) == FR_LOCKED);
+            CHECK(f_lseek(&fil, 0) == FR_LOCKED);
+            CHECK(f_borrow(&fil, &p, 1, &bw) == FR_LOCKED);
+            CHECK(f_setbuf(&fil, NULL, 0) == FR_LOCKED);
+            CHECK(f_close(&fil) == FR_LOCKED);
+        }
+        CHECK(f_release(&fil) == FR_OK);
+    }
+    CHECK(f_release(&fil) == FR_INVALID_PARAMETER);
+    CHECK(f_close(&fil) == FR_OK);
+    CHECK(off == FILE_SIZE && memcmp(out, data, FILE_SIZE) == 0);
+}
+
+// Borrows and reads take turns on the same file pointer.
+static void test_mixed(void)
+{
+    const BYTE *p;
+    UINT br;
+    FSIZE_t off = 0;
+
+    CHECK(f_open(&fil, "DATA.BIN", FA_READ) == FR_OK);
+    CHECK(f_setbuf(&fil, cbuf, 5) == FR_OK);
+    for (int k = 0; off < FILE_SIZE; k++) {
+        if (k & 1) {
+            CHECK(f_read(&fil, &out[off], 77, &br) == FR_OK);
+        } else {
+            CHECK(f_borrow(&fil, &p, 1000, &br) == FR_OK);
+            memcpy(&out[off], p, br);
+            CHECK(f_release(&fil) == FR_OK);
+        }
+        CHECK(br > 0);
+        off += br;
+    }
+    CHECK(f_close(&fil) == FR_OK);
+    CHECK(off == FILE_SIZE && memcmp(out, data, FILE_SIZE) == 0);
+}
+
+static void test_borrowsect(void)
+{
+    const BYTE *p;
+    UINT br;
+    FSIZE_t off = 0;
+
+    CHECK(f_open(&fil, "DATA.BIN", FA_READ) == FR_OK);
+    CHECK(f_lseek(&fil, 1) == FR_OK);
+    CHECK(f_borrowsect(&fil, dma, 4, &p, &br) == FR_INVALID_PARAMETER);
+    CHECK(f_lseek(&fil, 0) == FR_OK);
+    for (;;) {
+        CHECK(f_borrowsect(&fil, dma, 4, &p, &br) == FR_OK);
+        if (br == 0)
+            break;
+        CHECK(p == dma);
+        memcpy(&out[off], p, br);
+        off += br;
+        CHECK(f_release(&fil) == FR_OK);
+    }
+    CHECK(off == FILE_SIZE && memcmp(out, data, FILE_SIZE) == 0);
+
+    // The partial last sector is still readable afterwards.
+    CHECK(f_lseek(&fil, FILE_SIZE - 100) == FR_OK);
+    CHECK(f_read(&fil, out, 50, &br) == FR_OK && br == 50);
+    CHECK(memcmp(out, &data[FILE_SIZE - 100], 50) == 0);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+// Data written but not yet flushed is what a borrow sees.
+static void test_dirty(void)
+{
+    const BYTE *p;
+    UINT br, bw;
+
+    CHECK(f_open(&fil, "DATA.BIN", FA_READ|FA_WRITE) == FR_OK);
+    CHECK(f_lseek(&fil, 600) == FR_OK);
+    CHECK(f_write(&fil, "HELLO", 5, &bw) == FR_OK);
+    CHECK(f_lseek(&fil, 0) == FR_OK);
+    CHECK(f_borrowsect(&fil, dma, 4, &p, &br) == FR_OK);
+    CHECK(memcmp(&p[600], "HELLO", 5) == 0);
+    CHECK(f_write(&fil, "x", 1, &bw) == FR_LOCKED);
+    CHECK(f_release(&fil) == FR_OK);
+
+    CHECK(f_lseek(&fil, 598) == FR_OK);
+    CHECK(f_borrow(&fil, &p, 10, &br) == FR_OK && br == 10);
+    CHECK(memcmp(&p[2], "HELLO", 5) == 0);
+    CHECK(f_release(&fil) == FR_OK);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+int main(void)
+{
+    UINT bw;
+
+    CHECK(host_format(&fs, 131072, FM_FAT, 8192) == FR_OK);
+    srand(29);
+    for (int i = 0; i < FILE_SIZE; i++)
+        data[i] = (BYTE)rand();
+    CHECK(f_open(&fil, "DATA.BIN", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(&fil, data, FILE_SIZE, &bw) == FR_OK && bw == FILE_SIZE);
+    CHECK(f_close(&fil) == FR_OK);
+
+    test_borrow(0);
+    test_borrow(8);
+    test_mixed();
+    test_borrowsect();
+    test_dirty();
+    return 0;
+}
@@ -0,0 +1,95 @@
+// DMA-paced output: the timer runs the output at AUDIO_RATE, the CPU is
+// interrupted once per block, the values land in the CC register of the
+// audio slice, the output rests at the midpoint when nothing plays, and
+// a sound is neither cut short at its end nor left running when stopped.
+
+#include "audio_sim.h"
+#include "audio.h"
+#include <math.h>
+#include <string.h>
+
+#define NSAMPLES 20000
+#define MID (0x8000u << 16 | 0x8000u)
+
+static FATFS *fs = &fs_storage;
+static int16_t data[NSAMPLES];
+
+static void test_pacing(void)
+{
+    double rate = (double)sim_clk_hz * sim_timer_x / sim_timer_y;
+    printf("DMA timer %u/%u of %u Hz: %.3f Hz\n", sim_timer_x, sim_timer_y, sim_clk_hz, rate);
+    CHECK(fabs(rate - AUDIO_RATE) / AUDIO_RATE < 1e-6);
+
+    // Ten seconds of silence: every tick writes a value, and the CPU
+    // sees one interrupt per block.
+    uint32_t irqs = sim_irqs;
+    sim_nout = 0;
+    sim_run(10000000);
+    printf("%u values and %u interrupts in 10 s\n", sim_nout, sim_irqs - irqs);
+    CHECK(sim_nout >= 10 * AUDIO_RATE - 1 && sim_nout <= 10 * AUDIO_RATE + 1);
+    CHECK(sim_irqs - irqs == sim_nout / AUDIO_BLOCK_SAMPLES
+            || sim_irqs - irqs == sim_nout / AUDIO_BLOCK_SAMPLES + 1);
+    for (uint32_t i = 0; i < sim_nout; i++)
+        CHECK(sim_out[i] == MID);
+    CHECK(pwm_hw->slice[pwm_gpio_to_slice_num(6)].cc == MID);
+}
+
+// Both halves of CC carry a mono file, and the last sample goes out
+// even when the voice is stopped as soon as it has been mixed.
+static void test_end(void)
+{
+    sim_nout = 0;
+    int v = audio_play("short.wav", 255, false);
+    CHECK(v >= 0);
+    while (audio_playing(v)) {
+        audio_service();
+        sim_run(1000);
+    }
+    audio_stop();
+    sim_frames(2 * AUDIO_BLOCK_SAMPLES);
+
+    uint32_t i = 0, j = 0;
+    while (sim_out[i] == MID)
+        i++;
+    for (; j < NSAMPLES; i++, j++) {
+        CHECK(sim_out[i] >> 16 == (sim_out[i] & 0xffff));
+        CHECK((sim_out[i] & 0xffff) == (uint32_t)(data[j] / 256 * 255 + 0x8000));
+    }
+    for (; i < sim_nout; i++)
+        CHECK(sim_out[i] == MID);
+}
+
+// Stopped in the middle, the voice is gone within the two blocks that
+// were already rendered.
+static void test_stop(void)
+{
+    int v = audio_play("short.wav", 255, true);
+    CHECK(v >= 0);
+    sim_frames(3000);
+    audio_stop_voice(v);
+    CHECK(!audio_playing(v));
+    sim_nout = 0;
+    sim_frames(4 * AUDIO_BLOCK_SAMPLES);
+    for (uint32_t i = 2 * AUDIO_BLOCK_SAMPLES; i < sim_nout; i++)
+        CHECK(sim_out[i] == MID);
+}
+
+int main(void)
+{
+    BYTE fmt[16];
+
+    CHECK(host_format(fs, 65536, FM_FAT, 4096) == FR_OK);
+    srand(42);
+    for (int i = 0; i < NSAMPLES; i++)
+        data[i] = (int16_t)((rand() % 255 - 127) * 256);
+    data[0] = 100 * 256;
+    sim_wav("short.wav", fmt, sim_pcm_fmt(fmt, 1, AUDIO_RATE, 16), data, sizeof data, 0);
+    CHECK(f_mount(NULL, "", 0) == FR_OK);
+
+    sim_init(11 * AUDIO_RATE);
+    audio_init();
+    test_pacing();
+    test_end();
+    test_stop();
+    return 0;
+}
@@ -0,0 +1,200 @@
+// The DSP kernels of mixer.c against its plain C ones: this file builds
+// mixer.c a second time with __ARM_FEATURE_DSP and the intrinsic models
+// of tests/acle, under dsp_* names, and both versions must give the same
+// accumulators and levels for odd lengths, unaligned sources, extreme
+// samples, every gain and positions stepping up to AUDIO_MAX_STEP.  Then
+// the resamplers are checked for what they must keep exactly, and the
+// plain C kernels are timed.
+
+#define mixer_add_mono dsp_add_mono
+#define mixer_add_stereo dsp_add_stereo
+#define mixer_resample_linear dsp_resample_linear
+#define mixer_resample_cubic dsp_resample_cubic
+#define mixer_pwm_levels dsp_pwm_levels
+#define __ARM_FEATURE_DSP 1
+#include "../src/mixer.c"
+#undef __ARM_FEATURE_DSP
+#undef mixer_add_mono
+#undef mixer_add_stereo
+#undef mixer_resample_linear
+#undef mixer_resample_cubic
+#undef mixer_pwm_levels
+
+// The plain C versions, linked from mixer.c
+void mixer_add_mono(int32_t *acc, const int16_t *src, unsigned n, int32_t gain);
+void mixer_add_stereo(int32_t *acc, const int16_t *src, unsigned n, int32_t gain);
+void mixer_resample_linear(int32_t *acc, const int16_t *src, unsigned ch, unsigned n,
+        uint32_t pos, uint32_t step, int32_t gain);
+void mixer_resample_cubic(int32_t *acc, const int16_t *src, unsigned ch, unsigned n,
+        uint32_t pos, uint32_t step, int32_t gain);
+void mixer_pwm_levels(uint32_t *dst, const int32_t *acc, unsigned n, mixer_shaper_t *ns);
+
+#include "audio.h"
+#include "host.h"
+
+#define N 300
+#define SRC_FRAMES (N * AUDIO_MAX_STEP + 8)
+
+static int16_t src[2 * SRC_FRAMES + 2];
+static int32_t acc[2 * N], dsp[2 * N];
+
+static int16_t sample(void)
+{
+    int r = rand() % 8;
+    return r == 0 ? -32768 : r == 1 ? 32767 : (int16_t)rand();
+}
+
+static void fill(unsigned len)
+{
+    for (unsigned i = 0; i < len; i++)
+        src[i] = sample();
+}
+
+static void start(void)
+{
+    for (unsigned i = 0; i < 2 * N; i++)
+        acc[i] = dsp[i] = rand() - RAND_MAX / 2;
+}
+
+static void same(unsigned n)
+{
+    for (unsigned i = 0; i < 2 * n; i++)
+        CHECK(acc[i] == dsp[i]);
+}
+
+static void test_add(void)
+{
+    for (int round = 0; round < 20000; round++) {
+        unsigned n = 1 + rand() % N;
+        const int16_t *s = src + rand() % 2;
+        int32_t gain = rand() % (MIXER_UNITY + 1);
+        fill(2 * n + 1);
+        start();
+        mixer_add_mono(acc, s, n, gain);
+        dsp_add_mono(dsp, s, n, gain);
+        same(n);
+        mixer_add_stereo(acc, s, n, gain);
+        dsp_add_stereo(dsp, s, n, gain);
+        same(n);
+    }
+}
+
+typedef void resample_fn(int32_t *, const int16_t *, unsigned, unsigned, uint32_t, uint32_t,
+        int32_t);
+
+static void test_resample(void)
+{
+    static resample_fn *const c[] = { mixer_resample_linear, mixer_resample_cubic };
+    static resample_fn *const d[] = { dsp_resample_linear, dsp_resample_cubic };
+    long frames = 0;
+
+    for (int round = 0; round < 20000; round++) {
+        unsigned ch = 1 + rand() % 2;
+        unsigned n = 1 + rand() % N;
+        uint32_t step = rand() % 4 ? 1 + rand() % (AUDIO_MAX_STEP * MIXER_STEP_ONE)
+                : rand() % 2 ? MIXER_STEP_ONE : AUDIO_MAX_STEP * MIXER_STEP_ONE;
+        uint32_t pos = rand() % (2 * MIXER_STEP_ONE);
+        // src[-ch] is read, and the source is unaligned half the time
+        const int16_t *s = src + 2 + rand() % 2;
+        fill(count_of(src));
+        for (int k = 0; k < 2; k++) {
+            int32_t gain = rand() % (MIXER_UNITY + 1);
+            start();
+            c[k](acc, s, ch, n, pos, step, gain);
+            d[k](dsp, s, ch, n, pos, step, gain);
+            same(n);
+        }
+        frames += 2 * n;
+    }
+    printf("%ld resampled frames the same in both versions\n", frames);
+}
+
+static void test_levels(void)
+{
+    static uint32_t out[N], out_dsp[N];
+
+    for (int round = 0; round < 5000; round++) {
+        unsigned n = 1 + rand() % N;
+        mixer_shaper_t ns, ns_dsp;
+        for (int c = 0; c < 2; c++) {
+            ns.e1[c] = rand() % (1 << LEVEL_SHIFT);
+            ns.e2[c] = rand() % (1 << LEVEL_SHIFT);
+            ns.quiet[c] = rand() % (SILENT_RUN + 2);
+        }
+        ns_dsp = ns;
+        // Up to eight full-scale voices, so both ends clip, and in some
+        // rounds silence from a frame on
+        unsigned cut = rand() % 4 ? 2 * n : rand() % (2 * n);
+        for (unsigned i = 0; i < 2 * n; i++) {
+            int32_t a = (rand() % 0x1000001 - 0x800000) * (1 + rand() % 8);
+            acc[i] = i < cut && rand() % 16 ? a : 0;
+        }
+        mixer_pwm_levels(out, acc, n, &ns);
+        dsp_pwm_levels(out_dsp, acc, n, &ns_dsp);
+        CHECK(memcmp(out, out_dsp, n * sizeof *out) == 0);
+        CHECK(memcmp(&ns, &ns_dsp, sizeof ns) == 0);
+    }
+}
+
+// A constant comes through both interpolations unchanged at any
+// position, and a whole position gives the source sample.
+static void test_exact(void)
+{
+    for (int round = 0; round < 2000; round++) {
+        unsigned ch = 1 + rand() % 2;
+        int16_t v = sample();
+        uint32_t step = 1 + rand() % (AUDIO_MAX_STEP * MIXER_STEP_ONE);
+        for (unsigned i = 0; i < count_of(src); i++)
+            src[i] = v;
+        memset(acc, 0, sizeof acc);
+        mixer_resample_linear(acc, src + 2, ch, N, rand() % MIXER_STEP_ONE, step, MIXER_UNITY);
+        mixer_resample_cubic(acc, src + 2, ch, N, rand() % MIXER_STEP_ONE, step, MIXER_UNITY);
+        for (unsigned i = 0; i < 2 * N; i++)
+            CHECK(acc[i] == 2 * v * MIXER_UNITY);
+
+        fill(count_of(src));
+        memset(acc, 0, sizeof acc);
+        mixer_resample_cubic(acc, src + 2, ch, N / 2, 0, 2 * MIXER_STEP_ONE, 1);
+        for (unsigned i = 0; i < N / 2; i++) {
+            const int16_t *f = src + 2 + 2 * i * ch;
+            CHECK(acc[2 * i] == f[0] && acc[2 * i + 1] == f[ch - 1]);
+        }
+    }
+}
+
+// Nanoseconds per output frame of the plain C kernels on this machine,
+// to compare the kernels with one another.
+static void bench(void)
+{
+    static const char *const names[] = { "linear", "cubic" };
+    static resample_fn *const c[] = { mixer_resample_linear, mixer_resample_cubic };
+    const int blocks = 20000;
+
+    fill(count_of(src));
+    for (unsigned ch = 1; ch <= 2; ch++) {
+        double t = wall_seconds();
+        for (int b = 0; b < blocks; b++)
+            ch == 2 ? mixer_add_stereo(acc, src, N, 100) : mixer_add_mono(acc, src, N, 100);
+        printf("%s add     %5.2f ns/frame\n", ch == 2 ? "stereo" : "mono  ",
+               (wall_seconds() - t) * 1e9 / blocks / N);
+        for (int k = 0; k < 2; k++) {
+            t = wall_seconds();
+            for (int b = 0; b < blocks; b++)
+                c[k](acc, src + 2, ch, N, b & 0xffff, 0x1a3c5, 100);
+            printf("%s %-7s %5.2f ns/frame\n", ch == 2 ? "stereo" : "mono  ", names[k],
+                   (wall_seconds() - t) * 1e9 / blocks / N);
+        }
+    }
+    CHECK(acc[0] != 0x7fffffff);
+}
+
+int main(void)
+{
+    srand(45);
+    test_add();
+    test_resample();
+    test_levels();
+    test_exact();
+    bench();
+    return 0;
+}
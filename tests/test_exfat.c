@@ -0,0 +1,202 @@
+// exFAT contiguous files (NoFatChain): reads that cross cluster
+// boundaries go to the card in one command, seeks never touch the FAT,
+// and f_expand() lays files out that way.  The same 3 MB file on FAT32
+// with the same 4 KB clusters is the reference for the card reads.
+// Appending to a contiguous file that cannot stay contiguous turns it
+// into a chain that reads back intact after a remount.
+
+#include "host.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define SECTORS 1048576         // 512 MB, enough clusters for FAT32
+#define CLUSTER 4096
+#define FILE_SIZE (3 * 1024 * 1024)
+#define CHUNK (64 * 1024)
+
+static FATFS fs;
+static FIL fil;
+static BYTE data[FILE_SIZE];
+static BYTE out[FILE_SIZE];
+
+typedef struct {
+    uint32_t seq_reads;         // reading the file in CHUNK requests
+    uint32_t seek_reads;        // sector aligned seeks alone
+    uint32_t random_reads;      // random seek and read pairs
+} result_t;
+
+// Card reads of sequential and random access to DATA.BIN
+static void measure(result_t *r, bool nochain)
+{
+    UINT br;
+
+    CHECK(f_open(&fil, "DATA.BIN", FA_READ) == FR_OK);
+    CHECK(nochain == (fil.obj.stat == 2));
+    uint32_t reads = disk_stats.reads, sectors = disk_stats.read_sectors;
+    for (FSIZE_t off = 0; off < FILE_SIZE; off += br)
+        CHECK(f_read(&fil, &out[off], CHUNK, &br) == FR_OK && br == CHUNK);
+    r->seq_reads = disk_stats.reads - reads;
+    CHECK(memcmp(out, data, FILE_SIZE) == 0);
+    // Nothing but the file itself, whole clusters at a time
+    if (nochain)
+        CHECK(disk_stats.read_sectors - sectors == FILE_SIZE / FF_MAX_SS);
+
+    srand(32);
+    reads = disk_stats.reads;
+    for (int i = 0; i < 1000; i++) {
+        FSIZE_t ofs = (FSIZE_t)(rand() % (FILE_SIZE / FF_MAX_SS)) * FF_MAX_SS;
+        CHECK(f_lseek(&fil, ofs) == FR_OK && f_tell(&fil) == ofs);
+    }
+    r->seek_reads = disk_stats.reads - reads;
+
+    reads = disk_stats.reads;
+    for (int i = 0; i < 3000; i++) {
+        FSIZE_t ofs = (FSIZE_t)rand() % FILE_SIZE;
+        UINT len = (UINT)rand() % (3 * CLUSTER);
+        UINT want = ofs + len > FILE_SIZE ? (UINT)(FILE_SIZE - ofs) : len;
+        CHECK(f_lseek(&fil, ofs) == FR_OK);
+        CHECK(f_read(&fil, out, len, &br) == FR_OK);
+        CHECK(br == want && memcmp(out, &data[ofs], br) == 0);
+    }
+    r->random_reads = disk_stats.reads - reads;
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+// Reads across every kind of cluster boundary of a contiguous file
+static void test_cross(void)
+{
+    static const UINT lens[] = { 1, 511, 512, 513, CLUSTER - 1, CLUSTER, CLUSTER + 1,
+                                 3 * CLUSTER + 700, CHUNK };
+    UINT br;
+
+    CHECK(f_open(&fil, "DATA.BIN", FA_READ) == FR_OK);
+    CHECK(f_readahead(&fil, 0) == FR_OK);
+    for (unsigned i = 0; i < sizeof lens / sizeof lens[0]; i++) {
+        for (int back = 1; back <= 2 * FF_MAX_SS + 1; back += FF_MAX_SS / 2) {
+            FSIZE_t ofs = 7 * CLUSTER - back;
+            CHECK(f_lseek(&fil, ofs) == FR_OK);
+            uint32_t reads = disk_stats.reads;
+            CHECK(f_read(&fil, out, lens[i], &br) == FR_OK && br == lens[i]);
+            CHECK(memcmp(out, &data[ofs], br) == 0);
+            // A head sector, the whole sectors and a tail sector at most,
+            // wherever the clusters change.
+            CHECK(disk_stats.reads - reads <= 3);
+        }
+    }
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+static void put_data(void)
+{
+    UINT bw;
+    CHECK(f_open(&fil, "DATA.BIN", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(&fil, data, FILE_SIZE, &bw) == FR_OK && bw == FILE_SIZE);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+// f_expand() on exFAT: the area is contiguous, the file is marked so on
+// the card, and it reads back after a remount without the FAT.
+static void test_expand(void)
+{
+    UINT bw, br;
+
+    CHECK(f_open(&fil, "EXP.BIN", FA_READ|FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_expand(&fil, 100 * CLUSTER, 1) == FR_OK);
+    CHECK(fil.obj.stat == 2 && f_size(&fil) == 100 * CLUSTER);
+    DWORD first = fil.obj.sclust;
+    CHECK(f_write(&fil, data, 100 * CLUSTER, &bw) == FR_OK && bw == 100 * CLUSTER);
+    CHECK(fil.obj.stat == 2 && fil.obj.sclust == first);
+    // Seeking past the end grows it in place while the clusters after it
+    // are free.
+    CHECK(f_lseek(&fil, 103 * CLUSTER) == FR_OK && f_size(&fil) == 103 * CLUSTER);
+    CHECK(fil.obj.stat == 2);
+    CHECK(f_close(&fil) == FR_OK);
+
+    CHECK(f_mount(&fs, "", 1) == FR_OK);
+    CHECK(f_open(&fil, "EXP.BIN", FA_READ) == FR_OK);
+    CHECK(fil.obj.stat == 2 && fil.obj.sclust == first && f_size(&fil) == 103 * CLUSTER);
+    CHECK(f_lseek(&fil, 99 * CLUSTER + 5) == FR_OK);
+    uint32_t reads = disk_stats.reads;
+    CHECK(f_read(&fil, out, CLUSTER - 5, &br) == FR_OK && br == CLUSTER - 5);
+    CHECK(memcmp(out, &data[99 * CLUSTER + 5], br) == 0);
+    CHECK(disk_stats.reads - reads <= 2);
+    CHECK(f_close(&fil) == FR_OK);
+
+    // A second expand, or one on a file with data, is refused.
+    CHECK(f_open(&fil, "EXP.BIN", FA_WRITE) == FR_OK);
+    CHECK(f_expand(&fil, CLUSTER, 1) == FR_DENIED);
+    CHECK(f_close(&fil) == FR_OK);
+    CHECK(f_unlink("EXP.BIN") == FR_OK);
+}
+
+// A contiguous file with another file right behind it has to go on
+// elsewhere: it becomes a FAT chain.
+static void test_fragment(void)
+{
+    FIL other;
+    UINT bw, br;
+
+    CHECK(f_open(&fil, "FRAG.BIN", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_expand(&fil, 10 * CLUSTER, 1) == FR_OK);
+    CHECK(f_write(&fil, data, 10 * CLUSTER, &bw) == FR_OK && bw == 10 * CLUSTER);
+    CHECK(f_open(&other, "BEHIND.BIN", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(&other, data, CLUSTER, &bw) == FR_OK && bw == CLUSTER);
+    CHECK(other.obj.sclust == fil.obj.sclust + 10);
+    CHECK(f_close(&other) == FR_OK);
+    CHECK(f_write(&fil, &data[10 * CLUSTER], 3 * CLUSTER + 100, &bw) == FR_OK);
+    CHECK(bw == 3 * CLUSTER + 100);
+    CHECK(fil.obj.stat == 3);
+    CHECK(f_close(&fil) == FR_OK);
+
+    CHECK(f_mount(&fs, "", 1) == FR_OK);
+    CHECK(f_open(&fil, "FRAG.BIN", FA_READ) == FR_OK);
+    CHECK(fil.obj.stat == 0 && f_size(&fil) == 13 * CLUSTER + 100);
+    CHECK(f_read(&fil, out, FILE_SIZE, &br) == FR_OK && br == 13 * CLUSTER + 100);
+    CHECK(memcmp(out, data, br) == 0);
+    CHECK(f_lseek(&fil, 9 * CLUSTER + 17) == FR_OK);
+    CHECK(f_read(&fil, out, 2 * CLUSTER, &br) == FR_OK && br == 2 * CLUSTER);
+    CHECK(memcmp(out, &data[9 * CLUSTER + 17], br) == 0);
+    CHECK(f_close(&fil) == FR_OK);
+    CHECK(f_open(&fil, "BEHIND.BIN", FA_READ) == FR_OK);
+    CHECK(f_read(&fil, out, FILE_SIZE, &br) == FR_OK && br == CLUSTER);
+    CHECK(memcmp(out, data, br) == 0);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+int main(void)
+{
+    result_t fat32, exfat;
+
+    srand(3200);
+    for (int i = 0; i < FILE_SIZE; i++)
+        data[i] = (BYTE)rand();
+
+    CHECK(host_format(&fs, SECTORS, FM_FAT32, CLUSTER) == FR_OK);
+    CHECK(fs.fs_type == FS_FAT32);
+    put_data();
+    CHECK(f_mount(&fs, "", 1) == FR_OK);
+    measure(&fat32, false);
+
+    CHECK(host_format(&fs, SECTORS, FM_EXFAT, CLUSTER) == FR_OK);
+    CHECK(fs.fs_type == FS_EXFAT);
+    put_data();
+    CHECK(f_mount(&fs, "", 1) == FR_OK);
+    measure(&exfat, true);
+
+    printf("3 MB in %u KB reads: %u card reads on FAT32, %u on exFAT\n", CHUNK / 1024,
+           fat32.seq_reads, exfat.seq_reads);
+    printf("1000 seeks: %u card reads on FAT32, %u on exFAT\n", fat32.seek_reads,
+           exfat.seek_reads);
+    printf("3000 seek and read pairs: %u card reads on FAT32, %u on exFAT\n",
+           fat32.random_reads, exfat.random_reads);
+    // FAT32 reads a cluster per command, and the FAT besides.
+    CHECK(fat32.seq_reads > FILE_SIZE / CLUSTER);
+    CHECK(exfat.seq_reads == FILE_SIZE / CHUNK);
+    CHECK(exfat.seek_reads == 0 && fat32.seek_reads > 0);
+    CHECK(exfat.random_reads < fat32.random_reads);
+
+    test_cross();
+    test_expand();
+    test_fragment();
+    return 0;
+}
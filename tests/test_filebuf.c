@@ -0,0 +1,95 @@
+// Multi-sector read buffers: the disk_read() calls saved for short
+// sequential reads, and correct data under random seeks while buffers
+// are attached, resized and detached.
+
+#include "host.h"
+#include <string.h>
+
+#define FILE_SIZE 200000
+
+static FATFS fs;
+static FIL fil;
+static BYTE data[FILE_SIZE];
+static BYTE out[FILE_SIZE];
+static BYTE cbuf[8 * FF_MAX_SS];
+
+// Read the whole file in pieces of len bytes and return the number of
+// disk_read() calls it took.
+static uint32_t read_all(UINT len, UINT nsect)
+{
+    FSIZE_t off = 0;
+    UINT br;
+
+    CHECK(f_open(&fil, "DATA.BIN", FA_READ) == FR_OK);
+    if (nsect)
+        CHECK(f_setbuf(&fil, cbuf, nsect) == FR_OK);
+    uint32_t reads = disk_stats.reads;
+    do {
+        CHECK(f_read(&fil, &out[off], len, &br) == FR_OK);
+        off += br;
+    } while (br);
+    reads = disk_stats.reads - reads;
+    CHECK(f_close(&fil) == FR_OK);
+    CHECK(off == FILE_SIZE && memcmp(out, data, FILE_SIZE) == 0);
+    return reads;
+}
+
+static void test_sequential(void)
+{
+    static const UINT lens[] = { 1, 100, 777, 4096 };
+    const uint32_t sectors = (FILE_SIZE + FF_MAX_SS - 1) / FF_MAX_SS;
+
+    for (unsigned i = 0; i < sizeof lens / sizeof lens[0]; i++) {
+        uint32_t plain = read_all(lens[i], 0);
+        uint32_t buffered = read_all(lens[i], 8);
+        printf("%4u B reads: %3u disk reads, %3u with an 8 sector buffer\n",
+               lens[i], plain, buffered);
+        // One fill per 8 sectors, plus the FAT sectors of the chain.
+        CHECK(buffered <= sectors / 8 + 4);
+    }
+}
+
+static void test_random(void)
+{
+    UINT br;
+
+    CHECK(f_open(&fil, "DATA.BIN", FA_READ) == FR_OK);
+    CHECK(f_setbuf(&fil, cbuf, 8) == FR_OK);
+    for (int i = 0; i < 20000; i++) {
+        UINT ofs = (UINT)rand() % FILE_SIZE;
+        UINT len = (UINT)rand() % 1500;
+        UINT want = ofs + len > FILE_SIZE ? FILE_SIZE - ofs : len;
+        CHECK(f_lseek(&fil, ofs) == FR_OK);
+        CHECK(f_read(&fil, out, len, &br) == FR_OK);
+        CHECK(br == want && memcmp(out, &data[ofs], br) == 0);
+        if (i == 5000)
+            CHECK(f_setbuf(&fil, NULL, 0) == FR_OK);
+        if (i == 10000)
+            CHECK(f_setbuf(&fil, cbuf, 3) == FR_OK);
+        if (i == 15000)
+            CHECK(f_setbuf(&fil, NULL, 4) == FR_OK); // from the pool
+    }
+    CHECK(f_close(&fil) == FR_OK);
+
+    // Only read-only files take a buffer.
+    CHECK(f_open(&fil, "DATA.BIN", FA_READ|FA_WRITE) == FR_OK);
+    CHECK(f_setbuf(&fil, cbuf, 8) == FR_DENIED);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+int main(void)
+{
+    UINT bw;
+
+    CHECK(host_format(&fs, 131072, FM_FAT, 8192) == FR_OK);
+    srand(28);
+    for (int i = 0; i < FILE_SIZE; i++)
+        data[i] = (BYTE)rand();
+    CHECK(f_open(&fil, "DATA.BIN", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(&fil, data, FILE_SIZE, &bw) == FR_OK && bw == FILE_SIZE);
+    CHECK(f_close(&fil) == FR_OK);
+
+    test_sequential();
+    test_random();
+    return 0;
+}
@@ -0,0 +1,255 @@
+// Key-value store: a random script of puts and deletes checked against a
+// model, the same after a reload, with one sector write per update plus
+// the compaction it finishes, a power cut before any card write and one
+// in the middle of a sector, and a deleted key that is put again while
+// the put finishes a compaction.
+
+#include "host.h"
+#include "kvstore.h"
+#include <string.h>
+
+#define NKEYS 28
+#define NOPS 1500
+// The most a compaction writes: every key, again for each update made
+// while it runs, and the commit record.
+#define COMPACTION_WRITES (KV_MAX_KEYS + KV_BANK_SECTORS / 4 + 1)
+
+typedef struct {
+    int has;
+    UINT len;
+    BYTE v[KV_VALUE_MAX];
+} model_t;
+
+static FATFS fs;
+static model_t model[NKEYS], before[NKEYS];
+static unsigned rng;
+static uint32_t worst_writes;   // most sector writes of one update
+
+static unsigned rnd(void)
+{
+    rng = rng * 1103515245u + 12345u;
+    return rng >> 8;
+}
+
+static void key_name(int i, char *k)
+{
+    sprintf(k, "key.%02d.%s", i, i % 3 ? "x" : "longer_name");
+}
+
+// Run the script until an operation fails.  Returns the number of
+// operations done; before[] is the model without the failed one.
+static int run(int service_every)
+{
+    char k[32];
+    BYTE v[KV_VALUE_MAX];
+    FRESULT fr;
+    kv_stats_t st, st0;
+
+    rng = 1;
+    memset(model, 0, sizeof model);
+    for (int n = 0; n < NOPS; n++) {
+        int i = rnd() % NKEYS;
+        key_name(i, k);
+        memcpy(before, model, sizeof model);
+        kv_get_stats(&st0);
+        uint32_t writes = disk_stats.writes;
+        if (rnd() % 10 < 7) {
+            UINT len = 1 + rnd() % KV_VALUE_MAX;
+            for (UINT j = 0; j < len; j++)
+                v[j] = (BYTE)rnd();
+            fr = kv_put(k, v, len);
+            if (fr == FR_OK) {
+                model[i].has = 1;
+                model[i].len = len;
+                memcpy(model[i].v, v, len);
+            }
+        } else {
+            fr = kv_delete(k);
+            if (fr == FR_NO_FILE) {
+                CHECK(!model[i].has);
+                fr = FR_OK;
+            } else if (fr == FR_OK) {
+                model[i].has = 0;
+            }
+        }
+        if (fr)
+            return n;
+        // One sector for an update that was made (not an unchanged value
+        // or a missing key), and the rest of a compaction it had to finish
+        kv_get_stats(&st);
+        writes = disk_stats.writes - writes;
+        uint32_t made = st.puts + st.deletes - st0.puts - st0.deletes;
+        CHECK(made <= 1 && st.sectors - st0.sectors == made);
+        CHECK(writes == made + st.copies - st0.copies);
+        CHECK(writes <= 1 + COMPACTION_WRITES);
+        if (writes > worst_writes)
+            worst_writes = writes;
+        writes = disk_stats.writes;
+        if (n % service_every == 0 && kv_service() != FR_OK) {
+            memcpy(before, model, sizeof model);
+            return n + 1;
+        }
+        CHECK(disk_stats.writes - writes <= 1);
+    }
+    return NOPS;
+}
+
+static int same(const model_t *m)
+{
+    char k[32];
+    BYTE v[KV_VALUE_MAX];
+    UINT len;
+    for (int i = 0; i < NKEYS; i++) {
+        key_name(i, k);
+        FRESULT fr = kv_get(k, v, sizeof v, &len);
+        if (m[i].has != (fr == FR_OK))
+            return 0;
+        if (fr == FR_OK && (len != m[i].len || memcmp(v, m[i].v, len) != 0))
+            return 0;
+    }
+    return 1;
+}
+
+static void test_script(void)
+{
+    for (int every = 1; every <= 4; every *= 4) {
+        CHECK(kv_open("save.kv") == FR_OK);
+        uint32_t writes = disk_stats.writes;
+        worst_writes = 0;
+        CHECK(run(every) == NOPS);
+        kv_stats_t st;
+        kv_get_stats(&st);
+        writes = disk_stats.writes - writes;
+        printf("service every %d op(s): %.2f sector writes per update, %u compactions, "
+               "worst update %u writes, %u us\n", every,
+               (double)writes / (st.puts + st.deletes), st.compactions, worst_writes,
+               st.max_put_us);
+        // Every write is an update's own sector or compaction's.
+        CHECK(writes == st.sectors + st.copies);
+        CHECK(st.sectors == st.puts + st.deletes);
+        CHECK(st.copies <= st.compactions * COMPACTION_WRITES);
+        CHECK(same(model));
+        CHECK(kv_open("save.kv") == FR_OK);
+        CHECK(same(model));
+    }
+}
+
+// Every write the script makes is in turn the one that fails.
+static void test_power_cuts(const BYTE *snap, LBA_t base)
+{
+    size_t size = 2 * KV_BANK_SECTORS * FF_MAX_SS;
+    uint32_t writes;
+
+    memcpy(&disk_image[(size_t)base * FF_MAX_SS], snap, size);
+    CHECK(kv_open("save.kv") == FR_OK);
+    writes = disk_stats.writes;
+    run(4);
+    writes = disk_stats.writes - writes;
+
+    for (uint32_t cut = 0; cut < writes; cut++) {
+        memcpy(&disk_image[(size_t)base * FF_MAX_SS], snap, size);
+        CHECK(kv_open("save.kv") == FR_OK);
+        disk_write_limit = (int32_t)cut;
+        run(4);
+        disk_write_limit = -1;
+
+        // Boot again: the update being written is either done or lost.
+        CHECK(kv_open("save.kv") == FR_OK);
+        CHECK(same(model) || same(before));
+        CHECK(kv_put("after", "x", 1) == FR_OK && kv_delete("after") == FR_OK);
+    }
+    printf("%u power cuts recovered\n", writes);
+
+    // Power lost while a sector is programmed: the start of the record is
+    // on the card, the rest is what was there before.  Only the CRC can
+    // tell, and the update must be lost.
+    static const int32_t torn[] = { 1, 8, 16, 100, 300, 507, 508, 511 };
+    unsigned ntorn = 0;
+    for (uint32_t cut = 0; cut < writes; cut += 3) {
+        memcpy(&disk_image[(size_t)base * FF_MAX_SS], snap, size);
+        CHECK(kv_open("save.kv") == FR_OK);
+        disk_write_limit = (int32_t)cut;
+        disk_torn_bytes = torn[cut / 3 % (sizeof torn / sizeof torn[0])];
+        run(4);
+        disk_write_limit = -1;
+        disk_torn_bytes = 0;
+
+        CHECK(kv_open("save.kv") == FR_OK);
+        CHECK(same(before));
+        CHECK(kv_put("after", "x", 1) == FR_OK && kv_delete("after") == FR_OK);
+        ntorn++;
+    }
+    printf("%u torn sectors recovered\n", ntorn);
+}
+
+// A key deleted after compaction has copied it stays in the RAM copy
+// until compaction ends.  Put it again when the bank is full, so that
+// the put has to finish the compaction first.
+static void test_put_deleted(void)
+{
+    char k[32];
+    BYTE v[4] = "abc";
+    UINT len;
+    kv_stats_t st;
+
+    CHECK(f_unlink("save.kv") == FR_OK);
+    CHECK(kv_open("save.kv") == FR_OK);
+    for (int i = 0; i < 10; i++) {
+        key_name(i, k);
+        CHECK(kv_put(k, v, 3) == FR_OK);
+    }
+    for (int n = 0; ; n++) {
+        v[0] = (BYTE)n;
+        CHECK(kv_put("filler", v, 3) == FR_OK);
+        kv_get_stats(&st);
+        if (st.sectors == KV_BANK_SECTORS - KV_BANK_SECTORS / 4)
+            break;
+    }
+    CHECK(kv_service() == FR_OK); // copies key 0
+    key_name(0, k);
+    CHECK(kv_delete(k) == FR_OK);
+    for (;;) {
+        kv_get_stats(&st);
+        if (st.sectors == KV_BANK_SECTORS - 1)
+            break;
+        v[0]++;
+        CHECK(kv_put("filler", v, 3) == FR_OK);
+    }
+    CHECK(kv_put(k, "new", 3) == FR_OK);
+    kv_get_stats(&st);
+    CHECK(st.compactions == 1);
+    CHECK(kv_get(k, v, sizeof v, &len) == FR_OK && len == 3 && memcmp(v, "new", 3) == 0);
+    CHECK(kv_put(k, "newer", 5) == FR_OK);
+    CHECK(kv_open("save.kv") == FR_OK);
+    CHECK(kv_get(k, v, sizeof v, &len) == FR_OK && len == 5);
+}
+
+int main(void)
+{
+    static BYTE filler[3000];
+    FIL fil;
+    UINT bw;
+    DWORD nfrag;
+    LBA_t base;
+
+    CHECK(host_format(&fs, 65536, FM_FAT, 0) == FR_OK);
+    CHECK(f_open(&fil, "a.bin", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(&fil, filler, sizeof filler, &bw) == FR_OK);
+    CHECK(f_close(&fil) == FR_OK);
+    CHECK(kv_open("save.kv") == FR_OK);
+    CHECK(f_open(&fil, "save.kv", FA_READ) == FR_OK);
+    CHECK(f_getfrag(&fil, &nfrag, &base) == FR_OK && nfrag == 1);
+    CHECK(f_close(&fil) == FR_OK);
+
+    size_t size = 2 * KV_BANK_SECTORS * FF_MAX_SS;
+    BYTE *snap = malloc(size);
+    CHECK(snap);
+    memcpy(snap, &disk_image[(size_t)base * FF_MAX_SS], size);
+
+    test_script();
+    test_power_cuts(snap, base);
+    CHECK(f_chmod("save.kv", 0, AM_RDO|AM_SYS) == FR_OK);
+    test_put_deleted();
+    free(snap);
+    return 0;
+}
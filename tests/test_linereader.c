@@ -0,0 +1,189 @@
+// Line reader: the lines f_gets() would return, for every line ending,
+// lines longer than the buffer, and what it saves over f_gets().
+
+#include "host.h"
+#include "linereader.h"
+#include <string.h>
+
+static FATFS fs;
+static FIL fil;
+static line_reader_t lr;
+static char text[64 * 1024];
+
+static void put_file(const char *path, const char *data, UINT len)
+{
+    UINT bw;
+    CHECK(f_open(&fil, path, FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(&fil, data, len, &bw) == FR_OK && bw == len);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+// Compare every line with f_gets(), which keeps the line ending.
+static void check_against_gets(const char *path)
+{
+    static char ref[LINE_READER_SECTORS * FF_MAX_SS];
+    static FIL rf;
+    char *line;
+    UINT len;
+
+    CHECK(f_open(&fil, path, FA_READ) == FR_OK);
+    CHECK(f_open(&rf, path, FA_READ) == FR_OK);
+    line_reader_init(&lr, &fil);
+    while ((line = line_reader_next(&lr, &len)) != NULL) {
+        CHECK(f_gets(ref, sizeof ref, &rf) != NULL);
+        size_t n = strcspn(ref, "\r\n");
+        CHECK(len == n && strlen(line) == n);
+        CHECK(memcmp(line, ref, n) == 0);
+    }
+    CHECK(lr.err == FR_OK);
+    CHECK(f_gets(ref, sizeof ref, &rf) == NULL);
+    f_close(&rf);
+    f_close(&fil);
+}
+
+static void test_endings(void)
+{
+    static const char *const cases[] = {
+        "",
+        "one line without an ending",
+        "lf\nlines\n\nwith an empty one\n",
+        "crlf\r\nlines\r\n\r\nlast\r\n",
+        "mixed\r\nendings\nand a tail",
+    };
+    for (unsigned i = 0; i < sizeof cases / sizeof cases[0]; i++) {
+        put_file("CASE.TXT", cases[i], (UINT)strlen(cases[i]));
+        check_against_gets("CASE.TXT");
+    }
+}
+
+// A line that does not fit in the buffer comes back in pieces.
+static void test_long_line(void)
+{
+    UINT n = 0, len;
+    char *line;
+
+    n += sprintf(&text[n], "short\r\n");
+    memset(&text[n], 'x', 3000);
+    n += 3000;
+    n += sprintf(&text[n], "\nend\n");
+    put_file("LONG.TXT", text, n);
+
+    CHECK(f_open(&fil, "LONG.TXT", FA_READ) == FR_OK);
+    line_reader_init(&lr, &fil);
+    line = line_reader_next(&lr, &len);
+    CHECK(line && strcmp(line, "short") == 0);
+    UINT total = 0;
+    while ((line = line_reader_next(&lr, &len)) != NULL && line[0] == 'x') {
+        CHECK(len <= LINE_READER_SECTORS * FF_MAX_SS);
+        CHECK(strspn(line, "x") == len);
+        total += len;
+    }
+    CHECK(total == 3000);
+    CHECK(line && strcmp(line, "end") == 0);
+    CHECK(line_reader_next(&lr, &len) == NULL);
+    f_close(&fil);
+}
+
+// f_read() calls made by the line reader; the test links with f_read
+// wrapped.  f_gets() calls it from inside ff.c, once for every byte.
+static unsigned reads;
+
+FRESULT __real_f_read(FIL *fp, void *buff, UINT btr, UINT *br);
+
+FRESULT __wrap_f_read(FIL *fp, void *buff, UINT btr, UINT *br)
+{
+    reads++;
+    return __real_f_read(fp, buff, btr, br);
+}
+
+// Read a text file of 2000 lines both ways and report the card time.
+// The line reader must go through f_read() once per sector or less,
+// where f_gets() goes once per byte.
+static void test_cost(void)
+{
+    UINT n = 0, len, lines = 0;
+
+    for (int i = 0; i < 2000; i++)
+        n += sprintf(&text[n], "%d,%d,telemetry record %d\r\n", i, i * 7 % 1000, i);
+    put_file("DATA.CSV", text, n);
+    check_against_gets("DATA.CSV");
+
+    // Drop the cached sector of the volume, as the shell would have it.
+    CHECK(f_mount(&fs, "", 1) == FR_OK);
+    uint64_t t0 = sim_us;
+    uint32_t r0 = disk_stats.reads;
+    reads = 0;
+    CHECK(f_open(&fil, "DATA.CSV", FA_READ) == FR_OK);
+    line_reader_init(&lr, &fil);
+    while (line_reader_next(&lr, &len))
+        lines++;
+    f_close(&fil);
+    uint64_t reader_us = sim_us - t0;
+    uint32_t reader_reads = disk_stats.reads - r0;
+    CHECK(lines == 2000);
+    CHECK(reads <= n / FF_MAX_SS + 1);
+
+    static char ref[256];
+    CHECK(f_mount(&fs, "", 1) == FR_OK);
+    t0 = sim_us;
+    r0 = disk_stats.reads;
+    CHECK(f_open(&fil, "DATA.CSV", FA_READ) == FR_OK);
+    while (f_gets(ref, sizeof ref, &fil))
+        ;
+    f_close(&fil);
+    uint64_t gets_us = sim_us - t0;
+
+    printf("%u bytes: line reader %u f_read calls, %u card reads, %llu us card; "
+           "f_gets %u f_read calls, %u card reads, %llu us card\n", n, reads, reader_reads,
+           (unsigned long long)reader_us, n, disk_stats.reads - r0,
+           (unsigned long long)gets_us);
+}
+
+// Lines per second of host CPU time both ways on a file of a few MB, for
+// information only: the host is not the target and may be busy.
+static void bench(void)
+{
+    UINT n = 0, bw, len;
+    unsigned lines = 0, gets_lines = 0;
+    static char ref[256];
+
+    CHECK(f_open(&fil, "BIG.CSV", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    for (int i = 0; i < 100000; i++) {
+        n += sprintf(&text[n], "%d,%d,telemetry record %d\r\n", i, i * 7 % 1000, i);
+        if (n > sizeof text - 64 || i == 99999) {
+            CHECK(f_write(&fil, text, n, &bw) == FR_OK && bw == n);
+            n = 0;
+        }
+    }
+    FSIZE_t size = f_size(&fil);
+    CHECK(f_close(&fil) == FR_OK);
+
+    double t = wall_seconds();
+    CHECK(f_open(&fil, "BIG.CSV", FA_READ) == FR_OK);
+    line_reader_init(&lr, &fil);
+    while (line_reader_next(&lr, &len))
+        lines++;
+    f_close(&fil);
+    double reader_s = wall_seconds() - t;
+
+    t = wall_seconds();
+    CHECK(f_open(&fil, "BIG.CSV", FA_READ) == FR_OK);
+    while (f_gets(ref, sizeof ref, &fil))
+        gets_lines++;
+    f_close(&fil);
+    double gets_s = wall_seconds() - t;
+
+    CHECK(lines == 100000 && gets_lines == lines);
+    printf("%llu bytes: line reader %.0f lines/s, f_gets %.0f lines/s on this host\n",
+           (unsigned long long)size, lines / reader_s, gets_lines / gets_s);
+}
+
+int main(void)
+{
+    CHECK(host_format(&fs, 131072, FM_FAT32, 512) == FR_OK);
+    test_endings();
+    test_long_line();
+    test_cost();
+    bench();
+    return 0;
+}
@@ -0,0 +1,143 @@
+// Log stream: appending to existing files of every alignment, and
+// preallocated logs on FAT16, FAT32 and exFAT: the worst latency of a
+// write inside the extent, and logs that outgrow their extent.
+
+#include "host.h"
+#include "logstream.h"
+#include <string.h>
+
+#define RING_SIZE (LOG_RING_SECTORS * FF_MAX_SS)
+
+static FATFS fs;
+static log_stream_t log;
+static BYTE buf[64 * 1024];
+
+// Content of byte i of every test file, so that a byte written to the
+// wrong offset shows up.
+static BYTE pattern(FSIZE_t i)
+{
+    return (BYTE)(i ^ i >> 8 ^ i >> 16);
+}
+
+static void fill(BYTE *dst, FSIZE_t from, UINT len)
+{
+    for (UINT i = 0; i < len; i++)
+        dst[i] = pattern(from + i);
+}
+
+static void check_file(const char *path, FSIZE_t size)
+{
+    FIL fil;
+    UINT br;
+    CHECK(size <= sizeof buf);
+    CHECK(f_open(&fil, path, FA_READ) == FR_OK);
+    CHECK(f_size(&fil) == size);
+    CHECK(f_read(&fil, buf, sizeof buf, &br) == FR_OK);
+    CHECK(br == size);
+    for (UINT i = 0; i < br; i++)
+        CHECK(buf[i] == pattern(i));
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+// Write len bytes of the pattern through the log in odd-sized records.
+static void write_records(FSIZE_t len)
+{
+    BYTE rec[37];
+    while (len) {
+        UINT n = len < sizeof rec ? (UINT)len : sizeof rec;
+        fill(rec, log.wpos, n);
+        CHECK(log_write(&log, rec, n) == FR_OK);
+        len -= n;
+    }
+}
+
+static void test_append(FSIZE_t existing)
+{
+    FIL fil;
+    UINT bw;
+
+    fill(buf, 0, (UINT)existing);
+    CHECK(f_open(&fil, "APPEND.LOG", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(&fil, buf, (UINT)existing, &bw) == FR_OK && bw == existing);
+    CHECK(f_close(&fil) == FR_OK);
+
+    // A short record and a checkpoint rewrite the partial last sector.
+    CHECK(log_open(&log, "APPEND.LOG", 0) == FR_OK);
+    CHECK(log.wpos == existing);
+    write_records(6);
+    CHECK(log_close(&log) == FR_OK);
+    check_file("APPEND.LOG", existing + 6);
+
+    // Enough to wrap the ring twice, with a checkpoint on the way.
+    CHECK(log_open(&log, "APPEND.LOG", 0) == FR_OK);
+    write_records(RING_SIZE + 300);
+    CHECK(log_checkpoint(&log) == FR_OK);
+    write_records(RING_SIZE + 700);
+    CHECK(log_close(&log) == FR_OK);
+    check_file("APPEND.LOG", existing + 6 + 2 * RING_SIZE + 1000);
+}
+
+static void test_prealloc(void)
+{
+    FATFS *pfs;
+    DWORD free0, free1;
+
+    // A log that stays inside its extent gives the rest back on close.
+    // Until then only its own sectors go to the card: a log_write() of a
+    // short record costs at most one batch, a command for each sector
+    // when the clusters are that small, and on FAT the read of the next
+    // FAT sector of the chain.
+    CHECK(f_getfree("", &free0, &pfs) == FR_OK);
+    CHECK(log_open(&log, "INPUT.LOG", 64 * 1024) == FR_OK);
+    CHECK(log.limit == 64 * 1024);
+    CHECK(f_getfree("", &free1, &pfs) == FR_OK);
+    CHECK(free0 - free1 == 64 * 1024 / (fs.csize * FF_MAX_SS));
+    uint32_t sectors = disk_stats.write_sectors, reads = disk_stats.reads;
+    write_records(60 * 1024);
+    CHECK(disk_stats.write_sectors - sectors == log.sectors);
+    reads = disk_stats.reads - reads;
+    printf("%s: worst log_write() %u us inside the extent, %u FAT reads\n",
+           fs.fs_type == FS_EXFAT ? "exFAT" : fs.fs_type == FS_FAT32 ? "FAT32" : "FAT16",
+           log.max_write_us, reads);
+    if (fs.fs_type == FS_EXFAT)
+        CHECK(reads == 0);
+    CHECK(log.max_write_us <= LOG_BATCH_SECTORS * (CMD_US + SECTOR_US + PROGRAM_US)
+            + (reads ? CMD_US + SECTOR_US : 0));
+    CHECK(log_close(&log) == FR_OK);
+    check_file("INPUT.LOG", 60 * 1024);
+    CHECK(f_getfree("", &free1, &pfs) == FR_OK);
+    CHECK(free0 - free1 == (60 * 1024u + fs.csize * FF_MAX_SS - 1) / (fs.csize * FF_MAX_SS));
+
+    // Closed before anything reaches the card, it leaves an empty file
+    // and all of the extent free.
+    CHECK(log_open(&log, "EMPTY.LOG", 64 * 1024) == FR_OK);
+    CHECK(log_close(&log) == FR_OK);
+    check_file("EMPTY.LOG", 0);
+    // Counted afresh from the FAT or the bitmap
+    CHECK(f_mount(&fs, "", 1) == FR_OK);
+    CHECK(f_getfree("", &free1, &pfs) == FR_OK);
+    CHECK(free0 - free1 == (60 * 1024u + fs.csize * FF_MAX_SS - 1) / (fs.csize * FF_MAX_SS));
+
+    // One that outgrows it keeps going.
+    CHECK(log_open(&log, "INPUT.LOG", 4096) == FR_OK);
+    CHECK(log.limit == 4096);
+    write_records(3 * RING_SIZE + 123);
+    CHECK(log_close(&log) == FR_OK);
+    check_file("INPUT.LOG", 3 * RING_SIZE + 123);
+}
+
+int main(void)
+{
+    static const struct { BYTE fmt; DWORD au; } vols[] = {
+        { FM_FAT, 4096 }, { FM_FAT32, 512 }, { FM_EXFAT, 4096 },
+    };
+    static const FSIZE_t lengths[] = { 0, 511, 512, 1000, RING_SIZE + 1 };
+
+    for (unsigned v = 0; v < sizeof vols / sizeof vols[0]; v++) {
+        CHECK(host_format(&fs, 131072, vols[v].fmt, vols[v].au) == FR_OK);
+        for (unsigned i = 0; i < sizeof lengths / sizeof lengths[0]; i++)
+            test_append(lengths[i]);
+        test_prealloc();
+    }
+    return 0;
+}
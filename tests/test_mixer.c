@@ -0,0 +1,225 @@
+// Multi-voice mixing: the block kernels against a 64-bit reference, all
+// AUDIO_VOICES voices playing through the simulated DMA against a mix
+// worked out frame by frame, and the throughput of an eight-voice block.
+//
+// Built with 16-bit PWM levels and sources whose low byte is 0, so every
+// level is the mix exactly: 32768 plus the sum of (sample >> 8) * gain,
+// clipped to 0..65535.
+
+#include "audio_sim.h"
+#include "audio.h"
+#include "mixer.h"
+#include <string.h>
+#include <time.h>
+
+#define MID 0x8000
+
+static FATFS *fs = &fs_storage;
+
+static void test_kernels(void)
+{
+    static int16_t src[12][2 * 301 + 1];
+    static int32_t acc[2 * 300];
+    static int64_t ref[2 * 300];
+    long cases = 0;
+
+    srand(44);
+    for (int round = 0; round < 2000; round++) {
+        unsigned n = 1 + rand() % 300;
+        int voices = 1 + rand() % 12;
+        memset(acc, 0, sizeof acc);
+        memset(ref, 0, sizeof ref);
+        for (int v = 0; v < voices; v++) {
+            unsigned ch = 1 + rand() % 2;
+            unsigned ofs = rand() % 2;      // odd: an unaligned source
+            int32_t gain = rand() % (MIXER_UNITY + 1);
+            for (unsigned i = 0; i < ch * n + 1; i++) {
+                int r = rand() % 8;
+                src[v][i] = r == 0 ? -32768 : r == 1 ? 32767 : (int16_t)rand();
+            }
+            const int16_t *s = src[v] + ofs;
+            if (ch == 2)
+                mixer_add_stereo(acc, s, n, gain);
+            else
+                mixer_add_mono(acc, s, n, gain);
+            for (unsigned i = 0; i < n; i++) {
+                ref[2 * i] += (int64_t)s[ch == 2 ? 2 * i : i] * gain;
+                ref[2 * i + 1] += (int64_t)s[ch == 2 ? 2 * i + 1 : i] * gain;
+            }
+            cases += n;
+        }
+        for (unsigned i = 0; i < 2 * n; i++)
+            CHECK(acc[i] == ref[i]);
+    }
+    printf("%ld voice frames mixed exactly\n", cases);
+}
+
+typedef struct {
+    const char *name;
+    unsigned ch, bits, frames;
+    bool loop;
+    uint8_t volume;
+    uint32_t start_ms;      // When it is started
+    uint32_t stop_ms;       // When it is stopped, 0: never
+    int16_t *data;          // Frames of ch samples, low byte 0
+    uint32_t first, end;    // Output frames it covers
+} voice_plan_t;
+
+static voice_plan_t plan[AUDIO_VOICES] = {
+    { "music.wav", 1, 16, 50000, true, 150, 0, 5000, NULL, 0, 0 },
+    { "fx0.wav", 1, 8, 20011, false, 255, 40, 0, NULL, 0, 0 },
+    { "fx1.wav", 2, 16, 15000, false, 200, 95, 0, NULL, 0, 0 },
+    { "fx2.wav", 1, 16, 30000, true, 90, 130, 900, NULL, 0, 0 },
+    { "fx3.wav", 2, 8, 12345, false, 255, 210, 0, NULL, 0, 0 },
+    { "fx4.wav", 1, 16, 40000, false, 128, 333, 0, NULL, 0, 0 },
+    { "fx5.wav", 2, 16, 25000, true, 64, 400, 0, NULL, 0, 0 },
+    { "fx6.wav", 1, 8, 9999, false, 255, 401, 0, NULL, 0, 0 },
+};
+
+// The first output frame of the block rendered after n frames have gone
+// out: the interrupt at the next block boundary renders the block after
+// the one that starts playing then.
+static uint32_t next_block(uint32_t n)
+{
+    return (n / AUDIO_BLOCK_SAMPLES + 2) * AUDIO_BLOCK_SAMPLES;
+}
+
+static void make_files(void)
+{
+    BYTE fmt[16];
+    for (int k = 0; k < AUDIO_VOICES; k++) {
+        voice_plan_t *p = &plan[k];
+        UINT n = p->frames * p->ch;
+        p->data = malloc(n * sizeof *p->data);
+        BYTE *raw = malloc(n * 2);
+        CHECK(p->data && raw);
+        for (UINT i = 0; i < n; i++) {
+            int s = (int)((i * 2654435761u + k * 40503u) >> 11) % 255 - 127;
+            p->data[i] = (int16_t)(s * 256);
+            if (p->bits == 8)
+                raw[i] = (BYTE)(s + 128);
+            else
+                memcpy(&raw[2 * i], &p->data[i], 2);
+        }
+        sim_wav(p->name, fmt, sim_pcm_fmt(fmt, p->ch, AUDIO_RATE, p->bits), raw,
+                n * p->bits / 8, 0);
+        free(raw);
+    }
+}
+
+static uint16_t clip(int32_t l)
+{
+    return l < 0 ? 0 : l > 0xffff ? 0xffff : l;
+}
+
+// With every voice open, the rest of the firmware can still open a file
+// and read it in small pieces, which starts read-ahead.
+static void read_some(const char *path)
+{
+    FIL fil;
+    BYTE buf[100];
+    UINT br;
+    CHECK(f_open(&fil, path, FA_READ) == FR_OK);
+    for (int i = 0; i < 80; i++)
+        CHECK(f_read(&fil, buf, sizeof buf, &br) == FR_OK && br == sizeof buf);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+static void test_playback(void)
+{
+    int handle[AUDIO_VOICES];
+
+    make_files();
+    sim_init(15 * AUDIO_RATE / 2);
+    audio_init();
+    bool started[AUDIO_VOICES] = { false }, stopped[AUDIO_VOICES] = { false };
+    int playing = 0;
+    uint64_t t0 = sim_us;
+    while (sim_nout < 7 * AUDIO_RATE) {
+        uint64_t ms = (sim_us - t0) / 1000;
+        for (int k = 0; k < AUDIO_VOICES; k++) {
+            voice_plan_t *p = &plan[k];
+            if (!started[k] && ms >= p->start_ms) {
+                started[k] = true;
+                handle[k] = audio_play(p->name, p->volume, p->loop);
+                CHECK(handle[k] >= 0);
+                p->first = next_block(sim_nout) + 2;    // after the interpolation history
+                p->end = p->loop ? UINT32_MAX : p->first + p->frames;
+                if (++playing == AUDIO_VOICES) {
+                    CHECK(audio_play("music.wav", 255, false) < 0);
+                    read_some("fx4.wav");
+                }
+            }
+            if (p->stop_ms && !stopped[k] && ms >= p->stop_ms) {
+                stopped[k] = true;
+                audio_stop_voice(handle[k]);
+                p->end = next_block(sim_nout);
+            }
+        }
+        audio_service();
+        sim_run(1000);
+    }
+    audio_stats_t st;
+    audio_get_stats(&st);
+    CHECK(st.underruns == 0);
+
+    uint32_t clipped = 0;
+    for (uint32_t t = 0; t < sim_nout; t++) {
+        int32_t l = MID, r = MID;
+        for (int k = 0; k < AUDIO_VOICES; k++) {
+            voice_plan_t *p = &plan[k];
+            if (t < p->first || t >= p->end)
+                continue;
+            uint32_t f = (t - p->first) % p->frames;
+            int16_t *s = &p->data[f * p->ch];
+            l += s[0] / 256 * p->volume;
+            r += s[p->ch - 1] / 256 * p->volume;
+        }
+        clipped += (l != clip(l)) + (r != clip(r));
+        CHECK(sim_out[t] == ((uint32_t)clip(l) << 16 | clip(r)));
+    }
+    printf("%u frames of %d voices match the reference mix, %u levels clipped\n",
+           sim_nout, AUDIO_VOICES, clipped);
+    CHECK(clipped > 0);
+    audio_stop();
+}
+
+static void test_throughput(void)
+{
+    static int16_t src[AUDIO_VOICES][2 * AUDIO_BLOCK_SAMPLES];
+    static int32_t acc[2 * AUDIO_BLOCK_SAMPLES];
+    static uint32_t out[AUDIO_BLOCK_SAMPLES];
+    mixer_shaper_t ns = { { 0 }, { 0 }, { 0 } };
+    struct timespec t0, t1;
+    const int blocks = 20000;
+
+    for (int v = 0; v < AUDIO_VOICES; v++)
+        for (int i = 0; i < 2 * AUDIO_BLOCK_SAMPLES; i++)
+            src[v][i] = (int16_t)(i * 97 + v * 1031);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int b = 0; b < blocks; b++) {
+        memset(acc, 0, sizeof acc);
+        for (int v = 0; v < AUDIO_VOICES; v++) {
+            if (v & 1)
+                mixer_add_stereo(acc, src[v], AUDIO_BLOCK_SAMPLES, 100);
+            else
+                mixer_add_mono(acc, src[v], AUDIO_BLOCK_SAMPLES, 100);
+        }
+        mixer_pwm_levels(out, acc, AUDIO_BLOCK_SAMPLES, &ns);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    double rate = (double)blocks * AUDIO_BLOCK_SAMPLES * AUDIO_VOICES / s;
+    printf("%d voices: %.0f M voice frames/s, %.0fx real time\n", AUDIO_VOICES, rate / 1e6,
+           rate / AUDIO_VOICES / AUDIO_RATE);
+    CHECK(out[0] != 0);
+}
+
+int main(void)
+{
+    CHECK(host_format(fs, 131072, FM_FAT, 4096) == FR_OK);
+    test_kernels();
+    test_playback();
+    test_throughput();
+    return 0;
+}
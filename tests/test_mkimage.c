@@ -0,0 +1,132 @@
+// The image builder: tools/mkimage.c (its path is argv[1]) lays out a
+// list of files on FAT32 and on exFAT, with and without directories to
+// create first.  Every file of at least the -l size must start on an
+// erase block and be flagged E in the manifest, also when it is the
+// first thing allocated after an exFAT mount, and -v must accept the
+// image and refuse it once the manifest no longer matches.
+
+#include "host.h"
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define DIR_NAME "mkimage_files"
+#define ERASE_KB 64
+#define LARGE_KB 16
+#define ERASE_SECTORS (ERASE_KB * 1024 / FF_MAX_SS)
+#define NFILES 6
+
+static const char *mkimage;
+
+// Sizes in the order of the list: large first, then small and large
+// mixed so that small files leave the allocator between erase blocks.
+static const long sizes[NFILES] = { 70000, 3000, 140000, LARGE_KB * 1024, 100, 210000 };
+
+static int run(const char *args)
+{
+    char cmd[1024];
+    snprintf(cmd, sizeof cmd, "%s %s >/dev/null 2>&1", mkimage, args);
+    int st = system(cmd);
+    CHECK(WIFEXITED(st));
+    return WEXITSTATUS(st);
+}
+
+static void write_list(const char *list, int dirs)
+{
+    char path[64];
+    FILE *l = fopen(list, "w");
+    CHECK(l);
+    fprintf(l, "# assets\n\n");
+    for (int i = 0; i < NFILES; i++) {
+        snprintf(path, sizeof path, DIR_NAME "/f%d.bin", i);
+        FILE *f = fopen(path, "wb");
+        CHECK(f);
+        for (long k = 0; k < sizes[i]; k++)
+            fputc((int)(k * 13 + i), f);
+        CHECK(fclose(f) == 0);
+        if (dirs && i % 2)
+            fprintf(l, "%s /snd/level %d/F%d.BIN\n", path, i, i);
+        else
+            fprintf(l, "%s /F%d.BIN\n", path, i);
+    }
+    CHECK(fclose(l) == 0);
+}
+
+// Check the manifest of an image and return the LBA of its first file.
+static unsigned long check_manifest(const char *manifest, const char *fmt)
+{
+    char line[512], path[256], flag;
+    unsigned long lba, nsect, first = 0;
+    long size;
+    int n = 0;
+    FILE *m = fopen(manifest, "r");
+    CHECK(m);
+    CHECK(fgets(line, sizeof line, m) && strstr(line, fmt));
+    while (fgets(line, sizeof line, m)) {
+        if (line[0] == '#')
+            continue;
+        CHECK(sscanf(line, "%lu %lu %ld %c %255[^\n]", &lba, &nsect, &size, &flag, path) == 5);
+        CHECK(n < NFILES && size == sizes[n]);
+        CHECK(nsect == (unsigned long)(size + FF_MAX_SS - 1) / FF_MAX_SS);
+        if (size >= LARGE_KB * 1024)
+            CHECK(flag == 'E' && lba % ERASE_SECTORS == 0);
+        CHECK((flag == 'E') == (lba % ERASE_SECTORS == 0));
+        if (n++ == 0)
+            first = lba;
+    }
+    fclose(m);
+    CHECK(n == NFILES);
+    return first;
+}
+
+// The manifest with the first file one sector further on
+static void move_first(const char *manifest, const char *moved)
+{
+    char line[512];
+    int done = 0;
+    FILE *in = fopen(manifest, "r"), *out = fopen(moved, "w");
+    CHECK(in && out);
+    while (fgets(line, sizeof line, in)) {
+        unsigned long lba;
+        int skip;
+        if (!done && line[0] != '#' && sscanf(line, "%lu%n", &lba, &skip) == 1) {
+            fprintf(out, "%10lu%s", lba + 1, line + skip);
+            done = 1;
+        } else {
+            fputs(line, out);
+        }
+    }
+    fclose(in);
+    CHECK(fclose(out) == 0 && done);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *const fmts[] = { "fat32", "exfat" };
+    char args[512];
+
+    CHECK(argc == 2);
+    mkimage = argv[1];
+    mkdir(DIR_NAME, 0755);
+
+    for (int f = 0; f < 2; f++) {
+        for (int dirs = 0; dirs < 2; dirs++) {
+            const char *img = DIR_NAME "/card.img", *list = DIR_NAME "/list.txt",
+                       *man = DIR_NAME "/manifest.txt", *moved = DIR_NAME "/moved.txt";
+            write_list(list, dirs);
+            snprintf(args, sizeof args, "-s 64 -f %s -e %d -l %d %s %s %s", fmts[f], ERASE_KB,
+                     LARGE_KB, img, list, man);
+            CHECK(run(args) == 0);
+            unsigned long first = check_manifest(man, f ? "exFAT" : "FAT32");
+            printf("%s%s: first file at LBA %lu\n", fmts[f], dirs ? " with directories" : "",
+                   first);
+
+            snprintf(args, sizeof args, "-v %s %s", img, man);
+            CHECK(run(args) == 0);
+            move_first(man, moved);
+            snprintf(args, sizeof args, "-v %s %s", img, moved);
+            CHECK(run(args) != 0);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+// Fast mount and the free cluster count: what a fast mount saves before
+// the first read, a count kept across writes that matches a full scan,
+// and FSInfo written back after a scan only on a volume being written.
+
+#include "host.h"
+#include <string.h>
+
+static FATFS fs;
+
+// Mark the FSInfo free count of a FAT32 volume as unknown.
+static void forget_free_count(void)
+{
+    LBA_t fsinfo = fs.volbase + 1;
+    CHECK(f_mount(NULL, "", 0) == FR_OK);
+    memset(&disk_image[fsinfo * FF_MAX_SS + 488], 0xFF, 4);
+}
+
+// Free clusters from a full scan, mounting the volume afresh and
+// leaving no trace on the card.
+static DWORD scan_free(void)
+{
+    static FATFS scan;
+    FATFS *pfs;
+    DWORD nfree;
+    BYTE *saved = malloc((size_t)disk_sectors * FF_MAX_SS);
+    CHECK(saved);
+    memcpy(saved, disk_image, (size_t)disk_sectors * FF_MAX_SS);
+    forget_free_count();
+    CHECK(f_mount(&scan, "", 1) == FR_OK);
+    CHECK(f_getfree("", &nfree, &pfs) == FR_OK);
+    CHECK(f_mount(NULL, "", 0) == FR_OK);
+    memcpy(disk_image, saved, (size_t)disk_sectors * FF_MAX_SS);
+    free(saved);
+    return nfree;
+}
+
+static uint64_t mount_to_first_read(BYTE opt, uint32_t *reads)
+{
+    FIL fil;
+    BYTE buf[16];
+    UINT br;
+    uint64_t t0 = sim_us;
+    *reads = disk_stats.reads;
+    CHECK(f_mount(&fs, "", opt) == FR_OK);
+    CHECK(f_open(&fil, "first.bin", FA_READ) == FR_OK);
+    CHECK(f_read(&fil, buf, sizeof buf, &br) == FR_OK && br == sizeof buf);
+    CHECK(f_close(&fil) == FR_OK);
+    *reads = disk_stats.reads - *reads;
+    return sim_us - t0;
+}
+
+static void put_file(const char *path, UINT len)
+{
+    static BYTE buf[32768];
+    FIL fil;
+    UINT bw;
+    CHECK(f_open(&fil, path, FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(&fil, buf, len, &bw) == FR_OK && bw == len);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+// The fast mount leaves out the FSInfo sector on FAT32, and on exFAT the
+// FAT sector of the bitmap's chain along with the root directory sector
+// it pushes out of the window.  Card initialization is the same for both.
+static void test_mount_time(BYTE fmt, DWORD au, uint32_t deferred)
+{
+    uint32_t normal_reads, fast_reads;
+
+    CHECK(host_format(&fs, 131072, fmt, au) == FR_OK);
+    put_file("first.bin", 1000);
+    CHECK(f_mount(NULL, "", 0) == FR_OK);
+    uint64_t normal = mount_to_first_read(1, &normal_reads);
+    uint64_t fast = mount_to_first_read(2, &fast_reads);
+    printf("format %u: mount to first read %llu us in %u reads, %llu us in %u with a fast "
+           "mount, %u us of it card init\n", fmt, (unsigned long long)normal, normal_reads,
+           (unsigned long long)fast, fast_reads, INIT_US);
+    CHECK(normal_reads - fast_reads == deferred);
+    CHECK(normal - fast == deferred * (CMD_US + SECTOR_US));
+    CHECK(fast == INIT_US + fast_reads * (CMD_US + SECTOR_US));
+}
+
+static void test_free_count(void)
+{
+    FATFS *pfs;
+    DWORD nfree, again;
+
+    CHECK(host_format(&fs, 131072, FM_FAT32, 512) == FR_OK);
+    put_file("first.bin", 1000);
+    forget_free_count();
+
+    // Read only: the scan is not written back, so it is done again
+    // after the next mount.
+    for (int boot = 0; boot < 2; boot++) {
+        CHECK(f_mount(&fs, "", 2) == FR_OK);
+        uint32_t reads = disk_stats.reads, writes = disk_stats.writes;
+        CHECK(f_getfree("", &nfree, &pfs) == FR_OK);
+        CHECK(disk_stats.reads - reads > 100);
+        CHECK(disk_stats.writes == writes);
+        CHECK(f_getfree("", &again, &pfs) == FR_OK && again == nfree);
+    }
+
+    // Once the volume is written, the count is saved with the scan.
+    CHECK(f_mkdir("saves") == FR_OK);
+    CHECK(f_getfree("", &nfree, &pfs) == FR_OK);
+    CHECK(f_mount(&fs, "", 2) == FR_OK);
+    uint32_t reads = disk_stats.reads;
+    CHECK(f_getfree("", &again, &pfs) == FR_OK && again == nfree);
+    CHECK(disk_stats.reads - reads < 4);
+
+    // The count kept across writes and deletes after a fast mount
+    // matches a full scan.
+    put_file("saves/a.bin", 30000);
+    put_file("saves/b.bin", 5000);
+    CHECK(f_unlink("first.bin") == FR_OK);
+    CHECK(f_mkdir("saves/old") == FR_OK);
+    CHECK(f_getfree("", &nfree, &pfs) == FR_OK);
+    CHECK(f_mount(NULL, "", 0) == FR_OK);
+    CHECK(scan_free() == nfree);
+}
+
+int main(void)
+{
+    test_mount_time(FM_FAT32, 512, 1);
+    test_mount_time(FM_EXFAT, 4096, 2);
+    test_free_count();
+    return 0;
+}
@@ -0,0 +1,282 @@
+// Packed assets: files packed by tools/pakpack.c (its path is argv[1])
+// and put on the card are found by name in any case and read back
+// sector by sector, with the last sector padded.  A name that shares its
+// hash with an asset is not found, the packer refuses two such names and
+// more than PAK_MAX_ASSETS files, and pak_open() rejects a pack with a
+// bad CRC, an unsorted index, an asset outside it or the wrong size.
+
+#include "host.h"
+#include "pak.h"
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define DIR_NAME "pak_files"
+#define NASSETS 40
+#define MAX_PACK (1024 * 1024)
+
+static FATFS fs;
+static const char *pakpack;
+static BYTE pack[MAX_PACK];
+static UINT pack_size;
+
+static BYTE content(int i, DWORD k)
+{
+    return (BYTE)(i * 29 + k * 7 + (k >> 9));
+}
+
+static DWORD asset_length(int i)
+{
+    static const DWORD lengths[] = { 0, 1, 511, 512, 513, 1000, 4096, 5000, 20000 };
+    return i < (int)(sizeof lengths / sizeof lengths[0]) ? lengths[i] : (DWORD)i * 997;
+}
+
+static void asset_name(int i, char *name)
+{
+    sprintf(name, i % 4 == 0 ? "Sound %02d.wav" : i % 4 == 1 ? "LEVEL%02d.BIN" : "tex%02d.raw",
+            i);
+}
+
+static void write_host_file(const char *name, int i, DWORD len)
+{
+    char path[64];
+    snprintf(path, sizeof path, DIR_NAME "/%s", name);
+    FILE *f = fopen(path, "wb");
+    CHECK(f);
+    for (DWORD k = 0; k < len; k++)
+        fputc(content(i, k), f);
+    CHECK(fclose(f) == 0);
+}
+
+// Run pakpack on the given names in DIR_NAME; returns its exit status and
+// loads the pack into pack[] when it succeeded.
+static int run_pakpack(const char *align, char names[][32], int n)
+{
+    static char cmd[8192];
+    int len = snprintf(cmd, sizeof cmd, "%s %s " DIR_NAME "/out.pak", pakpack, align);
+    for (int i = 0; i < n; i++)
+        len += snprintf(cmd + len, sizeof cmd - len, " '" DIR_NAME "/%s'", names[i]);
+    snprintf(cmd + len, sizeof cmd - len, " >/dev/null 2>&1");
+    CHECK(len < (int)sizeof cmd - 32);
+    int st = system(cmd);
+    CHECK(WIFEXITED(st));
+    if (WEXITSTATUS(st))
+        return WEXITSTATUS(st);
+    FILE *f = fopen(DIR_NAME "/out.pak", "rb");
+    CHECK(f);
+    pack_size = fread(pack, 1, sizeof pack, f);
+    CHECK(pack_size < sizeof pack && feof(f));
+    fclose(f);
+    return 0;
+}
+
+// Put size bytes of p on the card as one contiguous file and open it.
+static FRESULT open_pack(pak_t *pk, const BYTE *p, UINT size)
+{
+    FIL fil;
+    UINT bw;
+    CHECK(f_open(&fil, "ASSETS.PAK", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_expand(&fil, size, 1) == FR_OK);
+    CHECK(f_write(&fil, p, size, &bw) == FR_OK && bw == size);
+    CHECK(f_close(&fil) == FR_OK);
+    return pak_open(pk, "ASSETS.PAK");
+}
+
+static uint32_t get_u32(const BYTE *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_u32(BYTE *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void fix_crc(BYTE *p)
+{
+    put_u32(p + PAK_HDR_CRC,
+            pak_crc32(p + PAK_HDR_SIZE, get_u32(p + PAK_HDR_COUNT) * PAK_ENTRY_SIZE));
+}
+
+static void test_read(void)
+{
+    static char names[NASSETS][32];
+    static BYTE buf[64 * PAK_SECTOR];
+    pak_t pk;
+    pak_asset_t a;
+
+    for (int i = 0; i < NASSETS; i++) {
+        asset_name(i, names[i]);
+        write_host_file(names[i], i, asset_length(i));
+    }
+    CHECK(run_pakpack("-a 8", names, NASSETS) == 0);
+    CHECK(open_pack(&pk, pack, pack_size) == FR_OK);
+    CHECK(pk.count == NASSETS && pk.sectors == pack_size / PAK_SECTOR);
+
+    for (int i = 0; i < NASSETS; i++) {
+        char upper[32];
+        for (int k = 0; (upper[k] = names[i][k]) != '\0'; k++)
+            if (upper[k] >= 'a' && upper[k] <= 'z')
+                upper[k] -= 'a' - 'A';
+        CHECK(pak_find(&pk, upper, &a) == FR_OK);
+        CHECK(pak_find(&pk, names[i], &a) == FR_OK);
+        CHECK(a.length == asset_length(i));
+        CHECK(a.format == (i % 4 == 0 ? PAK_FMT_WAV : PAK_FMT_RAW));
+        // Every asset on an 8-sector boundary of the pack
+        CHECK((a.lba - pk.base) % 8 == 0);
+
+        DWORD span = (a.length + PAK_SECTOR - 1) / PAK_SECTOR;
+        for (DWORD s = 0; s < span; s += 64) {
+            UINT n = span - s < 64 ? span - s : 64;
+            CHECK(pak_read(&pk, &a, s, buf, n) == FR_OK);
+            for (DWORD k = 0; k < n * PAK_SECTOR; k++) {
+                DWORD ofs = s * PAK_SECTOR + k;
+                CHECK(buf[k] == (ofs < a.length ? content(i, ofs) : 0));
+            }
+        }
+        // Nothing past the last sector, and nothing empty
+        CHECK(pak_read(&pk, &a, span, buf, 1) == FR_INVALID_PARAMETER);
+        CHECK(pak_read(&pk, &a, 0, buf, span + 1) == FR_INVALID_PARAMETER);
+        CHECK(pak_read(&pk, &a, 0, buf, 0) == FR_INVALID_PARAMETER);
+        if (span > 1)
+            CHECK(pak_read(&pk, &a, span - 1, buf, 2) == FR_INVALID_PARAMETER);
+    }
+    CHECK(pak_find(&pk, "missing.wav", &a) == FR_NO_FILE);
+    CHECK(pak_find(&pk, "Sound 00.wa", &a) == FR_NO_FILE);
+}
+
+static int by_hash(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Name number n: hex digits of a mix of n, so that the names look random
+// to the hash (numbered names in order hardly ever collide).
+static void mixed_name(uint32_t n, char *name)
+{
+    uint64_t r = (n + 1) * 0x9e3779b97f4a7c15u;
+    sprintf(name, "%llx.bin", (unsigned long long)(r ^ r >> 29));
+}
+
+// Two names with the same pak_hash(), from the sorted hashes of 400000
+// names (hash in the high half, name number in the low)
+static void find_collision(char *a, char *b)
+{
+    enum { NAMES = 400000 };
+    static uint64_t hashes[NAMES];
+    char name[32];
+
+    for (uint32_t n = 0; n < NAMES; n++) {
+        mixed_name(n, name);
+        hashes[n] = (uint64_t)pak_hash(name) << 32 | n;
+    }
+    qsort(hashes, NAMES, sizeof hashes[0], by_hash);
+    for (uint32_t n = 1; n < NAMES; n++) {
+        if (hashes[n] >> 32 == hashes[n - 1] >> 32) {
+            mixed_name((uint32_t)hashes[n - 1], a);
+            mixed_name((uint32_t)hashes[n], b);
+            return;
+        }
+    }
+    CHECK(!"no two names with the same hash");
+}
+
+static void test_collision(void)
+{
+    char names[2][32];
+    pak_t pk;
+    pak_asset_t a;
+
+    find_collision(names[0], names[1]);
+    CHECK(pak_check(names[0]) != pak_check(names[1]));
+    write_host_file(names[0], 1, 700);
+    write_host_file(names[1], 2, 900);
+
+    // The packer cannot tell them apart by the hash.
+    CHECK(run_pakpack("", names, 2) != 0);
+
+    // With one of them in the pack, the other is not found.
+    CHECK(run_pakpack("", names, 1) == 0);
+    CHECK(open_pack(&pk, pack, pack_size) == FR_OK);
+    CHECK(pak_find(&pk, names[0], &a) == FR_OK && a.length == 700);
+    CHECK(pak_find(&pk, names[1], &a) == FR_NO_FILE);
+    printf("%s and %s share hash %08x\n", names[0], names[1], (unsigned)pak_hash(names[0]));
+}
+
+static void test_limit(void)
+{
+    static char names[PAK_MAX_ASSETS + 1][32];
+    pak_t pk;
+
+    for (int i = 0; i <= PAK_MAX_ASSETS; i++) {
+        sprintf(names[i], "small%03d.bin", i);
+        write_host_file(names[i], i, 10 + i);
+    }
+    CHECK(run_pakpack("", names, PAK_MAX_ASSETS + 1) != 0);
+    CHECK(run_pakpack("", names, PAK_MAX_ASSETS) == 0);
+    CHECK(open_pack(&pk, pack, pack_size) == FR_OK && pk.count == PAK_MAX_ASSETS);
+}
+
+// Packs of the test_read() assets, broken in one way each
+static void test_reject(void)
+{
+    static char names[NASSETS][32];
+    static BYTE bad[MAX_PACK];
+    pak_t pk;
+
+    for (int i = 0; i < NASSETS; i++)
+        asset_name(i, names[i]);
+    CHECK(run_pakpack("", names, NASSETS) == 0);
+    BYTE *ent = pack + PAK_HDR_SIZE;
+
+    // An index byte changed, with the CRC left as it was
+    memcpy(bad, pack, pack_size);
+    bad[PAK_HDR_SIZE + PAK_ENTRY_SIZE + PAK_ENT_LENGTH] ^= 1;
+    CHECK(open_pack(&pk, bad, pack_size) == FR_NO_FILESYSTEM && pk.count == 0);
+
+    // Two entries swapped, with a good CRC
+    memcpy(bad, pack, pack_size);
+    memcpy(bad + PAK_HDR_SIZE, ent + PAK_ENTRY_SIZE, PAK_ENTRY_SIZE);
+    memcpy(bad + PAK_HDR_SIZE + PAK_ENTRY_SIZE, ent, PAK_ENTRY_SIZE);
+    fix_crc(bad);
+    CHECK(open_pack(&pk, bad, pack_size) == FR_NO_FILESYSTEM);
+
+    // An asset running past the end of the pack
+    memcpy(bad, pack, pack_size);
+    put_u32(bad + PAK_HDR_SIZE + 3 * PAK_ENTRY_SIZE + PAK_ENT_START, pack_size / PAK_SECTOR);
+    fix_crc(bad);
+    CHECK(open_pack(&pk, bad, pack_size) == FR_NO_FILESYSTEM);
+
+    // A sector more or less than the header says, and not whole sectors
+    memcpy(bad, pack, pack_size);
+    memset(bad + pack_size, 0, PAK_SECTOR);
+    CHECK(open_pack(&pk, bad, pack_size + PAK_SECTOR) == FR_NO_FILESYSTEM);
+    CHECK(open_pack(&pk, bad, pack_size - PAK_SECTOR) == FR_NO_FILESYSTEM);
+    CHECK(open_pack(&pk, bad, pack_size + 1) == FR_NO_FILESYSTEM);
+
+    // Not a pack
+    memcpy(bad, pack, pack_size);
+    bad[PAK_HDR_MAGIC] ^= 0x20;
+    CHECK(open_pack(&pk, bad, pack_size) == FR_NO_FILESYSTEM);
+
+    // And the good one still opens.
+    CHECK(open_pack(&pk, pack, pack_size) == FR_OK && pk.count == NASSETS);
+}
+
+int main(int argc, char **argv)
+{
+    CHECK(argc == 2);
+    pakpack = argv[1];
+    mkdir(DIR_NAME, 0755);
+    CHECK(host_format(&fs, 131072, FM_FAT32, 512) == FR_OK);
+
+    test_read();
+    test_collision();
+    test_limit();
+    test_reject();
+    return 0;
+}
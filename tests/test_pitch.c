@@ -0,0 +1,271 @@
+// Variable-rate playback: files at other rates than AUDIO_RATE, bent in
+// pitch while they play, come out of the simulated DMA exactly as the
+// resampling kernel and quantizer give them when run over the whole file
+// at once with the step of each block.  Then, on the kernels alone, how
+// much of a resampled sine ends up away from its frequency (images and
+// aliases of the interpolation), and what a frame costs at each step.
+
+#include "audio_sim.h"
+#include "audio.h"
+#include "mixer.h"
+#include <math.h>
+#include <string.h>
+
+#define MID 0x8000u
+#define BLOCK AUDIO_BLOCK_SAMPLES
+#define OUT_FRAMES (4 * AUDIO_RATE)
+
+static FATFS *fs = &fs_storage;
+
+typedef struct {
+    const char *name;
+    unsigned ch, bits, frames;
+    uint32_t rate;
+    uint8_t volume;
+    int16_t *z;             // Three frames of silence, the frames, and silence after
+} pitch_file_t;
+
+static pitch_file_t files[] = {
+    { "mono32k.wav", 1, 16, 40000, 32000, 200, NULL },
+    { "st22k.wav", 2, 8, 25000, 22050, 255, NULL },
+    { "mono44k.wav", 1, 16, 60000, 44100, 130, NULL },
+};
+
+// Step changes, by the first output frame they apply to
+static struct {
+    uint32_t frame, step;
+} bends[4096];
+static unsigned nbends;
+
+static void make_file(pitch_file_t *p)
+{
+    BYTE fmt[16];
+    UINT n = p->frames * p->ch;
+    UINT tail = 8 * BLOCK * AUDIO_MAX_STEP * p->ch;
+    BYTE *raw = malloc(2 * n);
+    p->z = calloc(3 * p->ch + n + tail, sizeof *p->z);
+    CHECK(raw && p->z);
+    for (UINT i = 0; i < n; i++) {
+        // A couple of tones and some noise, full scale
+        double t = (double)(i / p->ch) / p->rate;
+        double s = 0.5 * sin(2 * M_PI * 440 * t + i % p->ch) + 0.3 * sin(2 * M_PI * 3100 * t);
+        int v = (int)lrint(32767 * 0.8 * s) + rand() % 6000 - 3000;
+        if (p->bits == 8) {
+            raw[i] = (BYTE)((v >> 8) + 128);
+            p->z[3 * p->ch + i] = (int16_t)((raw[i] - 128) * 256);
+        } else {
+            p->z[3 * p->ch + i] = (int16_t)v;
+            memcpy(&raw[2 * i], &p->z[3 * p->ch + i], 2);
+        }
+    }
+    sim_wav(p->name, fmt, sim_pcm_fmt(fmt, p->ch, p->rate, p->bits), raw, n * p->bits / 8, 0);
+    free(raw);
+}
+
+// The step audio.c takes for a pitch
+static uint32_t step_for(uint32_t rate, uint32_t pitch)
+{
+    uint64_t step = (uint64_t)rate * pitch / AUDIO_RATE;
+    return step < 1 ? 1 : step > AUDIO_MAX_STEP * MIXER_STEP_ONE
+            ? AUDIO_MAX_STEP * MIXER_STEP_ONE : (uint32_t)step;
+}
+
+static uint32_t next_block(uint32_t n)
+{
+    return (n / BLOCK + 2) * BLOCK;
+}
+
+// An engine revving: the pitch sweeps from a quarter to four times, up to
+// AUDIO_MAX_STEP for the 44.1 kHz file.
+static uint32_t rev(uint32_t ms)
+{
+    double x = 0.5 + 0.5 * sin(ms * 0.015);
+    return (uint32_t)(MIXER_STEP_ONE * pow(16, x) / 4);
+}
+
+static void test_bends(pitch_file_t *p)
+{
+    static int32_t acc[2 * BLOCK];
+    static uint32_t ref[BLOCK];
+    audio_stats_t st;
+
+    // Count output frames from a block boundary.
+    sim_block_start();
+    audio_reset_stats();
+    sim_nout = 0;
+    int v = audio_play(p->name, p->volume, false);
+    CHECK(v >= 0);
+    uint32_t first = next_block(sim_nout);
+    nbends = 0;
+    bends[nbends].frame = first;
+    bends[nbends++].step = step_for(p->rate, MIXER_STEP_ONE);
+    uint64_t t0 = sim_us;
+    uint32_t ms = 0;
+    while (audio_playing(v)) {
+        if ((sim_us - t0) / 1000 >= ms + 7 && nbends < count_of(bends)) {
+            ms = (sim_us - t0) / 1000;
+            audio_set_pitch(v, rev(ms));
+            bends[nbends].frame = next_block(sim_nout);
+            bends[nbends++].step = step_for(p->rate, rev(ms));
+        }
+        audio_service();
+        sim_run(1000);
+    }
+    sim_frames(2 * BLOCK);
+    audio_get_stats(&st);
+    CHECK(st.underruns == 0);
+    CHECK(sim_nout < OUT_FRAMES);
+
+    // The same voice, all at once: output frame k is at source position
+    // P, which the step of each block moves on.
+    for (uint32_t i = 0; i < first; i++)
+        CHECK(sim_out[i] == (MID << 16 | MID));
+    mixer_shaper_t ns = { { 0 }, { 0 }, { 0 } };
+    uint64_t pos = 0;
+    uint32_t min_step = UINT32_MAX, max_step = 0;
+    unsigned b = 0;
+    for (uint32_t f = first; f < sim_nout; f += BLOCK) {
+        while (b + 1 < nbends && bends[b + 1].frame <= f)
+            b++;
+        uint32_t step = bends[b].step;
+        memset(acc, 0, sizeof acc);
+        if ((pos >> 16) < p->frames + 3) {
+            const int16_t *s = p->z + p->ch * (1 + (pos >> 16));
+            if (AUDIO_CUBIC)
+                mixer_resample_cubic(acc, s, p->ch, BLOCK, pos & 0xffff, step, p->volume);
+            else
+                mixer_resample_linear(acc, s, p->ch, BLOCK, pos & 0xffff, step, p->volume);
+            if (step < min_step)
+                min_step = step;
+            if (step > max_step)
+                max_step = step;
+        }
+        pos += (uint64_t)BLOCK * step;
+        mixer_pwm_levels(ref, acc, BLOCK, &ns);
+        for (uint32_t i = 0; i < BLOCK && f + i < sim_nout; i++)
+            CHECK(sim_out[f + i] == ref[i]);
+    }
+    CHECK(pos >> 16 >= p->frames);
+    printf("%-12s %5u Hz, %u bends, steps %.3f to %.3f: %u frames match the kernel\n",
+           p->name, p->rate, nbends, (double)min_step / MIXER_STEP_ONE,
+           (double)max_step / MIXER_STEP_ONE, sim_nout - first);
+}
+
+#define N 16384
+
+typedef void resample_fn_t(int32_t *, const int16_t *, unsigned, unsigned, uint32_t, uint32_t,
+        int32_t);
+
+// Resample a sine at step and return the power of the output away from
+// its frequency, in dB below the sine.  The source is chosen so the
+// output has a whole number of cycles, bin k, in N frames; the power
+// within three bins of the tone is the sine, the rest (Parseval) is
+// spurious.
+static double spurious(resample_fn_t *fn, uint32_t step, unsigned k)
+{
+    static int16_t src[N * AUDIO_MAX_STEP + 8];
+    static int32_t acc[2 * N];
+    static double y[N];
+    double cycles = (double)k / N * MIXER_STEP_ONE / step;   // per source frame
+
+    for (unsigned i = 0; i < count_of(src); i++)
+        src[i] = (int16_t)lrint(30000 * sin(2 * M_PI * cycles * ((double)i - 1)));
+    memset(acc, 0, sizeof acc);
+    fn(acc, src + 1, 1, N, 0, step, MIXER_UNITY);
+    double total = 0, tone = 0;
+    for (int i = 0; i < N; i++) {
+        y[i] = acc[2 * i] * (0.5 - 0.5 * cos(2 * M_PI * i / N));
+        total += y[i] * y[i];
+    }
+    total *= N;
+    for (unsigned j = k - 3; j <= k + 3; j++) {
+        double re = 0, im = 0;
+        for (int i = 0; i < N; i++) {
+            double a = 2 * M_PI * (double)j * i / N;
+            re += y[i] * cos(a);
+            im -= y[i] * sin(a);
+        }
+        tone += 2 * (re * re + im * im);
+    }
+    return 10 * log10(tone / (total - tone));
+}
+
+static void test_spurious(void)
+{
+    static const struct {
+        double step;
+        unsigned hz;        // Output frequency
+    } cases[] = {
+        { 0.5, 1000 }, { 0.5, 5000 }, { 0.7256, 1000 }, { 0.7256, 8000 },
+        { 1.37, 1000 }, { 1.37, 8000 }, { 2.9, 3000 },
+    };
+    printf("spurious energy, dB below the tone:\n");
+    for (unsigned c = 0; c < count_of(cases); c++) {
+        uint32_t step = (uint32_t)lrint(cases[c].step * MIXER_STEP_ONE);
+        unsigned k = (unsigned)lrint((double)cases[c].hz * N / AUDIO_RATE);
+        double lin = spurious(mixer_resample_linear, step, k);
+        double cub = spurious(mixer_resample_cubic, step, k);
+        printf("  step %.4f, %5u Hz out: linear %5.1f, cubic %5.1f\n",
+               cases[c].step, cases[c].hz, lin, cub);
+        // Both interpolators improve as the source is oversampled, and
+        // the cubic one by more.
+        CHECK(cub > lin);
+        if (cases[c].hz * cases[c].step <= 1000)
+            CHECK(cub > 75 && lin > 40);
+    }
+}
+
+// Nanoseconds per output frame on this machine, against adding frames
+// at the output rate
+static void bench(void)
+{
+    static int16_t src[2 * (BLOCK * AUDIO_MAX_STEP + 4)];
+    static int32_t acc[2 * BLOCK];
+    static const double steps[] = { 0.25, 0.5, 1.0001, 2, 4 };
+    const int blocks = 40000;
+
+    for (unsigned i = 0; i < count_of(src); i++)
+        src[i] = (int16_t)(i * 7919);
+    for (unsigned ch = 1; ch <= 2; ch++) {
+        double t = wall_seconds();
+        for (int b = 0; b < blocks; b++) {
+            if (ch == 2)
+                mixer_add_stereo(acc, src, BLOCK, 100);
+            else
+                mixer_add_mono(acc, src, BLOCK, 100);
+        }
+        double base = (wall_seconds() - t) * 1e9 / blocks / BLOCK;
+        printf("%s: %.2f ns/frame at the output rate; linear, cubic at step",
+               ch == 2 ? "stereo" : "mono", base);
+        for (unsigned s = 0; s < count_of(steps); s++) {
+            uint32_t step = (uint32_t)(steps[s] * MIXER_STEP_ONE);
+            double ns[2];
+            for (int k = 0; k < 2; k++) {
+                t = wall_seconds();
+                for (int b = 0; b < blocks; b++)
+                    (k ? mixer_resample_cubic : mixer_resample_linear)(acc, src + 2, ch, BLOCK,
+                            b & 0xffff, step, 100);
+                ns[k] = (wall_seconds() - t) * 1e9 / blocks / BLOCK;
+            }
+            printf(" %g: %.2f, %.2f;", steps[s], ns[0], ns[1]);
+        }
+        printf("\n");
+    }
+    CHECK(acc[0] != 0x7fffffff);
+}
+
+int main(void)
+{
+    CHECK(host_format(fs, 131072, FM_FAT, 4096) == FR_OK);
+    srand(48);
+    for (unsigned k = 0; k < count_of(files); k++)
+        make_file(&files[k]);
+    sim_init(OUT_FRAMES);
+    audio_init();
+    for (unsigned k = 0; k < count_of(files); k++)
+        test_bends(&files[k]);
+    audio_stop();
+    test_spurious();
+    bench();
+    return 0;
+}
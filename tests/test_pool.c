@@ -0,0 +1,192 @@
+// The shared sector buffer pool: f_open() and f_setbuf() fail cleanly
+// with FR_NOT_ENOUGH_CORE when it is exhausted and work again once
+// sectors come back, a pool buffer handed to f_setbuf() stays with the
+// file after the caller drops its own reference, and runs are placed
+// first fit, with ff_poolstat() counting all of it.
+
+#include "host.h"
+#include "ffsystem.h"
+#include <string.h>
+
+#define FILE_SIZE 20000
+
+static FATFS fs;
+static BYTE data[FILE_SIZE];
+static BYTE *base;             // Pool[0], from the first run of an empty pool
+
+// Pool sector i
+#define SECT(i) (base + (i) * FF_MAX_SS)
+
+static void check_stat(UINT used, DWORD allocs, DWORD fails)
+{
+    FF_POOLSTAT st;
+    ff_poolstat(&st);
+    CHECK(st.size == FF_BUF_POOL);
+    CHECK(st.used == used && st.allocs == allocs && st.fails == fails);
+    CHECK(st.peak >= st.used && st.peak <= FF_BUF_POOL);
+}
+
+static void test_first_fit(void)
+{
+    FF_POOLSTAT st;
+
+    ff_poolstat(&st);
+    CHECK(st.used == 0 && st.fails == 0);
+    DWORD allocs = st.allocs;
+
+    base = ff_bufalloc(4);
+    BYTE *b = ff_bufalloc(4), *c = ff_bufalloc(4);
+    CHECK(b == SECT(4) && c == SECT(8));
+    check_stat(12, allocs + 3, 0);
+    ff_buffree(b);
+    check_stat(8, allocs + 3, 0);
+
+    // The first hole that fits: 4..7, then what is left of it, then the
+    // free end of the pool for a run too long for that.
+    CHECK(ff_bufalloc(2) == SECT(4));
+    CHECK(ff_bufalloc(3) == SECT(12));
+    CHECK(ff_bufalloc(2) == SECT(6));
+    CHECK(ff_bufalloc(1) == SECT(15));
+    check_stat(FF_BUF_POOL, allocs + 7, 0);
+    CHECK(ff_bufalloc(1) == NULL);
+    check_stat(FF_BUF_POOL, allocs + 7, 1);
+
+    // 4 sectors free, but not 5 in a row.
+    ff_buffree(base);
+    CHECK(ff_bufalloc(5) == NULL);
+    check_stat(FF_BUF_POOL - 4, allocs + 7, 2);
+    CHECK(ff_bufalloc(4) == base);
+    ff_poolstat(&st);
+    CHECK(st.peak == FF_BUF_POOL);
+
+    // Out of range sizes are refused without counting, and other memory
+    // and null are ignored.
+    CHECK(ff_bufalloc(0) == NULL && ff_bufalloc(FF_BUF_POOL + 1) == NULL);
+    CHECK(!ff_bufref(data) && !ff_bufref(SECT(1)));
+    ff_buffree(NULL);
+    ff_buffree(data);
+    ff_buffree(SECT(1));           // inside a run, not its head
+    check_stat(FF_BUF_POOL, allocs + 8, 2);
+
+    ff_buffree(base);
+    ff_buffree(SECT(4));
+    ff_buffree(SECT(6));
+    ff_buffree(c);
+    ff_buffree(SECT(12));
+    ff_buffree(SECT(15));
+    check_stat(0, allocs + 8, 2);
+}
+
+static void test_exhausted(void)
+{
+    FF_POOLSTAT st;
+    FIL fil[5];
+    char path[16];
+
+    ff_poolstat(&st);
+    // Leave room for the sector buffers of 4 files.
+    BYTE *hog = ff_bufalloc(FF_BUF_POOL - 4);
+    CHECK(hog);
+    for (int i = 0; i < 4; i++) {
+        sprintf(path, "F%d.BIN", i);
+        CHECK(f_open(&fil[i], path, FA_READ|FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    }
+    check_stat(FF_BUF_POOL, st.allocs + 5, st.fails);
+    CHECK(f_open(&fil[4], "DATA.BIN", FA_READ) == FR_NOT_ENOUGH_CORE);
+    check_stat(FF_BUF_POOL, st.allocs + 5, st.fails + 1);
+    CHECK(f_close(&fil[3]) == FR_OK);
+    check_stat(FF_BUF_POOL - 1, st.allocs + 5, st.fails + 1);
+
+    // The file is not left locked by the failed open.
+    CHECK(f_open(&fil[4], "DATA.BIN", FA_READ) == FR_OK);
+    CHECK(f_setbuf(&fil[4], NULL, 2) == FR_NOT_ENOUGH_CORE);
+    check_stat(FF_BUF_POOL, st.allocs + 6, st.fails + 2);
+    // Still readable without the buffer.
+    BYTE buf[100];
+    UINT br;
+    CHECK(f_read(&fil[4], buf, sizeof buf, &br) == FR_OK);
+    CHECK(br == sizeof buf && memcmp(buf, data, br) == 0);
+
+    CHECK(f_close(&fil[2]) == FR_OK);
+    CHECK(f_close(&fil[1]) == FR_OK);
+    CHECK(f_setbuf(&fil[4], NULL, 2) == FR_OK);
+    check_stat(FF_BUF_POOL, st.allocs + 7, st.fails + 2);
+
+    // A failed open of a missing file gives its buffer back.
+    CHECK(f_close(&fil[0]) == FR_OK);
+    CHECK(f_open(&fil[0], "NONE.BIN", FA_READ) == FR_NO_FILE);
+    check_stat(FF_BUF_POOL - 1, st.allocs + 8, st.fails + 2);
+
+    CHECK(f_close(&fil[4]) == FR_OK);
+    ff_buffree(hog);
+    check_stat(0, st.allocs + 8, st.fails + 2);
+    for (int i = 0; i < 4; i++) {
+        sprintf(path, "F%d.BIN", i);
+        CHECK(f_unlink(path) == FR_OK);
+    }
+}
+
+static void test_early_release(void)
+{
+    static BYTE out[FILE_SIZE];
+    FF_POOLSTAT st;
+    FIL fil;
+    UINT br;
+
+    CHECK(f_open(&fil, "DATA.BIN", FA_READ) == FR_OK);
+    BYTE *cb = ff_bufalloc(4);
+    CHECK(cb);
+    CHECK(f_setbuf(&fil, cb, 4) == FR_OK);
+    CHECK(f_read(&fil, out, 1000, &br) == FR_OK && br == 1000);
+    // The caller is done with the buffer; the file still holds it.
+    ff_buffree(cb);
+    ff_poolstat(&st);
+    CHECK(st.used == 5);
+
+    // Everything else in the pool, scribbled over.
+    BYTE *rest = ff_bufalloc(FF_BUF_POOL - 5);
+    CHECK(rest && (rest >= cb + 4 * FF_MAX_SS || rest + (FF_BUF_POOL - 5) * FF_MAX_SS <= cb));
+    CHECK(ff_bufalloc(1) == NULL);
+    memset(rest, 0xa5, (FF_BUF_POOL - 5) * FF_MAX_SS);
+
+    // Read on through the buffer, and back over what is in it.
+    for (UINT ofs = 1000; ofs < FILE_SIZE; ofs += br)
+        CHECK(f_read(&fil, &out[ofs], 333, &br) == FR_OK && br > 0);
+    CHECK(f_lseek(&fil, FILE_SIZE - 3 * FF_MAX_SS) == FR_OK);
+    CHECK(f_read(&fil, out, 3 * FF_MAX_SS, &br) == FR_OK && br == 3 * FF_MAX_SS);
+    CHECK(memcmp(out, &data[FILE_SIZE - 3 * FF_MAX_SS], br) == 0);
+    CHECK(f_lseek(&fil, 0) == FR_OK);
+    CHECK(f_read(&fil, out, FILE_SIZE, &br) == FR_OK && br == FILE_SIZE);
+    CHECK(memcmp(out, data, FILE_SIZE) == 0);
+
+    // Closing drops the last reference.
+    CHECK(f_close(&fil) == FR_OK);
+    ff_poolstat(&st);
+    CHECK(st.used == FF_BUF_POOL - 5);
+    // The file's sector buffer and the 4 in front of the rest
+    BYTE *freed = ff_bufalloc(5);
+    CHECK(freed == base && cb == SECT(1));
+    ff_buffree(freed);
+    ff_buffree(rest);
+    ff_poolstat(&st);
+    CHECK(st.used == 0);
+}
+
+int main(void)
+{
+    FIL fil;
+    UINT bw;
+
+    CHECK(host_format(&fs, 65536, FM_FAT, 4096) == FR_OK);
+    srand(31);
+    for (int i = 0; i < FILE_SIZE; i++)
+        data[i] = (BYTE)rand();
+    CHECK(f_open(&fil, "DATA.BIN", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(&fil, data, FILE_SIZE, &bw) == FR_OK && bw == FILE_SIZE);
+    CHECK(f_close(&fil) == FR_OK);
+
+    test_first_fit();
+    test_exhausted();
+    test_early_release();
+    return 0;
+}
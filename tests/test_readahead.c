@@ -0,0 +1,198 @@
+// Read-ahead: card commands saved for short sequential reads, data and
+// pool sectors under random access and window changes, files opened
+// while others read ahead, and borrows of buffers that span clusters of
+// a FAT chain.
+
+#include "host.h"
+#include "ffsystem.h"
+#include <string.h>
+
+#define FILE_SIZE (3 * 1024 * 1024)
+
+static FATFS fs;
+static FIL fil;
+static BYTE data[FILE_SIZE];
+static BYTE out[FILE_SIZE];
+
+static void put_file(const char *path, const BYTE *src, UINT len)
+{
+    UINT bw;
+    CHECK(f_open(&fil, path, FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(&fil, src, len, &bw) == FR_OK && bw == len);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+static UINT pool_used(void)
+{
+    FF_POOLSTAT st;
+    ff_poolstat(&st);
+    return st.used;
+}
+
+static void test_sequential(void)
+{
+    static const UINT lens[] = { 64, 256 };
+    static const UINT windows[] = { 0, 2, 4 };
+    UINT br;
+
+    for (unsigned i = 0; i < sizeof lens / sizeof lens[0]; i++) {
+        uint32_t last = 0;
+        for (unsigned w = 0; w < sizeof windows / sizeof windows[0]; w++) {
+            FSIZE_t off = 0;
+            CHECK(f_open(&fil, "DATA.BIN", FA_READ) == FR_OK);
+            CHECK(f_readahead(&fil, windows[w]) == FR_OK);
+            uint32_t reads = disk_stats.reads;
+            uint64_t t0 = sim_us;
+            do {
+                CHECK(f_read(&fil, &out[off], lens[i], &br) == FR_OK);
+                off += br;
+            } while (br);
+            reads = disk_stats.reads - reads;
+            printf("%3u B reads, window %u: %5u card reads, %.2f s\n", lens[i],
+                   windows[w], reads, (sim_us - t0) / 1e6);
+            CHECK(f_close(&fil) == FR_OK);
+            CHECK(off == FILE_SIZE && memcmp(out, data, FILE_SIZE) == 0);
+            CHECK(w == 0 || reads < last);
+            last = reads;
+        }
+        CHECK(pool_used() == 0);
+    }
+}
+
+static void test_random(void)
+{
+    UINT br;
+
+    CHECK(f_open(&fil, "DATA.BIN", FA_READ) == FR_OK);
+    for (int i = 0; i < 4000; i++) {
+        // Runs of sequential reads from random places.
+        UINT ofs = (UINT)rand() % FILE_SIZE;
+        CHECK(f_lseek(&fil, ofs) == FR_OK);
+        for (int k = rand() % 40; k >= 0; k--) {
+            UINT len = (UINT)rand() % 700;
+            UINT want = ofs + len > FILE_SIZE ? FILE_SIZE - ofs : len;
+            CHECK(f_read(&fil, out, len, &br) == FR_OK);
+            CHECK(br == want && memcmp(out, &data[ofs], br) == 0);
+            ofs += br;
+        }
+        if (i % 500 == 0)
+            CHECK(f_readahead(&fil, (UINT)rand() % 9) == FR_OK);
+    }
+    CHECK(f_close(&fil) == FR_OK);
+    CHECK(pool_used() == 0);
+}
+
+// Read-ahead must leave the pool to files still to be opened: readers
+// loading in sequence, then as many more files as the lock table takes.
+static void test_many_open(void)
+{
+    enum { READERS = 4, SIZE = 64 * 1024 };
+    static FIL files[FF_FS_LOCK];
+    char path[16];
+    UINT br;
+
+    for (int i = 0; i < FF_FS_LOCK; i++) {
+        sprintf(path, "F%d.BIN", i);
+        put_file(path, &data[i * 1000], SIZE);
+    }
+    for (int i = 0; i < READERS; i++) {
+        sprintf(path, "F%d.BIN", i);
+        CHECK(f_open(&files[i], path, FA_READ) == FR_OK);
+        for (UINT ofs = 0; ofs < SIZE / 2; ofs += br) {
+            CHECK(f_read(&files[i], out, 256, &br) == FR_OK && br == 256);
+            CHECK(memcmp(out, &data[i * 1000 + ofs], br) == 0);
+        }
+    }
+    // The first reader has a window, but not one that takes the room
+    // of the files to come.
+    CHECK(files[0].raown && files[0].cbsz >= 2);
+    UINT ra = pool_used() - READERS;
+    CHECK(ra > 0 && pool_used() + FF_FS_LOCK - READERS <= FF_BUF_POOL);
+    printf("%d readers: %u pool sectors reading ahead\n", READERS, ra);
+
+    for (int i = READERS; i < FF_FS_LOCK; i++) {
+        sprintf(path, "F%d.BIN", i);
+        CHECK(f_open(&files[i], path, FA_READ) == FR_OK);
+    }
+    // The readers carry on, and every file reads to its end.
+    for (int i = 0; i < FF_FS_LOCK; i++) {
+        FSIZE_t ofs = f_tell(&files[i]);
+        CHECK(f_read(&files[i], out, SIZE, &br) == FR_OK && br == SIZE - ofs);
+        CHECK(memcmp(out, &data[i * 1000 + ofs], br) == 0);
+    }
+    for (int i = 0; i < FF_FS_LOCK; i++) {
+        CHECK(f_close(&files[i]) == FR_OK);
+        sprintf(path, "F%d.BIN", i);
+        CHECK(f_unlink(path) == FR_OK);
+    }
+    CHECK(pool_used() == 0);
+}
+
+// Borrow a file from the middle of its first cluster in odd-sized
+// pieces, with a pool buffer that spans clusters where the chain allows.
+static void check_borrows(const char *path, UINT size)
+{
+    const BYTE *p;
+    UINT br;
+    UINT off = 3072;
+
+    CHECK(f_open(&fil, path, FA_READ) == FR_OK);
+    CHECK(f_setbuf(&fil, NULL, 4) == FR_OK);
+    CHECK(f_lseek(&fil, off) == FR_OK);
+    for (int k = 0; ; k++) {
+        CHECK(f_borrow(&fil, &p, k & 1 ? 700 : 4096, &br) == FR_OK);
+        if (br == 0)
+            break;
+        CHECK(memcmp(p, &data[off], br) == 0);
+        off += br;
+        CHECK(f_release(&fil) == FR_OK);
+        // A read after the borrow continues from the right cluster.
+        if (k % 5 == 4 && off < size) {
+            CHECK(f_read(&fil, out, 100, &br) == FR_OK);
+            CHECK(memcmp(out, &data[off], br) == 0);
+            off += br;
+        }
+    }
+    CHECK(off == size);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+static void test_borrow_chain(void)
+{
+    UINT bw;
+
+    CHECK(host_format(&fs, 131072, FM_FAT, 4096) == FR_OK);
+
+    // One file with its clusters in order on the volume.
+    put_file("LINEAR.BIN", data, 64 * 1024);
+    check_borrows("LINEAR.BIN", 64 * 1024);
+
+    // Two files written a cluster at a time in turn, so that neither
+    // chain has two clusters next to each other.
+    static FIL other;
+    CHECK(f_open(&fil, "SPLIT.BIN", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_open(&other, "OTHER.BIN", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    for (UINT ofs = 0; ofs < 64 * 1024; ofs += 4096) {
+        CHECK(f_write(&fil, &data[ofs], 4096, &bw) == FR_OK);
+        CHECK(f_write(&other, &data[ofs], 4096, &bw) == FR_OK);
+    }
+    CHECK(f_close(&fil) == FR_OK);
+    CHECK(f_close(&other) == FR_OK);
+    check_borrows("SPLIT.BIN", 64 * 1024);
+    CHECK(pool_used() == 0);
+}
+
+int main(void)
+{
+    srand(36);
+    for (int i = 0; i < FILE_SIZE; i++)
+        data[i] = (BYTE)rand();
+
+    CHECK(host_format(&fs, 131072, FM_FAT32, 512) == FR_OK);
+    put_file("DATA.BIN", data, FILE_SIZE);
+    test_sequential();
+    test_random();
+    test_many_open();
+    test_borrow_chain();
+    return 0;
+}
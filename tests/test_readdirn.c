@@ -0,0 +1,230 @@
+// Batched directory reads: f_readdirn() returns what f_readdir() does, in
+// the same order, for batch sizes that divide the number of items and
+// sizes that do not, keeps returning 0 items at the end, and filters by
+// extension case-insensitively on long names, skipping directories.
+// Then the ls command of sdcard.c lists "dir/*.ext" through it, on FAT32
+// and exFAT, for a small directory and one with over a thousand items.
+
+#include "host.h"
+#include "sdcard.h"
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_ITEMS 1300
+
+typedef struct {
+    char name[FF_MAX_LFN + 1];
+    bool dir;
+} item_t;
+
+static FATFS *fs = &fs_storage;
+static item_t items[MAX_ITEMS];
+static unsigned nitems;
+
+// Names on the card, some matching "wav" in any case, some nearly.
+static const char *const names[] = {
+    "a.wav", "B.WAV", "Mixed Case Sound.Wav", "long name with spaces.wav", "x.wave",
+    "wav", "a.b.wav", "notes.txt", "README", "wav.txt", ".wav.bak", "Dot.wav.wav",
+    "UPPER CASE LONG NAME.WAV", "tiny.w", "kick.wav", "snare.WaV",
+};
+static const char *const dirs[] = { "sub.wav", "other" };
+
+static bool has_ext(const char *name, const char *ext)
+{
+    const char *dot = strrchr(name, '.');
+    if (*ext == '.')
+        ext++;
+    if (!dot)
+        return *ext == '\0';
+    return strcasecmp(dot + 1, ext) == 0;
+}
+
+// Everything in dir, from f_readdir()
+static void read_all(const char *dir)
+{
+    DIR dj;
+    FILINFO fno;
+
+    nitems = 0;
+    CHECK(f_opendir(&dj, dir) == FR_OK);
+    while (f_readdir(&dj, &fno) == FR_OK && fno.fname[0]) {
+        CHECK(nitems < MAX_ITEMS);
+        strcpy(items[nitems].name, fno.fname);
+        items[nitems++].dir = fno.fattrib & AM_DIR;
+    }
+    CHECK(f_closedir(&dj) == FR_OK);
+}
+
+// Read dir in batches of batch items and check them against items[].
+// Returns the number of items that passed the filter.
+static unsigned check_batches(const char *dir, UINT batch, const char *ext)
+{
+    static FILINFO fno[64];
+    DIR dj;
+    UINT n;
+    unsigned k = 0, got = 0, calls = 0;
+
+    CHECK(batch <= sizeof fno / sizeof fno[0]);
+    CHECK(f_opendir(&dj, dir) == FR_OK);
+    for (;;) {
+        CHECK(f_readdirn(&dj, fno, batch, &n, ext) == FR_OK);
+        calls++;
+        CHECK(n <= batch);
+        if (n == 0)
+            break;
+        for (UINT i = 0; i < n; i++) {
+            while (k < nitems && ext && (items[k].dir || !has_ext(items[k].name, ext)))
+                k++;
+            CHECK(k < nitems && strcmp(fno[i].fname, items[k].name) == 0);
+            k++;
+            got++;
+        }
+        // A short batch only at the end
+        if (n < batch) {
+            CHECK(f_readdirn(&dj, fno, batch, &n, ext) == FR_OK && n == 0);
+            calls++;
+            break;
+        }
+    }
+    // The end stays the end.
+    CHECK(f_readdirn(&dj, fno, batch, &n, ext) == FR_OK && n == 0);
+    while (k < nitems && ext && (items[k].dir || !has_ext(items[k].name, ext)))
+        k++;
+    CHECK(k == nitems);
+    CHECK(calls == got / batch + (got % batch != 0) + 1);
+    // And starts over after a rewind.
+    CHECK(f_rewinddir(&dj) == FR_OK);
+    CHECK(f_readdirn(&dj, fno, 1, &n, NULL) == FR_OK && n == 1);
+    CHECK(strcmp(fno[0].fname, items[0].name) == 0);
+    CHECK(f_closedir(&dj) == FR_OK);
+    return got;
+}
+
+// Run ls with the given arguments and return what it printed.
+static char *run_ls(int argc, char **argv)
+{
+    static char out[256 * 1024];
+    fflush(stdout);
+    int saved = dup(1);
+    FILE *tmp = tmpfile();
+    CHECK(saved >= 0 && tmp);
+    dup2(fileno(tmp), 1);
+    ls(argc, argv);
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+    rewind(tmp);
+    size_t len = fread(out, 1, sizeof out - 1, tmp);
+    CHECK(len < sizeof out - 1);
+    out[len] = '\0';
+    fclose(tmp);
+    return out;
+}
+
+// ls of pattern must print prefix/name for every file of items[] with the
+// extension, in order, and nothing else.
+static void check_ls(const char *pattern, const char *prefix, const char *ext)
+{
+    char *argv[] = { "ls", (char *)pattern };
+    char *out = run_ls(2, argv), line[FF_MAX_LFN + 64];
+    unsigned listed = 0;
+
+    for (unsigned k = 0; k < nitems; k++) {
+        if (items[k].dir || !has_ext(items[k].name, ext))
+            continue;
+        CHECK(snprintf(line, sizeof line, "%s%s\n", prefix, items[k].name) < (int)sizeof line);
+        CHECK(strncmp(out, line, strlen(line)) == 0);
+        out += strlen(line);
+        listed++;
+    }
+    CHECK(*out == '\0');
+    CHECK(listed > 0);
+}
+
+static void touch(const char *path)
+{
+    FIL fil;
+    CHECK(f_open(&fil, path, FA_WRITE|FA_CREATE_NEW) == FR_OK);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+static void test_small(void)
+{
+    char path[FF_MAX_LFN + 8];
+
+    CHECK(f_mkdir("snd") == FR_OK);
+    for (unsigned i = 0; i < sizeof names / sizeof names[0]; i++) {
+        snprintf(path, sizeof path, "snd/%s", names[i]);
+        touch(path);
+        if (i == 5) {
+            for (unsigned d = 0; d < sizeof dirs / sizeof dirs[0]; d++) {
+                snprintf(path, sizeof path, "snd/%s", dirs[d]);
+                CHECK(f_mkdir(path) == FR_OK);
+            }
+        }
+    }
+    read_all("snd");
+    CHECK(nitems == sizeof names / sizeof names[0] + sizeof dirs / sizeof dirs[0]);
+
+    // 18 items: batches that divide it and that do not, both filtered
+    // (9 .wav files) and not.
+    static const UINT batches[] = { 1, 2, 3, 4, 5, 8, 9, 17, 18, 19, 64 };
+    for (unsigned b = 0; b < sizeof batches / sizeof batches[0]; b++) {
+        CHECK(check_batches("snd", batches[b], NULL) == nitems);
+        CHECK(check_batches("snd", batches[b], "wav") == 9);
+        CHECK(check_batches("snd", batches[b], ".WAV") == 9);
+        CHECK(check_batches("snd", batches[b], "txt") == 2);
+        CHECK(check_batches("snd", batches[b], "") == 2);  // wav, README
+        CHECK(check_batches("snd", batches[b], "bak") == 1);
+        CHECK(check_batches("snd", batches[b], "mp3") == 0);
+    }
+
+    check_ls("snd/*.wav", "snd/", "wav");
+    check_ls("snd/*.WAV", "snd/", "wav");
+    check_ls("snd/*.txt", "snd/", "txt");
+    CHECK(f_chdir("snd") == FR_OK);
+    check_ls("*.Wav", "", "wav");
+    CHECK(f_chdir("/") == FR_OK);
+    touch("root.txt");
+    read_all("/");
+    check_ls("/*.TXT", "/", "txt");
+    CHECK(f_unlink("root.txt") == FR_OK);
+    read_all("snd");
+    // No match prints nothing.
+    char *argv[] = { "ls", "snd/*.mp3" };
+    CHECK(*run_ls(2, argv) == '\0');
+}
+
+static void test_large(void)
+{
+    char path[64];
+
+    CHECK(f_mkdir("big") == FR_OK);
+    for (unsigned i = 0; i < 1200; i++) {
+        snprintf(path, sizeof path, "big/Asset number %04u.%s", i,
+                 i % 3 == 0 ? "wav" : i % 3 == 1 ? "WAV" : "bin");
+        touch(path);
+    }
+    read_all("big");
+    CHECK(nitems == 1200);
+    uint32_t reads = disk_stats.reads;
+    CHECK(check_batches("big", 8, NULL) == 1200);
+    CHECK(check_batches("big", 7, "wav") == 800);
+    CHECK(check_batches("big", 64, "bin") == 400);
+    printf("  1200 items read 3 times in batches: %u card reads\n", disk_stats.reads - reads);
+    check_ls("big/*.wav", "big/", "wav");
+}
+
+int main(void)
+{
+    static const BYTE fmts[] = { FM_FAT32, FM_EXFAT };
+
+    for (unsigned f = 0; f < sizeof fmts / sizeof fmts[0]; f++) {
+        CHECK(host_format(fs, 131072, fmts[f], 512) == FR_OK);
+        printf("%s\n", fs->fs_type == FS_EXFAT ? "exFAT" : "FAT32");
+        test_small();
+        test_large();
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+// The volume lock: FatFs built thread-safe (FF_HOST_THREADS), with the
+// pico-sdk mutex on a pthread one, and two threads standing for the two
+// cores.  Each hammers the one volume with its own files, small writes,
+// reads, seeks, syncs, and files created and deleted in the shared root
+// directory, and everything must read back intact.  The lock statistics
+// must count every grant the same workload takes on one thread, and the
+// time the lock was held must be all of the card time, which only passes
+// under the lock.  Then a thread stalls inside a card read and the other
+// must give up after FF_FS_TIMEOUT with FR_TIMEOUT, counted as a timeout.
+
+#include "host.h"
+#include "ffsystem.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+
+#define ROUNDS 300
+#define FILE_SIZE (48 * 1024)
+
+static FATFS fs;
+
+// Content of byte i of the file of thread t
+static BYTE pattern(int t, FSIZE_t i)
+{
+    return (BYTE)(i * (t + 3) ^ i >> 9 ^ t * 0x55);
+}
+
+// Let the other thread run in the middle of card reads, with the lock
+// held, so that it runs into it.
+static void yield(void)
+{
+    sched_yield();
+}
+
+static void *worker(void *arg)
+{
+    int t = (int)(intptr_t)arg;
+    char path[16], tmp[16];
+    static BYTE bufs[2][4096];
+    BYTE *buf = bufs[t];
+    unsigned seed = 30 + t;
+    FIL fil;
+    UINT n;
+
+    sprintf(path, "T%d.BIN", t);
+    CHECK(f_open(&fil, path, FA_READ|FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    for (int r = 0; r < ROUNDS; r++) {
+        // Write a piece somewhere in the file, then read back another.
+        FSIZE_t ofs = rand_r(&seed) % FILE_SIZE;
+        UINT len = 1 + rand_r(&seed) % sizeof bufs[0];
+        if (ofs + len > FILE_SIZE)
+            len = (UINT)(FILE_SIZE - ofs);
+        if (ofs > f_size(&fil))
+            ofs = f_size(&fil);
+        for (UINT i = 0; i < len; i++)
+            buf[i] = pattern(t, ofs + i);
+        CHECK(f_lseek(&fil, ofs) == FR_OK);
+        CHECK(f_write(&fil, buf, len, &n) == FR_OK && n == len);
+
+        ofs = rand_r(&seed) % (f_size(&fil) + 1);
+        CHECK(f_lseek(&fil, ofs) == FR_OK);
+        CHECK(f_read(&fil, buf, sizeof bufs[0], &n) == FR_OK);
+        CHECK(n == (UINT)(f_size(&fil) - ofs < sizeof bufs[0] ? f_size(&fil) - ofs
+                                                             : sizeof bufs[0]));
+        for (UINT i = 0; i < n; i++)
+            CHECK(buf[i] == pattern(t, ofs + i));
+
+        if (r % 10 == 0)
+            CHECK(f_sync(&fil) == FR_OK);
+        if (r % 25 == 0) {
+            // The directory and the FAT are shared.
+            FIL f;
+            sprintf(tmp, "S%d_%d.TMP", t, r);
+            CHECK(f_open(&f, tmp, FA_WRITE|FA_CREATE_NEW) == FR_OK);
+            CHECK(f_write(&f, bufs[t], 1500, &n) == FR_OK && n == 1500);
+            CHECK(f_close(&f) == FR_OK);
+            if (r % 50 == 0)
+                CHECK(f_unlink(tmp) == FR_OK);
+        }
+    }
+    CHECK(f_close(&fil) == FR_OK);
+    return NULL;
+}
+
+static void check_files(int threads)
+{
+    static BYTE buf[4096];
+    FIL fil;
+    UINT n;
+    char path[16];
+
+    for (int t = 0; t < threads; t++) {
+        sprintf(path, "T%d.BIN", t);
+        CHECK(f_open(&fil, path, FA_READ) == FR_OK);
+        FSIZE_t ofs = 0;
+        do {
+            CHECK(f_read(&fil, buf, sizeof buf, &n) == FR_OK);
+            for (UINT i = 0; i < n; i++)
+                CHECK(buf[i] == pattern(t, ofs + i));
+            ofs += n;
+        } while (n);
+        CHECK(f_size(&fil) > FILE_SIZE / 2);
+        CHECK(f_close(&fil) == FR_OK);
+    }
+}
+
+// Run the workload on the given number of threads, on a fresh volume,
+// and return the lock statistics and the card time it took.
+static void run(int threads, FF_LOCKSTAT *st, uint64_t *card_us)
+{
+    pthread_t th[2];
+
+    CHECK(host_format(&fs, 65536, FM_FAT, 4096) == FR_OK);
+    ff_lockstat(0, st, 1);
+    uint64_t t0 = sim_us;
+    for (int t = 0; t < threads; t++)
+        CHECK(pthread_create(&th[t], NULL, worker, (void *)(intptr_t)t) == 0);
+    for (int t = 0; t < threads; t++)
+        CHECK(pthread_join(th[t], NULL) == 0);
+    *card_us = sim_us - t0;
+    ff_lockstat(0, st, 1);
+    check_files(threads);
+}
+
+static void test_stress(void)
+{
+    FF_LOCKSTAT one, two;
+    uint64_t one_us, two_us;
+
+    run(1, &one, &one_us);
+    disk_hook = yield;
+    run(2, &two, &two_us);
+    disk_hook = NULL;
+    printf("one thread: %u grants; two: %u grants, %u contended, wait max %u total %llu us, "
+           "hold max %u total %llu us of %llu us card time\n",
+           one.grants, two.grants, two.contended, two.max_wait,
+           (unsigned long long)two.total_wait, two.max_hold,
+           (unsigned long long)two.total_hold, (unsigned long long)two_us);
+
+    // The second thread's workload takes the lock as often as the first.
+    CHECK(one.contended == 0 && one.total_wait == 0);
+    CHECK(two.grants == 2 * one.grants);
+    CHECK(two.contended > 0 && two.contended < two.grants);
+    CHECK(two.max_wait > 0 && two.max_wait <= two.total_wait);
+    CHECK(two.total_wait <= two.total_hold);
+    CHECK(one.timeouts == 0 && two.timeouts == 0);
+    // The card is only used under the lock.
+    CHECK(one.total_hold == one_us && two.total_hold == two_us);
+    CHECK(two.max_hold > 0 && two.max_hold <= two.total_hold);
+}
+
+static sem_t stalled, resume;
+static pthread_t staller;
+
+static void stall(void)
+{
+    if (pthread_equal(pthread_self(), staller)) {
+        disk_hook = NULL;
+        sem_post(&stalled);
+        sem_wait(&resume);
+    }
+}
+
+static void *stall_read(void *arg)
+{
+    static BYTE buf[FF_MAX_SS];
+    FIL *fil = arg;
+    UINT n;
+    CHECK(f_read(fil, buf, sizeof buf, &n) == FR_OK && n == sizeof buf);
+    return NULL;
+}
+
+static void test_timeout(void)
+{
+    FF_LOCKSTAT st;
+    FILINFO fno;
+    FIL fil;
+
+    // Drop the cached sectors so that the read goes to the card.
+    CHECK(f_mount(&fs, "", 1) == FR_OK);
+    CHECK(f_open(&fil, "T0.BIN", FA_READ) == FR_OK);
+    sem_init(&stalled, 0, 0);
+    sem_init(&resume, 0, 0);
+    ff_lockstat(0, &st, 1);
+    disk_hook = stall;
+    CHECK(pthread_create(&staller, NULL, stall_read, &fil) == 0);
+    sem_wait(&stalled);
+    // The reader holds the lock until it is let go.
+    CHECK(f_stat("T1.BIN", &fno) == FR_TIMEOUT);
+    sem_post(&resume);
+    CHECK(pthread_join(staller, NULL) == 0);
+    CHECK(f_stat("T1.BIN", &fno) == FR_OK);
+    CHECK(f_close(&fil) == FR_OK);
+    ff_lockstat(0, &st, 0);
+    printf("a stalled reader: %u timeout after %d ms\n", st.timeouts, FF_FS_TIMEOUT);
+    CHECK(st.timeouts == 1);
+}
+
+int main(void)
+{
+    test_stress();
+    test_timeout();
+    return 0;
+}
@@ -0,0 +1,227 @@
+// Noise shaping at the default MIXER_PWM_BITS: a 997 Hz sine through
+// mixer_pwm_levels() against the same sine truncated to that many bits
+// and to 8, as the signal-to-noise ratio below BAND_HZ, where the shaping
+// is meant to leave little of the error.  Loud and quiet sines are both
+// checked, and frames that are exactly 0 where a sine crosses zero must
+// not cost it in-band noise.  After the sound stops the output settles
+// at the midpoint and stays there, from the frame after SILENT_RUN
+// silent ones on when a block ends in them.  Last, the cost per frame of
+// mixer_pwm_levels() against the two passes it replaced.
+
+#include "mixer.h"
+#include "audio.h"
+#include "host.h"
+#include <math.h>
+#include <string.h>
+
+#define N 16384
+#define TONE_HZ 997.0
+#define BAND_HZ 4000
+#define MID ((MIXER_PWM_PERIOD + 1) / 2)
+#define SILENT_RUN 64          // as in mixer.c
+
+static int16_t x[N];
+static double window[N], twiddle[2][N];
+
+// Power below BAND_HZ, from 20 Hz, of s over the Hann-windowed frames.
+// The window keeps the noise pushed towards half the sample rate from
+// leaking into the band.
+static double band_power(const double *s)
+{
+    static double ws[N];
+    double p = 0;
+    for (int i = 0; i < N; i++)
+        ws[i] = s[i] * window[i];
+    for (int k = 20 * N / AUDIO_RATE; k <= BAND_HZ * N / AUDIO_RATE; k++) {
+        double re = 0, im = 0;
+        for (int i = 0, j = 0; i < N; i++, j = (j + k) % N) {
+            re += ws[i] * twiddle[0][j];
+            im += ws[i] * twiddle[1][j];
+        }
+        p += re * re + im * im;
+    }
+    return p;
+}
+
+// The signal-to-noise ratio in the band, in dB, of levels of bits bits
+static double snr(const uint32_t *level, unsigned bits)
+{
+    static double sig[N], err[N];
+    for (int i = 0; i < N; i++) {
+        sig[i] = x[i];
+        err[i] = ((double)level[i] - (1 << (bits - 1))) * (1 << (16 - bits)) - x[i];
+    }
+    return 10 * log10(band_power(sig) / band_power(err));
+}
+
+static void sine(double amplitude)
+{
+    for (int i = 0; i < N; i++)
+        x[i] = (int16_t)lrint(amplitude * sin(2 * M_PI * TONE_HZ * i / AUDIO_RATE));
+}
+
+// The right levels of x through the shaper, a block at a time
+static void shaped(uint32_t *level, mixer_shaper_t *ns)
+{
+    static int32_t acc[2 * AUDIO_BLOCK_SAMPLES];
+    static uint32_t out[AUDIO_BLOCK_SAMPLES];
+    for (int b = 0; b < N; b += AUDIO_BLOCK_SAMPLES) {
+        for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++)
+            acc[2 * i] = acc[2 * i + 1] = x[b + i] * MIXER_UNITY;
+        mixer_pwm_levels(out, acc, AUDIO_BLOCK_SAMPLES, ns);
+        for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+            CHECK(out[i] >> 16 == (out[i] & 0xffff));
+            level[b + i] = out[i] & 0xffff;
+        }
+    }
+}
+
+static void test_snr(void)
+{
+    static const double dbfs[] = { -1, -6, -20, -40, -60 };
+    static uint32_t level[N], plain[N], byte[N];
+
+    for (unsigned a = 0; a < count_of(dbfs); a++) {
+        mixer_shaper_t ns = { { 0 }, { 0 }, { 0 } };
+        sine(32767 * pow(10, dbfs[a] / 20));
+        unsigned zeros = 0;
+        for (int i = 0; i < N; i++) {
+            plain[i] = (uint32_t)(x[i] + 32768) >> (16 - MIXER_PWM_BITS);
+            byte[i] = (uint32_t)(x[i] + 32768) >> 8;
+            zeros += x[i] == 0;
+        }
+        shaped(level, &ns);     // settle
+        shaped(level, &ns);
+        double s = snr(level, MIXER_PWM_BITS), p = snr(plain, MIXER_PWM_BITS);
+        double b = snr(byte, 8);
+        // The same sine with no frame exactly 0, to see what the zero
+        // crossings cost
+        for (int i = 0; i < N; i++)
+            x[i] += x[i] == 0;
+        shaped(level, &ns);
+        shaped(level, &ns);
+        double nz = snr(level, MIXER_PWM_BITS);
+        printf("%3.0f dBFS, %4u zero frames: shaped %5.1f dB (%5.1f without zeros), "
+               "truncated %5.1f dB, 8 bits %5.1f dB below %d Hz\n",
+               dbfs[a], zeros, s, nz, p, b, BAND_HZ);
+        CHECK(s > p + 10);
+        CHECK(s > b + 20);
+        CHECK(s > nz - 1);
+    }
+}
+
+static void test_silence(void)
+{
+    static uint32_t level[N];
+    mixer_shaper_t ns = { { 0 }, { 0 }, { 0 } };
+
+    sine(10000);
+    shaped(level, &ns);
+    memset(x, 0, sizeof x);
+    shaped(level, &ns);
+    int settled = N;
+    while (settled > 0 && level[settled - 1] == MID)
+        settled--;
+    printf("midpoint for good %d frames after the sound\n", settled);
+    CHECK(settled <= 128);     // twice the silence the shaper waits for
+    CHECK(ns.e1[0] == 0 && ns.e2[0] == 0 && ns.e1[1] == 0 && ns.e2[1] == 0);
+}
+
+// Blocks of sound ending in 30, 64 and 100 silent frames, then one of
+// silence: the error goes where the run passes SILENT_RUN, and not before.
+static void test_drop(void)
+{
+    static int32_t acc[2 * AUDIO_BLOCK_SAMPLES];
+    static uint32_t out[AUDIO_BLOCK_SAMPLES];
+    static const unsigned tails[] = { 30, SILENT_RUN, 100 };
+    const unsigned n = AUDIO_BLOCK_SAMPLES;
+
+    for (unsigned t = 0; t < count_of(tails); t++) {
+        mixer_shaper_t ns = { { 0 }, { 0 }, { 0 } };
+        for (unsigned i = 0; i < 2 * n; i++)
+            acc[i] = i < 2 * (n - tails[t]) ? ((int32_t)(i * 7919 % 20000) - 10000) * 256 + 77 : 0;
+        mixer_pwm_levels(out, acc, n, &ns);
+        unsigned quiet = tails[t] < SILENT_RUN ? tails[t] : SILENT_RUN;
+        CHECK(ns.quiet[0] == quiet && ns.quiet[1] == quiet);
+        unsigned mid = 0;
+        while (mid < n && out[n - 1 - mid] == (MID << 16 | MID))
+            mid++;
+        if (tails[t] > SILENT_RUN) {
+            CHECK(mid >= tails[t] - SILENT_RUN);
+            CHECK(ns.e1[0] == 0 && ns.e2[0] == 0 && ns.e1[1] == 0 && ns.e2[1] == 0);
+        } else {
+            CHECK(ns.e1[0] != 0 || ns.e2[0] != 0);
+        }
+        // Still silent: the rest of the run is dropped in the next block.
+        memset(acc, 0, sizeof acc);
+        mixer_pwm_levels(out, acc, n, &ns);
+        mid = 0;
+        while (mid < n && out[n - 1 - mid] == (MID << 16 | MID))
+            mid++;
+        CHECK(mid >= n - (tails[t] < SILENT_RUN ? SILENT_RUN - tails[t] : 0));
+        CHECK(ns.e1[0] == 0 && ns.e2[0] == 0 && ns.quiet[0] == SILENT_RUN);
+    }
+}
+
+// What each frame went through before the shaper: saturated to 16 bits
+// in one pass and cut to 8-bit levels in another.  Kept from
+// vectorizing, which the M33 cannot do either.
+__attribute__((optimize("no-tree-vectorize")))
+static void saturate_pass(int16_t *dst, const int32_t *acc, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++) {
+        int32_t v = acc[i] >> MIXER_SHIFT;
+        dst[i] = v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+    }
+}
+
+__attribute__((optimize("no-tree-vectorize")))
+static void byte_pass(uint32_t *dst, const int16_t *pcm, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++, pcm += 2) {
+        int32_t l = (pcm[0] >> 8) + 127, r = (pcm[1] >> 8) + 127;
+        dst[i] = (uint32_t)(l < 0 ? 0 : l) << 16 | (r < 0 ? 0 : r);
+    }
+}
+
+// Nanoseconds per frame on this machine, for a block of sound
+static void test_cost(void)
+{
+    static int32_t acc[2 * AUDIO_BLOCK_SAMPLES];
+    static int16_t pcm[2 * AUDIO_BLOCK_SAMPLES];
+    static uint32_t out[AUDIO_BLOCK_SAMPLES];
+    mixer_shaper_t ns = { { 0 }, { 0 }, { 0 } };
+    const int blocks = 100000;
+
+    sine(20000);
+    for (int i = 0; i < 2 * AUDIO_BLOCK_SAMPLES; i++)
+        acc[i] = x[i] * MIXER_UNITY * 3 / 2;
+    double t = wall_seconds();
+    for (int b = 0; b < blocks; b++) {
+        mixer_pwm_levels(out, acc, AUDIO_BLOCK_SAMPLES, &ns);
+        __asm__ volatile("" ::: "memory");
+    }
+    double shaped = (wall_seconds() - t) * 1e9 / blocks / AUDIO_BLOCK_SAMPLES;
+    t = wall_seconds();
+    for (int b = 0; b < blocks; b++) {
+        saturate_pass(pcm, acc, 2 * AUDIO_BLOCK_SAMPLES);
+        byte_pass(out, pcm, AUDIO_BLOCK_SAMPLES);
+        __asm__ volatile("" ::: "memory");
+    }
+    printf("shaped levels %.2f ns/frame, saturate and 8-bit passes %.2f ns/frame\n", shaped,
+           (wall_seconds() - t) * 1e9 / blocks / AUDIO_BLOCK_SAMPLES);
+}
+
+int main(void)
+{
+    for (int i = 0; i < N; i++) {
+        window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / N);
+        twiddle[0][i] = cos(2 * M_PI * i / N);
+        twiddle[1][i] = -sin(2 * M_PI * i / N);
+    }
+    test_snr();
+    test_silence();
+    test_drop();
+    test_cost();
+    return 0;
+}
@@ -0,0 +1,158 @@
+// Stereo output: both levels of a frame go out in one CC value, left in
+// the high half (channel B) and right in the low half (channel A).  A
+// short stereo file comes out as a table of CC values worked out by hand,
+// from 16-bit and 8-bit data; a mono file carries its samples on both
+// halves; and a left-only and a right-only file played together each move
+// only their own half.
+//
+// Built with 16-bit PWM levels, so a sample of k * 256 at volume 255 is
+// the level k * 255 + 32768.
+
+#include "audio_sim.h"
+#include "audio.h"
+#include <string.h>
+
+#define MID 0x8000u
+#define SILENT (MID << 16 | MID)
+#define NFRAMES 30000
+
+static FATFS *fs = &fs_storage;
+
+// Left and right in units of 256, and the CC values they give at volume 255
+static const int8_t golden_in[8][2] = {
+    { 1, 0 }, { 0, 1 }, { -1, -1 }, { 127, -128 },
+    { -128, 127 }, { 64, -64 }, { 0, 0 }, { 100, -100 },
+};
+static const uint32_t golden_out[8] = {
+    0x80ff8000, 0x800080ff, 0x7f017f01, 0xfe810080,
+    0x0080fe81, 0xbfc04040, 0x80008000, 0xe39c1c64,
+};
+
+static int16_t left[2 * NFRAMES], right[2 * NFRAMES];
+
+// The first frame after the silence before a sound
+static uint32_t first_sound(void)
+{
+    uint32_t i = 0;
+    while (i < sim_nout && sim_out[i] == SILENT)
+        i++;
+    CHECK(i < sim_nout);
+    return i;
+}
+
+// Play a looping file until n frames have gone out, then stop it.
+static void loop_for(const char *path, uint32_t n)
+{
+    sim_frames(2 * AUDIO_BLOCK_SAMPLES);
+    int v = audio_play(path, 255, true);
+    CHECK(v >= 0);
+    sim_nout = 0;
+    while (sim_nout < n) {
+        audio_service();
+        sim_run(2000);
+    }
+    audio_stop_voice(v);
+}
+
+static void test_golden(void)
+{
+    int16_t s16[16];
+    BYTE s8[16], mono[8 * 2], fmt[16];
+
+    for (int i = 0; i < 8; i++) {
+        for (int c = 0; c < 2; c++) {
+            s16[2 * i + c] = (int16_t)(golden_in[i][c] * 256);
+            s8[2 * i + c] = (BYTE)(golden_in[i][c] + 128);
+        }
+        memcpy(&mono[2 * i], &s16[2 * i], 2);
+    }
+    sim_wav("g16.wav", fmt, sim_pcm_fmt(fmt, 2, AUDIO_RATE, 16), s16, sizeof s16, 0);
+    sim_wav("g8.wav", fmt, sim_pcm_fmt(fmt, 2, AUDIO_RATE, 8), s8, sizeof s8, 0);
+    sim_wav("gm.wav", fmt, sim_pcm_fmt(fmt, 1, AUDIO_RATE, 16), mono, sizeof mono, 0);
+
+    static const char *const stereo[] = { "g16.wav", "g8.wav" };
+    for (int k = 0; k < 2; k++) {
+        loop_for(stereo[k], 4000);
+        uint32_t i = first_sound();
+        for (uint32_t j = 0; j < 3000; i++, j++)
+            CHECK(sim_out[i] == golden_out[j % 8]);
+    }
+
+    // The left column as a mono file: the left level on both sides
+    loop_for("gm.wav", 4000);
+    uint32_t i = first_sound();
+    for (uint32_t j = 0; j < 3000; i++, j++) {
+        uint32_t l = golden_out[j % 8] >> 16;
+        CHECK(sim_out[i] == (l << 16 | l));
+    }
+    printf("3 files match the golden CC values\n");
+}
+
+static void test_separation(void)
+{
+    BYTE fmt[16];
+
+    srand(46);
+    for (int i = 0; i < NFRAMES; i++) {
+        int a, b;
+        do {
+            a = rand() % 255 - 127;
+            b = rand() % 255 - 127;
+        } while (a == 0 || b == 0);
+        left[2 * i] = (int16_t)(a * 256);
+        right[2 * i + 1] = (int16_t)(b * 256);
+    }
+    sim_wav("left.wav", fmt, sim_pcm_fmt(fmt, 2, AUDIO_RATE, 16), left, sizeof left, 0);
+    sim_wav("right.wav", fmt, sim_pcm_fmt(fmt, 2, AUDIO_RATE, 16), right, sizeof right, 0);
+
+    // Alone, a one-sided file leaves the other half at the midpoint.
+    static const char *const one[] = { "left.wav", "right.wav" };
+    for (int k = 0; k < 2; k++) {
+        loop_for(one[k], NFRAMES);
+        for (uint32_t i = first_sound(), j = 0; i < sim_nout; i++, j++) {
+            uint32_t l = (uint32_t)(left[2 * (j % NFRAMES)] / 256 * 255 + (int)MID);
+            uint32_t r = (uint32_t)(right[2 * (j % NFRAMES) + 1] / 256 * 255 + (int)MID);
+            CHECK(sim_out[i] == (k == 0 ? l << 16 | MID : MID << 16 | r));
+        }
+    }
+
+    // Together, at different volumes, each keeps to its own half.
+    sim_frames(2 * AUDIO_BLOCK_SAMPLES);
+    int vl = audio_play("left.wav", 200, false);
+    int vr = audio_play("right.wav", 77, false);
+    CHECK(vl >= 0 && vr >= 0);
+    sim_nout = 0;
+    while (audio_playing(vl) || audio_playing(vr)) {
+        audio_service();
+        sim_run(2000);
+    }
+    sim_frames(2 * AUDIO_BLOCK_SAMPLES);
+    // Opening the second file reads the card, so it may start a block
+    // later.  No sample is 0, so each side starts at its first sound.
+    uint32_t il = 0, ir = 0;
+    while (il < sim_nout && sim_out[il] >> 16 == MID)
+        il++;
+    while (ir < sim_nout && (sim_out[ir] & 0xffff) == MID)
+        ir++;
+    for (uint32_t i = 0; i < sim_nout; i++) {
+        uint32_t l = MID, r = MID;
+        if (i >= il && i - il < NFRAMES)
+            l = (uint32_t)(left[2 * (i - il)] / 256 * 200 + (int)MID);
+        if (i >= ir && i - ir < NFRAMES)
+            r = (uint32_t)(right[2 * (i - ir) + 1] / 256 * 77 + (int)MID);
+        CHECK(sim_out[i] == (l << 16 | r));
+    }
+    CHECK(il + NFRAMES < sim_nout && ir + NFRAMES < sim_nout);
+    printf("%d frames of left and right kept apart\n", NFRAMES);
+}
+
+int main(void)
+{
+    CHECK(host_format(fs, 65536, FM_FAT, 4096) == FR_OK);
+    sim_init(2 * NFRAMES);
+    audio_init();
+    test_golden();
+    test_separation();
+    audio_stop();
+    return 0;
+}
@@ -0,0 +1,156 @@
+// Streaming playback: a file many times the size of a voice's ring
+// comes out of the simulated DMA sample by sample in order, with the main
+// loop stalling for longer and longer between audio_service() calls, and
+// a looping file comes round again without a seam, also when it is
+// shorter than a segment.  Silence may only appear where a block was
+// counted as an underrun.
+//
+// Built with 16-bit PWM levels and samples whose low byte is 0, so every
+// level is the sample exactly: (k - 128) * volume + 32768.
+
+#include "audio_sim.h"
+#include "audio.h"
+#include <string.h>
+
+#define NSAMPLES 300000
+#define VOLUME 255
+#define MID 0x8000u
+
+static FATFS *fs = &fs_storage;
+static int16_t data[NSAMPLES];
+
+static uint32_t level(int16_t s)
+{
+    uint32_t l = (uint32_t)(s / 256 * VOLUME + MID);
+    return l << 16 | l;
+}
+
+// Check the output against the file: every sample once and in order,
+// from the first sound on, with midpoints only between blocks.  Returns
+// the silent frames before the last sample.
+static uint32_t check_order(bool loop, uint32_t *played)
+{
+    uint32_t i = 0, j = 0, gaps = 0, pending = 0;
+    while (i < sim_nout && sim_out[i] == (MID << 16 | MID))
+        i++;
+    for (; i < sim_nout; i++) {
+        if (sim_out[i] == (MID << 16 | MID)) {
+            pending++;
+            continue;
+        }
+        CHECK(pending % AUDIO_BLOCK_SAMPLES == 0);
+        gaps += pending;
+        pending = 0;
+        CHECK(loop || j < NSAMPLES);
+        CHECK(sim_out[i] == level(data[j % NSAMPLES]));
+        j++;
+    }
+    *played = j;
+    return gaps;
+}
+
+static void test_stalls(void)
+{
+    static const uint32_t stall_ms[] = { 1, 5, 10, 20, 40, 150 };
+    audio_stats_t st;
+
+    for (unsigned s = 0; s < count_of(stall_ms); s++) {
+        uint32_t played, reads = disk_stats.reads;
+        srand(41);
+        audio_reset_stats();
+        sim_nout = 0;
+        int v = audio_play("long.wav", VOLUME, false);
+        CHECK(v >= 0);
+        while (audio_playing(v)) {
+            audio_service();
+            sim_run(rand() % (stall_ms[s] * 1000));
+        }
+        // The last blocks mixed are still to go out.
+        sim_frames(2 * AUDIO_BLOCK_SAMPLES);
+        audio_service();
+        audio_get_stats(&st);
+        uint32_t gaps = check_order(false, &played);
+        printf("stalls up to %3u ms: %u samples in order, %u underrun frames, %u card reads\n",
+               stall_ms[s], played, st.underruns, disk_stats.reads - reads);
+        CHECK(played == NSAMPLES);
+        CHECK(gaps == st.underruns);
+        // A ring refilled at AUDIO_LOW_WATER segments rides out 46 ms.
+        if (stall_ms[s] <= 40)
+            CHECK(st.underruns == 0);
+    }
+}
+
+static void test_loop(void)
+{
+    uint32_t played;
+    sim_nout = 0;
+    int v = audio_play("long.wav", VOLUME, true);
+    CHECK(v >= 0);
+    while (sim_nout < 5 * NSAMPLES / 2) {
+        audio_service();
+        sim_run(2000);
+    }
+    audio_stop_voice(v);
+    CHECK(check_order(true, &played) == 0);
+    CHECK(played > 2 * NSAMPLES);
+}
+
+// A loop shorter than a segment still fills the ring with a block's
+// worth of samples, and repeats without a gap.
+static void test_short_loop(void)
+{
+    static const uint16_t lens[] = {
+        1, 7, 100, AUDIO_SEGMENT_SAMPLES - 1, AUDIO_SEGMENT_SAMPLES + 3,
+    };
+    BYTE fmt[16];
+    audio_stats_t st;
+
+    for (unsigned k = 0; k < count_of(lens); k++) {
+        sim_wav("short.wav", fmt, sim_pcm_fmt(fmt, 1, AUDIO_RATE, 16), data, lens[k] * 2, 0);
+        audio_reset_stats();
+        sim_frames(2 * AUDIO_BLOCK_SAMPLES);    // the blocks already queued
+        int v = audio_play("short.wav", VOLUME, true);
+        CHECK(v >= 0);
+        sim_nout = 0;
+        while (sim_nout < 20 * AUDIO_BLOCK_SAMPLES) {
+            audio_service();
+            sim_run(2000);
+        }
+        audio_stop_voice(v);
+        audio_get_stats(&st);
+        CHECK(st.underruns == 0);
+        uint32_t i = 0;
+        while (sim_out[i] == (MID << 16 | MID))
+            i++;
+        CHECK(i <= 2 * AUDIO_BLOCK_SAMPLES + 2);
+        for (uint32_t j = 0; i < sim_nout; i++, j++)
+            CHECK(sim_out[i] == level(data[j % lens[k]]));
+    }
+}
+
+int main(void)
+{
+    BYTE fmt[16];
+
+    CHECK(host_format(fs, 131072, FM_FAT, 4096) == FR_OK);
+    srand(1);
+    for (int i = 0; i < NSAMPLES; i++) {
+        int k;
+        do
+            k = rand() & 0xff;
+        while (k == 128);
+        data[i] = (int16_t)((k - 128) * 256);
+    }
+    sim_wav("long.wav", fmt, sim_pcm_fmt(fmt, 1, AUDIO_RATE, 16), data, sizeof data, 30);
+    CHECK(f_mount(NULL, "", 0) == FR_OK);
+
+    sim_init(3 * NSAMPLES);
+    audio_init();
+    test_stalls();
+    test_loop();
+    test_short_loop();
+    printf("%u bytes of ring per voice for a %u byte file\n",
+           (unsigned)(AUDIO_SEGMENTS * AUDIO_SEGMENT_SAMPLES * sizeof(int16_t)),
+           (unsigned)sizeof data);
+    return 0;
+}
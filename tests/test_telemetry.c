@@ -0,0 +1,202 @@
+// Telemetry of the audio path on the simulated clock.  The link wraps
+// mixer_pwm_levels() so that every block rendered costs a known number of
+// microseconds of interrupt time, from a table of costs across the
+// histogram bins; the counters must then add up to the model exactly:
+// the histogram, the worst interrupt, busy and elapsed time, and the mix
+// cost in cycles of clk_sys.  Then the main loop is starved a few times
+// for longer than a ring lasts, and each time must show as one late
+// refill, a low water of 0 and underruns that delay the end of the sound
+// by as many frames.
+//
+// Built with 16-bit PWM levels, so no sample of the file is the midpoint.
+
+#include "audio_sim.h"
+#include "audio.h"
+#include "mixer.h"
+#include <string.h>
+
+#define NSAMPLES 100000
+#define MID 0x8000u
+#define SILENT (MID << 16 | MID)
+#define BLOCK AUDIO_BLOCK_SAMPLES
+
+static FATFS *fs = &fs_storage;
+static int16_t data[NSAMPLES];
+
+// Interrupt time per block, taken in turn
+static const uint32_t cost_us[] = {
+    0, 1, 2, 3, 4, 7, 8, 15, 16, 40, 64, 100, 255, 256, 700, 1024, 1800, 12, 5, 90,
+};
+static unsigned ncost;
+static bool model;
+static uint64_t since;         // sim_us at the reset
+
+// What the counters should say
+static struct {
+    uint32_t blocks;
+    uint32_t irq_us[AUDIO_IRQ_BINS];
+    uint32_t max_us, last_us;
+    uint64_t busy_us;
+} want;
+
+void __real_mixer_pwm_levels(uint32_t *dst, const int32_t *acc, unsigned n, mixer_shaper_t *ns);
+
+// The last step of every block's render, from the DMA interrupt
+void __wrap_mixer_pwm_levels(uint32_t *dst, const int32_t *acc, unsigned n, mixer_shaper_t *ns)
+{
+    __real_mixer_pwm_levels(dst, acc, n, ns);
+    if (!model)
+        return;
+    uint32_t us = cost_us[ncost++ % count_of(cost_us)];
+    sim_us += us;
+    unsigned bin = 0;
+    while (bin < AUDIO_IRQ_BINS - 1 && us >= 1u << bin)
+        bin++;
+    want.blocks++;
+    want.irq_us[bin]++;
+    if (us > want.max_us)
+        want.max_us = us;
+    want.last_us = us;
+    want.busy_us += us;
+}
+
+static void reset(void)
+{
+    // Start between blocks, with nothing left of the last sound queued.
+    sim_block_start();
+    memset(&want, 0, sizeof want);
+    ncost = 0;
+    audio_reset_stats();
+    since = sim_us;
+    sim_nout = 0;
+}
+
+// Play the file with audio_service() every 2 ms, and the main loop away
+// for starve_ms at each of the starve times, in ms from the start.
+static void play(const uint32_t *starve_at, unsigned nstarve, uint32_t starve_ms)
+{
+    int v = audio_play("tele.wav", 255, false);
+    CHECK(v >= 0);
+    uint64_t t0 = sim_us;
+    unsigned s = 0;
+    while (audio_playing(v)) {
+        if (s < nstarve && sim_us - t0 >= starve_at[s] * 1000) {
+            sim_run(starve_ms * 1000);
+            s++;
+        }
+        audio_service();
+        sim_run(2000);
+    }
+    CHECK(s == nstarve);
+    sim_frames(2 * BLOCK);
+}
+
+// Where the sound starts and ends, checking the samples in between are
+// the file's with only whole blocks of silence among them.  Returns the
+// silent frames.
+static uint32_t sound(uint32_t *first, uint32_t *end)
+{
+    uint32_t i = 0, j = 0, gaps = 0;
+    while (i < sim_nout && sim_out[i] == SILENT)
+        i++;
+    *first = i;
+    for (; i < sim_nout && j < NSAMPLES; i++) {
+        if (sim_out[i] == SILENT) {
+            gaps++;
+            continue;
+        }
+        uint32_t l = (uint32_t)(data[j++] / 256 * 255 + (int)MID);
+        CHECK(sim_out[i] == (l << 16 | l));
+    }
+    CHECK(j == NSAMPLES && gaps % BLOCK == 0);
+    *end = i;
+    while (i < sim_nout)
+        CHECK(sim_out[i++] == SILENT);
+    return gaps;
+}
+
+static void test_model(void)
+{
+    audio_stats_t st;
+    uint32_t first, end;
+
+    reset();
+    model = true;
+    play(NULL, 0, 0);
+    model = false;
+    audio_get_stats(&st);
+    CHECK(st.blocks == want.blocks);
+    CHECK(memcmp(st.irq_us, want.irq_us, sizeof st.irq_us) == 0);
+    CHECK(st.irq_max_us == want.max_us);
+    CHECK(st.busy_us == want.busy_us);
+    CHECK(st.elapsed_us == sim_us - since);
+    uint32_t per_us = sim_clk_hz / 1000000;
+    CHECK(st.mix_cycles == want.last_us * per_us);
+    CHECK(st.mix_max_cycles == want.max_us * per_us);
+    CHECK(st.mix_total_cycles == want.busy_us * per_us);
+    CHECK(st.underruns == 0 && st.late_refills == 0);
+    CHECK(st.low_water > 0 && st.low_water < AUDIO_SEGMENTS * AUDIO_SEGMENT_SAMPLES);
+    CHECK(sound(&first, &end) == 0);
+    CHECK(end - first == NSAMPLES);
+    printf("%u blocks, %u us busy in %llu us, worst interrupt %u us, low water %u samples\n",
+           st.blocks, (unsigned)st.busy_us, (unsigned long long)st.elapsed_us, st.irq_max_us,
+           st.low_water);
+}
+
+static void test_elapsed(void)
+{
+    audio_stats_t st;
+
+    reset();
+    sim_run(123456);
+    audio_get_stats(&st);
+    CHECK(st.elapsed_us == sim_us - since);
+    CHECK(st.blocks == 123456 * (uint64_t)AUDIO_RATE / 1000000 / BLOCK
+            || st.blocks == 123456 * (uint64_t)AUDIO_RATE / 1000000 / BLOCK + 1);
+    // Nothing plays: nothing to run short of.
+    CHECK(st.underruns == 0 && st.late_refills == 0);
+    CHECK(st.low_water == AUDIO_SEGMENTS * AUDIO_SEGMENT_SAMPLES);
+}
+
+static void test_starved(void)
+{
+    // A ring lasts 93 ms at the output rate.
+    static const uint32_t starve_at[] = { 300, 900, 1500 };
+    audio_stats_t st;
+    uint32_t first, end;
+
+    reset();
+    play(starve_at, count_of(starve_at), 150);
+    audio_get_stats(&st);
+    uint32_t gaps = sound(&first, &end);
+    printf("starved %u times: %u late refills, low water %u, %u underrun frames\n",
+           (unsigned)count_of(starve_at), st.late_refills, st.low_water, st.underruns);
+    CHECK(st.late_refills == count_of(starve_at));
+    CHECK(st.low_water == 0);
+    CHECK(st.underruns > 0 && st.underruns % BLOCK == 0);
+    CHECK(gaps == st.underruns);
+    CHECK(end - first == NSAMPLES + st.underruns);
+}
+
+int main(void)
+{
+    BYTE fmt[16];
+
+    CHECK(host_format(fs, 65536, FM_FAT, 4096) == FR_OK);
+    srand(50);
+    for (int i = 0; i < NSAMPLES; i++) {
+        int k;
+        do
+            k = rand() & 0xff;
+        while (k == 128);
+        data[i] = (int16_t)((k - 128) * 256);
+    }
+    sim_wav("tele.wav", fmt, sim_pcm_fmt(fmt, 1, AUDIO_RATE, 16), data, sizeof data, 0);
+    sim_init(2 * NSAMPLES);
+    audio_init();
+    test_model();
+    test_elapsed();
+    test_starved();
+    audio_stop();
+    return 0;
+}
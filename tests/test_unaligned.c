@@ -0,0 +1,250 @@
+// Unaligned loads and stores in ff.c.  This file includes ff.c and is
+// built twice: test_unaligned_ref keeps the byte-wise ld_*/st_* and
+// writes the card image a file system workload leaves behind, and
+// test_unaligned, built with __ARM_FEATURE_UNALIGNED as on the M33,
+// checks every load and store against the byte-wise form at each
+// alignment and then requires the same workload to leave the same image.
+
+#include "../src/ff.c"
+#include "host.h"
+#include <string.h>
+
+static FATFS fs;
+
+static void workload(BYTE fmt, DWORD au)
+{
+    static BYTE buf[20000];
+    FIL fil;
+    DIR dir;
+    FILINFO fno;
+    UINT bw;
+    char name[64];
+
+    CHECK(host_format(&fs, 131072, fmt, au) == FR_OK);
+    CHECK(f_mkdir("assets") == FR_OK);
+    for (int i = 0; i < 40; i++) {
+        UINT len = (UINT)(i * 997 % sizeof buf);
+        for (UINT k = 0; k < len; k++)
+            buf[k] = (BYTE)(i + k * 31);
+        sprintf(name, "assets/Long file name %02d.bin", i);
+        CHECK(f_open(&fil, name, FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+        if (i % 5 == 0)
+            CHECK(f_expand(&fil, 8192, 1) == FR_OK);
+        CHECK(f_write(&fil, buf, len, &bw) == FR_OK && bw == len);
+        CHECK(f_close(&fil) == FR_OK);
+    }
+    for (int i = 0; i < 40; i += 3) {
+        char to[64];
+        sprintf(name, "assets/Long file name %02d.bin", i);
+        sprintf(to, "assets/renamed %d.dat", i);
+        CHECK(f_rename(name, to) == FR_OK);
+    }
+    int removed = 0;
+    for (int i = 1; i < 40; i += 4) {
+        if (i % 3 == 0)
+            continue; // renamed
+        sprintf(name, "assets/Long file name %02d.bin", i);
+        CHECK(f_unlink(name) == FR_OK);
+        removed++;
+    }
+    CHECK(f_opendir(&dir, "assets") == FR_OK);
+    int n = 0;
+    while (f_readdir(&dir, &fno) == FR_OK && fno.fname[0])
+        n++;
+    CHECK(f_closedir(&dir) == FR_OK);
+    CHECK(n == 40 - removed);
+    CHECK(f_mount(NULL, "", 0) == FR_OK);
+}
+
+// The byte loops mem_cpy(), mem_set() and mem_cmp() were before they
+// went to the C library, kept as loops of single bytes.
+__attribute__((optimize("no-tree-loop-distribute-patterns", "no-tree-vectorize")))
+static void cpy_bytes(BYTE *d, const BYTE *s, UINT cnt)
+{
+    while (cnt--)
+        *d++ = *s++;
+}
+
+__attribute__((optimize("no-tree-loop-distribute-patterns", "no-tree-vectorize")))
+static void set_bytes(BYTE *d, int val, UINT cnt)
+{
+    while (cnt--)
+        *d++ = (BYTE)val;
+}
+
+__attribute__((optimize("no-tree-loop-distribute-patterns", "no-tree-vectorize")))
+static int cmp_bytes(const BYTE *d, const BYTE *s, UINT cnt)
+{
+    int r = 0;
+    while (cnt-- && (r = *d++ - *s++) == 0)
+        ;
+    return r;
+}
+
+#define BARRIER() __asm__ volatile("" ::: "memory")
+
+// Nanoseconds per sector for the memory functions, and per field for the
+// loads and stores at every alignment, on this machine.  Each build
+// prints its own form of ld_* and st_*: byte-wise in test_unaligned_ref,
+// single accesses in test_unaligned.
+static void bench(void)
+{
+    static BYTE a[FF_MAX_SS + 8], b[FF_MAX_SS + 8];
+    const int rounds = 200000;
+    volatile QWORD sink = 0;
+    QWORD sum = 0;
+    double t;
+
+    for (int i = 0; i < FF_MAX_SS; i++)
+        a[i] = (BYTE)(i * 7);
+    t = wall_seconds();
+    for (int r = 0; r < rounds; r++) {
+        mem_cpy(b, a, FF_MAX_SS);
+        BARRIER();
+    }
+    double lib = wall_seconds() - t;
+    t = wall_seconds();
+    for (int r = 0; r < rounds; r++) {
+        cpy_bytes(b, a, FF_MAX_SS);
+        BARRIER();
+    }
+    printf("copy    %6.1f ns/sector, %6.1f byte-wise\n", lib * 1e9 / rounds,
+           (wall_seconds() - t) * 1e9 / rounds);
+
+    t = wall_seconds();
+    for (int r = 0; r < rounds; r++) {
+        mem_set(b, r, FF_MAX_SS);
+        BARRIER();
+    }
+    lib = wall_seconds() - t;
+    t = wall_seconds();
+    for (int r = 0; r < rounds; r++) {
+        set_bytes(b, r, FF_MAX_SS);
+        BARRIER();
+    }
+    printf("clear   %6.1f ns/sector, %6.1f byte-wise\n", lib * 1e9 / rounds,
+           (wall_seconds() - t) * 1e9 / rounds);
+
+    // Equal blocks: compared to the end
+    memcpy(b, a, FF_MAX_SS);
+    t = wall_seconds();
+    for (int r = 0; r < rounds; r++) {
+        sum += mem_cmp(b, a, FF_MAX_SS) != 0;
+        BARRIER();
+    }
+    lib = wall_seconds() - t;
+    t = wall_seconds();
+    for (int r = 0; r < rounds; r++) {
+        sum += cmp_bytes(b, a, FF_MAX_SS) != 0;
+        BARRIER();
+    }
+    printf("compare %6.1f ns/sector, %6.1f byte-wise\n", lib * 1e9 / rounds,
+           (wall_seconds() - t) * 1e9 / rounds);
+    CHECK(sum == 0);
+
+    const int fields = FF_MAX_SS / 8;
+    t = wall_seconds();
+    for (int r = 0; r < rounds / 8; r++) {
+        for (int i = 0; i < fields; i++) {
+            const BYTE *p = a + i * 8 + (i & 7);
+            sum += ld_word(p) + ld_dword(p) + ld_qword(p);
+        }
+        BARRIER();
+    }
+    double ld = wall_seconds() - t;
+    t = wall_seconds();
+    for (int r = 0; r < rounds / 8; r++) {
+        for (int i = 0; i < fields; i++) {
+            BYTE *p = b + i * 8 + (i & 7);
+            st_word(p, (WORD)r);
+            st_dword(p, (DWORD)r);
+            st_qword(p, (QWORD)r);
+        }
+        BARRIER();
+    }
+    printf("%s ld_word+ld_dword+ld_qword %5.2f ns, st_* %5.2f ns per field\n",
+           LD_UNALIGNED ? "unaligned" : "byte-wise", ld * 1e9 / (rounds / 8) / fields,
+           (wall_seconds() - t) * 1e9 / (rounds / 8) / fields);
+    sink = sum;
+    (void)sink;
+}
+
+#if LD_UNALIGNED
+
+static QWORD ld_bytes(const BYTE *p, int n)
+{
+    QWORD v = 0;
+    while (n--)
+        v = v << 8 | p[n];
+    return v;
+}
+
+static void test_access(void)
+{
+    BYTE b[32], ref[32];
+    for (int ofs = 0; ofs < 16; ofs++) {
+        for (int i = 0; i < 32; i++)
+            b[i] = (BYTE)(i * 37 + 5);
+        CHECK(ld_word(b + ofs) == ld_bytes(b + ofs, 2));
+        CHECK(ld_dword(b + ofs) == ld_bytes(b + ofs, 4));
+        CHECK(ld_qword(b + ofs) == ld_bytes(b + ofs, 8));
+
+        memcpy(ref, b, sizeof b);
+        for (int i = 0; i < 8; i++)
+            ref[ofs + i] = (BYTE)(0x88 - 0x11 * i);
+        st_qword(b + ofs, 0x1122334455667788);
+        CHECK(memcmp(b, ref, sizeof b) == 0);
+        ref[ofs] = 0xDD; ref[ofs + 1] = 0xCC; ref[ofs + 2] = 0xBB; ref[ofs + 3] = 0xAA;
+        st_dword(b + ofs, 0xAABBCCDD);
+        CHECK(memcmp(b, ref, sizeof b) == 0);
+        ref[ofs] = 0x34; ref[ofs + 1] = 0x12;
+        st_word(b + ofs, 0x1234);
+        CHECK(memcmp(b, ref, sizeof b) == 0);
+    }
+}
+
+static void compare_image(const char *path)
+{
+    size_t size = (size_t)disk_sectors * FF_MAX_SS;
+    BYTE *ref = malloc(size);
+    FILE *f = fopen(path, "rb");
+    CHECK(ref && f);
+    CHECK(fread(ref, 1, size, f) == size);
+    fclose(f);
+    CHECK(memcmp(ref, disk_image, size) == 0);
+    free(ref);
+}
+
+int main(int argc, char **argv)
+{
+    char path[256];
+    CHECK(argc == 2);
+    test_access();
+    bench();
+    for (int v = 0; v < 2; v++) {
+        workload(v ? FM_EXFAT : FM_FAT32, v ? 4096 : 512);
+        snprintf(path, sizeof path, "%s.%d", argv[1], v);
+        compare_image(path);
+    }
+    return 0;
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+    char path[256];
+    CHECK(argc == 2);
+    for (int v = 0; v < 2; v++) {
+        workload(v ? FM_EXFAT : FM_FAT32, v ? 4096 : 512);
+        snprintf(path, sizeof path, "%s.%d", argv[1], v);
+        FILE *f = fopen(path, "wb");
+        CHECK(f);
+        CHECK(fwrite(disk_image, FF_MAX_SS, disk_sectors, f) == disk_sectors);
+        fclose(f);
+    }
+    bench();
+    return 0;
+}
+
+#endif
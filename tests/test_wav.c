@@ -0,0 +1,347 @@
+// WAV parsing and the output clock: wav_open() and wav_open_mem() on the
+// layouts writers produce and on broken files, the DMA timer fraction
+// against a search over every denominator, and 8-bit and stereo files
+// played exactly.
+// This file includes audio.c to reach rate_fraction().
+
+#include "../src/audio.c"
+#include "audio_sim.h"
+
+#define MID 0x8000u
+
+static FATFS *fs = &fs_storage;
+static BYTE img[200000];
+static UINT ilen;
+
+static void p16(unsigned v)
+{
+    img[ilen++] = v;
+    img[ilen++] = v >> 8;
+}
+
+static void p32(uint32_t v)
+{
+    p16(v & 0xffff);
+    p16(v >> 16);
+}
+
+static void id(const char *s)
+{
+    memcpy(&img[ilen], s, 4);
+    ilen += 4;
+}
+
+static void riff(const char *kind)
+{
+    ilen = 0;
+    id(kind);
+    p32(0);
+    id("WAVE");
+}
+
+static void body(const char *s, uint32_t len)
+{
+    id(s);
+    p32(len);
+    for (uint32_t i = 0; i < len; i++)
+        img[ilen++] = (BYTE)(i * 7 + 1);
+    if (len & 1)
+        img[ilen++] = 0;
+}
+
+// A fmt chunk; ext adds cbSize and that many bytes of extension.
+static void fmt(unsigned tag, unsigned ch, uint32_t rate, unsigned align, unsigned bits, int ext)
+{
+    id("fmt ");
+    p32(ext < 0 ? 16 : 18 + ext);
+    p16(tag);
+    p16(ch);
+    p32(rate);
+    p32(rate * align);
+    p16(align);
+    p16(bits);
+    if (ext >= 0)
+        p16(ext);
+}
+
+static FRESULT parse(wav_info_t *w)
+{
+    FIL fil;
+    UINT bw;
+    CHECK(f_open(&fil, "t.wav", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(&fil, img, ilen, &bw) == FR_OK && bw == ilen);
+    CHECK(f_close(&fil) == FR_OK);
+    CHECK(f_open(&fil, "t.wav", FA_READ) == FR_OK);
+    memset(w, 0, sizeof *w);
+    FRESULT fr = wav_open(&fil, w);
+    if (fr == FR_OK)
+        CHECK(f_tell(&fil) == w->data_ofs);
+    CHECK(f_close(&fil) == FR_OK);
+    // The same file in memory reads the same.
+    wav_info_t m;
+    memset(&m, 0, sizeof m);
+    CHECK(wav_open_mem(img, ilen, &m) == fr);
+    CHECK(memcmp(&m, w, sizeof m) == 0);
+    return fr;
+}
+
+static void expect(unsigned tag, unsigned ch, uint32_t rate, unsigned bits,
+        FSIZE_t ofs, FSIZE_t len)
+{
+    wav_info_t w;
+    CHECK(parse(&w) == FR_OK);
+    CHECK(w.format == tag && w.channels == ch && w.rate == rate && w.bits == bits);
+    CHECK(w.data_ofs == ofs && w.data_len == len);
+}
+
+static void test_layouts(void)
+{
+    wav_info_t w;
+
+    // The canonical 44-byte header
+    riff("RIFF");
+    fmt(1, 1, 44100, 2, 16, -1);
+    body("data", 1000);
+    expect(1, 1, 44100, 16, 44, 1000);
+
+    // 8-bit stereo after LIST, with a fact chunk between fmt and data
+    riff("RIFF");
+    body("LIST", 26);
+    fmt(1, 2, 22050, 2, 8, 0);
+    body("fact", 4);
+    body("data", 601);
+    expect(1, 2, 22050, 8, 12 + 34 + 26 + 12 + 8, 600);
+
+    // data before fmt, and an odd JUNK chunk with its pad byte
+    riff("RIFF");
+    body("JUNK", 3);
+    body("data", 800);
+    fmt(1, 1, 8000, 2, 16, -1);
+    expect(1, 1, 8000, 16, 12 + 12 + 8, 800);
+
+    // Extensible 24-bit stereo resolves to PCM
+    riff("RIFF");
+    fmt(0xfffe, 2, 48000, 6, 24, 22);
+    p16(24);
+    p32(3);
+    p16(1);
+    for (int i = 0; i < 14; i++)
+        img[ilen++] = 0;
+    body("data", 600);
+    expect(1, 2, 48000, 24, 12 + 48 + 8, 600);
+
+    // 32-bit mono
+    riff("RIFF");
+    fmt(1, 1, 96000, 4, 32, -1);
+    body("data", 400);
+    expect(1, 1, 96000, 32, 44, 400);
+
+    // RF64 with a data size left at 0xffffffff runs to the end
+    riff("RF64");
+    body("ds64", 28);
+    fmt(1, 2, 44100, 4, 16, -1);
+    id("data");
+    p32(0xffffffff);
+    for (int i = 0; i < 1001; i++)
+        img[ilen++] = (BYTE)i;
+    expect(1, 2, 44100, 16, 12 + 36 + 24 + 8, 1000);
+
+    // Data cut short of its size, to whole frames
+    riff("RIFF");
+    fmt(1, 2, 44100, 4, 16, -1);
+    id("data");
+    p32(100000);
+    for (int i = 0; i < 1003; i++)
+        img[ilen++] = (BYTE)i;
+    expect(1, 2, 44100, 16, 44, 1000);
+
+    // IMA ADPCM, with the frames per block given and left at 0
+    for (int frames = 505; frames >= 0; frames -= 505) {
+        riff("RIFF");
+        fmt(0x11, 1, 22050, 256, 4, 2);
+        p16(frames);
+        body("fact", 4);
+        body("data", 1000);
+        expect(0x11, 1, 22050, 4, 12 + 28 + 12 + 8, 1000);
+        CHECK(parse(&w) == FR_OK && w.block_frames == 505);
+    }
+
+    // MS ADPCM with the standard predictors, and a short last block kept
+    riff("RIFF");
+    fmt(2, 2, 44100, 1024, 4, 32);
+    p16(1012);
+    p16(7);
+    for (int i = 0; i < 7; i++) {
+        p16((uint16_t)adpcm_ms_coef[i][0]);
+        p16((uint16_t)adpcm_ms_coef[i][1]);
+    }
+    body("data", 2500);
+    expect(2, 2, 44100, 4, 12 + 58 + 8, 2500);
+    CHECK(parse(&w) == FR_OK && w.block_frames == 1012);
+}
+
+static void refuse(int *n)
+{
+    wav_info_t w;
+    CHECK(parse(&w) == FR_NO_FILESYSTEM);
+    (*n)++;
+}
+
+static void test_broken(void)
+{
+    int n = 0;
+
+    riff("RIFX");
+    fmt(1, 1, 44100, 2, 16, -1);
+    body("data", 100);
+    refuse(&n);
+
+    riff("RIFF");
+    memcpy(&img[8], "AVI ", 4);
+    fmt(1, 1, 44100, 2, 16, -1);
+    body("data", 100);
+    refuse(&n);
+
+    riff("RIFF");
+    body("data", 100);
+    refuse(&n);
+
+    riff("RIFF");
+    fmt(1, 1, 44100, 2, 16, -1);
+    refuse(&n);
+
+    riff("RIFF");
+    body("fmt ", 14);
+    body("data", 100);
+    refuse(&n);
+
+    riff("RIFF");
+    fmt(1, 2, 44100, 2, 16, -1);
+    body("data", 100);
+    refuse(&n);
+
+    riff("RIFF");
+    fmt(1, 0, 44100, 2, 16, -1);
+    body("data", 100);
+    refuse(&n);
+
+    riff("RIFF");
+    fmt(0xfffe, 1, 44100, 2, 16, 10);
+    for (int i = 0; i < 10; i++)
+        img[ilen++] = 0;
+    body("data", 100);
+    refuse(&n);
+
+    riff("RIFF");
+    fmt(2, 1, 22050, 256, 4, 32);
+    p16(500);
+    p16(7);
+    for (int i = 0; i < 7; i++) {
+        p16((uint16_t)adpcm_ms_coef[i][0]);
+        p16((uint16_t)(adpcm_ms_coef[i][1] + (i == 3)));
+    }
+    body("data", 100);
+    refuse(&n);
+
+    riff("RIFF");
+    fmt(0x11, 1, 22050, 2, 4, 2);
+    p16(0);
+    body("data", 100);
+    refuse(&n);
+
+    printf("%d broken files refused\n", n);
+}
+
+// |clk * x / y - rate| as a fraction over y
+static bool closer(uint32_t clk, uint32_t rate, uint32_t xa, uint32_t ya, uint32_t xb, uint32_t yb)
+{
+    return rate_error(clk, rate, xa, ya) * yb < rate_error(clk, rate, xb, yb) * ya;
+}
+
+static void test_rate(void)
+{
+    static const uint32_t clks[] = { 150000000, 125000000, 200000000 };
+    static const uint32_t rates[] = { 8000, 11025, 16000, 22050, 24000, 32000, 44100, 48000, 96000 };
+
+    for (unsigned c = 0; c < count_of(clks); c++) {
+        for (unsigned r = 0; r < count_of(rates); r++) {
+            uint16_t x, y;
+            rate_fraction(clks[c], rates[r], &x, &y);
+            for (uint32_t by = 1; by <= 0xffff; by++) {
+                uint64_t bx = ((uint64_t)rates[r] * by + clks[c] / 2) / clks[c];
+                if (bx >= 1 && bx <= 0xffff)
+                    CHECK(!closer(clks[c], rates[r], bx, by, x, y));
+            }
+            if (clks[c] == 150000000 && 150000000 % rates[r] == 0)
+                CHECK(rate_error(clks[c], rates[r], x, y) == 0);
+            if (c == 0)
+                printf("%6u Hz: %5u/%5u, %.2f ppm\n", rates[r], x, y,
+                       1e6 * rate_error(clks[c], rates[r], x, y) / y / rates[r]);
+        }
+    }
+}
+
+// 8-bit mono and 16-bit stereo files come out exactly, looping included.
+static void test_play(void)
+{
+    static BYTE u8[3001];
+    static int16_t st[2 * 2000];
+    BYTE f[16];
+
+    for (int i = 0; i < 3001; i++)
+        u8[i] = (BYTE)(i * 37 % 255 + 1);
+    for (int i = 0; i < 2000; i++) {
+        st[2 * i] = (int16_t)((i * 13 % 251 - 125) * 256);
+        st[2 * i + 1] = (int16_t)((i * 29 % 241 - 120) * 256);
+    }
+    sim_wav("u8.wav", f, sim_pcm_fmt(f, 1, AUDIO_RATE, 8), u8, sizeof u8, 0);
+    sim_wav("st.wav", f, sim_pcm_fmt(f, 2, AUDIO_RATE, 16), st, sizeof st, 13);
+
+    audio_init();
+    int v = audio_play("u8.wav", 255, true);
+    CHECK(v >= 0);
+    sim_nout = 0;
+    while (sim_nout < 3 * 3001 + 2 * AUDIO_BLOCK_SAMPLES) {
+        audio_service();
+        sim_run(3000);
+    }
+    audio_stop();
+    uint32_t i = 0;
+    while ((sim_out[i] & 0xffff) == MID)
+        i++;
+    for (uint32_t j = 0; j < 3 * 3001; i++, j++) {
+        uint32_t l = (uint32_t)((u8[j % 3001] - 128) * 255 + MID);
+        CHECK(sim_out[i] == (l << 16 | l));
+    }
+
+    sim_frames(2 * AUDIO_BLOCK_SAMPLES);
+    v = audio_play("st.wav", 255, false);
+    CHECK(v >= 0);
+    sim_nout = 0;
+    while (audio_playing(v)) {
+        audio_service();
+        sim_run(3000);
+    }
+    sim_frames(2 * AUDIO_BLOCK_SAMPLES);
+    i = 0;
+    while (sim_out[i] == (MID << 16 | MID))
+        i++;
+    for (uint32_t j = 0; j < 2000; i++, j++) {
+        uint32_t left = (uint32_t)(st[2 * j] / 256 * 255 + MID);
+        uint32_t right = (uint32_t)(st[2 * j + 1] / 256 * 255 + MID);
+        CHECK(sim_out[i] == (left << 16 | right));
+    }
+    for (; i < sim_nout; i++)
+        CHECK(sim_out[i] == (MID << 16 | MID));
+}
+
+int main(void)
+{
+    CHECK(host_format(fs, 65536, FM_FAT, 4096) == FR_OK);
+    test_layouts();
+    test_broken();
+    test_rate();
+    sim_init(20000);
+    test_play();
+    return 0;
+}
@@ -0,0 +1,367 @@
+// Build an SD card image with every asset stored contiguously.
+//
+//   cc -O2 -DFF_HOST -Iinclude -o mkimage tools/mkimage.c src/ff.c src/ffsystem.c src/ffunicode.c
+//   ./mkimage [options] card.img list.txt manifest.txt
+//   ./mkimage -v card.img manifest.txt
+//
+// The image is formatted and filled by the same ff.c the firmware runs,
+// through a diskio layer that reads and writes the image file.
+//
+// list.txt names one asset per line as "host-path image-path", in the
+// order the game reads them: files are laid out in that order, so
+// assets loaded together sit next to each other.  Blank lines and lines
+// starting with '#' are ignored.  The image path runs to the end of the
+// line, so it may contain spaces.  Directories are created before any
+// file so that they end up at the start of the data area.
+//
+// Every file is one extent.  Files of at least the -l size start on an
+// erase block boundary; the others follow the previous file directly.
+//
+// The manifest lists the first LBA, sector count and size of each file.
+// -v mounts an image, for example one read back from a card with dd,
+// and checks every file against the manifest.
+//
+// Options:
+//   -s MB       image size (default 256)
+//   -f fmt      fat32 or exfat (default fat32)
+//   -c KB       cluster size (default: chosen by f_mkfs)
+//   -e KB       erase block size (default 4096)
+//   -l KB       files this large are erase block aligned (default: -e)
+
+#include "ff.h"
+#include "diskio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LINE 512
+
+static int img_fd = -1;
+static LBA_t img_sectors;
+static DWORD erase_sectors = 8192;
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+    return img_fd < 0 ? STA_NOINIT : 0;
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+    return img_fd < 0 ? STA_NOINIT : 0;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buffer, LBA_t sector, UINT count)
+{
+    size_t len = (size_t)count * FF_MAX_SS;
+    if (sector + count > img_sectors)
+        return RES_PARERR;
+    if (pread(img_fd, buffer, len, (off_t)sector * FF_MAX_SS) != (ssize_t)len)
+        return RES_ERROR;
+    return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buffer, LBA_t sector, UINT count)
+{
+    size_t len = (size_t)count * FF_MAX_SS;
+    if (sector + count > img_sectors)
+        return RES_PARERR;
+    if (pwrite(img_fd, buffer, len, (off_t)sector * FF_MAX_SS) != (ssize_t)len)
+        return RES_ERROR;
+    return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+    switch (cmd) {
+    case CTRL_SYNC:
+        return fsync(img_fd) == 0 ? RES_OK : RES_ERROR;
+    case GET_SECTOR_COUNT:
+        *(LBA_t *)buff = img_sectors;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *(DWORD *)buff = erase_sectors;
+        return RES_OK;
+    }
+    return RES_PARERR;
+}
+
+DWORD get_fattime(void)
+{
+    time_t now = time(NULL);
+    struct tm *t = localtime(&now);
+    return (DWORD)(t->tm_year - 80) << 25 | (DWORD)(t->tm_mon + 1) << 21
+            | (DWORD)t->tm_mday << 16 | (DWORD)t->tm_hour << 11
+            | (DWORD)t->tm_min << 5 | (DWORD)t->tm_sec >> 1;
+}
+
+static int open_image(const char *path, int flags, LBA_t sectors)
+{
+    img_fd = open(path, flags, 0644);
+    if (img_fd < 0) {
+        fprintf(stderr, "mkimage: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (sectors && ftruncate(img_fd, (off_t)sectors * FF_MAX_SS) != 0) {
+        fprintf(stderr, "mkimage: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    img_sectors = lseek(img_fd, 0, SEEK_END) / FF_MAX_SS;
+    return 0;
+}
+
+// Split a list line into host and image path.  Returns 0 for a line to
+// skip, 1 for an entry and -1 for a malformed line.
+static int parse_line(char *line, char **src, char **dst)
+{
+    line[strcspn(line, "\r\n")] = '\0';
+    *src = strtok(line, " \t");
+    if (!*src || **src == '#')
+        return 0;
+    // The image path is the rest of the line and may contain spaces.
+    *dst = strtok(NULL, "");
+    if (!*dst)
+        return -1;
+    *dst += strspn(*dst, " \t");
+    return **dst ? 1 : -1;
+}
+
+// Create the directories leading up to path.
+static FRESULT make_parents(const char *path)
+{
+    char dir[MAX_LINE];
+    for (const char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        snprintf(dir, sizeof dir, "%.*s", (int)(p - path), path);
+        FRESULT fr = f_mkdir(dir);
+        if (fr && fr != FR_EXIST)
+            return fr;
+    }
+    return FR_OK;
+}
+
+// Point the allocator at the first free cluster that starts an erase
+// block, so the next f_expand() takes an aligned run.
+static void align_next(FATFS *fs)
+{
+    DWORD csize = fs->csize;
+    // last_clst is only known once something has been allocated: an exFAT
+    // mount leaves it out of range.  On a fresh image the first free
+    // cluster is then the one after the root directory, which f_mkfs
+    // places behind the bitmap and up-case table.
+    DWORD next = fs->last_clst + 1;
+    if (fs->last_clst < 2 || fs->last_clst >= fs->n_fatent)
+        next = (DWORD)fs->dirbase + 1;
+    LBA_t lba = fs->database + (LBA_t)(next - 2) * csize;
+    LBA_t aligned = (lba + erase_sectors - 1) / erase_sectors * erase_sectors;
+    DWORD clst = (DWORD)((aligned - fs->database + csize - 1) / csize) + 2;
+    if (clst < fs->n_fatent)
+        fs->last_clst = clst;
+}
+
+// Copy a host file into a new contiguous file on the image.
+static FRESULT place_file(FATFS *fs, const char *src, const char *dst, DWORD large,
+        FILE *manifest)
+{
+    static BYTE buf[64 * FF_MAX_SS];
+    FILE *in = fopen(src, "rb");
+    if (!in) {
+        fprintf(stderr, "mkimage: %s: %s\n", src, strerror(errno));
+        return FR_NO_FILE;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    rewind(in);
+
+    FIL fil;
+    FRESULT fr = f_open(&fil, dst, FA_WRITE|FA_CREATE_NEW);
+    if (fr == FR_OK && size > 0) {
+        if ((DWORD)size >= large)
+            align_next(fs);
+        fr = f_expand(&fil, size, 1);
+    }
+    while (fr == FR_OK) {
+        size_t n = fread(buf, 1, sizeof buf, in);
+        UINT bw;
+        if (n == 0)
+            break;
+        fr = f_write(&fil, buf, n, &bw);
+        if (fr == FR_OK && bw != n)
+            fr = FR_DENIED;
+    }
+    fclose(in);
+
+    DWORD nfrag = 0;
+    LBA_t lba = 0;
+    if (fr == FR_OK)
+        fr = f_getfrag(&fil, &nfrag, &lba);
+    FRESULT cr = f_close(&fil);
+    if (fr == FR_OK)
+        fr = cr;
+    if (fr == FR_OK && nfrag > 1)
+        fr = FR_INT_ERR;
+    if (fr) {
+        fprintf(stderr, "mkimage: %s: cannot place (error %d)\n", dst, fr);
+        return fr;
+    }
+    fprintf(manifest, "%10lu %8lu %10ld %s %s\n", (unsigned long)lba,
+            (unsigned long)((size + FF_MAX_SS - 1) / FF_MAX_SS), size,
+            size && lba % erase_sectors == 0 ? "E" : "-", dst);
+    return FR_OK;
+}
+
+static int build(const char *image, const char *listpath, const char *manpath,
+        LBA_t sectors, BYTE fmt, DWORD cluster, DWORD large)
+{
+    FILE *list = fopen(listpath, "r");
+    if (!list) {
+        fprintf(stderr, "mkimage: %s: %s\n", listpath, strerror(errno));
+        return 1;
+    }
+    if (open_image(image, O_RDWR|O_CREAT|O_TRUNC, sectors))
+        return 1;
+
+    static BYTE work[32 * FF_MAX_SS];
+    MKFS_PARM opt = { fmt, 0, erase_sectors, 0, cluster };
+    FRESULT fr = f_mkfs("", &opt, work, sizeof work);
+    static FATFS fs;
+    if (fr == FR_OK)
+        fr = f_mount(&fs, "", 1);
+    if (fr) {
+        fprintf(stderr, "mkimage: cannot format %s (error %d)\n", image, fr);
+        return 1;
+    }
+
+    char line[MAX_LINE], *src, *dst;
+    int lineno = 0, bad = 0;
+    while (fgets(line, sizeof line, list)) {
+        lineno++;
+        int r = parse_line(line, &src, &dst);
+        if (r < 0) {
+            fprintf(stderr, "mkimage: %s:%d: expected \"host-path image-path\"\n", listpath, lineno);
+            bad = 1;
+        } else if (r > 0 && make_parents(dst) != FR_OK) {
+            fprintf(stderr, "mkimage: %s: cannot create directory\n", dst);
+            bad = 1;
+        }
+    }
+    if (bad)
+        return 1;
+
+    FILE *manifest = fopen(manpath, "w");
+    if (!manifest) {
+        fprintf(stderr, "mkimage: %s: %s\n", manpath, strerror(errno));
+        return 1;
+    }
+    fprintf(manifest, "# %s %s, %lu sectors, cluster %lu sectors, erase block %lu sectors, data at %lu\n",
+            image, fs.fs_type == FS_EXFAT ? "exFAT" : "FAT32", (unsigned long)img_sectors,
+            (unsigned long)fs.csize, (unsigned long)erase_sectors, (unsigned long)fs.database);
+    fprintf(manifest, "#        lba  sectors      bytes E path\n");
+    rewind(list);
+    while (!bad && fgets(line, sizeof line, list)) {
+        if (parse_line(line, &src, &dst) > 0 && place_file(&fs, src, dst, large, manifest))
+            bad = 1;
+    }
+    fclose(list);
+
+    DWORD nfree;
+    FATFS *pfs;
+    if (!bad && f_getfree("", &nfree, &pfs) == FR_OK)
+        fprintf(manifest, "# %lu clusters free\n", (unsigned long)nfree);
+    if (fclose(manifest) || f_mount(NULL, "", 0) || close(img_fd))
+        bad = 1;
+    return bad;
+}
+
+static int verify(const char *image, const char *manpath)
+{
+    FILE *manifest = fopen(manpath, "r");
+    if (!manifest) {
+        fprintf(stderr, "mkimage: %s: %s\n", manpath, strerror(errno));
+        return 1;
+    }
+    if (open_image(image, O_RDONLY, 0))
+        return 1;
+    static FATFS fs;
+    FRESULT fr = f_mount(&fs, "", 1);
+    if (fr) {
+        fprintf(stderr, "mkimage: cannot mount %s (error %d)\n", image, fr);
+        return 1;
+    }
+
+    char line[MAX_LINE], path[MAX_LINE];
+    int files = 0, bad = 0;
+    while (fgets(line, sizeof line, manifest)) {
+        unsigned long lba, nsect;
+        long size;
+        char flag;
+        if (line[0] == '#' || sscanf(line, "%lu %lu %ld %c %511[^\r\n]", &lba, &nsect, &size, &flag, path) != 5)
+            continue;
+        files++;
+        FIL fil;
+        DWORD nfrag = 0;
+        LBA_t first = 0;
+        fr = f_open(&fil, path, FA_READ);
+        if (fr == FR_OK) {
+            fr = f_getfrag(&fil, &nfrag, &first);
+            if (fr == FR_OK && (f_size(&fil) != (FSIZE_t)size || nfrag > 1
+                    || (size && first != lba)))
+                fr = FR_INT_ERR;
+            f_close(&fil);
+        }
+        if (fr) {
+            printf("%s: %s\n", path, fr == FR_INT_ERR ? "moved, resized or fragmented" : "missing");
+            bad++;
+        }
+    }
+    fclose(manifest);
+    printf("%d files checked, %d bad\n", files, bad);
+    return bad != 0;
+}
+
+static int usage(void)
+{
+    fprintf(stderr, "usage: mkimage [-s MB] [-f fat32|exfat] [-c KB] [-e KB] [-l KB] card.img list.txt manifest.txt\n"
+            "       mkimage -v card.img manifest.txt\n");
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long size_mb = 256, cluster_kb = 0, erase_kb = 4096, large_kb = 0;
+    BYTE fmt = FM_FAT32;
+    int check = 0, opt;
+    while ((opt = getopt(argc, argv, "s:f:c:e:l:v")) != -1) {
+        switch (opt) {
+        case 's': size_mb = strtoul(optarg, NULL, 0); break;
+        case 'c': cluster_kb = strtoul(optarg, NULL, 0); break;
+        case 'e': erase_kb = strtoul(optarg, NULL, 0); break;
+        case 'l': large_kb = strtoul(optarg, NULL, 0); break;
+        case 'v': check = 1; break;
+        case 'f':
+            if (strcmp(optarg, "fat32") == 0)
+                fmt = FM_FAT32;
+            else if (strcmp(optarg, "exfat") == 0)
+                fmt = FM_EXFAT;
+            else
+                return usage();
+            break;
+        default:
+            return usage();
+        }
+    }
+    if (check)
+        return argc - optind == 2 ? verify(argv[optind], argv[optind + 1]) : usage();
+    if (argc - optind != 3 || size_mb == 0)
+        return usage();
+
+    // f_mkfs wants the erase block as a power of two number of sectors.
+    erase_sectors = erase_kb * 1024 / FF_MAX_SS;
+    if (erase_sectors == 0 || erase_sectors > 0x8000 || (erase_sectors & (erase_sectors - 1)))
+        return usage();
+    DWORD large = large_kb ? large_kb * 1024 : erase_kb * 1024;
+    return build(argv[optind], argv[optind + 1], argv[optind + 2],
+            (LBA_t)size_mb * 1024 * 1024 / FF_MAX_SS, fmt, cluster_kb * 1024, large);
+}
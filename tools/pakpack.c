@@ -0,0 +1,199 @@
+// Build a pack of assets for pak_open() (see include/pak.h).
+//
+//   cc -O2 -Wall -o pakpack tools/pakpack.c
+//   ./pakpack [-a sectors] out.pak file...
+//
+// Each file is stored under its name without the directory, and .wav
+// files are tagged PAK_FMT_WAV.  Every asset starts on a sector
+// boundary; -a aligns them to a larger number of sectors instead, e.g.
+// the cluster size of the card, so that no asset straddles a cluster
+// more than it has to.  The pack is refused when two names hash to the
+// same value, since the reader finds assets by the hash, and when it has
+// more assets than the reader's index holds (PAK_MAX_ASSETS).
+
+#define PAK_FORMAT_ONLY
+#include "../include/pak.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef struct {
+    const char *path;
+    const char *name;
+    uint32_t hash;
+    uint32_t check;
+    uint32_t start;
+    uint32_t length;
+    uint16_t format;
+} item_t;
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static int by_hash(const void *a, const void *b)
+{
+    uint32_t x = ((const item_t *)a)->hash, y = ((const item_t *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t align_up(uint32_t v, uint32_t a)
+{
+    return (v + a - 1) / a * a;
+}
+
+static long file_length(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return -1;
+    long len = -1;
+    if (fseek(f, 0, SEEK_END) == 0)
+        len = ftell(f);
+    fclose(f);
+    return len;
+}
+
+// Copy path into out and pad it with zeros to a whole sector.
+static int copy_file(FILE *out, const char *path, uint32_t length)
+{
+    static uint8_t buf[64 * PAK_SECTOR];
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return -1;
+    uint32_t left = length;
+    while (left) {
+        size_t n = left < sizeof buf ? left : sizeof buf;
+        if (fread(buf, 1, n, f) != n || fwrite(buf, 1, n, out) != n) {
+            fclose(f);
+            return -1;
+        }
+        left -= n;
+    }
+    fclose(f);
+    uint32_t pad = align_up(length, PAK_SECTOR) - length;
+    memset(buf, 0, pad);
+    return fwrite(buf, 1, pad, out) == pad ? 0 : -1;
+}
+
+static int usage(void)
+{
+    fprintf(stderr, "usage: pakpack [-a sectors] out.pak file...\n");
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t align = 1;
+    int argi = 1;
+    if (argi + 1 < argc && strcmp(argv[argi], "-a") == 0) {
+        align = strtoul(argv[argi + 1], NULL, 0);
+        argi += 2;
+        if (align == 0)
+            return usage();
+    }
+    if (argc - argi < 2)
+        return usage();
+    const char *outpath = argv[argi++];
+    int count = argc - argi;
+    if (count > PAK_MAX_ASSETS) {
+        fprintf(stderr, "pakpack: %d files, a pack holds at most %d\n", count, PAK_MAX_ASSETS);
+        return 1;
+    }
+
+    item_t *items = calloc(count, sizeof *items);
+    if (!items)
+        return 1;
+    for (int i = 0; i < count; i++) {
+        item_t *it = &items[i];
+        it->path = argv[argi + i];
+        const char *slash = strrchr(it->path, '/');
+        it->name = slash ? slash + 1 : it->path;
+        it->hash = pak_hash(it->name);
+        it->check = pak_check(it->name);
+        const char *dot = strrchr(it->name, '.');
+        it->format = dot && strcasecmp(dot, ".wav") == 0 ? PAK_FMT_WAV : PAK_FMT_RAW;
+        long len = file_length(it->path);
+        if (len < 0 || len > 0xffffffffL - PAK_SECTOR) {
+            fprintf(stderr, "pakpack: cannot read %s\n", it->path);
+            return 1;
+        }
+        it->length = len;
+    }
+    qsort(items, count, sizeof *items, by_hash);
+    for (int i = 1; i < count; i++) {
+        if (items[i].hash == items[i - 1].hash) {
+            fprintf(stderr, "pakpack: %s and %s have the same hash\n",
+                    items[i - 1].name, items[i].name);
+            return 1;
+        }
+    }
+
+    // Lay out the header and index, then the assets.
+    uint32_t index_bytes = PAK_HDR_SIZE + count * PAK_ENTRY_SIZE;
+    uint32_t index_sectors = align_up((index_bytes + PAK_SECTOR - 1) / PAK_SECTOR, align);
+    uint32_t next = index_sectors;
+    for (int i = 0; i < count; i++) {
+        items[i].start = next;
+        next = align_up(next + (items[i].length + PAK_SECTOR - 1) / PAK_SECTOR, align);
+    }
+    // The pack ends right after the last asset, not at the alignment.
+    uint32_t total = count ? items[count - 1].start
+            + (items[count - 1].length + PAK_SECTOR - 1) / PAK_SECTOR : index_sectors;
+
+    uint32_t head_size = index_sectors * PAK_SECTOR;
+    uint8_t *head = calloc(1, head_size);
+    if (!head)
+        return 1;
+    for (int i = 0; i < count; i++) {
+        uint8_t *p = head + PAK_HDR_SIZE + i * PAK_ENTRY_SIZE;
+        put_u32(p + PAK_ENT_HASH, items[i].hash);
+        put_u32(p + PAK_ENT_START, items[i].start);
+        put_u32(p + PAK_ENT_LENGTH, items[i].length);
+        put_u16(p + PAK_ENT_FORMAT, items[i].format);
+        put_u16(p + PAK_ENT_FLAGS, 0);
+        put_u32(p + PAK_ENT_CHECK, items[i].check);
+    }
+    put_u32(head + PAK_HDR_MAGIC, PAK_MAGIC);
+    put_u32(head + PAK_HDR_COUNT, count);
+    put_u32(head + PAK_HDR_INDEX, index_sectors);
+    put_u32(head + PAK_HDR_TOTAL, total);
+    put_u32(head + PAK_HDR_CRC, pak_crc32(head + PAK_HDR_SIZE, count * PAK_ENTRY_SIZE));
+
+    FILE *out = fopen(outpath, "wb");
+    if (!out || fwrite(head, 1, head_size, out) != head_size) {
+        fprintf(stderr, "pakpack: cannot write %s\n", outpath);
+        return 1;
+    }
+    static const uint8_t zero[PAK_SECTOR];
+    uint32_t pos = index_sectors;
+    for (int i = 0; i < count; i++) {
+        for (; pos < items[i].start; pos++)
+            fwrite(zero, 1, PAK_SECTOR, out);
+        if (copy_file(out, items[i].path, items[i].length)) {
+            fprintf(stderr, "pakpack: cannot copy %s\n", items[i].path);
+            return 1;
+        }
+        pos += (items[i].length + PAK_SECTOR - 1) / PAK_SECTOR;
+        printf("%08x %8u %10u  %s\n", (unsigned)items[i].hash,
+                (unsigned)items[i].start, (unsigned)items[i].length, items[i].name);
+    }
+    if (fclose(out)) {
+        fprintf(stderr, "pakpack: cannot write %s\n", outpath);
+        return 1;
+    }
+    printf("%d assets, %u sectors\n", count, (unsigned)total);
+    return 0;
+}